@@ -0,0 +1,575 @@
+#include "async_file.h"
+#include "encrypted_file.h"
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QFile>
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+extern "C" {
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+}
+
+namespace adc{
+
+namespace {
+// the muxer's own buffer, flushed into the blocks below
+constexpr int kIoBufferBytes = 256 * 1024;
+// AES-GCM time of all the recording's files as a share of its duration;
+// judged after the first seconds, when the header chunks no longer dominate
+constexpr double kCipherBudget = 0.03;
+constexpr int64_t kCipherGraceUs = 10 * 1000000;
+
+struct Block{
+    int64_t offset = 0;
+    int64_t size = 0;
+    int64_t capacity = 0;
+    uint8_t* data = nullptr;
+};
+
+using OpenCallback = int (*)(AVFormatContext*, AVIOContext**, const char*, int, AVDictionary**);
+
+OpenCallback defaultOpen(){
+    static const OpenCallback callback = []{
+        AVFormatContext* ctx = avformat_alloc_context();
+        OpenCallback open = ctx ? ctx->io_open : nullptr;
+        avformat_free_context(ctx);
+        return open;
+    }();
+    return callback;
+}
+}
+
+void WriteMetrics::record(int64_t us, int64_t bytes){
+    QMutexLocker locker(&m_mutex);
+    const double ms = us / 1000.0;
+    m_stats.lastMs = ms;
+    m_stats.maxMs = std::max(m_stats.maxMs, ms);
+    m_stats.writes += 1;
+    m_stats.bytes += bytes;
+    m_totalMs += ms;
+    m_stats.averageMs = m_totalMs / m_stats.writes;
+}
+
+void WriteMetrics::queued(int64_t delta){
+    QMutexLocker locker(&m_mutex);
+    if (m_startUs == 0 && delta > 0) {
+        m_startUs = av_gettime_relative();
+    }
+    m_stats.queuedBytes += delta;
+    m_stats.maxQueuedBytes = std::max(m_stats.maxQueuedBytes, m_stats.queuedBytes);
+}
+
+void WriteMetrics::synced(){
+    QMutexLocker locker(&m_mutex);
+    m_stats.syncs += 1;
+}
+
+void WriteMetrics::ciphered(int64_t us){
+    QMutexLocker locker(&m_mutex);
+    m_stats.cipherMs += us / 1000.0;
+    const int64_t elapsedUs = m_startUs > 0 ? av_gettime_relative() - m_startUs : 0;
+    if (!m_stats.cipherOverBudget && elapsedUs >= kCipherGraceUs &&
+        m_stats.cipherMs * 1000 > kCipherBudget * elapsedUs) {
+        m_stats.cipherOverBudget = true;
+        qWarning() << "Encryption took" << m_stats.cipherMs << "ms of the first" << elapsedUs / 1000
+                   << "ms, over the" << kCipherBudget * 100 << "% budget";
+    }
+}
+
+WriteStats WriteMetrics::stats() const{
+    QMutexLocker locker(&m_mutex);
+    return m_stats;
+}
+
+void WriteMetrics::reset(){
+    QMutexLocker locker(&m_mutex);
+    // files still closing keep reporting into the queue depth
+    const int64_t queued = m_stats.queuedBytes;
+    m_stats = WriteStats();
+    m_stats.queuedBytes = m_stats.maxQueuedBytes = queued;
+    m_totalMs = 0;
+    m_startUs = 0;
+}
+
+class AsyncFilePrivate{
+public:
+    AsyncFile::Options options;
+    QString path;
+
+    QMutex mutex;
+    QWaitCondition notEmpty;
+    QWaitCondition notFull;
+    QWaitCondition idle;
+    QQueue<Block> queue;
+    // queued or being written
+    int64_t pending = 0;
+    bool stopping = false;
+    bool failed = false;
+    bool finished = false;
+
+    // muxer thread
+    int64_t position = 0;
+    int64_t size = 0;
+
+    // writer thread
+    int64_t allocated = 0;
+    int64_t syncedUs = 0;
+    EncryptedFile* crypt = nullptr;
+    int64_t cipherUs = 0;
+#ifdef Q_OS_WIN
+    HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
+};
+
+AsyncFile::AsyncFile(const Options& options)
+{
+    d = new AsyncFilePrivate;
+    d->options = options;
+    d->options.blockBytes = std::max<int64_t>(d->options.blockBytes, kIoBufferBytes);
+    d->options.maxQueuedBytes = std::max<int64_t>(d->options.maxQueuedBytes, 1);
+}
+
+AsyncFile::~AsyncFile(){
+    this->finish();
+    delete d->crypt;
+    delete d;
+}
+
+int AsyncFile::open(AVFormatContext* ctx, const QString& path, const Options& options){
+    auto file = new AsyncFile(options);
+    if (!file->openFile(path)) {
+        delete file;
+        return AVERROR(EIO);
+    }
+    if (!options.key.isEmpty()) {
+        file->d->crypt = new EncryptedFile(
+            [file](const uint8_t* data, int size, int64_t offset){ return file->writeAt(data, size, offset); },
+            [file](uint8_t* data, int size, int64_t offset){ return file->readAt(data, size, offset); });
+        if (!file->d->crypt->begin(options.key)) {
+            qWarning() << "Could not set up encryption for" << path;
+            delete file->d->crypt;
+            file->d->crypt = nullptr;
+            delete file;
+            return AVERROR(EINVAL);
+        }
+    }
+    auto buffer = static_cast<unsigned char*>(av_malloc(kIoBufferBytes));
+    AVIOContext* pb = buffer ? avio_alloc_context(buffer, kIoBufferBytes, 1, file, nullptr,
+                                                  &AsyncFile::writePacket, &AsyncFile::seek) : nullptr;
+    if (!pb) {
+        av_free(buffer);
+        delete file;
+        return AVERROR(ENOMEM);
+    }
+    pb->seekable = AVIO_SEEKABLE_NORMAL;
+    ctx->pb = pb;
+    // muxers that read their output back (faststart) must see it on disk,
+    // an encrypted file cannot be read back as such
+    if (ctx->io_open == defaultOpen() && !file->d->crypt) {
+        ctx->io_open = &AsyncFile::openHook;
+    }
+    file->d->syncedUs = av_gettime_relative();
+    file->start();
+    return 0;
+}
+
+int AsyncFile::close(AVFormatContext* ctx){
+    if (!ctx || !ctx->pb) {
+        return 0;
+    }
+    AsyncFile* file = from(ctx->pb);
+    if (!file) {
+        return avio_closep(&ctx->pb);
+    }
+    avio_flush(ctx->pb);
+    int ret = file->finish();
+    if (ctx->pb->error < 0) {
+        ret = ctx->pb->error;
+    }
+    if (ctx->io_open == &AsyncFile::openHook) {
+        ctx->io_open = defaultOpen();
+    }
+    av_freep(&ctx->pb->buffer);
+    avio_context_free(&ctx->pb);
+    delete file;
+    return ret;
+}
+
+void AsyncFile::abort(AVFormatContext* ctx){
+    AsyncFile* file = ctx ? from(ctx->pb) : nullptr;
+    if (!file) {
+        return;
+    }
+    AsyncFilePrivate* d = file->d;
+    QMutexLocker locker(&d->mutex);
+    d->failed = true;
+    while (!d->queue.isEmpty()) {
+        Block block = d->queue.dequeue();
+        d->pending -= block.size;
+        if (d->options.metrics) {
+            d->options.metrics->queued(-block.size);
+        }
+        av_free(block.data);
+    }
+    d->notFull.wakeAll();
+    if (d->pending == 0) {
+        d->idle.wakeAll();
+    }
+}
+
+AsyncFile* AsyncFile::from(const AVIOContext* pb){
+    return pb && pb->write_packet == &AsyncFile::writePacket ? static_cast<AsyncFile*>(pb->opaque) : nullptr;
+}
+
+int AsyncFile::openHook(AVFormatContext* s, AVIOContext** pb, const char* url, int flags, AVDictionary** options){
+    if (AsyncFile* file = from(s->pb)) {
+        file->drain();
+    }
+    return defaultOpen()(s, pb, url, flags, options);
+}
+
+int AsyncFile::writePacket(void* opaque, const uint8_t* buf, int size){
+    return static_cast<AsyncFile*>(opaque)->enqueue(buf, size);
+}
+
+int64_t AsyncFile::seek(void* opaque, int64_t offset, int whence){
+    AsyncFilePrivate* d = static_cast<AsyncFile*>(opaque)->d;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return d->size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += d->position;
+        break;
+    case SEEK_END:
+        offset += d->size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (offset < 0) {
+        return AVERROR(EINVAL);
+    }
+    d->position = offset;
+    return offset;
+}
+
+int AsyncFile::enqueue(const uint8_t* data, int size){
+    QMutexLocker locker(&d->mutex);
+    while (d->pending > 0 && d->pending + size > d->options.maxQueuedBytes && !d->failed) {
+        d->notFull.wait(&d->mutex);
+    }
+    if (d->failed) {
+        return AVERROR(EIO);
+    }
+    int64_t done = 0;
+    // flushes of single packets are merged into the last block
+    if (!d->queue.isEmpty()) {
+        Block& tail = d->queue.last();
+        if (tail.offset + tail.size == d->position) {
+            done = std::min<int64_t>(size, tail.capacity - tail.size);
+            memcpy(tail.data + tail.size, data, size_t(done));
+            tail.size += done;
+        }
+    }
+    if (done < size) {
+        Block block;
+        block.offset = d->position + done;
+        block.capacity = std::max<int64_t>(d->options.blockBytes, size - done);
+        block.size = size - done;
+        block.data = static_cast<uint8_t*>(av_malloc(size_t(block.capacity)));
+        if (!block.data) {
+            return AVERROR(ENOMEM);
+        }
+        memcpy(block.data, data + done, size_t(block.size));
+        d->queue.enqueue(block);
+    }
+    d->pending += size;
+    if (d->options.metrics) {
+        d->options.metrics->queued(size);
+    }
+    d->position += size;
+    d->size = std::max(d->size, d->position);
+    d->notEmpty.wakeOne();
+    return size;
+}
+
+void AsyncFile::drain(){
+    QMutexLocker locker(&d->mutex);
+    while (d->pending > 0) {
+        d->idle.wait(&d->mutex);
+    }
+}
+
+int AsyncFile::finish(){
+    if (d->finished) {
+        return d->failed ? AVERROR(EIO) : 0;
+    }
+    d->finished = true;
+    {
+        QMutexLocker locker(&d->mutex);
+        d->stopping = true;
+        d->notEmpty.wakeOne();
+    }
+    this->wait();
+    bool ok = !d->failed;
+    if (d->crypt) {
+        ok = ok && d->crypt->finish();
+        this->reportCipher();
+        delete d->crypt;
+        d->crypt = nullptr;
+    }
+    if (ok && d->options.sync != SyncNever) {
+        ok = this->sync();
+    }
+    this->closeFile();
+    return ok ? 0 : AVERROR(EIO);
+}
+
+void AsyncFile::run(){
+    while (true) {
+        Block block;
+        bool failed = false;
+        {
+            QMutexLocker locker(&d->mutex);
+            while (d->queue.isEmpty() && !d->stopping) {
+                d->notEmpty.wait(&d->mutex);
+            }
+            if (d->queue.isEmpty()) {
+                return;
+            }
+            block = d->queue.dequeue();
+            failed = d->failed;
+        }
+        bool ok = true;
+        if (!failed) {
+            this->preallocate(block.offset + block.size);
+            const int64_t startUs = av_gettime_relative();
+            ok = d->crypt ? d->crypt->write(block.data, block.size, block.offset)
+                          : this->writeAt(block.data, int(block.size), block.offset);
+            if (ok && d->options.metrics) {
+                d->options.metrics->record(av_gettime_relative() - startUs, block.size);
+            }
+            this->reportCipher();
+        }
+        av_free(block.data);
+
+        {
+            QMutexLocker locker(&d->mutex);
+            d->pending -= block.size;
+            if (d->options.metrics) {
+                d->options.metrics->queued(-block.size);
+            }
+            d->notFull.wakeAll();
+            if (d->pending == 0) {
+                d->idle.wakeAll();
+            }
+            if (!ok && !d->failed) {
+                d->failed = true;
+                qWarning() << "Error writing" << d->path;
+            }
+        }
+        if (ok && !failed && d->options.sync == SyncPeriodic &&
+            av_gettime_relative() - d->syncedUs >= int64_t(d->options.syncIntervalMs) * 1000) {
+            // the partial last chunk has to be on disk as well
+            if (!d->crypt || d->crypt->flush()) {
+                this->sync();
+            }
+        }
+    }
+}
+
+void AsyncFile::reportCipher(){
+    if (!d->crypt || !d->options.metrics) {
+        return;
+    }
+    const int64_t us = d->crypt->cipherUs();
+    d->options.metrics->ciphered(us - d->cipherUs);
+    d->cipherUs = us;
+}
+
+#ifdef Q_OS_WIN
+
+bool AsyncFile::openFile(const QString& path){
+    d->path = path;
+    // positioned writes, the file can be read back while open
+    // encrypted files read back the chunks they re-seal
+    const DWORD access = d->options.key.isEmpty() ? GENERIC_WRITE : GENERIC_READ | GENERIC_WRITE;
+    d->handle = CreateFileW(reinterpret_cast<const wchar_t*>(path.utf16()), access,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                            CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (d->handle == INVALID_HANDLE_VALUE) {
+        qWarning() << "Could not open" << path << GetLastError();
+        return false;
+    }
+    return true;
+}
+
+void AsyncFile::closeFile(){
+    if (d->handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(d->handle);
+        d->handle = INVALID_HANDLE_VALUE;
+    }
+}
+
+bool AsyncFile::writeAt(const uint8_t* data, int size, int64_t offset){
+    while (size > 0) {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = DWORD(offset & 0xffffffff);
+        overlapped.OffsetHigh = DWORD(offset >> 32);
+        DWORD written = 0;
+        if (!WriteFile(d->handle, data, DWORD(size), &written, &overlapped) || written == 0) {
+            return false;
+        }
+        data += written;
+        size -= int(written);
+        offset += written;
+    }
+    return true;
+}
+
+bool AsyncFile::readAt(uint8_t* data, int size, int64_t offset){
+    while (size > 0) {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = DWORD(offset & 0xffffffff);
+        overlapped.OffsetHigh = DWORD(offset >> 32);
+        DWORD read = 0;
+        if (!ReadFile(d->handle, data, DWORD(size), &read, &overlapped) || read == 0) {
+            return false;
+        }
+        data += read;
+        size -= int(read);
+        offset += read;
+    }
+    return true;
+}
+
+bool AsyncFile::preallocate(int64_t end){
+    if (d->options.preallocateBytes <= 0 || end <= d->allocated) {
+        return true;
+    }
+    // reserves space past the end of file without moving it, whatever is
+    // left over is released on close
+    FILE_ALLOCATION_INFO info = {};
+    info.AllocationSize.QuadPart = end + d->options.preallocateBytes;
+    if (!SetFileInformationByHandle(d->handle, FileAllocationInfo, &info, sizeof(info))) {
+        qDebug() << "preallocation failed" << d->path << GetLastError();
+        d->options.preallocateBytes = 0;
+        return false;
+    }
+    d->allocated = info.AllocationSize.QuadPart;
+    return true;
+}
+
+bool AsyncFile::sync(){
+    d->syncedUs = av_gettime_relative();
+    if (d->handle == INVALID_HANDLE_VALUE || !FlushFileBuffers(d->handle)) {
+        return false;
+    }
+    if (d->options.metrics) {
+        d->options.metrics->synced();
+    }
+    return true;
+}
+
+#else
+
+bool AsyncFile::openFile(const QString& path){
+    d->path = path;
+    const int access = d->options.key.isEmpty() ? O_WRONLY : O_RDWR;
+    d->fd = ::open(QFile::encodeName(path).constData(), access | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (d->fd < 0) {
+        qWarning() << "Could not open" << path << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+void AsyncFile::closeFile(){
+    if (d->fd >= 0) {
+        ::close(d->fd);
+        d->fd = -1;
+    }
+}
+
+bool AsyncFile::writeAt(const uint8_t* data, int size, int64_t offset){
+    while (size > 0) {
+        const ssize_t written = ::pwrite(d->fd, data, size_t(size), off_t(offset));
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= int(written);
+        offset += written;
+    }
+    return true;
+}
+
+bool AsyncFile::readAt(uint8_t* data, int size, int64_t offset){
+    while (size > 0) {
+        const ssize_t read = ::pread(d->fd, data, size_t(size), off_t(offset));
+        if (read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read <= 0) {
+            return false;
+        }
+        data += read;
+        size -= int(read);
+        offset += read;
+    }
+    return true;
+}
+
+bool AsyncFile::preallocate(int64_t end){
+    if (d->options.preallocateBytes <= 0 || end <= d->allocated) {
+        return true;
+    }
+#ifdef __linux__
+    const int64_t target = end + d->options.preallocateBytes;
+    if (fallocate(d->fd, FALLOC_FL_KEEP_SIZE, 0, off_t(target)) != 0) {
+        qDebug() << "preallocation failed" << d->path << strerror(errno);
+        d->options.preallocateBytes = 0;
+        return false;
+    }
+    d->allocated = target;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool AsyncFile::sync(){
+    d->syncedUs = av_gettime_relative();
+#ifdef __linux__
+    const bool ok = d->fd >= 0 && fdatasync(d->fd) == 0;
+#else
+    const bool ok = d->fd >= 0 && fsync(d->fd) == 0;
+#endif
+    if (ok && d->options.metrics) {
+        d->options.metrics->synced();
+    }
+    return ok;
+}
+
+#endif
+
+}
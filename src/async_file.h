@@ -0,0 +1,116 @@
+#ifndef ASYNC_FILE_H
+#define ASYNC_FILE_H
+
+#include <QThread>
+#include <QString>
+#include <QMutex>
+#include <QByteArray>
+#include <memory>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+namespace adc{
+
+struct WriteStats{
+    double lastMs = 0;
+    double averageMs = 0;
+    double maxMs = 0;
+    int64_t writes = 0;
+    int64_t bytes = 0;
+    int64_t queuedBytes = 0;
+    int64_t maxQueuedBytes = 0;
+    int64_t syncs = 0;
+    // AES-GCM time of encrypted files
+    double cipherMs = 0;
+    // cipherMs went over its share of the recording's time (logged once)
+    bool cipherOverBudget = false;
+};
+
+// shared by the files of one recording
+class WriteMetrics
+{
+public:
+    void record(int64_t us, int64_t bytes);
+    void queued(int64_t delta);
+    void synced();
+    void ciphered(int64_t us);
+    WriteStats stats() const;
+    void reset();
+
+private:
+    mutable QMutex m_mutex;
+    WriteStats m_stats;
+    double m_totalMs = 0;
+    // first write queued since reset()
+    int64_t m_startUs = 0;
+};
+
+// Write-behind output file behind an AVIOContext. The muxer's writes are
+// copied into large aligned blocks (small flushes are merged) and written
+// at their offsets by a dedicated thread, so a slow disk only blocks the
+// muxer once maxQueuedBytes are waiting. Seeks are only position changes.
+// Files are preallocated in steps and synced according to the policy.
+class AsyncFilePrivate;
+class AsyncFile : public QThread
+{
+public:
+    enum Sync{
+        SyncNever,
+        // once, when the file is closed
+        SyncOnClose,
+        // every syncIntervalMs and on close
+        SyncPeriodic,
+    };
+
+    struct Options{
+        int64_t blockBytes = 4 * 1024 * 1024;
+        int64_t maxQueuedBytes = 64 * 1024 * 1024;
+        // 0: the file grows with every write
+        int64_t preallocateBytes = 0;
+        Sync sync = SyncOnClose;
+        int syncIntervalMs = 1000;
+        std::shared_ptr<WriteMetrics> metrics;
+        // 32 bytes: the file is written encrypted (see EncryptedFile)
+        QByteArray key;
+    };
+
+    // replaces avio_open() on ctx->pb
+    static int open(AVFormatContext* ctx, const QString& path, const Options& options);
+    // replaces avio_closep(), plain AVIO contexts are closed as usual
+    static int close(AVFormatContext* ctx);
+    // for an output that is given up: the blocks not written yet are
+    // dropped, further writes fail and close() does not sync
+    static void abort(AVFormatContext* ctx);
+
+    ~AsyncFile();
+
+protected:
+    void run() override;
+
+private:
+    explicit AsyncFile(const Options& options);
+    bool openFile(const QString& path);
+    void closeFile();
+    bool writeAt(const uint8_t* data, int size, int64_t offset);
+    bool readAt(uint8_t* data, int size, int64_t offset);
+    bool preallocate(int64_t end);
+    bool sync();
+    void reportCipher();
+    int enqueue(const uint8_t* data, int size);
+    void drain();
+    int finish();
+
+    static int writePacket(void* opaque, const uint8_t* buf, int size);
+    static int64_t seek(void* opaque, int64_t offset, int whence);
+    static int openHook(AVFormatContext* s, AVIOContext** pb, const char* url, int flags, AVDictionary** options);
+    static AsyncFile* from(const AVIOContext* pb);
+
+private:
+    AsyncFilePrivate* d;
+};
+
+}
+
+#endif // ASYNC_FILE_H
@@ -4,6 +4,7 @@
 #include <audioclient.h>
 #include "recorder.h"
 #include <QDebug>
+#include <atomic>
 namespace adc{
 class AudioCapturePrivate{
 public:
@@ -14,8 +15,10 @@ public:
     IAudioCaptureClient* capture = nullptr;
     WAVEFORMATEX* pwfx = nullptr;
 
-    bool capturing = false;
-    bool paused = false;
+    bool initialized = false;
+    std::atomic<bool> capturing{ false };
+    // flipped by the recorder's worker, checked once per frame
+    std::atomic<bool> paused{ false };
 };
 
 
@@ -25,12 +28,18 @@ AudioCapture::AudioCapture(Recorder* instance)
     d = new AudioCapturePrivate;
     d->instance = instance;
 
-    connect(this, &QThread::finished, this, &AudioCapture::onFinished);
+    // runs on the capture thread before wait() returns, so the recorder can
+    // prepare the next session as soon as stop() is done
+    connect(this, &QThread::finished, this, &AudioCapture::onFinished, Qt::DirectConnection);
     CoInitialize(nullptr);
 }
 
 
 bool AudioCapture::init(){
+    // the loopback client survives recordings, it is only stopped and reset
+    if (d->initialized) {
+        return true;
+    }
     HRESULT hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_ALL, IID_PPV_ARGS(&d->enumerator));
     if (FAILED(hr)) return false;
     d->enumerator->GetDefaultAudioEndpoint(eRender, eConsole, &d->device);
@@ -43,6 +52,8 @@ bool AudioCapture::init(){
         qDebug()<<("AudioClient Initialize failed:")<<hr;
         return false;
     }
+    d->client->GetService(IID_PPV_ARGS(&d->capture));
+    d->initialized = true;
     return true;
 }
 
@@ -52,8 +63,11 @@ bool AudioCapture::startRecording(){
     if(d->capturing){
         return false;
     }
+    if(!d->initialized && !this->init()){
+        return false;
+    }
+    d->paused = false;
     d->capturing = true;
-    d->client->GetService(IID_PPV_ARGS(&d->capture));
     d->client->Start();
     this->start();
     return true;
@@ -64,6 +78,12 @@ void AudioCapture::stopRecording(){
 }
 
 AudioCapture::~AudioCapture(){
+    if (d->capture) d->capture->Release();
+    if (d->client) d->client->Release();
+    if (d->device) d->device->Release();
+    if (d->enumerator) d->enumerator->Release();
+    if (d->pwfx) CoTaskMemFree(d->pwfx);
+    delete d;
     CoUninitialize();
 }
 
@@ -91,12 +111,10 @@ void AudioCapture::run(){
 
 
 void AudioCapture::onFinished() {
-    d->client->Stop();
-    if (d->capture) d->capture->Release();
-    if (d->client) d->client->Release();
-    if (d->device) d->device->Release();
-    if (d->enumerator) d->enumerator->Release();
-    this->deleteLater();
+    if (d->client) {
+        d->client->Stop();
+        d->client->Reset();
+    }
 }
 
 void AudioCapture::pause(){
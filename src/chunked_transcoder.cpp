@@ -0,0 +1,531 @@
+#include "chunked_transcoder.h"
+#include <QFile>
+#include <QSaveFile>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QDebug>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+namespace adc{
+
+namespace {
+constexpr int kMinChunkSeconds = 20;
+// a few chunks per job keep every core busy to the end
+constexpr int kChunksPerJob = 3;
+// of the progress, the rest is the join
+constexpr int kEncodePercent = 95;
+// nut has no negative timestamps, the decode delay makes the first ones so
+constexpr int kOffsetSeconds = 10;
+
+struct Chunk{
+    int64_t start = 0;
+    int64_t end = 0;
+    QString path;
+};
+
+struct Scan{
+    AVRational timeBase{ 0, 1 };
+    std::vector<int64_t> keyframes;
+    int64_t end = AV_NOPTS_VALUE;
+};
+
+// keyframes of the video stream, reading the packets only
+bool scan(const QString& source, Scan* result){
+    AVFormatContext* in = nullptr;
+    if (avformat_open_input(&in, source.toUtf8().constData(), nullptr, nullptr) < 0) {
+        return false;
+    }
+    bool ok = avformat_find_stream_info(in, nullptr) >= 0;
+    const int videoIndex = ok ? av_find_best_stream(in, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0) : -1;
+    AVPacket* packet = av_packet_alloc();
+    ok = videoIndex >= 0 && packet;
+    if (ok) {
+        for (unsigned i = 0; i < in->nb_streams; ++i) {
+            if (int(i) != videoIndex) {
+                in->streams[i]->discard = AVDISCARD_ALL;
+            }
+        }
+        result->timeBase = in->streams[videoIndex]->time_base;
+        while (av_read_frame(in, packet) >= 0) {
+            const int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+            if (packet->stream_index == videoIndex && pts != AV_NOPTS_VALUE) {
+                if (packet->flags & AV_PKT_FLAG_KEY) {
+                    result->keyframes.push_back(pts);
+                }
+                const int64_t end = pts + std::max<int64_t>(1, packet->duration);
+                result->end = result->end == AV_NOPTS_VALUE ? end : std::max(result->end, end);
+            }
+            av_packet_unref(packet);
+        }
+        std::sort(result->keyframes.begin(), result->keyframes.end());
+        ok = !result->keyframes.empty();
+    }
+    av_packet_free(&packet);
+    avformat_close_input(&in);
+    return ok;
+}
+
+QString chunkPath(const QString& output, size_t index){
+    return QString("%1.%2.nut").arg(output).arg(index);
+}
+
+// <output>.chunks: the boundaries a run was cut into, one "start end" line
+// per chunk, so that a restarted run reuses the chunks it finished
+std::vector<Chunk> readChunks(const QString& path, const QString& output, const Scan& keys){
+    std::vector<Chunk> chunks;
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return chunks;
+    }
+    while (!file.atEnd()) {
+        const QList<QByteArray> fields = file.readLine().trimmed().split(' ');
+        bool startOk = false, endOk = false;
+        Chunk chunk;
+        chunk.start = fields.size() == 2 ? fields[0].toLongLong(&startOk) : 0;
+        chunk.end = fields.size() == 2 ? fields[1].toLongLong(&endOk) : 0;
+        if (!startOk || !endOk) {
+            return {};
+        }
+        chunk.path = chunkPath(output, chunks.size());
+        chunks.push_back(chunk);
+    }
+    // from another source
+    if (chunks.empty() || chunks.front().start != keys.keyframes.front() || chunks.back().end != keys.end) {
+        return {};
+    }
+    return chunks;
+}
+
+bool writeChunks(const QString& path, const std::vector<Chunk>& chunks){
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    QByteArray text;
+    for (const Chunk& chunk : chunks) {
+        text += QByteArray::number(qint64(chunk.start)) + ' ' + QByteArray::number(qint64(chunk.end)) + '\n';
+    }
+    file.write(text);
+    return file.commit();
+}
+
+// the chunk files one after the other as a single video stream
+class ChunkReader{
+public:
+    // offset: what the chunks were written shifted by, in source time base
+    ChunkReader(const std::vector<Chunk>& chunks, int64_t offset, AVRational timeBase)
+        : m_chunks(chunks), m_offset(offset), m_timeBase(timeBase) {}
+    ~ChunkReader(){
+        avformat_close_input(&m_in);
+        avcodec_parameters_free(&m_first);
+    }
+
+    // opens the first chunk; its stream is the one of the joined file
+    const AVStream* open(QString* error){
+        if (!this->openChunk(0, error)) {
+            return nullptr;
+        }
+        m_first = avcodec_parameters_alloc();
+        avcodec_parameters_copy(m_first, m_in->streams[0]->codecpar);
+        return m_in->streams[0];
+    }
+
+    // false at the end or on error (then error is set)
+    bool next(AVPacket* packet, AVRational* timeBase, QString* error){
+        while (m_in) {
+            if (av_read_frame(m_in, packet) >= 0) {
+                *timeBase = m_in->streams[0]->time_base;
+                const int64_t offset = av_rescale_q(m_offset, m_timeBase, *timeBase);
+                if (packet->pts != AV_NOPTS_VALUE) {
+                    packet->pts -= offset;
+                }
+                if (packet->dts != AV_NOPTS_VALUE) {
+                    packet->dts -= offset;
+                }
+                return true;
+            }
+            avformat_close_input(&m_in);
+            if (m_index + 1 >= int(m_chunks.size()) || !this->openChunk(m_index + 1, error)) {
+                return false;
+            }
+            const AVCodecParameters* par = m_in->streams[0]->codecpar;
+            if (par->codec_id != m_first->codec_id || par->extradata_size != m_first->extradata_size ||
+                (par->extradata_size > 0 && memcmp(par->extradata, m_first->extradata, size_t(par->extradata_size)) != 0)) {
+                *error = QString("chunk %1 has other stream headers").arg(m_index);
+                return false;
+            }
+        }
+        return false;
+    }
+
+private:
+    bool openChunk(int index, QString* error){
+        m_index = index;
+        const QByteArray path = m_chunks[size_t(index)].path.toUtf8();
+        if (avformat_open_input(&m_in, path.constData(), nullptr, nullptr) < 0 ||
+            avformat_find_stream_info(m_in, nullptr) < 0 || m_in->nb_streams != 1) {
+            *error = "could not read " + m_chunks[size_t(index)].path;
+            avformat_close_input(&m_in);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    const std::vector<Chunk>& m_chunks;
+    int64_t m_offset;
+    AVRational m_timeBase;
+    AVFormatContext* m_in = nullptr;
+    AVCodecParameters* m_first = nullptr;
+    int m_index = 0;
+};
+
+int64_t timestamp(const AVPacket* packet){
+    return packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+}
+
+// the encoded chunks plus the source's audio, merged in dts order
+bool join(const QString& source, const std::vector<Chunk>& chunks, int64_t offset, AVRational timeBase,
+          const QString& output, const QString& part, QString* error){
+    AVFormatContext* in = nullptr;
+    AVFormatContext* out = nullptr;
+    AVPacket* video = av_packet_alloc();
+    AVPacket* audio = av_packet_alloc();
+    ChunkReader reader(chunks, offset, timeBase);
+    std::vector<int> streams;
+    int64_t lastDts = AV_NOPTS_VALUE;
+    int fixed = 0;
+    const bool ok = [&]{
+        if (!video || !audio) {
+            *error = "out of memory";
+            return false;
+        }
+        if (avformat_open_input(&in, source.toUtf8().constData(), nullptr, nullptr) < 0 ||
+            avformat_find_stream_info(in, nullptr) < 0) {
+            *error = "could not read " + source;
+            return false;
+        }
+        if (avformat_alloc_output_context2(&out, nullptr, nullptr, output.toUtf8().constData()) < 0) {
+            *error = "no muxer for " + output;
+            return false;
+        }
+        const AVStream* chunkVideo = reader.open(error);
+        if (!chunkVideo) {
+            return false;
+        }
+        AVStream* outVideo = avformat_new_stream(out, nullptr);
+        if (!outVideo || avcodec_parameters_copy(outVideo->codecpar, chunkVideo->codecpar) < 0) {
+            *error = "could not add the video stream";
+            return false;
+        }
+        outVideo->codecpar->codec_tag = 0;
+        outVideo->time_base = chunkVideo->time_base;
+        outVideo->avg_frame_rate = chunkVideo->avg_frame_rate;
+        streams.assign(in->nb_streams, -1);
+        for (unsigned i = 0; i < in->nb_streams; ++i) {
+            AVStream* stream = in->streams[i];
+            if (stream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO) {
+                stream->discard = AVDISCARD_ALL;
+                continue;
+            }
+            AVStream* copy = avformat_new_stream(out, nullptr);
+            if (!copy || avcodec_parameters_copy(copy->codecpar, stream->codecpar) < 0) {
+                *error = "could not add an audio stream";
+                return false;
+            }
+            copy->codecpar->codec_tag = 0;
+            copy->time_base = stream->time_base;
+            streams[i] = copy->index;
+        }
+        if (avio_open(&out->pb, part.toUtf8().constData(), AVIO_FLAG_WRITE) < 0) {
+            *error = "could not create " + part;
+            return false;
+        }
+        if (avformat_write_header(out, nullptr) < 0) {
+            *error = "could not write the header of " + output;
+            return false;
+        }
+
+        AVRational videoTimeBase = chunkVideo->time_base;
+        bool haveVideo = reader.next(video, &videoTimeBase, error);
+        auto nextAudio = [&]{
+            while (av_read_frame(in, audio) >= 0) {
+                if (streams[audio->stream_index] >= 0 && timestamp(audio) != AV_NOPTS_VALUE) {
+                    return true;
+                }
+                av_packet_unref(audio);
+            }
+            return false;
+        };
+        bool haveAudio = nextAudio();
+        while (haveVideo || haveAudio) {
+            const bool takeVideo = haveVideo && (!haveAudio ||
+                av_compare_ts(timestamp(video), videoTimeBase, timestamp(audio),
+                              in->streams[audio->stream_index]->time_base) <= 0);
+            int ret = 0;
+            if (takeVideo) {
+                // identical encoders keep the decode delay, this only
+                // catches a source with gaps in its frame rate
+                if (lastDts != AV_NOPTS_VALUE && video->dts != AV_NOPTS_VALUE && video->dts <= lastDts) {
+                    video->dts = lastDts + 1;
+                    video->pts = std::max(video->pts, video->dts);
+                    fixed += 1;
+                }
+                lastDts = video->dts;
+                av_packet_rescale_ts(video, videoTimeBase, outVideo->time_base);
+                video->stream_index = outVideo->index;
+                video->pos = -1;
+                ret = av_interleaved_write_frame(out, video);
+                haveVideo = reader.next(video, &videoTimeBase, error);
+                if (!haveVideo && !error->isEmpty()) {
+                    return false;
+                }
+            } else {
+                AVStream* copy = out->streams[streams[audio->stream_index]];
+                av_packet_rescale_ts(audio, in->streams[audio->stream_index]->time_base, copy->time_base);
+                audio->stream_index = copy->index;
+                audio->pos = -1;
+                ret = av_interleaved_write_frame(out, audio);
+                haveAudio = nextAudio();
+            }
+            if (ret < 0) {
+                *error = "error writing " + part;
+                return false;
+            }
+        }
+        if (av_write_trailer(out) < 0 || avio_closep(&out->pb) < 0) {
+            *error = "error finishing " + part;
+            return false;
+        }
+        return true;
+    }();
+    if (fixed > 0) {
+        qWarning() << "Joined" << output << "with" << fixed << "decode timestamps moved forward";
+    }
+    av_packet_free(&audio);
+    av_packet_free(&video);
+    if (out) {
+        avio_closep(&out->pb);
+        avformat_free_context(out);
+    }
+    avformat_close_input(&in);
+    return ok;
+}
+}
+
+ChunkedTranscoder::ChunkedTranscoder(){
+
+}
+
+void ChunkedTranscoder::setProfile(const TranscodeProfile& profile){
+    m_profile = profile;
+}
+
+void ChunkedTranscoder::setChunkSeconds(int seconds){
+    m_chunkSeconds = std::max(0, seconds);
+}
+
+void ChunkedTranscoder::setCheckpoint(const std::function<bool()>& checkpoint){
+    m_checkpoint = checkpoint;
+}
+
+void ChunkedTranscoder::setProgress(const std::function<void(int)>& progress){
+    m_progress = progress;
+}
+
+bool ChunkedTranscoder::isCancelled() const{
+    return m_cancelled;
+}
+
+QString ChunkedTranscoder::errorString() const{
+    return m_error;
+}
+
+int ChunkedTranscoder::chunks() const{
+    return m_chunks;
+}
+
+int ChunkedTranscoder::jobs() const{
+    return m_jobs;
+}
+
+bool ChunkedTranscoder::fail(const QString& message){
+    m_error = message;
+    return false;
+}
+
+bool ChunkedTranscoder::transcode(const QString& source, const QString& output){
+    m_cancelled = false;
+    m_error.clear();
+    m_chunks = m_jobs = 0;
+
+    Scan keys;
+    if (!scan(source, &keys)) {
+        return this->fail("no video keyframes in " + source);
+    }
+    const int cores = m_profile.threads > 0 ? m_profile.threads : QThread::idealThreadCount();
+    int jobs = m_profile.jobs > 0 ? m_profile.jobs : std::max(1, cores / 4);
+    const double seconds = (keys.end - keys.keyframes.front()) * av_q2d(keys.timeBase);
+    const double chunkSeconds = m_chunkSeconds > 0 ? m_chunkSeconds
+                                                   : std::max<double>(kMinChunkSeconds, seconds / (jobs * kChunksPerJob));
+    const int64_t chunkLength = std::max<int64_t>(1, int64_t(chunkSeconds / av_q2d(keys.timeBase)));
+
+    const QString chunksPath = output + ".chunks";
+    std::vector<Chunk> chunks = readChunks(chunksPath, output, keys);
+    if (chunks.empty()) {
+        for (int64_t key : keys.keyframes) {
+            if (chunks.empty() || key - chunks.back().start >= chunkLength) {
+                if (!chunks.empty()) {
+                    chunks.back().end = key;
+                }
+                Chunk chunk;
+                chunk.start = key;
+                chunk.path = chunkPath(output, chunks.size());
+                chunks.push_back(chunk);
+            }
+        }
+        chunks.back().end = keys.end;
+        // chunk files of an earlier layout would be taken as finished
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            QFile::remove(chunks[i].path);
+        }
+        if (!writeChunks(chunksPath, chunks)) {
+            qWarning() << "Could not write" << chunksPath << "- a restart starts over";
+        }
+    }
+    // a chunk file is only there once complete (Transcoder renames its .part)
+    std::vector<bool> finished(chunks.size());
+    int reused = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        finished[i] = QFile::exists(chunks[i].path);
+        reused += finished[i] ? 1 : 0;
+    }
+    jobs = std::min(jobs, int(chunks.size()));
+    m_chunks = int(chunks.size());
+    m_jobs = jobs;
+    qDebug() << "transcoding" << source << "in" << chunks.size() << "chunks," << jobs << "at a time,"
+             << reused << "already done";
+
+    // the chunks have to carry their headers the way the output wants them
+    const AVOutputFormat* format = av_guess_format(nullptr, output.toUtf8().constData(), nullptr);
+    if (!format) {
+        return this->fail("no muxer for " + output);
+    }
+    const bool globalHeader = (format->flags & AVFMT_GLOBALHEADER) != 0;
+    TranscodeProfile profile = m_profile;
+    profile.threads = std::max(1, cores / jobs);
+    const int64_t offset = av_rescale_q(kOffsetSeconds, AVRational{ 1, 1 }, keys.timeBase);
+
+    std::unique_ptr<std::atomic<int>[]> percents(new std::atomic<int>[chunks.size()]);
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        percents[i] = finished[i] ? 100 : 0;
+    }
+    std::atomic<bool> failed{ false };
+    std::atomic<bool> cancelled{ false };
+    QMutex errorMutex;
+    QString error;
+    const QThread::Priority priority = QThread::currentThread()->priority();
+    QThreadPool pool;
+    pool.setMaxThreadCount(jobs);
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (finished[i]) {
+            continue;
+        }
+        pool.start(QRunnable::create([&, i]{
+            if (failed || cancelled) {
+                return;
+            }
+            // as low as the thread that asked for it
+            if (priority != QThread::InheritPriority) {
+                QThread::currentThread()->setPriority(priority);
+            }
+            Transcoder transcoder;
+            transcoder.setProfile(profile);
+            transcoder.setCheckpoint([&]{
+                if (failed || cancelled) {
+                    return false;
+                }
+                if (m_checkpoint && !m_checkpoint()) {
+                    cancelled = true;
+                    return false;
+                }
+                return true;
+            });
+            transcoder.setProgress([&, i](int percent){
+                percents[i] = percent;
+            });
+            if (!transcoder.transcodeRange(source, chunks[i].path, chunks[i].start, chunks[i].end, globalHeader, offset) &&
+                !transcoder.isCancelled()) {
+                QMutexLocker locker(&errorMutex);
+                if (!failed.exchange(true)) {
+                    error = QString("chunk %1: %2").arg(i).arg(transcoder.errorString());
+                }
+            }
+        }));
+    }
+    const double total = std::max<double>(1, double(keys.end - chunks.front().start));
+    int reported = -1;
+    while (!pool.waitForDone(250)) {
+        if (!m_progress) {
+            continue;
+        }
+        double done = 0;
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            done += double(chunks[i].end - chunks[i].start) * percents[i] / 100.0;
+        }
+        const int percent = int(done / total * kEncodePercent);
+        if (percent != reported) {
+            reported = percent;
+            m_progress(percent);
+        }
+    }
+
+    bool ok = !failed && !cancelled;
+    if (cancelled) {
+        m_cancelled = true;
+        this->fail("cancelled");
+    } else if (failed) {
+        this->fail(error);
+    }
+    const QString part = output + ".part";
+    if (ok) {
+        if (m_progress) {
+            m_progress(kEncodePercent);
+        }
+        ok = join(source, chunks, offset, keys.timeBase, output, part, &m_error);
+    }
+    // a cancelled run keeps its finished chunks for the next one
+    if (!m_cancelled) {
+        for (const Chunk& chunk : chunks) {
+            QFile::remove(chunk.path);
+        }
+        QFile::remove(chunksPath);
+    }
+    if (!ok) {
+        QFile::remove(part);
+        return false;
+    }
+    QFile::remove(output);
+    if (!QFile::rename(part, output)) {
+        QFile::remove(part);
+        return this->fail("could not rename " + part);
+    }
+    if (m_progress) {
+        m_progress(100);
+    }
+    return true;
+}
+
+}
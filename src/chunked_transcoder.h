@@ -0,0 +1,56 @@
+#ifndef CHUNKED_TRANSCODER_H
+#define CHUNKED_TRANSCODER_H
+
+#include <QString>
+#include <functional>
+#include "transcoder.h"
+
+namespace adc{
+
+// Offline re-encode of long recordings on every core. The video is cut at
+// its keyframes into chunks, each encoded by an encoder of its own into
+// <output>.<n>.nut, profile.jobs of them at a time with cores / jobs
+// threads each. The chunks are then joined with the copied audio into the
+// output, packets as they are: every chunk starts with an IDR frame and
+// keeps the source timestamps, and identically configured encoders give
+// the same stream headers and decode delay, so timestamps run on across
+// the joins. A cancelled run leaves its finished chunks and their layout
+// (<output>.chunks) behind; the next run for the same output reuses them.
+class ChunkedTranscoder
+{
+public:
+    ChunkedTranscoder();
+
+    void setProfile(const TranscodeProfile& profile);
+    // chunks are cut at the first keyframe past this length, 0 sizes them
+    // for a few chunks per job
+    void setChunkSeconds(int seconds);
+    // called between packets on the encoding threads; may block, false cancels
+    void setCheckpoint(const std::function<bool()>& checkpoint);
+    // on the caller's thread
+    void setProgress(const std::function<void(int percent)>& progress);
+
+    bool transcode(const QString& source, const QString& output);
+    bool isCancelled() const;
+    QString errorString() const;
+    // of the last transcode()
+    int chunks() const;
+    int jobs() const;
+
+private:
+    bool fail(const QString& message);
+
+private:
+    TranscodeProfile m_profile;
+    int m_chunkSeconds = 0;
+    std::function<bool()> m_checkpoint;
+    std::function<void(int)> m_progress;
+    bool m_cancelled = false;
+    QString m_error;
+    int m_chunks = 0;
+    int m_jobs = 0;
+};
+
+}
+
+#endif // CHUNKED_TRANSCODER_H
@@ -0,0 +1,170 @@
+#include "content_classifier.h"
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+namespace adc{
+
+namespace {
+// sampling grid, independent of the output resolution
+constexpr int kGridWidth = 160;
+constexpr int kGridHeight = 90;
+// luma delta for a sample to count as changed / as an edge
+constexpr int kMotionDelta = 12;
+constexpr int kEdgeDelta = 64;
+// per-GOP averages that select a class
+constexpr double kMotionRatio = 0.20;
+constexpr double kTextEdgeRatio = 0.06;
+// consecutive GOPs that must agree before the class switches
+constexpr int kHysteresis = 2;
+}
+
+class ContentClassifierPrivate{
+public:
+    std::vector<uint8_t> prev;
+    int width = 0;
+    int height = 0;
+
+    double motionSum = 0;
+    double edgeSum = 0;
+    int frames = 0;
+
+    double motion = 0;
+    double edges = 0;
+    double frameMotion = 0;
+
+    ContentClassifier::Content content = ContentClassifier::Unknown;
+    ContentClassifier::Content candidate = ContentClassifier::Unknown;
+    int candidateCount = 0;
+};
+
+ContentClassifier::ContentClassifier(){
+    d = new ContentClassifierPrivate;
+}
+
+ContentClassifier::~ContentClassifier(){
+    delete d;
+}
+
+void ContentClassifier::reset(){
+    d->prev.clear();
+    d->width = d->height = 0;
+    d->motionSum = d->edgeSum = 0;
+    d->frames = 0;
+    d->frameMotion = 0;
+    d->candidate = Unknown;
+    d->candidateCount = 0;
+    //keep d->content: the last class is a good hint for the next recording
+}
+
+void ContentClassifier::analyze(const AVFrame* frame){
+    if (!frame || !frame->data[0] || frame->width < 2 || frame->height < 2) {
+        return;
+    }
+    const int w = frame->width;
+    const int h = frame->height;
+    const int stepX = std::max(1, w / kGridWidth);
+    const int stepY = std::max(1, h / kGridHeight);
+    const int cols = (w - 1) / stepX;
+    const int rows = (h - 1) / stepY;
+    const uint8_t* luma = frame->data[0];
+    const int stride = frame->linesize[0];
+
+    bool hasPrev = d->width == w && d->height == h && d->prev.size() == size_t(cols * rows);
+    if (!hasPrev) {
+        d->prev.assign(cols * rows, 0);
+        d->width = w;
+        d->height = h;
+    }
+
+    int changed = 0;
+    int edges = 0;
+    uint8_t* prev = d->prev.data();
+    for (int r = 0; r < rows; ++r) {
+        const uint8_t* line = luma + r * stepY * stride;
+        const uint8_t* next = line + stride;
+        for (int c = 0; c < cols; ++c) {
+            int x = c * stepX;
+            int v = line[x];
+            if (std::abs(v - line[x + 1]) > kEdgeDelta || std::abs(v - next[x]) > kEdgeDelta) {
+                ++edges;
+            }
+            if (std::abs(v - *prev) > kMotionDelta) {
+                ++changed;
+            }
+            *prev++ = uint8_t(v);
+        }
+    }
+
+    const double samples = double(cols * rows);
+    d->frameMotion = hasPrev ? changed / samples : 0;
+    d->motionSum += d->frameMotion;
+    d->edgeSum += edges / samples;
+    d->frames += 1;
+}
+
+ContentClassifier::Content ContentClassifier::commit(){
+    if (d->frames == 0) {
+        return d->content;
+    }
+    d->motion = d->motionSum / d->frames;
+    d->edges = d->edgeSum / d->frames;
+    d->motionSum = d->edgeSum = 0;
+    d->frames = 0;
+
+    Content current;
+    if (d->motion > kMotionRatio) {
+        current = Motion;
+    } else if (d->edges > kTextEdgeRatio) {
+        current = Text;
+    } else {
+        current = Desktop;
+    }
+
+    if (d->content == Unknown) {
+        d->content = current;
+    } else if (current == d->content) {
+        d->candidateCount = 0;
+    } else {
+        if (current != d->candidate) {
+            d->candidate = current;
+            d->candidateCount = 0;
+        }
+        if (++d->candidateCount >= kHysteresis) {
+            d->content = current;
+            d->candidateCount = 0;
+        }
+    }
+    return d->content;
+}
+
+ContentClassifier::Content ContentClassifier::content() const{
+    return d->content;
+}
+
+double ContentClassifier::motion() const{
+    return d->motion;
+}
+
+double ContentClassifier::edges() const{
+    return d->edges;
+}
+
+double ContentClassifier::frameMotion() const{
+    return d->frameMotion;
+}
+
+const char* ContentClassifier::name(Content content){
+    switch (content) {
+    case Text:
+        return "text";
+    case Desktop:
+        return "desktop";
+    case Motion:
+        return "motion";
+    default:
+        return "unknown";
+    }
+}
+
+}
@@ -0,0 +1,48 @@
+#ifndef CONTENT_CLASSIFIER_H
+#define CONTENT_CLASSIFIER_H
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+namespace adc{
+
+class ContentClassifierPrivate;
+// Cheap motion / edge statistics over a sparse luma grid of the converted
+// YUV frames. Statistics are accumulated per GOP and turned into a content
+// class when the encoder reaches a GOP boundary (see commit()).
+class ContentClassifier
+{
+public:
+    enum Content{
+        Unknown=0,
+        Text,       // terminals, IDEs, documents: static, sharp edges
+        Desktop,    // general desktop use: mostly static, some scrolling
+        Motion      // games, video playback: most of the frame changes
+    };
+
+    ContentClassifier();
+    ~ContentClassifier();
+    ContentClassifier(const ContentClassifier&) = delete;
+    ContentClassifier& operator=(const ContentClassifier&) = delete;
+
+    void reset();
+    void analyze(const AVFrame* frame);
+    Content commit();
+    Content content() const;
+
+    // per-GOP averages of the last commit()
+    double motion() const;
+    double edges() const;
+    // changed fraction of the last analyzed frame
+    double frameMotion() const;
+
+    static const char* name(Content content);
+
+private:
+    ContentClassifierPrivate* d;
+};
+
+}
+
+#endif // CONTENT_CLASSIFIER_H
@@ -0,0 +1,198 @@
+#include "encoder_tuning.h"
+extern "C" {
+#include <libavutil/opt.h>
+}
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+namespace adc{
+
+namespace {
+
+bool isEncoder(const AVCodecContext* ctx, const char* name){
+    return ctx && ctx->codec && strcmp(ctx->codec->name, name) == 0;
+}
+
+// One x264 veryfast thread encodes ~47 Mpixel/s of the synthetic screen
+// content of tools/encoder_bench.cpp (45-49 from 720p to 4K). Real captures
+// cost more and a live encode must keep up at its peaks, so a thread is
+// planned for two thirds of that, about 1080p15.
+constexpr double kMeasuredPixelRate = 47e6;
+constexpr double kPixelRatePerThread = kMeasuredPixelRate * 2 / 3;
+constexpr int kMaxThreads = 64;
+
+const char* x264Tune(ContentClassifier::Content content){
+    switch (content) {
+    case ContentClassifier::Text:
+        return "stillimage";
+    case ContentClassifier::Desktop:
+        return "animation";
+    default:
+        return nullptr;
+    }
+}
+
+// static content is cheap to keep sharp, motion is where the bits go
+const char* x264Crf(ContentClassifier::Content content){
+    switch (content) {
+    case ContentClassifier::Text:
+        return "21";
+    case ContentClassifier::Motion:
+        return "25";
+    default:
+        return "23";
+    }
+}
+
+}
+
+void EncoderTuning::applyContent(AVCodecContext* ctx, AVDictionary** opts, ContentClassifier::Content content){
+    if (isEncoder(ctx, "libx264")) {
+        if (auto tune = x264Tune(content)) {
+            appendTune(opts, tune);
+        }
+        av_dict_set(opts, "crf", x264Crf(content), 0);
+    } else if (isEncoder(ctx, "libx265")) {
+        if (content == ContentClassifier::Text || content == ContentClassifier::Desktop) {
+            av_dict_set(opts, "tune", "animation", 0);
+            // x265 screen content coding is only defined for 4:4:4
+            if (ctx->pix_fmt == AV_PIX_FMT_YUV444P) {
+                appendParams(opts, "x265-params", "scc=1");
+            }
+        }
+    } else if (isEncoder(ctx, "libsvtav1")) {
+        const char* scm = "scm=2";
+        if (content == ContentClassifier::Text || content == ContentClassifier::Desktop) {
+            scm = "scm=1";
+        } else if (content == ContentClassifier::Motion) {
+            scm = "scm=0";
+        }
+        appendParams(opts, "svtav1-params", scm);
+    } else if (isEncoder(ctx, "libaom-av1")) {
+        if (content == ContentClassifier::Text || content == ContentClassifier::Desktop) {
+            av_dict_set(opts, "tune-content", "screen", 0);
+        }
+    }
+}
+
+void EncoderTuning::applyLowLatency(AVCodecContext* ctx, AVDictionary** opts, bool intraRefresh){
+    ctx->max_b_frames = 0;
+    ctx->thread_type = FF_THREAD_SLICE;
+    if (isEncoder(ctx, "libx264")) {
+        appendTune(opts, "zerolatency");
+        av_dict_set(opts, "rc-lookahead", "0", 0);
+        if (intraRefresh) {
+            av_dict_set(opts, "intra-refresh", "1", 0);
+        }
+    } else if (isEncoder(ctx, "libx265")) {
+        // x265 has a single tune slot, the content tune keeps it
+        appendParams(opts, "x265-params", "bframes=0:rc-lookahead=0:frame-threads=1:b-adapt=0");
+        if (intraRefresh) {
+            appendParams(opts, "x265-params", "intra-refresh=1");
+        }
+    } else if (isEncoder(ctx, "libsvtav1")) {
+        // low delay prediction structure, no lookahead
+        appendParams(opts, "svtav1-params", "pred-struct=1:lookahead=0");
+    } else if (isEncoder(ctx, "libaom-av1")) {
+        av_dict_set(opts, "usage", "realtime", 0);
+        av_dict_set(opts, "lag-in-frames", "0", 0);
+    }
+}
+
+bool EncoderTuning::reconfigureContent(AVCodecContext* ctx, ContentClassifier::Content content){
+    // libx264 picks up a changed crf on the next frame (x264_encoder_reconfig),
+    // the tune itself is fixed once the encoder is open
+    if (isEncoder(ctx, "libx264")) {
+        return av_opt_set(ctx->priv_data, "crf", x264Crf(content), 0) >= 0;
+    }
+    return false;
+}
+
+void EncoderTuning::applyForcedIdr(AVCodecContext* ctx, AVDictionary** opts){
+    // libaom and SVT-AV1 already turn a forced I frame into a key frame
+    if (isEncoder(ctx, "libx264") || isEncoder(ctx, "libx265")) {
+        av_dict_set(opts, "forced-idr", "1", 0);
+    }
+}
+
+ThreadingPlan EncoderTuning::planThreading(const char* encoder, int width, int height, int fps, int cores, bool lowLatency){
+    ThreadingPlan plan;
+    if (width <= 0 || height <= 0 || fps <= 0) {
+        return plan;
+    }
+    // leave a core to the application being recorded
+    const int available = std::max(1, cores > 2 ? cores - 1 : cores);
+    const double pixelRate = double(width) * height * fps;
+    int threads = int(pixelRate / kPixelRatePerThread + 0.999);
+    // x264 frame threads wait on each other's rows: in the bench, thread
+    // overhead stays under ~7 % up to a quarter of the macroblock rows and
+    // reaches ~30 % at half of them (4K, 64 threads), which also costs ~9 %
+    // bitrate. Slices need at least one row each
+    const int mbRows = (height + 15) / 16;
+    threads = std::min({ std::max(threads, 2), available, lowLatency ? mbRows : std::max(mbRows / 4, 1), kMaxThreads });
+    plan.threads = std::max(threads, 1);
+    plan.threadType = lowLatency ? FF_THREAD_SLICE : FF_THREAD_FRAME;
+
+    if (encoder && strcmp(encoder, "libx265") == 0) {
+        // x265 runs WPP inside each frame thread; more frame threads only
+        // pay off once a single frame's rows can't keep the pool busy
+        if (!lowLatency) {
+            const int ctuRows = (height + 63) / 64;
+            plan.frameThreads = std::clamp(plan.threads * 2 / std::max(ctuRows, 1) + 1, 1, 4);
+        }
+    } else if (encoder && (strcmp(encoder, "libsvtav1") == 0 || strcmp(encoder, "libaom-av1") == 0)) {
+        if (width >= 7680) {
+            plan.tileColumnsLog2 = 2;
+            plan.tileRowsLog2 = 1;
+        } else if (width >= 3840) {
+            plan.tileColumnsLog2 = 1;
+        }
+    }
+    return plan;
+}
+
+void EncoderTuning::applyThreading(AVCodecContext* ctx, AVDictionary** opts, const ThreadingPlan& plan){
+    if (plan.threads <= 0) {
+        return;
+    }
+    ctx->thread_count = plan.threads;
+    // libx264 takes sliced threads from thread_type
+    ctx->thread_type = plan.threadType;
+    if (isEncoder(ctx, "libx265")) {
+        std::string params = "pools=" + std::to_string(plan.threads) + ":wpp=1";
+        params += ":frame-threads=" + std::to_string(plan.frameThreads);
+        appendParams(opts, "x265-params", params.c_str());
+    } else if (isEncoder(ctx, "libsvtav1")) {
+        std::string params = "lp=" + std::to_string(plan.threads);
+        params += ":tile-columns=" + std::to_string(plan.tileColumnsLog2);
+        params += ":tile-rows=" + std::to_string(plan.tileRowsLog2);
+        appendParams(opts, "svtav1-params", params.c_str());
+    } else if (isEncoder(ctx, "libaom-av1")) {
+        av_dict_set(opts, "row-mt", "1", 0);
+        av_dict_set_int(opts, "tile-columns", plan.tileColumnsLog2, 0);
+        av_dict_set_int(opts, "tile-rows", plan.tileRowsLog2, 0);
+    }
+}
+
+void EncoderTuning::appendParams(AVDictionary** opts, const char* key, const char* params){
+    std::string value;
+    if (auto entry = av_dict_get(*opts, key, nullptr, 0)) {
+        value = entry->value;
+        value += ':';
+    }
+    value += params;
+    av_dict_set(opts, key, value.c_str(), 0);
+}
+
+void EncoderTuning::appendTune(AVDictionary** opts, const char* tune){
+    std::string value;
+    if (auto entry = av_dict_get(*opts, "tune", nullptr, 0)) {
+        value = entry->value;
+        value += ',';
+    }
+    value += tune;
+    av_dict_set(opts, "tune", value.c_str(), 0);
+}
+
+}
@@ -0,0 +1,53 @@
+#ifndef ENCODER_TUNING_H
+#define ENCODER_TUNING_H
+
+#include "content_classifier.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/dict.h>
+}
+
+namespace adc{
+
+struct ThreadingPlan{
+    int threads = 0;            // 0 keeps the encoder default
+    int threadType = FF_THREAD_FRAME;
+    int frameThreads = 1;       // x265 frame-threads
+    int tileColumnsLog2 = 0;    // AV1 tiles
+    int tileRowsLog2 = 0;
+};
+
+// Per-encoder option tables. Everything is keyed on the encoder name
+// (libx264, libx265, libsvtav1, libaom-av1), other encoders are left at
+// their defaults.
+class EncoderTuning
+{
+public:
+    // open-time options for a content class: tune / screen content tools
+    static void applyContent(AVCodecContext* ctx, AVDictionary** opts, ContentClassifier::Content content);
+    // switch content class on an open encoder, returns false when the
+    // encoder can only change it by reopening
+    static bool reconfigureContent(AVCodecContext* ctx, ContentClassifier::Content content);
+
+    // no B-frames, no lookahead, slice threads; optional periodic intra
+    // refresh instead of IDR frames
+    static void applyLowLatency(AVCodecContext* ctx, AVDictionary** opts, bool intraRefresh);
+
+    // make frames sent with pict_type I real IDR frames (clean cut points)
+    static void applyForcedIdr(AVCodecContext* ctx, AVDictionary** opts);
+
+    // thread count / type and tile / WPP layout from resolution, fps and
+    // the number of cores
+    static ThreadingPlan planThreading(const char* encoder, int width, int height, int fps, int cores, bool lowLatency);
+    static void applyThreading(AVCodecContext* ctx, AVDictionary** opts, const ThreadingPlan& plan);
+
+    // joins "key=value" pairs of x265-params / svtav1-params style options
+    static void appendParams(AVDictionary** opts, const char* key, const char* params);
+    // x264 accepts one psy tune plus fastdecode / zerolatency, comma separated
+    static void appendTune(AVDictionary** opts, const char* tune);
+};
+
+}
+
+#endif // ENCODER_TUNING_H
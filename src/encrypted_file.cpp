@@ -0,0 +1,349 @@
+#include "encrypted_file.h"
+#include <QIODevice>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#include <bcrypt.h>
+#endif
+
+namespace adc{
+
+namespace {
+constexpr uint8_t kMagic[8] = { 'A', 'C', 'E', 'N', 'C', 0, 0, 1 };
+// nonce, then the plaintext length with the final bit
+constexpr int kRecordHeader = ChunkCipher::kNonceBytes + 4;
+constexpr uint32_t kFinal = 0x80000000u;
+// header, chunk index, length field
+constexpr int kAadBytes = EncryptedFile::kHeaderBytes + 8 + 4;
+
+void putLe32(uint8_t* p, uint32_t value){
+    for (int i = 0; i < 4; ++i) {
+        p[i] = uint8_t(value >> (8 * i));
+    }
+}
+
+void putLe64(uint8_t* p, uint64_t value){
+    for (int i = 0; i < 8; ++i) {
+        p[i] = uint8_t(value >> (8 * i));
+    }
+}
+
+uint32_t getLe32(const uint8_t* p){
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+int64_t slotSize(int chunkBytes){
+    return kRecordHeader + int64_t(chunkBytes) + ChunkCipher::kTagBytes;
+}
+
+void makeAad(uint8_t* aad, const uint8_t* header, int64_t index, uint32_t field){
+    memcpy(aad, header, EncryptedFile::kHeaderBytes);
+    putLe64(aad + EncryptedFile::kHeaderBytes, uint64_t(index));
+    putLe32(aad + EncryptedFile::kHeaderBytes + 8, field);
+}
+}
+
+class ChunkCipherPrivate{
+public:
+#ifdef Q_OS_WIN
+    BCRYPT_ALG_HANDLE algorithm = nullptr;
+    BCRYPT_KEY_HANDLE key = nullptr;
+#endif
+};
+
+ChunkCipher::ChunkCipher()
+{
+    d = new ChunkCipherPrivate;
+}
+
+ChunkCipher::~ChunkCipher(){
+#ifdef Q_OS_WIN
+    if (d->key) {
+        BCryptDestroyKey(d->key);
+    }
+    if (d->algorithm) {
+        BCryptCloseAlgorithmProvider(d->algorithm, 0);
+    }
+#endif
+    delete d;
+}
+
+bool ChunkCipher::setKey(const QByteArray& key){
+    if (key.size() != kKeyBytes) {
+        return false;
+    }
+#ifdef Q_OS_WIN
+    if (!d->algorithm) {
+        if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&d->algorithm, BCRYPT_AES_ALGORITHM, nullptr, 0))) {
+            d->algorithm = nullptr;
+            return false;
+        }
+        if (!BCRYPT_SUCCESS(BCryptSetProperty(d->algorithm, BCRYPT_CHAINING_MODE, (PUCHAR)BCRYPT_CHAIN_MODE_GCM,
+                                              sizeof(BCRYPT_CHAIN_MODE_GCM), 0))) {
+            BCryptCloseAlgorithmProvider(d->algorithm, 0);
+            d->algorithm = nullptr;
+            return false;
+        }
+    }
+    if (d->key) {
+        BCryptDestroyKey(d->key);
+        d->key = nullptr;
+    }
+    if (!BCRYPT_SUCCESS(BCryptGenerateSymmetricKey(d->algorithm, &d->key, nullptr, 0,
+                                                   (PUCHAR)key.constData(), ULONG(key.size()), 0))) {
+        d->key = nullptr;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool ChunkCipher::isValid() const{
+#ifdef Q_OS_WIN
+    return d->key != nullptr;
+#else
+    return false;
+#endif
+}
+
+bool ChunkCipher::encrypt(const uint8_t* nonce, const uint8_t* aad, int aadSize,
+                          const uint8_t* plain, int size, uint8_t* out, uint8_t* tag){
+#ifdef Q_OS_WIN
+    BCRYPT_AUTHENTICATED_CIPHER_MODE_INFO info;
+    BCRYPT_INIT_AUTH_MODE_INFO(info);
+    info.pbNonce = (PUCHAR)nonce;
+    info.cbNonce = kNonceBytes;
+    info.pbAuthData = (PUCHAR)aad;
+    info.cbAuthData = ULONG(aadSize);
+    info.pbTag = tag;
+    info.cbTag = kTagBytes;
+    ULONG written = 0;
+    const NTSTATUS status = BCryptEncrypt(d->key, (PUCHAR)plain, ULONG(size), &info, nullptr, 0,
+                                          out, ULONG(size), &written, 0);
+    return BCRYPT_SUCCESS(status) && written == ULONG(size);
+#else
+    Q_UNUSED(nonce); Q_UNUSED(aad); Q_UNUSED(aadSize); Q_UNUSED(plain); Q_UNUSED(size); Q_UNUSED(out); Q_UNUSED(tag);
+    return false;
+#endif
+}
+
+bool ChunkCipher::decrypt(const uint8_t* nonce, const uint8_t* aad, int aadSize,
+                          const uint8_t* cipher, int size, uint8_t* out, const uint8_t* tag){
+#ifdef Q_OS_WIN
+    BCRYPT_AUTHENTICATED_CIPHER_MODE_INFO info;
+    BCRYPT_INIT_AUTH_MODE_INFO(info);
+    info.pbNonce = (PUCHAR)nonce;
+    info.cbNonce = kNonceBytes;
+    info.pbAuthData = (PUCHAR)aad;
+    info.cbAuthData = ULONG(aadSize);
+    info.pbTag = (PUCHAR)tag;
+    info.cbTag = kTagBytes;
+    ULONG written = 0;
+    // fails with STATUS_AUTH_TAG_MISMATCH on a wrong key or changed data
+    const NTSTATUS status = BCryptDecrypt(d->key, (PUCHAR)cipher, ULONG(size), &info, nullptr, 0,
+                                          out, ULONG(size), &written, 0);
+    return BCRYPT_SUCCESS(status) && written == ULONG(size);
+#else
+    Q_UNUSED(nonce); Q_UNUSED(aad); Q_UNUSED(aadSize); Q_UNUSED(cipher); Q_UNUSED(size); Q_UNUSED(out); Q_UNUSED(tag);
+    return false;
+#endif
+}
+
+bool ChunkCipher::random(uint8_t* out, int size){
+#ifdef Q_OS_WIN
+    return BCRYPT_SUCCESS(BCryptGenRandom(nullptr, out, ULONG(size), BCRYPT_USE_SYSTEM_PREFERRED_RNG));
+#else
+    Q_UNUSED(out); Q_UNUSED(size);
+    return false;
+#endif
+}
+
+EncryptedFile::EncryptedFile(Write write, Read read)
+    : m_write(std::move(write))
+    , m_read(std::move(read))
+{
+    m_tail = QByteArray(kChunkBytes, 0);
+    m_record = QByteArray(int(slotSize(kChunkBytes)), 0);
+}
+
+EncryptedFile::~EncryptedFile() = default;
+
+bool EncryptedFile::begin(const QByteArray& key){
+    if (!m_cipher.setKey(key)) {
+        return false;
+    }
+    memcpy(m_header, kMagic, sizeof(kMagic));
+    putLe32(m_header + 8, kChunkBytes);
+    putLe32(m_header + 12, 0);
+    // file id, ties every chunk to this file
+    if (!ChunkCipher::random(m_header + 16, 16)) {
+        return false;
+    }
+    m_tailIndex = 0;
+    m_tailLength = 0;
+    return m_write(m_header, kHeaderBytes, 0);
+}
+
+bool EncryptedFile::write(const uint8_t* data, int64_t size, int64_t offset){
+    uint8_t* tail = reinterpret_cast<uint8_t*>(m_tail.data());
+    while (size > 0) {
+        const int64_t index = offset / kChunkBytes;
+        const int within = int(offset % kChunkBytes);
+        const int count = int(std::min<int64_t>(size, kChunkBytes - within));
+        if (index > m_tailIndex) {
+            // written past the end: zeros in between
+            memset(tail + m_tailLength, 0, size_t(kChunkBytes - m_tailLength));
+            if (!this->seal(m_tailIndex, tail, kChunkBytes, false)) {
+                return false;
+            }
+            memset(tail, 0, size_t(kChunkBytes));
+            for (int64_t i = m_tailIndex + 1; i < index; ++i) {
+                if (!this->seal(i, tail, kChunkBytes, false)) {
+                    return false;
+                }
+            }
+            m_tailIndex = index;
+            m_tailLength = 0;
+        }
+        if (index == m_tailIndex) {
+            if (within > m_tailLength) {
+                memset(tail + m_tailLength, 0, size_t(within - m_tailLength));
+            }
+            memcpy(tail + within, data, size_t(count));
+            m_tailLength = std::max(m_tailLength, within + count);
+            if (m_tailLength == kChunkBytes) {
+                if (!this->seal(m_tailIndex, tail, kChunkBytes, false)) {
+                    return false;
+                }
+                m_tailIndex += 1;
+                m_tailLength = 0;
+            }
+        } else {
+            // a sealed chunk changes (size fields, indexes): open, patch, re-seal
+            QByteArray chunk(kChunkBytes, 0);
+            uint8_t* plain = reinterpret_cast<uint8_t*>(chunk.data());
+            if (!this->load(index, plain)) {
+                return false;
+            }
+            memcpy(plain + within, data, size_t(count));
+            if (!this->seal(index, plain, kChunkBytes, false)) {
+                return false;
+            }
+        }
+        data += count;
+        size -= count;
+        offset += count;
+    }
+    return true;
+}
+
+bool EncryptedFile::flush(){
+    if (m_tailLength == 0) {
+        return true;
+    }
+    return this->seal(m_tailIndex, reinterpret_cast<const uint8_t*>(m_tail.constData()), m_tailLength, false);
+}
+
+bool EncryptedFile::finish(){
+    return this->seal(m_tailIndex, reinterpret_cast<const uint8_t*>(m_tail.constData()), m_tailLength, true);
+}
+
+int64_t EncryptedFile::cipherUs() const{
+    return m_cipherUs;
+}
+
+bool EncryptedFile::seal(int64_t index, const uint8_t* plain, int length, bool final){
+    uint8_t* record = reinterpret_cast<uint8_t*>(m_record.data());
+    // a fresh nonce every time, re-sealed chunks included
+    if (!ChunkCipher::random(record, ChunkCipher::kNonceBytes)) {
+        return false;
+    }
+    const uint32_t field = uint32_t(length) | (final ? kFinal : 0);
+    putLe32(record + ChunkCipher::kNonceBytes, field);
+    uint8_t aad[kAadBytes];
+    makeAad(aad, m_header, index, field);
+
+    const auto start = std::chrono::steady_clock::now();
+    const bool ok = m_cipher.encrypt(record, aad, kAadBytes, plain, length,
+                                     record + kRecordHeader, record + kRecordHeader + length);
+    m_cipherUs += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    return ok && m_write(record, kRecordHeader + length + ChunkCipher::kTagBytes,
+                         kHeaderBytes + index * slotSize(kChunkBytes));
+}
+
+bool EncryptedFile::load(int64_t index, uint8_t* plain){
+    uint8_t* record = reinterpret_cast<uint8_t*>(m_record.data());
+    if (!m_read(record, int(slotSize(kChunkBytes)), kHeaderBytes + index * slotSize(kChunkBytes))) {
+        return false;
+    }
+    const uint32_t field = getLe32(record + ChunkCipher::kNonceBytes);
+    if (field != uint32_t(kChunkBytes)) {
+        return false;
+    }
+    uint8_t aad[kAadBytes];
+    makeAad(aad, m_header, index, field);
+    const auto start = std::chrono::steady_clock::now();
+    const bool ok = m_cipher.decrypt(record, aad, kAadBytes, record + kRecordHeader, kChunkBytes,
+                                     plain, record + kRecordHeader + kChunkBytes);
+    m_cipherUs += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    return ok;
+}
+
+bool EncryptedFile::decrypt(QIODevice* in, QIODevice* out, const QByteArray& key, QString* error){
+    auto fail = [error](const QString& message){
+        if (error) {
+            *error = message;
+        }
+        return false;
+    };
+    ChunkCipher cipher;
+    if (!cipher.setKey(key)) {
+        return fail("the key must be 32 bytes (AES-256)");
+    }
+    QByteArray header = in->read(kHeaderBytes);
+    if (header.size() != kHeaderBytes || memcmp(header.constData(), kMagic, sizeof(kMagic)) != 0) {
+        return fail("not an encrypted recording");
+    }
+    const uint8_t* head = reinterpret_cast<const uint8_t*>(header.constData());
+    const int chunkBytes = int(getLe32(head + 8));
+    if (chunkBytes <= 0 || chunkBytes > 64 * 1024 * 1024) {
+        return fail("corrupt header");
+    }
+    QByteArray record(int(slotSize(chunkBytes)), 0);
+    QByteArray plain(chunkBytes, 0);
+    uint8_t* data = reinterpret_cast<uint8_t*>(record.data());
+    for (int64_t index = 0;; ++index) {
+        if (!in->seek(kHeaderBytes + index * slotSize(chunkBytes)) ||
+            in->read(record.data(), kRecordHeader) != kRecordHeader) {
+            return fail(QString("cut off after %1 chunks, no final chunk").arg(index));
+        }
+        const uint32_t field = getLe32(data + ChunkCipher::kNonceBytes);
+        const int length = int(field & ~kFinal);
+        if (length > chunkBytes) {
+            return fail(QString("corrupt chunk %1").arg(index));
+        }
+        const int body = length + ChunkCipher::kTagBytes;
+        if (in->read(record.data() + kRecordHeader, body) != body) {
+            return fail(QString("cut off in chunk %1").arg(index));
+        }
+        uint8_t aad[kAadBytes];
+        makeAad(aad, head, index, field);
+        if (!cipher.decrypt(data, aad, kAadBytes, data + kRecordHeader, length,
+                            reinterpret_cast<uint8_t*>(plain.data()), data + kRecordHeader + length)) {
+            return fail(QString("chunk %1 failed authentication (wrong key or modified file)").arg(index));
+        }
+        if (out->write(plain.constData(), length) != length) {
+            return fail("could not write the output");
+        }
+        if (field & kFinal) {
+            return true;
+        }
+    }
+}
+
+}
@@ -0,0 +1,89 @@
+#ifndef ENCRYPTED_FILE_H
+#define ENCRYPTED_FILE_H
+
+#include <QByteArray>
+#include <QString>
+#include <functional>
+
+class QIODevice;
+
+namespace adc{
+
+// AES-256-GCM through Windows CNG, which uses AES-NI / VAES when present
+class ChunkCipherPrivate;
+class ChunkCipher
+{
+public:
+    static constexpr int kKeyBytes = 32;
+    static constexpr int kNonceBytes = 12;
+    static constexpr int kTagBytes = 16;
+
+    ChunkCipher();
+    ~ChunkCipher();
+    ChunkCipher(const ChunkCipher&) = delete;
+    ChunkCipher& operator=(const ChunkCipher&) = delete;
+
+    // false for anything but a 32 byte key, or without CNG
+    bool setKey(const QByteArray& key);
+    bool isValid() const;
+    bool encrypt(const uint8_t* nonce, const uint8_t* aad, int aadSize,
+                 const uint8_t* plain, int size, uint8_t* out, uint8_t* tag);
+    bool decrypt(const uint8_t* nonce, const uint8_t* aad, int aadSize,
+                 const uint8_t* cipher, int size, uint8_t* out, const uint8_t* tag);
+    static bool random(uint8_t* out, int size);
+
+private:
+    ChunkCipherPrivate* d;
+};
+
+// Encrypted file layout under AsyncFile. The plaintext is cut into 1 MiB
+// chunks, each sealed on its own (random nonce, length, tag) at a fixed
+// slot, so the muxer's seeks back (size fields, indexes) re-seal only the
+// chunk they touch. The header, chunk index and length are authenticated
+// with every chunk; the last chunk is marked final so that a cut off file
+// is detected. Not thread safe, used on the writer thread.
+class EncryptedFile
+{
+public:
+    static constexpr int kChunkBytes = 1024 * 1024;
+    static constexpr int kHeaderBytes = 32;
+
+    // positioned raw I/O on the underlying file
+    using Write = std::function<bool(const uint8_t* data, int size, int64_t offset)>;
+    using Read = std::function<bool(uint8_t* data, int size, int64_t offset)>;
+
+    EncryptedFile(Write write, Read read);
+    ~EncryptedFile();
+
+    bool begin(const QByteArray& key);
+    // plaintext offsets
+    bool write(const uint8_t* data, int64_t size, int64_t offset);
+    // writes the partial last chunk, for periodic syncs
+    bool flush();
+    bool finish();
+    // time spent in the cipher
+    int64_t cipherUs() const;
+
+    // whole file in, plaintext out; false on a wrong key, tampering or a
+    // missing final chunk (what verified is written anyway)
+    static bool decrypt(QIODevice* in, QIODevice* out, const QByteArray& key, QString* error);
+
+private:
+    bool seal(int64_t index, const uint8_t* plain, int length, bool final);
+    bool load(int64_t index, uint8_t* plain);
+
+private:
+    Write m_write;
+    Read m_read;
+    ChunkCipher m_cipher;
+    uint8_t m_header[kHeaderBytes] = {};
+    QByteArray m_tail;
+    int64_t m_tailIndex = 0;
+    int m_tailLength = 0;
+    QByteArray m_record;
+    int64_t m_cipherUs = 0;
+};
+
+}
+
+#endif // ENCRYPTED_FILE_H
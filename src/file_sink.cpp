@@ -0,0 +1,195 @@
+#include "file_sink.h"
+#include "packet_writer.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <QDebug>
+#include <atomic>
+#include <limits>
+
+namespace adc{
+
+namespace {
+// backlog past which the output counts as stalled and is given up
+constexpr int64_t kStallBytes = 128 * 1024 * 1024;
+
+int64_t timestampUs(const AVPacket* pkt, AVRational timeBase){
+    const int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    return ts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : av_rescale_q(ts, timeBase, AV_TIME_BASE_Q);
+}
+}
+
+class FileSinkPrivate{
+public:
+    QString filename;
+    QString format;
+    AsyncFile::Options fileOptions;
+
+    QMutex mutex;
+    AVFormatContext* fmtCtx = nullptr;
+    PacketWriter* writer = nullptr;
+    AVStream* streams[2] = {};
+    AVRational timeBases[2] = { { 1, 1 }, { 1, 1 } };
+    // first keyframe of the recording, written as time zero
+    int64_t startUs = AV_NOPTS_VALUE;
+    bool ending = false;
+    std::atomic<bool> failed{ false };
+};
+
+FileSink::FileSink(const QString& filename, QObject *parent)
+    : QThread{parent}
+{
+    d = new FileSinkPrivate;
+    d->filename = filename;
+}
+
+FileSink::~FileSink(){
+    if (this->isRunning()) {
+        this->wait();
+    } else {
+        this->close();
+    }
+    delete d;
+}
+
+QString FileSink::filename() const{
+    return d->filename;
+}
+
+void FileSink::setFormat(const QString& format){
+    d->format = format;
+}
+
+void FileSink::setFileOptions(const AsyncFile::Options& options){
+    d->fileOptions = options;
+}
+
+bool FileSink::failed() const{
+    return d->failed;
+}
+
+void FileSink::fail(const QString& reason){
+    if (!d->failed.exchange(true)) {
+        qWarning() << "Output" << d->filename << "stopped:" << reason;
+        emit error(QString("Output %1 stopped: %2").arg(d->filename, reason));
+    }
+}
+
+void FileSink::begin(const AVCodecContext* video, const AVCodecContext* audio){
+    QMutexLocker locker(&d->mutex);
+    const QByteArray path = d->filename.toUtf8();
+    const QByteArray format = d->format.toUtf8();
+    avformat_alloc_output_context2(&d->fmtCtx, nullptr, format.isEmpty() ? nullptr : format.constData(),
+                                   path.constData());
+    if (!d->fmtCtx) {
+        this->fail("unsupported container");
+        return;
+    }
+    const AVCodecContext* contexts[2] = { video, audio };
+    for (int i = Video; i <= Audio; ++i) {
+        if (!contexts[i]) {
+            continue;
+        }
+        AVStream* stream = avformat_new_stream(d->fmtCtx, nullptr);
+        if (!stream || avcodec_parameters_from_context(stream->codecpar, contexts[i]) < 0) {
+            this->fail("could not add stream");
+            return;
+        }
+        stream->time_base = contexts[i]->time_base;
+        d->streams[i] = stream;
+        d->timeBases[i] = contexts[i]->time_base;
+    }
+    if (!(d->fmtCtx->oformat->flags & AVFMT_NOFILE) &&
+        AsyncFile::open(d->fmtCtx, d->filename, d->fileOptions) < 0) {
+        this->fail("could not open file");
+        return;
+    }
+    if (avformat_write_header(d->fmtCtx, nullptr) < 0) {
+        this->fail("could not write header");
+        return;
+    }
+    d->writer = new PacketWriter;
+    // never blocks the encoder, push() gives the output up instead
+    d->writer->setMaxBytes(std::numeric_limits<int64_t>::max());
+    connect(d->writer, &PacketWriter::error, this, [this](const QString& message){
+        this->fail(message);
+    }, Qt::DirectConnection);
+    d->writer->begin(d->fmtCtx, true);
+}
+
+void FileSink::push(const AVPacket* pkt, Stream stream){
+    QMutexLocker locker(&d->mutex);
+    if (d->failed || d->ending || !d->writer || !d->streams[stream]) {
+        return;
+    }
+    if (d->startUs == AV_NOPTS_VALUE) {
+        if (stream != Video || !(pkt->flags & AV_PKT_FLAG_KEY)) {
+            return;
+        }
+        d->startUs = timestampUs(pkt, d->timeBases[Video]);
+    }
+    if (d->writer->queuedBytes() + pkt->size > kStallBytes) {
+        this->fail("the disk cannot keep up");
+        // the backlog is not written to the stalled disk
+        AsyncFile::abort(d->fmtCtx);
+        d->writer->abort();
+        return;
+    }
+    // a new reference, the payload is shared with the other outputs
+    AVPacket* copy = av_packet_clone(pkt);
+    if (!copy) {
+        return;
+    }
+    const AVRational timeBase = d->timeBases[stream];
+    const int64_t offset = av_rescale_q(d->startUs, AV_TIME_BASE_Q, timeBase);
+    if (copy->pts != AV_NOPTS_VALUE) copy->pts -= offset;
+    if (copy->dts != AV_NOPTS_VALUE) copy->dts -= offset;
+    if (stream == Audio && copy->pts != AV_NOPTS_VALUE && copy->pts < 0) {
+        av_packet_free(&copy);
+        return;
+    }
+    av_packet_rescale_ts(copy, timeBase, d->streams[stream]->time_base);
+    copy->stream_index = d->streams[stream]->index;
+    d->writer->push(copy);
+    av_packet_free(&copy);
+}
+
+void FileSink::end(){
+    {
+        QMutexLocker locker(&d->mutex);
+        d->ending = true;
+    }
+    this->start(QThread::LowPriority);
+}
+
+void FileSink::run(){
+    this->close();
+}
+
+void FileSink::close(){
+    // the writer only exists once the header is written
+    bool ok = d->writer != nullptr;
+    if (d->writer) {
+        // a failed output is given up rather than drained, no trailer
+        if (d->failed) {
+            AsyncFile::abort(d->fmtCtx);
+            d->writer->abort();
+        }
+        ok = d->writer->finish();
+        delete d->writer;
+        d->writer = nullptr;
+    }
+    if (!d->fmtCtx) {
+        return;
+    }
+    if (ok && av_write_trailer(d->fmtCtx) < 0) {
+        this->fail("could not write trailer");
+    }
+    if (AsyncFile::close(d->fmtCtx) < 0) {
+        this->fail("could not close file");
+    }
+    avformat_free_context(d->fmtCtx);
+    d->fmtCtx = nullptr;
+    d->streams[Video] = d->streams[Audio] = nullptr;
+}
+
+}
@@ -0,0 +1,52 @@
+#ifndef FILE_SINK_H
+#define FILE_SINK_H
+
+#include <QThread>
+#include <QString>
+#include "packet_sink.h"
+#include "async_file.h"
+
+namespace adc{
+
+// An extra container written from the recording's packets (tee output):
+// the packets are shared by reference, muxing and I/O run on this output's
+// own writer thread. A failing or stalled output (full disk, slow network
+// share) is closed and reported, the recording and the other outputs go on.
+class PacketWriter;
+class FileSinkPrivate;
+class FileSink : public QThread, public PacketSink
+{
+    Q_OBJECT
+public:
+    explicit FileSink(const QString& filename, QObject *parent = nullptr);
+    ~FileSink();
+
+    QString filename() const;
+    // short muxer name, empty picks it from the extension
+    void setFormat(const QString& format);
+    void setFileOptions(const AsyncFile::Options& options);
+
+    void begin(const AVCodecContext* video, const AVCodecContext* audio) override;
+    void push(const AVPacket* pkt, Stream stream) override;
+    // writes what is queued and the trailer in the background, see wait()
+    void end() override;
+
+    bool failed() const;
+
+signals:
+    void error(const QString& message);
+
+protected:
+    void run() override;
+
+private:
+    void fail(const QString& reason);
+    void close();
+
+private:
+    FileSinkPrivate* d;
+};
+
+}
+
+#endif // FILE_SINK_H
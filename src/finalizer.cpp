@@ -0,0 +1,261 @@
+#include "finalizer.h"
+#include "packet_writer.h"
+#include "async_file.h"
+#include "file_sink.h"
+#include "recovery_journal.h"
+#include "part_joiner.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QDebug>
+#include <algorithm>
+
+namespace adc{
+
+namespace {
+// progress split: encoder drain, then trailer (moov relocation for faststart)
+constexpr int kDrainShare = 80;
+
+struct TrailerProgress{
+    AVIOContext* pb;
+    int64_t size;
+    std::function<void(int)> report;
+};
+
+// faststart reads the file back through io_open, which installs the
+// format's interrupt callback; it is polled for every chunk read while the
+// moov atom is moved to the front, the write position is the progress
+int trailerInterrupt(void* opaque){
+    auto state = static_cast<TrailerProgress*>(opaque);
+    if (state->pb && state->size > 0) {
+        int64_t pos = std::min<int64_t>(state->pb->pos, state->size);
+        state->report(kDrainShare + int((100 - kDrainShare) * pos / state->size));
+    }
+    return 0;
+}
+}
+
+class FinalizerPrivate{
+public:
+    mutable QMutex mutex;
+    QWaitCondition wake;
+    QQueue<OutputSession*> queue;
+    OutputSession* current = nullptr;
+    bool quit = false;
+    Finalizer::Recycler recycler;
+    // finalizer thread: tee outputs still closing on their own threads
+    QList<FileSink*> closing;
+};
+
+Finalizer::Finalizer(QObject *parent)
+    : QThread{parent}
+{
+    d = new FinalizerPrivate;
+}
+
+Finalizer::~Finalizer(){
+    this->shutdown();
+    this->wait();
+    delete d;
+}
+
+void Finalizer::setRecycler(const Recycler& recycler){
+    QMutexLocker locker(&d->mutex);
+    d->recycler = recycler;
+}
+
+void Finalizer::submit(OutputSession* session){
+    QMutexLocker locker(&d->mutex);
+    d->queue.enqueue(session);
+    d->wake.wakeOne();
+}
+
+void Finalizer::shutdown(){
+    QMutexLocker locker(&d->mutex);
+    d->quit = true;
+    d->wake.wakeOne();
+}
+
+int Finalizer::pending() const{
+    QMutexLocker locker(&d->mutex);
+    return d->queue.size() + (d->current ? 1 : 0);
+}
+
+void Finalizer::run(){
+    while (true) {
+        OutputSession* session = nullptr;
+        {
+            QMutexLocker locker(&d->mutex);
+            while (d->queue.isEmpty() && !d->quit) {
+                d->wake.wait(&d->mutex);
+            }
+            if (d->queue.isEmpty()) {
+                locker.unlock();
+                this->reapOutputs(true);
+                return;
+            }
+            session = d->current = d->queue.dequeue();
+        }
+        this->reapOutputs(false);
+        bool ok = this->finalize(session);
+        Recycler recycler;
+        {
+            QMutexLocker locker(&d->mutex);
+            d->current = nullptr;
+            recycler = d->recycler;
+        }
+        if (recycler) {
+            recycler(*session);
+        }
+        if (session->vencCtx) avcodec_free_context(&session->vencCtx);
+        if (session->aencCtx) avcodec_free_context(&session->aencCtx);
+        QString filename = session->filename;
+        const bool part = session->part;
+        delete session;
+        if (!part) {
+            emit finalized(filename, ok);
+        }
+    }
+}
+
+bool Finalizer::finalize(OutputSession* session){
+    this->report(session, 0);
+    // the sessions of the parts were queued before
+    if (!session->parts.isEmpty()) {
+        QString error;
+        const bool ok = PartJoiner::join(session->parts, session->filename,
+                                         [this, session](int percent){ this->report(session, percent); }, &error);
+        if (!ok) {
+            qWarning() << "Could not join" << session->filename << error << "- the parts are kept";
+        }
+        emit closed(session->filename, ok);
+        this->report(session, 100);
+        return ok;
+    }
+    this->flushEncoder(session, session->vencCtx, session->videoStream, 0, kDrainShare - 5);
+    this->flushEncoder(session, session->aencCtx, session->audioStream, kDrainShare - 5, kDrainShare);
+    this->report(session, kDrainShare);
+    // their trailers are written alongside this one, on their own threads: a
+    // stalled share holds up neither this recording nor the ones after it
+    for (FileSink* output : session->outputs) {
+        connect(output, &QThread::finished, this, [this, output]{
+            emit closed(output->filename(), !output->failed());
+        }, Qt::DirectConnection);
+        output->end();
+        d->closing.append(output);
+    }
+    session->outputs.clear();
+
+    bool ok = true;
+    AVFormatContext* output = session->fmtCtx;
+    if (session->writer) {
+        ok = session->writer->finish();
+        output = session->writer->output();
+    }
+    if (output && output->pb) {
+        TrailerProgress state{ output->pb, avio_size(output->pb),
+                               [this, session](int percent){ this->report(session, percent); } };
+        // faststart moves the samples back by what the trailer adds
+        const int64_t samplesEnd = avio_tell(output->pb);
+        output->interrupt_callback.callback = trailerInterrupt;
+        output->interrupt_callback.opaque = &state;
+        int ret = av_write_trailer(output);
+        output->interrupt_callback.callback = nullptr;
+        if (ret < 0) {
+            qWarning() << "Error writing trailer" << session->filename << ret;
+            ok = false;
+        }
+        if (AsyncFile::close(output) < 0) {
+            qWarning() << "Error closing" << session->filename;
+            ok = false;
+        }
+        const QString url = QString::fromUtf8(output->url);
+        if (session->writer) {
+            session->writer->closeIndex(ok, QFileInfo(url).size() - samplesEnd);
+        }
+        if (!session->part) {
+            emit closed(url, ok);
+        }
+    }
+    // a segmenting writer frees the segments it opened itself
+    delete session->writer;
+    session->writer = nullptr;
+    if (ok) {
+        QFile::remove(RecoveryJournal::pathFor(session->filename));
+    }
+    if (session->fmtCtx) {
+        AsyncFile::close(session->fmtCtx);
+        avformat_free_context(session->fmtCtx);
+        session->fmtCtx = nullptr;
+    }
+    this->report(session, 100);
+    return ok;
+}
+
+void Finalizer::reapOutputs(bool wait){
+    for (auto it = d->closing.begin(); it != d->closing.end();) {
+        if (wait) {
+            (*it)->wait();
+        }
+        if ((*it)->isFinished()) {
+            delete *it;
+            it = d->closing.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void Finalizer::flushEncoder(OutputSession* session, AVCodecContext* codecContext, AVStream* stream, int from, int to){
+    if (!codecContext || !stream || !session->fmtCtx) {
+        return;
+    }
+    const bool video = codecContext == session->vencCtx;
+    const int64_t base = video ? session->videoBase : session->audioBase;
+    const int64_t expected = std::max<int64_t>(1, video ? session->pendingFrames : 1);
+    int64_t received = 0;
+
+    avcodec_send_frame(codecContext, nullptr);
+    AVPacket* packet = av_packet_alloc();
+    while (true) {
+        int ret = avcodec_receive_packet(codecContext, packet);
+        if (ret == AVERROR_EOF) {
+            break;
+        }
+        else if (ret < 0 && ret != AVERROR(EAGAIN)) {
+            qWarning() << "Error receiving final packets:" << ret;
+            break;
+        }
+        else if (ret >= 0) {
+            for (FileSink* output : session->outputs) {
+                output->push(packet, video ? PacketSink::Video : PacketSink::Audio);
+            }
+            if (packet->pts != AV_NOPTS_VALUE) packet->pts -= base;
+            if (packet->dts != AV_NOPTS_VALUE) packet->dts -= base;
+            av_packet_rescale_ts(packet, codecContext->time_base, stream->time_base);
+            packet->stream_index = stream->index;
+
+            if (session->writer) {
+                session->writer->push(packet);
+            } else if (av_interleaved_write_frame(session->fmtCtx, packet) < 0) {
+                qWarning() << "Error writing final packet";
+            }
+            av_packet_unref(packet);
+            received += 1;
+            this->report(session, from + int((to - from) * std::min(received, expected) / expected));
+        }
+    }
+    av_packet_free(&packet);
+}
+
+void Finalizer::report(OutputSession* session, int percent){
+    if (percent > session->progress) {
+        session->progress = percent;
+        emit progress(session->filename, percent);
+    }
+}
+
+}
@@ -0,0 +1,89 @@
+#ifndef FINALIZER_H
+#define FINALIZER_H
+
+#include <QThread>
+#include <QString>
+#include <QList>
+#include <QStringList>
+#include <functional>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+namespace adc{
+
+class PacketWriter;
+class FileSink;
+
+// Everything a finished recording still needs: the muxer and the encoders
+// holding delayed frames. Ownership moves to the Finalizer on stop.
+struct OutputSession{
+    QString filename;
+    AVFormatContext* fmtCtx = nullptr;
+    // still running; the drained packets go through it
+    PacketWriter* writer = nullptr;
+    // tee outputs, they get the drained packets too
+    QList<FileSink*> outputs;
+    AVStream* videoStream = nullptr;
+    AVStream* audioStream = nullptr;
+    AVCodecContext* vencCtx = nullptr;
+    AVCodecContext* aencCtx = nullptr;
+    int64_t videoBase = 0;
+    int64_t audioBase = 0;
+    int64_t videoPts = 0;
+    int64_t audioPts = 0;
+    // frames the video encoder has not returned yet
+    int64_t pendingFrames = 0;
+    int generation = 0;
+    int progress = -1;
+    // a paused recording's part: no closed() or finalized() of its own, it
+    // is reported as the file the parts are joined into
+    bool part = false;
+    // nothing to drain, joins these parts into filename (PartJoiner)
+    QStringList parts;
+};
+
+class FinalizerPrivate;
+class Finalizer : public QThread
+{
+    Q_OBJECT
+public:
+    // called on the finalizer thread with the drained encoders; the
+    // callee takes what it can reuse and nulls it, the rest is freed
+    using Recycler = std::function<void(OutputSession& session)>;
+
+    explicit Finalizer(QObject *parent = nullptr);
+    ~Finalizer();
+
+    void setRecycler(const Recycler& recycler);
+    void submit(OutputSession* session);
+    // finishes the queued sessions, then the thread exits
+    void shutdown();
+    int pending() const;
+
+signals:
+    void progress(const QString& filename, int percent);
+    void finalized(const QString& filename, bool ok);
+    // every file the session completes: the recording or its last segment,
+    // and the tee outputs
+    void closed(const QString& path, bool ok);
+
+protected:
+    void run() override;
+
+private:
+    bool finalize(OutputSession* session);
+    void flushEncoder(OutputSession* session, AVCodecContext* codecContext, AVStream* stream, int from, int to);
+    void report(OutputSession* session, int percent);
+    // deletes the tee outputs that are closed; wait: for all of them
+    void reapOutputs(bool wait);
+
+private:
+    FinalizerPrivate* d;
+};
+
+}
+
+#endif // FINALIZER_H
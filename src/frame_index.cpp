@@ -0,0 +1,262 @@
+#include "frame_index.h"
+#include <QSaveFile>
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+
+namespace adc{
+
+namespace {
+constexpr char kMagic[4] = { 'A', 'I', 'D', 'X' };
+constexpr uint32_t kVersion = 1;
+// records per read while grouping
+constexpr int kChunkRecords = 4096;
+
+int64_t aligned(int64_t offset){
+    return (offset + 7) & ~int64_t(7);
+}
+}
+
+FrameIndexWriter::~FrameIndexWriter(){
+    if (m_file.isOpen()) {
+        this->discard();
+    }
+}
+
+QString FrameIndexWriter::pathFor(const QString& filename){
+    return filename + ".index";
+}
+
+bool FrameIndexWriter::open(const QString& path, const AVFormatContext* fmtCtx){
+    m_path = path;
+    m_file.setFileName(path + ".part");
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Could not open frame index" << m_file.fileName();
+        return false;
+    }
+    m_streams.assign(fmtCtx->nb_streams, FrameIndexStream());
+    m_keyframes.assign(fmtCtx->nb_streams, {});
+    for (unsigned i = 0; i < fmtCtx->nb_streams; ++i) {
+        const AVStream* stream = fmtCtx->streams[i];
+        m_streams[i].type = stream->codecpar->codec_type;
+        m_streams[i].timeBaseNum = stream->time_base.num;
+        m_streams[i].timeBaseDen = stream->time_base.den;
+    }
+    return true;
+}
+
+void FrameIndexWriter::setRelocated(bool relocated){
+    m_relocated = relocated;
+}
+
+void FrameIndexWriter::record(int stream, int flags, int64_t pts, int64_t dts, int64_t offset, int64_t size){
+    if (!m_file.isOpen() || size <= 0 || stream < 0 || stream >= int(m_streams.size())) {
+        return;
+    }
+    FrameIndexStream& entry = m_streams[stream];
+    if (flags & AV_PKT_FLAG_KEY) {
+        m_keyframes[stream].emplace_back(pts, uint32_t(entry.recordCount));
+    }
+    entry.recordCount += 1;
+    const FrameIndexRecord record{ pts, dts, offset, uint32_t(size), uint16_t(flags), uint16_t(stream) };
+    m_file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+}
+
+void FrameIndexWriter::discard(){
+    m_file.close();
+    m_file.remove();
+}
+
+bool FrameIndexWriter::close(int64_t trailerBytes){
+    if (!m_file.isOpen()) {
+        return false;
+    }
+    m_file.close();
+    const int64_t shift = m_relocated ? trailerBytes : 0;
+
+    int64_t position = aligned(sizeof(FrameIndexHeader) + m_streams.size() * sizeof(FrameIndexStream));
+    for (size_t i = 0; i < m_streams.size(); ++i) {
+        FrameIndexStream& entry = m_streams[i];
+        entry.records = position;
+        position += entry.recordCount * sizeof(FrameIndexRecord);
+        entry.keyframes = position;
+        entry.keyframeCount = m_keyframes[i].size();
+        position = aligned(position + entry.keyframeCount * sizeof(uint32_t));
+    }
+
+    QSaveFile out(m_path);
+    if (!m_file.open(QIODevice::ReadOnly) || !out.open(QIODevice::WriteOnly)) {
+        qWarning() << "Could not write frame index" << m_path;
+        this->discard();
+        return false;
+    }
+    FrameIndexHeader header;
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.streams = uint32_t(m_streams.size());
+    header.recordSize = sizeof(FrameIndexRecord);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(m_streams.data()), m_streams.size() * sizeof(FrameIndexStream));
+
+    // one pass over the mux order records per stream
+    bool ok = true;
+    std::vector<FrameIndexRecord> chunk(kChunkRecords);
+    for (size_t i = 0; i < m_streams.size() && ok; ++i) {
+        const FrameIndexStream& entry = m_streams[i];
+        out.write(QByteArray(int(entry.records - out.pos()), '\0'));
+        m_file.seek(0);
+        uint64_t written = 0;
+        while (true) {
+            const int64_t bytes = m_file.read(reinterpret_cast<char*>(chunk.data()), kChunkRecords * sizeof(FrameIndexRecord));
+            if (bytes <= 0) {
+                break;
+            }
+            for (int64_t r = 0; r < bytes / int64_t(sizeof(FrameIndexRecord)); ++r) {
+                FrameIndexRecord& record = chunk[r];
+                if (record.stream != i) {
+                    continue;
+                }
+                if (record.offset >= 0) {
+                    record.offset += shift;
+                }
+                out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+                written += 1;
+            }
+        }
+        ok = written == entry.recordCount;
+
+        // keyframes by presentation time for seek()
+        auto& keyframes = m_keyframes[i];
+        std::stable_sort(keyframes.begin(), keyframes.end(), [](const auto& a, const auto& b){
+            return a.first < b.first;
+        });
+        for (const auto& keyframe : keyframes) {
+            out.write(reinterpret_cast<const char*>(&keyframe.second), sizeof(uint32_t));
+        }
+    }
+    out.write(QByteArray(int(std::max<int64_t>(0, position - out.pos())), '\0'));
+    m_file.close();
+    m_file.remove();
+    if (!ok) {
+        qWarning() << "Frame index records lost" << m_path;
+        out.cancelWriting();
+        return false;
+    }
+    return out.commit();
+}
+
+FrameIndex::~FrameIndex(){
+    this->close();
+}
+
+bool FrameIndex::open(const QString& path){
+    this->close();
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    m_size = m_file.size();
+    if (m_size < int64_t(sizeof(FrameIndexHeader)) || !(m_map = m_file.map(0, m_size))) {
+        this->close();
+        return false;
+    }
+    m_header = reinterpret_cast<const FrameIndexHeader*>(m_map);
+    bool ok = memcmp(m_header->magic, kMagic, sizeof(kMagic)) == 0 && m_header->version == kVersion &&
+              m_header->recordSize == sizeof(FrameIndexRecord) &&
+              int64_t(sizeof(FrameIndexHeader) + m_header->streams * sizeof(FrameIndexStream)) <= m_size;
+    for (int i = 0; ok && i < this->streams(); ++i) {
+        const FrameIndexStream& e = this->entry(i);
+        ok = e.records + e.recordCount * sizeof(FrameIndexRecord) <= uint64_t(m_size) &&
+             e.keyframes + e.keyframeCount * sizeof(uint32_t) <= uint64_t(m_size);
+        for (uint64_t k = 0; ok && k < e.keyframeCount; ++k) {
+            ok = uint64_t(this->keyframe(i, k)) < e.recordCount;
+        }
+    }
+    if (!ok) {
+        qWarning() << "Not a frame index" << path;
+        this->close();
+    }
+    return ok;
+}
+
+void FrameIndex::close(){
+    if (m_map) {
+        m_file.unmap(const_cast<uchar*>(m_map));
+    }
+    m_map = nullptr;
+    m_header = nullptr;
+    m_size = 0;
+    m_file.close();
+}
+
+int FrameIndex::streams() const{
+    return m_header ? int(m_header->streams) : 0;
+}
+
+int FrameIndex::find(AVMediaType type) const{
+    for (int i = 0; i < this->streams(); ++i) {
+        if (this->type(i) == type) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const FrameIndexStream& FrameIndex::entry(int stream) const{
+    return reinterpret_cast<const FrameIndexStream*>(m_map + sizeof(FrameIndexHeader))[stream];
+}
+
+AVMediaType FrameIndex::type(int stream) const{
+    return AVMediaType(this->entry(stream).type);
+}
+
+AVRational FrameIndex::timeBase(int stream) const{
+    return AVRational{ this->entry(stream).timeBaseNum, this->entry(stream).timeBaseDen };
+}
+
+int64_t FrameIndex::count(int stream) const{
+    return int64_t(this->entry(stream).recordCount);
+}
+
+const FrameIndexRecord& FrameIndex::record(int stream, int64_t i) const{
+    return reinterpret_cast<const FrameIndexRecord*>(m_map + this->entry(stream).records)[i];
+}
+
+int64_t FrameIndex::keyframes(int stream) const{
+    return int64_t(this->entry(stream).keyframeCount);
+}
+
+int64_t FrameIndex::keyframe(int stream, int64_t i) const{
+    return reinterpret_cast<const uint32_t*>(m_map + this->entry(stream).keyframes)[i];
+}
+
+int64_t FrameIndex::seek(int stream, int64_t pts) const{
+    // binary search over the keyframe table, which is sorted by pts
+    int64_t low = 0;
+    int64_t high = this->keyframes(stream);
+    while (low < high) {
+        const int64_t mid = low + (high - low) / 2;
+        if (this->record(stream, this->keyframe(stream, mid)).pts <= pts) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low > 0 ? this->keyframe(stream, low - 1) : -1;
+}
+
+int64_t FrameIndex::lookup(int stream, int64_t dts) const{
+    int64_t low = 0;
+    int64_t high = this->count(stream);
+    while (low < high) {
+        const int64_t mid = low + (high - low) / 2;
+        if (this->record(stream, mid).dts <= dts) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low - 1;
+}
+
+}
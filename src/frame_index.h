@@ -0,0 +1,124 @@
+#ifndef FRAME_INDEX_H
+#define FRAME_INDEX_H
+
+#include <QString>
+#include <QFile>
+#include <vector>
+#include <cstdint>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+namespace adc{
+
+// <recording>.index, little endian, laid out to be used in place from a
+// memory map:
+//   FrameIndexHeader
+//   FrameIndexStream[streams]
+//   per stream: FrameIndexRecord[records] in decode order (dts increasing),
+//               uint32_t[keyframes] its keyframes' record numbers by pts
+// Offsets and counts are in bytes from the start of the file and in items.
+struct FrameIndexHeader{
+    char magic[4];
+    uint32_t version;
+    uint32_t streams;
+    uint32_t recordSize;
+};
+
+struct FrameIndexStream{
+    int32_t type;
+    int32_t timeBaseNum;
+    int32_t timeBaseDen;
+    uint32_t reserved;
+    uint64_t records;
+    uint64_t recordCount;
+    uint64_t keyframes;
+    uint64_t keyframeCount;
+};
+
+struct FrameIndexRecord{
+    int64_t pts;
+    int64_t dts;
+    // of the sample in the file, -1 where the muxer does not write
+    // packets in place (everything but plain mp4/mov)
+    int64_t offset;
+    uint32_t size;
+    // AV_PKT_FLAG_*
+    uint16_t flags;
+    uint16_t stream;
+};
+
+// Written by the mux stage while recording: records go to <index>.part in
+// mux order, close() groups them per stream into the index.
+class FrameIndexWriter
+{
+public:
+    FrameIndexWriter() = default;
+    ~FrameIndexWriter();
+
+    // <recording>.index
+    static QString pathFor(const QString& filename);
+
+    // after the header has been written
+    bool open(const QString& path, const AVFormatContext* fmtCtx);
+    // faststart: the trailer puts the moov in front of the samples
+    void setRelocated(bool relocated);
+    // as written; offset -1 if unknown
+    void record(int stream, int flags, int64_t pts, int64_t dts, int64_t offset, int64_t size);
+    // trailerBytes: what the trailer added to the file, the offsets move
+    // by it when relocated
+    bool close(int64_t trailerBytes);
+    // a recording that failed leaves no index
+    void discard();
+
+private:
+    QString m_path;
+    QFile m_file;
+    std::vector<FrameIndexStream> m_streams;
+    // per stream: pts and record number of the keyframes
+    std::vector<std::vector<std::pair<int64_t, uint32_t>>> m_keyframes;
+    bool m_relocated = false;
+};
+
+// Read side for viewers and thumbnail extraction: the index is mapped, not
+// loaded, and searched in place.
+class FrameIndex
+{
+public:
+    FrameIndex() = default;
+    ~FrameIndex();
+
+    bool open(const QString& path);
+    void close();
+
+    int streams() const;
+    // first stream of the type, -1 if none
+    int find(AVMediaType type) const;
+    AVMediaType type(int stream) const;
+    AVRational timeBase(int stream) const;
+    int64_t count(int stream) const;
+    const FrameIndexRecord& record(int stream, int64_t i) const;
+    int64_t keyframes(int stream) const;
+    // record number of the i-th keyframe
+    int64_t keyframe(int stream, int64_t i) const;
+
+    // record number of the last keyframe presented at or before pts,
+    // -1 if pts is before the first one
+    int64_t seek(int stream, int64_t pts) const;
+    // record number of the last packet decoded at or before dts, -1 if none
+    int64_t lookup(int stream, int64_t dts) const;
+
+private:
+    const FrameIndexStream& entry(int stream) const;
+
+private:
+    QFile m_file;
+    const uchar* m_map = nullptr;
+    int64_t m_size = 0;
+    const FrameIndexHeader* m_header = nullptr;
+};
+
+}
+
+#endif // FRAME_INDEX_H
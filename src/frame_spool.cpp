@@ -0,0 +1,520 @@
+#include "frame_spool.h"
+#include "lz4_block.h"
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/channel_layout.h>
+}
+
+namespace adc{
+
+namespace {
+constexpr uint32_t kMagic = 0x4c4f4f50;
+// records start on cache lines; a header always fits before the end
+constexpr int64_t kAlign = 64;
+constexpr int kMaxStripes = 8;
+
+enum RecordKind : uint8_t{
+    RecordVideo,
+    RecordAudio,
+    // the rest of the ring is unused, the next record is at 0
+    RecordWrap,
+};
+
+struct RecordHeader{
+    uint32_t magic;
+    uint8_t kind;
+    uint8_t compressed;
+    uint16_t stripes;
+    int32_t requests;
+    int32_t format;
+    // video: width, height; audio: samples, channels
+    int32_t width;
+    int32_t height;
+    int32_t sampleRate;
+    int32_t rawBytes;
+    int64_t pts;
+    // whole record, aligned
+    int64_t bytes;
+};
+static_assert(sizeof(RecordHeader) <= kAlign, "a header must fit in the smallest gap");
+
+int64_t aligned(int64_t bytes){
+    return (bytes + kAlign - 1) & ~(kAlign - 1);
+}
+
+int rawSize(const AVFrame* frame, FrameSpool::Kind kind){
+    if (kind == FrameSpool::Video) {
+        return av_image_get_buffer_size(AVPixelFormat(frame->format), frame->width, frame->height, 1);
+    }
+    return av_samples_get_buffer_size(nullptr, frame->ch_layout.nb_channels, frame->nb_samples,
+                                      AVSampleFormat(frame->format), 1);
+}
+
+// the capture side reuses its frames, so a reference is not enough
+AVFrame* copyFrame(const AVFrame* frame){
+    AVFrame* copy = av_frame_alloc();
+    if (!copy) {
+        return nullptr;
+    }
+    copy->format = frame->format;
+    copy->width = frame->width;
+    copy->height = frame->height;
+    copy->nb_samples = frame->nb_samples;
+    copy->sample_rate = frame->sample_rate;
+    if (av_channel_layout_copy(&copy->ch_layout, &frame->ch_layout) < 0 || av_frame_get_buffer(copy, 0) < 0 ||
+        av_frame_copy(copy, frame) < 0 || av_frame_copy_props(copy, frame) < 0) {
+        av_frame_free(&copy);
+    }
+    return copy;
+}
+
+struct Queued{
+    AVFrame* frame;
+    FrameSpool::Kind kind;
+    int requests;
+    int64_t bytes;
+};
+}
+
+class FrameSpoolPrivate{
+public:
+    QString path;
+    QFile file;
+    uint8_t* map = nullptr;
+    int64_t capacity = 0;
+    bool compress = false;
+    // the file is created on the first spill, once
+    bool lazy = false;
+    bool unavailable = false;
+
+    mutable QMutex mutex;
+    QWaitCondition wake;
+    // running byte counters, positions are modulo capacity
+    int64_t written = 0;
+    int64_t read = 0;
+    bool finishing = false;
+    bool deferred = false;
+    FrameSpool::Consumer consumer;
+    std::function<void()> finished;
+    SpoolStats stats;
+    int64_t rawVideoBytes = 0;
+    int64_t spooledVideoBytes = 0;
+
+    // ahead of the file, only used while the file is empty
+    std::deque<Queued> memory;
+    int64_t memoryBytes = 0;
+    int64_t memoryBudget = 0;
+    int64_t fileFrames = 0;
+    QElapsedTimer clock;
+    int64_t spillStartMs = -1;
+
+    // stripes are (de)compressed in parallel, each side with its own pool
+    // and buffers
+    int stripes = 1;
+    QThreadPool packPool;
+    QByteArray raw;
+    std::vector<QByteArray> packed;
+    std::vector<int> packedSizes;
+    QThreadPool unpackPool;
+    QByteArray unpacked;
+};
+
+FrameSpool::FrameSpool(QObject *parent)
+    : QThread{parent}
+{
+    d = new FrameSpoolPrivate;
+    d->stripes = std::max(1, std::min(kMaxStripes, QThread::idealThreadCount() / 2));
+    d->packPool.setMaxThreadCount(d->stripes);
+    d->unpackPool.setMaxThreadCount(d->stripes);
+    d->packed.resize(size_t(d->stripes));
+    d->packedSizes.resize(size_t(d->stripes));
+}
+
+FrameSpool::~FrameSpool(){
+    if (this->isRunning()) {
+        this->finish();
+        this->wait();
+    }
+    this->close();
+    delete d;
+}
+
+bool FrameSpool::open(const QString& path, int64_t capacity, bool compress, bool lazy){
+    d->path = path;
+    d->capacity = aligned(std::max<int64_t>(capacity, 64 * 1024 * 1024));
+    d->compress = compress;
+    d->lazy = lazy;
+    d->unavailable = false;
+    d->stats = SpoolStats();
+    d->stats.capacity = d->capacity;
+    d->clock.start();
+    return lazy || this->createFile();
+}
+
+bool FrameSpool::createFile(){
+    const QString& path = d->path;
+    d->file.setFileName(path);
+    if (!d->file.open(QIODevice::ReadWrite | QIODevice::Truncate) || !d->file.resize(d->capacity)) {
+        qWarning() << "Could not create spool" << path << d->file.errorString();
+        d->file.close();
+        d->file.remove();
+        return false;
+    }
+    d->map = d->file.map(0, d->capacity);
+    if (!d->map) {
+        qWarning() << "Could not map spool" << path << d->file.errorString();
+        d->file.close();
+        d->file.remove();
+        return false;
+    }
+    return true;
+}
+
+void FrameSpool::close(){
+    for (Queued& queued : d->memory) {
+        av_frame_free(&queued.frame);
+    }
+    d->memory.clear();
+    d->memoryBytes = 0;
+    if (d->map) {
+        d->file.unmap(d->map);
+        d->map = nullptr;
+    }
+    if (d->file.isOpen()) {
+        d->file.close();
+        d->file.remove();
+    }
+}
+
+void FrameSpool::setConsumer(const Consumer& consumer){
+    d->consumer = consumer;
+}
+
+void FrameSpool::setFinished(const std::function<void()>& finished){
+    d->finished = finished;
+}
+
+void FrameSpool::setDeferred(bool deferred){
+    QMutexLocker locker(&d->mutex);
+    d->deferred = deferred;
+}
+
+void FrameSpool::setMemoryBudget(int64_t bytes){
+    QMutexLocker locker(&d->mutex);
+    d->memoryBudget = std::max<int64_t>(0, bytes);
+}
+
+QString FrameSpool::path() const{
+    return d->path;
+}
+
+SpoolStats FrameSpool::stats() const{
+    QMutexLocker locker(&d->mutex);
+    SpoolStats stats = d->stats;
+    stats.usedBytes = d->written - d->read;
+    stats.memoryBytes = d->memoryBytes;
+    stats.spillFrames = d->fileFrames;
+    stats.spillMs = d->spillStartMs >= 0 ? d->clock.elapsed() - d->spillStartMs : 0;
+    stats.ratio = d->spooledVideoBytes > 0 ? double(d->rawVideoBytes) / d->spooledVideoBytes : 1;
+    return stats;
+}
+
+bool FrameSpool::push(const AVFrame* frame, Kind kind, int requests){
+    if (!d->map && !d->lazy) {
+        return false;
+    }
+    const int rawBytes = rawSize(frame, kind);
+    if (rawBytes <= 0) {
+        return false;
+    }
+    bool toMemory = false;
+    {
+        // memory only while nothing waits in the file, which keeps the order
+        QMutexLocker locker(&d->mutex);
+        toMemory = d->written == d->read && d->memoryBytes + rawBytes <= d->memoryBudget;
+    }
+    if (toMemory) {
+        if (AVFrame* copy = copyFrame(frame)) {
+            QMutexLocker locker(&d->mutex);
+            d->memory.push_back(Queued{ copy, kind, requests, rawBytes });
+            d->memoryBytes += rawBytes;
+            d->stats.maxMemoryBytes = std::max(d->stats.maxMemoryBytes, d->memoryBytes);
+            d->stats.frames += 1;
+            d->wake.wakeOne();
+            return true;
+        }
+    }
+    if (!d->map && (d->unavailable || !this->createFile())) {
+        // the memory tier goes on without the file
+        QMutexLocker locker(&d->mutex);
+        d->unavailable = true;
+        d->stats.dropped += 1;
+        return false;
+    }
+    const bool compressed = d->compress && kind == Video;
+    int64_t payload = rawBytes;
+    if (compressed) {
+        // contiguous copy, cut into stripes compressed side by side
+        if (d->raw.size() < rawBytes) {
+            d->raw.resize(rawBytes);
+        }
+        uint8_t* raw = reinterpret_cast<uint8_t*>(d->raw.data());
+        av_image_copy_to_buffer(raw, rawBytes, frame->data, frame->linesize, AVPixelFormat(frame->format),
+                                frame->width, frame->height, 1);
+        const int stripe = (rawBytes + d->stripes - 1) / d->stripes;
+        for (int i = 0; i < d->stripes; ++i) {
+            const int offset = std::min(rawBytes, i * stripe);
+            const int size = std::min(stripe, rawBytes - offset);
+            QByteArray& packed = d->packed[size_t(i)];
+            if (packed.size() < Lz4Block::bound(size)) {
+                packed.resize(Lz4Block::bound(size));
+            }
+            int* result = &d->packedSizes[size_t(i)];
+            uint8_t* out = reinterpret_cast<uint8_t*>(packed.data());
+            const int capacity = packed.size();
+            d->packPool.start(QRunnable::create([raw, offset, size, out, capacity, result]{
+                *result = Lz4Block::compress(raw + offset, size, out, capacity);
+            }));
+        }
+        d->packPool.waitForDone();
+        payload = int64_t(d->stripes) * 4;
+        for (int i = 0; i < d->stripes; ++i) {
+            if (d->packedSizes[size_t(i)] < 0) {
+                return false;
+            }
+            payload += d->packedSizes[size_t(i)];
+        }
+    }
+    const int64_t bytes = aligned(int64_t(sizeof(RecordHeader)) + payload);
+
+    int64_t position = 0;
+    {
+        QMutexLocker locker(&d->mutex);
+        position = d->written % d->capacity;
+        const int64_t tail = d->capacity - position;
+        const int64_t needed = bytes + (tail < bytes ? tail : 0);
+        if (d->written - d->read + needed > d->capacity) {
+            d->stats.dropped += 1;
+            return false;
+        }
+        if (tail < bytes) {
+            RecordHeader wrap = {};
+            wrap.magic = kMagic;
+            wrap.kind = RecordWrap;
+            wrap.bytes = tail;
+            memcpy(d->map + position, &wrap, sizeof(wrap));
+            d->written += tail;
+            position = 0;
+        }
+    }
+
+    // the range is the producer's until it is committed below
+    uint8_t* record = d->map + position;
+    RecordHeader header = {};
+    header.magic = kMagic;
+    header.kind = kind == Video ? RecordVideo : RecordAudio;
+    header.compressed = compressed ? 1 : 0;
+    header.stripes = uint16_t(compressed ? d->stripes : 0);
+    header.requests = requests;
+    header.format = frame->format;
+    header.width = kind == Video ? frame->width : frame->nb_samples;
+    header.height = kind == Video ? frame->height : frame->ch_layout.nb_channels;
+    header.sampleRate = frame->sample_rate;
+    header.rawBytes = rawBytes;
+    header.pts = frame->pts;
+    header.bytes = bytes;
+    memcpy(record, &header, sizeof(header));
+    uint8_t* data = record + sizeof(RecordHeader);
+    if (compressed) {
+        for (int i = 0; i < d->stripes; ++i) {
+            const uint32_t size = uint32_t(d->packedSizes[size_t(i)]);
+            memcpy(data, &size, 4);
+            data += 4;
+        }
+        for (int i = 0; i < d->stripes; ++i) {
+            memcpy(data, d->packed[size_t(i)].constData(), size_t(d->packedSizes[size_t(i)]));
+            data += d->packedSizes[size_t(i)];
+        }
+    } else if (kind == Video) {
+        av_image_copy_to_buffer(data, rawBytes, frame->data, frame->linesize, AVPixelFormat(frame->format),
+                                frame->width, frame->height, 1);
+    } else {
+        uint8_t* planes[AV_NUM_DATA_POINTERS] = {};
+        av_samples_fill_arrays(planes, nullptr, data, frame->ch_layout.nb_channels, frame->nb_samples,
+                               AVSampleFormat(frame->format), 1);
+        av_samples_copy(planes, frame->data, 0, 0, frame->nb_samples, frame->ch_layout.nb_channels,
+                        AVSampleFormat(frame->format));
+    }
+
+    QMutexLocker locker(&d->mutex);
+    if (d->fileFrames == 0 && d->memoryBudget > 0) {
+        d->stats.spills += 1;
+        d->spillStartMs = d->clock.elapsed();
+    }
+    d->fileFrames += 1;
+    d->stats.maxSpillFrames = std::max(d->stats.maxSpillFrames, d->fileFrames);
+    d->written += bytes;
+    d->stats.frames += 1;
+    d->stats.maxUsedBytes = std::max(d->stats.maxUsedBytes, d->written - d->read);
+    if (kind == Video) {
+        d->rawVideoBytes += rawBytes;
+        d->spooledVideoBytes += bytes;
+    }
+    d->wake.wakeOne();
+    return true;
+}
+
+void FrameSpool::finish(){
+    {
+        QMutexLocker locker(&d->mutex);
+        d->finishing = true;
+        d->wake.wakeOne();
+    }
+    // catching up is all that is left
+    if (this->isRunning()) {
+        this->setPriority(QThread::NormalPriority);
+    }
+}
+
+bool FrameSpool::pop(AVFrame* frame, Kind* kind, int* requests){
+    while (true) {
+        int64_t position = 0;
+        {
+            QMutexLocker locker(&d->mutex);
+            while (!d->finishing && ((d->memory.empty() && d->read == d->written) ||
+                   (d->deferred && (d->written - d->read) * 4 < d->capacity * 3))) {
+                d->wake.wait(&d->mutex);
+            }
+            // older than anything in the file
+            if (!d->memory.empty()) {
+                Queued queued = d->memory.front();
+                d->memory.pop_front();
+                d->memoryBytes -= queued.bytes;
+                locker.unlock();
+                av_frame_unref(frame);
+                av_frame_move_ref(frame, queued.frame);
+                av_frame_free(&queued.frame);
+                *kind = queued.kind;
+                *requests = queued.requests;
+                return true;
+            }
+            if (d->read == d->written) {
+                return false;
+            }
+            position = d->read % d->capacity;
+        }
+        RecordHeader header;
+        memcpy(&header, d->map + position, sizeof(header));
+        if (header.magic != kMagic || header.bytes <= 0) {
+            qWarning() << "Corrupt spool record at" << position;
+            return false;
+        }
+        if (header.kind == RecordWrap) {
+            QMutexLocker locker(&d->mutex);
+            d->read += header.bytes;
+            continue;
+        }
+
+        av_frame_unref(frame);
+        frame->format = header.format;
+        const uint8_t* data = d->map + position + sizeof(RecordHeader);
+        bool ok = true;
+        if (header.kind == RecordVideo) {
+            *kind = Video;
+            frame->width = header.width;
+            frame->height = header.height;
+            ok = av_frame_get_buffer(frame, 32) >= 0;
+            if (ok && header.compressed) {
+                if (d->unpacked.size() < header.rawBytes) {
+                    d->unpacked.resize(header.rawBytes);
+                }
+                uint8_t* raw = reinterpret_cast<uint8_t*>(d->unpacked.data());
+                const int stripes = header.stripes;
+                const int stripe = (header.rawBytes + stripes - 1) / stripes;
+                const uint8_t* packed = data + int64_t(stripes) * 4;
+                std::vector<int> results(size_t(stripes), 0);
+                for (int i = 0; i < stripes; ++i) {
+                    uint32_t size = 0;
+                    memcpy(&size, data + i * 4, 4);
+                    const int offset = std::min(header.rawBytes, i * stripe);
+                    const int capacity = std::min(stripe, header.rawBytes - offset);
+                    int* result = &results[size_t(i)];
+                    d->unpackPool.start(QRunnable::create([packed, size, raw, offset, capacity, result]{
+                        *result = Lz4Block::decompress(packed, int(size), raw + offset, capacity) == capacity ? 1 : 0;
+                    }));
+                    packed += size;
+                }
+                d->unpackPool.waitForDone();
+                ok = std::all_of(results.begin(), results.end(), [](int result){ return result == 1; });
+                data = raw;
+            }
+            if (ok) {
+                const uint8_t* planes[4] = {};
+                int linesizes[4] = {};
+                av_image_fill_arrays(const_cast<uint8_t**>(planes), linesizes, data, AVPixelFormat(header.format),
+                                     header.width, header.height, 1);
+                av_image_copy(frame->data, frame->linesize, planes, linesizes, AVPixelFormat(header.format),
+                              header.width, header.height);
+            }
+        } else {
+            *kind = Audio;
+            frame->nb_samples = header.width;
+            frame->sample_rate = header.sampleRate;
+            av_channel_layout_default(&frame->ch_layout, header.height);
+            ok = av_frame_get_buffer(frame, 0) >= 0;
+            if (ok) {
+                uint8_t* planes[AV_NUM_DATA_POINTERS] = {};
+                av_samples_fill_arrays(planes, nullptr, data, header.height, header.width,
+                                       AVSampleFormat(header.format), 1);
+                av_samples_copy(frame->data, planes, 0, 0, header.width, header.height, AVSampleFormat(header.format));
+            }
+        }
+        frame->pts = header.pts;
+        *requests = header.requests;
+
+        QMutexLocker locker(&d->mutex);
+        d->read += header.bytes;
+        d->fileFrames -= 1;
+        if (d->fileFrames == 0 && d->spillStartMs >= 0) {
+            d->stats.longestSpillMs = std::max(d->stats.longestSpillMs, d->clock.elapsed() - d->spillStartMs);
+            d->spillStartMs = -1;
+        }
+        if (!ok) {
+            qWarning() << "Could not read spooled frame" << header.pts;
+            continue;
+        }
+        return true;
+    }
+}
+
+void FrameSpool::run(){
+    AVFrame* frame = av_frame_alloc();
+    Kind kind = Video;
+    int requests = 0;
+    while (frame && this->pop(frame, &kind, &requests)) {
+        if (d->consumer) {
+            d->consumer(frame, kind, requests);
+        }
+    }
+    av_frame_free(&frame);
+    if (d->finished) {
+        d->finished();
+    }
+    this->close();
+}
+
+}
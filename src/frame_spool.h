@@ -0,0 +1,94 @@
+#ifndef FRAME_SPOOL_H
+#define FRAME_SPOOL_H
+
+#include <QThread>
+#include <QString>
+#include <functional>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+namespace adc{
+
+struct SpoolStats{
+    int64_t capacity = 0;
+    int64_t usedBytes = 0;
+    int64_t maxUsedBytes = 0;
+    int64_t frames = 0;
+    int64_t dropped = 0;
+    // raw / spooled bytes of the video frames
+    double ratio = 1;
+    // frames waiting in memory, ahead of the file
+    int64_t memoryBytes = 0;
+    int64_t maxMemoryBytes = 0;
+    // overflow past the memory budget: frames in the file now and at most,
+    // how often it happened and for how long (spillMs is the current one)
+    int64_t spillFrames = 0;
+    int64_t maxSpillFrames = 0;
+    int64_t spills = 0;
+    int64_t spillMs = 0;
+    int64_t longestSpillMs = 0;
+};
+
+// Raw capture spool: converted frames go into a ring buffer in a memory
+// mapped file at capture time and come out on this thread, at low priority,
+// for the consumer (the encoder). The file never grows past its capacity;
+// frames that do not fit are dropped and counted, their timestamps stay
+// taken. Video frames can be LZ4 compressed, in stripes on a thread pool.
+// With a memory budget frames wait in memory and only spill into the file
+// past it, until the file is empty again; the order is kept either way.
+class FrameSpoolPrivate;
+class FrameSpool : public QThread
+{
+public:
+    enum Kind{
+        Video,
+        Audio,
+    };
+
+    // frame is only valid for the call
+    using Consumer = std::function<void(AVFrame* frame, Kind kind, int requests)>;
+
+    explicit FrameSpool(QObject *parent = nullptr);
+    ~FrameSpool();
+
+    // creates the file and maps it, call before start(); lazy leaves that
+    // to the first frame past the memory budget, so an overflow queue that
+    // never spills takes no disk space. A lazy file that cannot be created
+    // drops what does not fit in memory
+    bool open(const QString& path, int64_t capacity, bool compress, bool lazy = false);
+    void setConsumer(const Consumer& consumer);
+    // called on this thread once finish() was called and the spool is empty
+    void setFinished(const std::function<void()>& finished);
+    // deferred: nothing is consumed before finish() or until the spool is
+    // three quarters full
+    void setDeferred(bool deferred);
+    // frames wait in memory up to bytes before going to the file,
+    // 0 sends every frame to the file
+    void setMemoryBudget(int64_t bytes);
+
+    // capture side, one thread at a time; requests are keyframe reasons
+    // that travel with the frame
+    bool push(const AVFrame* frame, Kind kind, int requests = 0);
+    // no more frames: what is spooled is consumed at normal priority
+    void finish();
+
+    QString path() const;
+    SpoolStats stats() const;
+
+protected:
+    void run() override;
+
+private:
+    bool createFile();
+    bool pop(AVFrame* frame, Kind* kind, int* requests);
+    void close();
+
+private:
+    FrameSpoolPrivate* d;
+};
+
+}
+
+#endif // FRAME_SPOOL_H
@@ -0,0 +1,91 @@
+#include "keyframe_scheduler.h"
+#include <algorithm>
+#include <iterator>
+
+namespace adc{
+
+namespace {
+// a cut replaces most of the frame at once, coming from a calm frame;
+// sustained high motion (games, video) is left to the encoder
+constexpr double kCutMotion = 0.6;
+constexpr double kCalmMotion = 0.3;
+
+int bitIndex(int reason){
+    int i = 0;
+    while (reason > 1) {
+        reason >>= 1;
+        ++i;
+    }
+    return i;
+}
+}
+
+KeyframeScheduler::KeyframeScheduler(){
+
+}
+
+void KeyframeScheduler::setInterval(int frames){
+    m_interval = std::max(1, frames);
+}
+
+int KeyframeScheduler::interval() const{
+    return m_interval;
+}
+
+void KeyframeScheduler::setMinDistance(int frames){
+    m_minDistance = std::max(1, frames);
+}
+
+void KeyframeScheduler::setIntraRefresh(bool enable){
+    m_intraRefresh = enable;
+}
+
+void KeyframeScheduler::reset(){
+    m_requests = 0;
+    m_sinceKeyframe = 0;
+    m_prevMotion = 0;
+    std::fill(std::begin(m_counts), std::end(m_counts), 0);
+}
+
+void KeyframeScheduler::request(Reason reason){
+    m_requests.fetch_or(reason);
+}
+
+int KeyframeScheduler::take(int reasons){
+    return m_requests.fetch_and(~reasons) & reasons;
+}
+
+int KeyframeScheduler::next(double motion){
+    int reasons = m_requests.exchange(0);
+    // the first frame is a keyframe anyway
+    if (m_sinceKeyframe > 0) {
+        if (m_sinceKeyframe >= m_interval) {
+            reasons |= Interval;
+        }
+        if (!m_intraRefresh && motion > kCutMotion && m_prevMotion < kCalmMotion && m_sinceKeyframe >= m_minDistance) {
+            reasons |= SceneChange;
+        }
+    }
+    m_prevMotion = motion;
+
+    if (reasons != None || m_sinceKeyframe == 0) {
+        for (int bit = Interval; bit <= Congestion; bit <<= 1) {
+            if (reasons & bit) {
+                m_counts[bitIndex(bit)] += 1;
+            }
+        }
+        m_sinceKeyframe = 1;
+        return reasons;
+    }
+    m_sinceKeyframe += 1;
+    return None;
+}
+
+int64_t KeyframeScheduler::count(Reason reason) const{
+    if (reason == None) {
+        return 0;
+    }
+    return m_counts[bitIndex(reason)];
+}
+
+}
@@ -0,0 +1,61 @@
+#ifndef KEYFRAME_SCHEDULER_H
+#define KEYFRAME_SCHEDULER_H
+
+#include <atomic>
+#include <cstdint>
+
+namespace adc{
+
+// Decides per frame whether the encoder must emit an IDR frame: at the
+// end of a (long) GOP, on scene cuts, and whenever something outside the
+// frame data asks for one (resume, capture size change, API markers,
+// segment rotation, a stream recovering from congestion).
+class KeyframeScheduler
+{
+public:
+    enum Reason{
+        None = 0,
+        Interval = 1 << 0,
+        SceneChange = 1 << 1,
+        Resume = 1 << 2,
+        Resize = 1 << 3,
+        Marker = 1 << 4,
+        Segment = 1 << 5,
+        Congestion = 1 << 6
+    };
+
+    KeyframeScheduler();
+
+    void setInterval(int frames);
+    int interval() const;
+    void setMinDistance(int frames);
+    // intra refresh: no scene cut keyframes, and Interval only ends a
+    // refresh period, the caller does not force an IDR frame for it
+    void setIntraRefresh(bool enable);
+    void reset();
+
+    // thread-safe, taken into account on the next frame
+    void request(Reason reason);
+    // removes and returns the pending requests among reasons, so that they
+    // can be replayed with request() on a frame encoded later
+    int take(int reasons);
+
+    // motion: fraction of the frame that changed since the previous one;
+    // returns the reasons for a keyframe, None to let the encoder decide
+    int next(double motion);
+
+    int64_t count(Reason reason) const;
+
+private:
+    std::atomic<int> m_requests{ 0 };
+    int m_interval = 300;
+    int m_minDistance = 15;
+    bool m_intraRefresh = false;
+    int m_sinceKeyframe = 0;
+    double m_prevMotion = 0;
+    int64_t m_counts[7] = {};
+};
+
+}
+
+#endif // KEYFRAME_SCHEDULER_H
@@ -0,0 +1,163 @@
+#include "lz4_block.h"
+#include <cstring>
+#include <vector>
+
+namespace adc{
+
+namespace {
+constexpr int kMinMatch = 4;
+// the format wants the last 5 bytes as literals and no match starting in
+// the last 12
+constexpr int kLastLiterals = 5;
+constexpr int kMatchLimit = 12;
+constexpr int kMaxOffset = 65535;
+constexpr int kHashBits = 14;
+
+uint32_t read32(const uint8_t* p){
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint32_t hash(uint32_t sequence){
+    return (sequence * 2654435761u) >> (32 - kHashBits);
+}
+
+// 15 in the token, then 255s and the rest
+uint8_t* writeLength(uint8_t* op, int length){
+    length -= 15;
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = uint8_t(length);
+    return op;
+}
+}
+
+int Lz4Block::bound(int size){
+    return size + size / 255 + 16;
+}
+
+int Lz4Block::compress(const uint8_t* src, int size, uint8_t* dst, int capacity){
+    if (capacity < bound(size)) {
+        return -1;
+    }
+    // positions + 1, 0 is empty
+    std::vector<uint32_t> table(size_t(1) << kHashBits, 0);
+    uint8_t* op = dst;
+    int anchor = 0;
+    int ip = 0;
+    int misses = 0;
+    while (ip < size - kMatchLimit) {
+        const uint32_t sequence = read32(src + ip);
+        const uint32_t h = hash(sequence);
+        const int ref = int(table[h]) - 1;
+        table[h] = uint32_t(ip + 1);
+        if (ref < 0 || ip - ref > kMaxOffset || read32(src + ref) != sequence) {
+            // incompressible stretches are skipped faster
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+        int length = kMinMatch;
+        while (ip + length < size - kLastLiterals && src[ref + length] == src[ip + length]) {
+            ++length;
+        }
+
+        const int literals = ip - anchor;
+        uint8_t* token = op++;
+        if (literals >= 15) {
+            *token = 15 << 4;
+            op = writeLength(op, literals);
+        } else {
+            *token = uint8_t(literals << 4);
+        }
+        memcpy(op, src + anchor, size_t(literals));
+        op += literals;
+        const int offset = ip - ref;
+        *op++ = uint8_t(offset & 0xff);
+        *op++ = uint8_t(offset >> 8);
+        const int match = length - kMinMatch;
+        if (match >= 15) {
+            *token |= 15;
+            op = writeLength(op, match);
+        } else {
+            *token |= uint8_t(match);
+        }
+        ip += length;
+        anchor = ip;
+    }
+
+    const int literals = size - anchor;
+    if (literals >= 15) {
+        *op++ = 15 << 4;
+        op = writeLength(op, literals);
+    } else {
+        *op++ = uint8_t(literals << 4);
+    }
+    memcpy(op, src + anchor, size_t(literals));
+    op += literals;
+    return int(op - dst);
+}
+
+int Lz4Block::decompress(const uint8_t* src, int size, uint8_t* dst, int capacity){
+    const uint8_t* ip = src;
+    const uint8_t* const end = src + size;
+    uint8_t* op = dst;
+    uint8_t* const limit = dst + capacity;
+    while (ip < end) {
+        const int token = *ip++;
+        int literals = token >> 4;
+        if (literals == 15) {
+            int extra = 255;
+            while (extra == 255 && ip < end) {
+                extra = *ip++;
+                literals += extra;
+            }
+        }
+        if (literals > end - ip || literals > limit - op) {
+            return -1;
+        }
+        memcpy(op, ip, size_t(literals));
+        op += literals;
+        ip += literals;
+        if (ip == end) {
+            // the last sequence has no match
+            break;
+        }
+        if (end - ip < 2) {
+            return -1;
+        }
+        const int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - dst) {
+            return -1;
+        }
+        int length = token & 15;
+        if (length == 15) {
+            int extra = 255;
+            while (extra == 255 && ip < end) {
+                extra = *ip++;
+                length += extra;
+            }
+        }
+        length += kMinMatch;
+        if (length > limit - op) {
+            return -1;
+        }
+        const uint8_t* match = op - offset;
+        if (offset >= length) {
+            memcpy(op, match, size_t(length));
+            op += length;
+        } else {
+            // overlapping: repeats the last offset bytes
+            for (int i = 0; i < length; ++i) {
+                *op++ = match[i];
+            }
+        }
+    }
+    return int(op - dst);
+}
+
+}
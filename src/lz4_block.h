@@ -0,0 +1,25 @@
+#ifndef LZ4_BLOCK_H
+#define LZ4_BLOCK_H
+
+#include <cstdint>
+
+namespace adc{
+
+// LZ4 block format (no frame header or checksums), readable by the
+// reference LZ4_decompress_safe. A greedy single-probe compressor tuned
+// for speed over ratio: raw capture frames have long runs of identical
+// pixels, which is what it is used on.
+class Lz4Block
+{
+public:
+    // worst case output for size input bytes
+    static int bound(int size);
+    // returns the compressed size, -1 if capacity is too small
+    static int compress(const uint8_t* src, int size, uint8_t* dst, int capacity);
+    // returns the decompressed size, -1 on corrupt input
+    static int decompress(const uint8_t* src, int size, uint8_t* dst, int capacity);
+};
+
+}
+
+#endif // LZ4_BLOCK_H
@@ -1,6 +1,7 @@
 #include "mainwindow.h"
 
 #include <QApplication>
+#include <QCommandLineParser>
 #include <winrt/Windows.Foundation.Collections.h>
 
 int main(int argc, char *argv[])
@@ -8,9 +9,18 @@ int main(int argc, char *argv[])
     //winrt::init_apartment();
     QApplication a(argc, argv);
 
-
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption fragments("fragment-seconds",
+                                 "Crash-safe recording: fragmented MP4 / MKV clusters every <seconds>.",
+                                 "seconds");
+    parser.addOption(fragments);
+    parser.process(a);
 
     adc::MainWindow w;
+    if (parser.isSet(fragments)) {
+        w.setFragmentDuration(parser.value(fragments).toInt());
+    }
     w.show();
     return a.exec();
 }
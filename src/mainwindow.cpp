@@ -44,6 +44,8 @@ public:
     MainWindow::State state;
     bool recording = false;
     bool pause = false;
+    // start() has been queued, the state flips once the recorder confirms
+    bool starting = false;
     QElapsedTimer elapsedTimer;
     QTimer timer;
     qint64 totalTime = 0;
@@ -88,6 +90,9 @@ MainWindow::MainWindow(QWidget *parent)
 
     connect(d->recorder,&Recorder::errorOccurred,this,&MainWindow::onOutputError);
     connect(d->recorder,&Recorder::openOutput,this,&MainWindow::onOpenOutput);
+    connect(d->recorder,&Recorder::finalizeProgress,this,&MainWindow::onFinalizeProgress);
+    connect(d->recorder,&Recorder::commandFinished,this,&MainWindow::onRecorderCommand);
+    d->recorder->setFaststart(true);
     connect(ui->start,&QToolButton::clicked,this,&MainWindow::start);
     connect(ui->stop,&QToolButton::clicked,this,&MainWindow::stop);
 
@@ -103,8 +108,10 @@ MainWindow::MainWindow(QWidget *parent)
     connect(this->d->close,&QToolButton::clicked,this,&MainWindow::close);
     connect(&d->timer, &QTimer::timeout, this, &MainWindow::onTimeout);
     ui->time->setText(this->formattedTime(0));
-    this->onScreenTarget();
     this->init();
+    this->onScreenTarget();
+    connect(ui->resolution,QOverload<int>::of(&QComboBox::currentIndexChanged),this,&MainWindow::armRecorder);
+    connect(ui->fps,QOverload<int>::of(&QComboBox::currentIndexChanged),this,&MainWindow::armRecorder);
 
     qDebug() << "checked:" << ui->sound->isCheckable()<<ui->sound->isChecked();
 
@@ -124,6 +131,12 @@ void MainWindow::init(){
     this->initFPS();
 }
 
+void MainWindow::setFragmentDuration(int seconds){
+    // crash-safe output is opt-in, it rules out faststart, the recovery
+    // journal and pausing in parts
+    d->recorder->setFragmentDuration(seconds);
+}
+
 void MainWindow::updateUI(State state) {
     if (state == Stopped) {
         ui->start->setIcon(QIcon(":/res/icons/Run_32x.svg"));
@@ -181,6 +194,7 @@ void MainWindow::onScreenTarget(){
     ui->window->setChecked(false);
     d->recorder->setTargetWindow(0);
     this->previewCapture();
+    this->armRecorder();
 }
 
 void MainWindow::onRegionTarget(){
@@ -249,6 +263,7 @@ void MainWindow::onAppSelected(const WindowInfo& info){
         d->targetWindow = info.handle;
         d->recorder->setTargetWindow(d->targetWindow);
         this->onWindowTarget();
+        this->armRecorder();
     }
 }
 
@@ -298,6 +313,14 @@ void MainWindow::onToggleMircophone(){
     ui->mircophone_level->setEnabled(!ui->mircophone->isChecked());
 }
 
+void MainWindow::onFinalizeProgress(const QString& path, int percent){
+    if (percent >= 100) {
+        ui->time->setToolTip(QString());
+    } else {
+        ui->time->setToolTip(tr("Saving %1: %2%").arg(QFileInfo(path).fileName()).arg(percent));
+    }
+}
+
 void MainWindow::onOpenOutput(const QString& path){
     if(QFile::exists(path)){
         if(QMessageBox::question(this,tr("Open output file"),tr("The video file has been generated. Do you want to open the directory where it is located?"),QMessageBox::Ok|QMessageBox::Cancel)==QMessageBox::Ok){
@@ -319,23 +342,14 @@ void MainWindow::start(){
                 return ;
             }
             outputFile += ("/"+this->outputFilename());
-            auto index = ui->resolution->currentIndex();
-            SelectModel<QSize>* model = static_cast<SelectModel<QSize>*>(ui->resolution->model());
-            auto resolution = model->value(index);
-            index = ui->fps->currentIndex();
-            SelectModel<int>* fpsModel = static_cast<SelectModel<int>*>(ui->fps->model());
-            auto fps = fpsModel->value(index);
+            auto resolution = this->currentResolution();
+            auto fps = this->currentFps();
             //qDebug()<<resolution<<fps;
-            if (d->recorder->start(outputFile, resolution, fps)) {
-                qDebug() << "recording start ok";
-                ui->start->setIcon(QIcon(":/res/icons/Pause_32x.svg"));
-                d->state = Recording;
-                d->timer.start();
-                d->elapsedTimer.start();
-            }else{
-                qDebug() << "recording start failed";
-                return;
+            if (!d->starting) {
+                d->starting = true;
+                d->recorder->start(outputFile, resolution, fps);
             }
+            return;
         }
     }
     else if (d->state == Recording) {
@@ -357,12 +371,28 @@ void MainWindow::stop(){
    if (this->d->recorder != nullptr) {
         this->d->recorder->stop();
     }
+   d->starting = false;
    d->state = Stopped;
    d->totalTime = 0;
    d->timer.stop();
    this->updateUI(d->state);
 }
 
+void MainWindow::onRecorderCommand(Recorder::Command command, bool ok){
+    if (command != Recorder::Start || !d->starting) {
+        return;
+    }
+    d->starting = false;
+    if (!ok) {
+        return;
+    }
+    ui->start->setIcon(QIcon(":/res/icons/Pause_32x.svg"));
+    d->state = Recording;
+    d->timer.start();
+    d->elapsedTimer.start();
+    this->updateUI(d->state);
+}
+
 void MainWindow::resizeEvent(QResizeEvent* e){
     auto size = e->size();
     this->d->close->setGeometry({size.width() - 24,0,24,24});
@@ -427,6 +457,27 @@ QString MainWindow::formattedTime(qint64 ms)
 }
 
 
+QSize MainWindow::currentResolution() const{
+    SelectModel<QSize>* model = static_cast<SelectModel<QSize>*>(ui->resolution->model());
+    return model->value(ui->resolution->currentIndex());
+}
+
+int MainWindow::currentFps() const{
+    SelectModel<int>* model = static_cast<SelectModel<int>*>(ui->fps->model());
+    return model->value(ui->fps->currentIndex());
+}
+
+void MainWindow::armRecorder(){
+    // encoders and capture session are set up in the background so the
+    // start button only has to open the output file
+    if (d->recorder == nullptr || d->state != Stopped) {
+        return;
+    }
+    d->recorder->setResolution(this->currentResolution());
+    d->recorder->setFps(this->currentFps());
+    d->recorder->prepare();
+}
+
 void MainWindow::initResolution(){
     QList<QPair<QSize,QString>> list;
     list.append({{0,0},tr("Auto")});
@@ -465,7 +516,7 @@ QString MainWindow::outputFilename() const{
     }else if(mode==VideoCapture::Window){
         filename = QString("%1_").arg(d->recorder->windowTitle());
     }
-    filename += QDateTime::currentDateTime().toString("yyyyMMddHHmm") + ".mp4";
+    filename += QDateTime::currentDateTime().toString("yyyyMMddHHmmss") + ".mp4";
     return filename;
 }
 
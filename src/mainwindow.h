@@ -2,6 +2,7 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
+#include "recorder.h"
 
 QT_BEGIN_NAMESPACE
 namespace Ui {
@@ -27,6 +28,7 @@ public:
     void init();
     void updateUI(State state);
     void previewCapture();
+    void setFragmentDuration(int seconds);
 
 public slots:
     void start();
@@ -45,11 +47,16 @@ public slots:
     void onToggleSound();
     void onToggleMircophone();
     void onOpenOutput(const QString& path);
+    void onFinalizeProgress(const QString& path, int percent);
+    void onRecorderCommand(adc::Recorder::Command command, bool ok);
+    void armRecorder();
 
 private:
     QString formattedTime(qint64 ms);
     void initResolution();
     void initFPS();
+    QSize currentResolution() const;
+    int currentFps() const;
     QString outputFilename() const;
 
 protected:
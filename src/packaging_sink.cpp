@@ -0,0 +1,91 @@
+#include "packaging_sink.h"
+#include <QDir>
+#include <QFileInfo>
+#include <QDebug>
+#include <algorithm>
+
+namespace adc{
+
+PackagingSink::PackagingSink(const QString& manifest, QObject *parent)
+    : StreamSink{manifest, parent}
+{
+    // a local disk is never congested, only a stalled one is
+    this->setMaxDelay(10000);
+}
+
+void PackagingSink::setSegmentDuration(int ms){
+    m_segmentMs = std::max(500, ms);
+}
+
+void PackagingSink::setChunkDuration(int ms){
+    m_chunkMs = std::max(0, ms);
+}
+
+void PackagingSink::setWindow(int segments){
+    m_window = std::max(1, segments);
+}
+
+void PackagingSink::begin(const AVCodecContext* video, const AVCodecContext* audio){
+    const QString dir = QFileInfo(this->url()).absolutePath();
+    if (!QDir().mkpath(dir)) {
+        qWarning() << "Could not create packaging directory" << dir;
+    }
+    m_keyUs = AV_NOPTS_VALUE;
+    m_requested = false;
+    m_timeBase = video ? video->time_base : AVRational{ 1, 1 };
+    StreamSink::begin(video, audio);
+}
+
+void PackagingSink::push(const AVPacket* pkt, Stream stream){
+    if (stream == Video) {
+        const int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+        if (ts != AV_NOPTS_VALUE) {
+            const int64_t us = av_rescale_q(ts, m_timeBase, AV_TIME_BASE_Q);
+            if (pkt->flags & AV_PKT_FLAG_KEY) {
+                m_keyUs = us;
+                m_requested = false;
+            } else if (m_keyUs != AV_NOPTS_VALUE && !m_requested &&
+                       us - m_keyUs >= int64_t(m_segmentMs) * 1000) {
+                // segments can only start on a keyframe, without one on
+                // time they would stretch to the encoder's GOP length
+                m_requested = true;
+                this->requestKeyframe();
+            }
+        }
+    }
+    StreamSink::push(pkt, stream);
+}
+
+const char* PackagingSink::formatName() const{
+    return "dash";
+}
+
+void PackagingSink::muxerOptions(AVDictionary** options) const{
+    const QString name = QFileInfo(this->url()).completeBaseName();
+    av_dict_set(options, "dash_segment_type", "mp4", 0);
+    av_dict_set_int(options, "seg_duration", int64_t(m_segmentMs) * 1000, 0);
+    av_dict_set_int(options, "use_template", 1, 0);
+    av_dict_set_int(options, "window_size", m_window, 0);
+    av_dict_set_int(options, "extra_window_size", 2, 0);
+    av_dict_set_int(options, "remove_at_exit", 0, 0);
+    av_dict_set_int(options, "hls_playlist", 1, 0);
+    av_dict_set(options, "hls_master_name", QString("%1.m3u8").arg(name).toUtf8().constData(), 0);
+    av_dict_set(options, "init_seg_name", QString("%1_init_$RepresentationID$.$ext$").arg(name).toUtf8().constData(), 0);
+    av_dict_set(options, "media_seg_name",
+                QString("%1_chunk_$RepresentationID$_$Number%05d$.$ext$").arg(name).toUtf8().constData(), 0);
+    if (m_chunkMs > 0) {
+        av_dict_set(options, "frag_type", "duration", 0);
+        av_dict_set_int(options, "frag_duration", int64_t(m_chunkMs) * 1000, 0);
+        av_dict_set_int(options, "streaming", 1, 0);
+        av_dict_set_int(options, "ldash", 1, 0);
+        // the dash muxer refuses lhls as experimental otherwise
+        av_dict_set(options, "strict", "experimental", 0);
+        av_dict_set_int(options, "lhls", 1, 0);
+        av_dict_set_int(options, "target_latency", int64_t(m_chunkMs) * 3000, 0);
+    } else {
+        av_dict_set_int(options, "use_timeline", 1, 0);
+        av_dict_set(options, "frag_type", "none", 0);
+    }
+}
+
+}
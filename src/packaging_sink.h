@@ -0,0 +1,47 @@
+#ifndef PACKAGING_SINK_H
+#define PACKAGING_SINK_H
+
+#include "stream_sink.h"
+
+namespace adc{
+
+// Live CMAF packaging for viewing through a plain static HTTP server:
+// fMP4 segments plus a DASH manifest and HLS master/media playlists next
+// to it, all from the recording's packets. Playlists (and segments, unless
+// chunks are used) are written to a temporary name and renamed when complete.
+// With a chunk duration every segment is split into CMAF chunks of that
+// length and written as they come: low-latency DASH, and LHLS prefetch hints
+// in the playlists. That is the older LHLS scheme, FFmpeg writes no LL-HLS
+// EXT-X-PART / EXT-X-PRELOAD-HINT tags.
+class PackagingSink : public StreamSink
+{
+    Q_OBJECT
+public:
+    // manifest: <dir>/<name>.mpd, the playlists go to the same directory
+    explicit PackagingSink(const QString& manifest, QObject *parent = nullptr);
+
+    void setSegmentDuration(int ms);
+    // 0: one chunk per segment
+    void setChunkDuration(int ms);
+    // segments listed in the playlists; older ones are deleted
+    void setWindow(int segments);
+
+    void begin(const AVCodecContext* video, const AVCodecContext* audio) override;
+    void push(const AVPacket* pkt, Stream stream) override;
+
+protected:
+    const char* formatName() const override;
+    void muxerOptions(AVDictionary** options) const override;
+
+private:
+    int m_segmentMs = 4000;
+    int m_chunkMs = 0;
+    int m_window = 6;
+    int64_t m_keyUs = AV_NOPTS_VALUE;
+    AVRational m_timeBase{ 1, 1 };
+    bool m_requested = false;
+};
+
+}
+
+#endif // PACKAGING_SINK_H
@@ -0,0 +1,31 @@
+#ifndef PACKET_SINK_H
+#define PACKET_SINK_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+namespace adc{
+
+// Receives every encoded packet next to the file writer, timestamps in the
+// encoder time base. push() is called on the encoding threads with the
+// recorder locked: it has to return right away and must not keep pkt.
+class PacketSink
+{
+public:
+    enum Stream{
+        Video = 0,
+        Audio = 1
+    };
+
+    virtual ~PacketSink(){}
+    // a recording starts with these encoders (audio may be null)
+    virtual void begin(const AVCodecContext* video, const AVCodecContext* audio) = 0;
+    virtual void push(const AVPacket* pkt, Stream stream) = 0;
+    // the recording stopped, no more packets until the next begin()
+    virtual void end(){}
+};
+
+}
+
+#endif // PACKET_SINK_H
@@ -0,0 +1,227 @@
+#include "packet_writer.h"
+#include "recovery_journal.h"
+#include "frame_index.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QDebug>
+#include <algorithm>
+
+namespace adc{
+
+class PacketWriterPrivate{
+public:
+    mutable QMutex mutex;
+    QWaitCondition notEmpty;
+    QWaitCondition notFull;
+    QQueue<AVPacket*> queue;
+    int64_t bytes = 0;
+    int64_t maxBytes = 64 * 1024 * 1024;
+    AVFormatContext* fmtCtx = nullptr;
+    RecoveryJournal* journal = nullptr;
+    FrameIndexWriter* index = nullptr;
+    bool indexInPlace = false;
+    bool interleaved = true;
+    bool stopping = false;
+    bool failed = false;
+    bool drained = true;
+};
+
+PacketWriter::PacketWriter(QObject *parent)
+    : QThread{parent}
+{
+    d = new PacketWriterPrivate;
+}
+
+PacketWriter::~PacketWriter(){
+    this->finish();
+    delete d->journal;
+    delete d->index;
+    delete d;
+}
+
+void PacketWriter::setMaxBytes(int64_t bytes){
+    QMutexLocker locker(&d->mutex);
+    d->maxBytes = std::max<int64_t>(bytes, 1);
+}
+
+void PacketWriter::setJournal(RecoveryJournal* journal){
+    delete d->journal;
+    d->journal = journal;
+}
+
+void PacketWriter::setIndex(FrameIndexWriter* index, bool inPlace){
+    delete d->index;
+    d->index = index;
+    d->indexInPlace = index && inPlace;
+}
+
+void PacketWriter::closeIndex(bool ok, int64_t trailerBytes){
+    if (!d->index) {
+        return;
+    }
+    if (ok) {
+        d->index->close(trailerBytes);
+    } else {
+        d->index->discard();
+    }
+    delete d->index;
+    d->index = nullptr;
+}
+
+void PacketWriter::begin(AVFormatContext* fmtCtx, bool interleaved){
+    d->fmtCtx = fmtCtx;
+    d->interleaved = interleaved;
+    d->stopping = false;
+    d->failed = false;
+    d->drained = false;
+    this->start();
+}
+
+bool PacketWriter::push(AVPacket* pkt){
+    QMutexLocker locker(&d->mutex);
+    // a single oversized packet still goes through an empty queue
+    while (d->bytes > 0 && d->bytes + pkt->size > d->maxBytes && !d->failed && !d->stopping) {
+        d->notFull.wait(&d->mutex);
+    }
+    if (d->failed || d->stopping || !d->fmtCtx) {
+        av_packet_unref(pkt);
+        return false;
+    }
+    AVPacket* queued = av_packet_alloc();
+    av_packet_move_ref(queued, pkt);
+    d->bytes += queued->size;
+    d->queue.enqueue(queued);
+    d->notEmpty.wakeOne();
+    return true;
+}
+
+bool PacketWriter::finish(){
+    {
+        QMutexLocker locker(&d->mutex);
+        d->stopping = true;
+        d->notEmpty.wakeOne();
+        d->notFull.wakeAll();
+    }
+    this->wait();
+    if (!d->drained) {
+        d->drained = true;
+        this->drained();
+    }
+    if (d->journal) {
+        // stays on disk until the trailer is written
+        d->journal->close();
+    }
+    return !d->failed;
+}
+
+void PacketWriter::abort(){
+    QMutexLocker locker(&d->mutex);
+    d->failed = true;
+    while (!d->queue.isEmpty()) {
+        AVPacket* pkt = d->queue.dequeue();
+        d->bytes -= pkt->size;
+        av_packet_free(&pkt);
+    }
+    d->notEmpty.wakeOne();
+    d->notFull.wakeAll();
+}
+
+AVFormatContext* PacketWriter::output() const{
+    return d->fmtCtx;
+}
+
+void PacketWriter::setOutput(AVFormatContext* fmtCtx){
+    d->fmtCtx = fmtCtx;
+}
+
+bool PacketWriter::interleaved() const{
+    return d->interleaved;
+}
+
+bool PacketWriter::setup(){
+    return true;
+}
+
+void PacketWriter::drained(){
+}
+
+int PacketWriter::write(AVPacket* pkt){
+    const int stream = pkt->stream_index;
+    const int flags = pkt->flags;
+    const int64_t pts = pkt->pts, dts = pkt->dts, duration = pkt->duration;
+    if (d->journal || d->indexInPlace) {
+        const int64_t offset = avio_tell(d->fmtCtx->pb);
+        const int ret = av_write_frame(d->fmtCtx, pkt);
+        if (ret >= 0) {
+            const int64_t size = avio_tell(d->fmtCtx->pb) - offset;
+            if (d->journal) {
+                d->journal->record(stream, flags, pts, dts, duration, offset, size);
+            }
+            if (d->index) {
+                d->index->record(stream, flags, pts, dts, offset, size);
+            }
+        }
+        return ret;
+    }
+    const int size = pkt->size;
+    const int ret = d->interleaved ? av_interleaved_write_frame(d->fmtCtx, pkt)
+                                   : av_write_frame(d->fmtCtx, pkt);
+    if (ret >= 0 && d->index) {
+        d->index->record(stream, flags, pts, dts, -1, size);
+    }
+    return ret;
+}
+
+bool PacketWriter::failed() const{
+    QMutexLocker locker(&d->mutex);
+    return d->failed;
+}
+
+int64_t PacketWriter::queuedBytes() const{
+    QMutexLocker locker(&d->mutex);
+    return d->bytes;
+}
+
+void PacketWriter::run(){
+    if (!this->setup()) {
+        QMutexLocker locker(&d->mutex);
+        d->failed = true;
+        d->notFull.wakeAll();
+        return;
+    }
+    while (true) {
+        AVPacket* pkt = nullptr;
+        {
+            QMutexLocker locker(&d->mutex);
+            while (d->queue.isEmpty() && !d->stopping) {
+                d->notEmpty.wait(&d->mutex);
+            }
+            if (d->queue.isEmpty()) {
+                return;
+            }
+            pkt = d->queue.dequeue();
+        }
+        const int size = pkt->size;
+        int ret = 0;
+        if (!d->failed) {
+            ret = this->write(pkt);
+        }
+        av_packet_free(&pkt);
+
+        QMutexLocker locker(&d->mutex);
+        d->bytes -= size;
+        d->notFull.wakeAll();
+        if (ret < 0 && !d->failed) {
+            d->failed = true;
+            locker.unlock();
+            char reason[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+            av_strerror(ret, reason, sizeof(reason));
+            qWarning() << "Error writing packet:" << reason;
+            emit error(QString("Writing the output failed: %1").arg(reason));
+        }
+    }
+}
+
+}
@@ -0,0 +1,69 @@
+#ifndef PACKET_WRITER_H
+#define PACKET_WRITER_H
+
+#include <QThread>
+#include <QString>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+namespace adc{
+
+// Muxes encoded packets on its own thread so that container I/O (fragment
+// flushes, a slow disk) never stalls the encoders. The queue is bounded:
+// push() blocks while more than maxBytes are waiting to be written.
+class PacketWriterPrivate;
+class RecoveryJournal;
+class FrameIndexWriter;
+class PacketWriter : public QThread
+{
+    Q_OBJECT
+public:
+    explicit PacketWriter(QObject *parent = nullptr);
+    ~PacketWriter();
+
+    void setMaxBytes(int64_t bytes);
+    // takes ownership; packets are then written in arrival order so that
+    // each one's place in the file can be journaled
+    void setJournal(RecoveryJournal* journal);
+    // takes ownership; inPlace: the muxer writes every packet where it is
+    // passed (plain mp4/mov), so offsets are recorded too and packets are
+    // written in arrival order as for the journal
+    void setIndex(FrameIndexWriter* index, bool inPlace);
+    // after the trailer, which added trailerBytes to the file; !ok drops it
+    void closeIndex(bool ok, int64_t trailerBytes);
+    // writes to fmtCtx (header already written) until finish() returns
+    void begin(AVFormatContext* fmtCtx, bool interleaved);
+    // takes over the packet's reference
+    bool push(AVPacket* pkt);
+    // writes what is queued and stops; output() is left for the trailer
+    bool finish();
+    // gives the output up: what is queued is dropped, later pushes fail and
+    // finish() only joins the thread. Does not wait for a write in progress
+    void abort();
+    AVFormatContext* output() const;
+    bool failed() const;
+    int64_t queuedBytes() const;
+
+signals:
+    void error(const QString& message);
+
+protected:
+    void run() override;
+    // writer thread: muxes one packet into output()
+    virtual int write(AVPacket* pkt);
+    // writer thread, before the first packet
+    virtual bool setup();
+    // once the queue is drained, on the thread calling finish()
+    virtual void drained();
+    void setOutput(AVFormatContext* fmtCtx);
+    bool interleaved() const;
+
+private:
+    PacketWriterPrivate* d;
+};
+
+}
+
+#endif // PACKET_WRITER_H
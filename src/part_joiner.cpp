@@ -0,0 +1,182 @@
+#include "part_joiner.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+namespace adc{
+
+namespace {
+struct Context{
+    AVFormatContext* in = nullptr;
+    AVFormatContext* out = nullptr;
+    AVPacket* packet = nullptr;
+
+    ~Context(){
+        av_packet_free(&packet);
+        if (out) {
+            avio_closep(&out->pb);
+            avformat_free_context(out);
+        }
+        avformat_close_input(&in);
+    }
+};
+
+bool sameStream(const AVCodecParameters* a, const AVCodecParameters* b){
+    return a->codec_type == b->codec_type && a->codec_id == b->codec_id &&
+           a->extradata_size == b->extradata_size &&
+           (a->extradata_size == 0 || memcmp(a->extradata, b->extradata, a->extradata_size) == 0);
+}
+}
+
+QString PartJoiner::partPath(const QString& filename, int index){
+    QFileInfo info(filename);
+    return QDir(info.path()).filePath(QString("%1_part%2.%3")
+                                          .arg(info.completeBaseName())
+                                          .arg(index, 3, 10, QChar('0'))
+                                          .arg(info.suffix()));
+}
+
+bool PartJoiner::join(const QStringList& parts, const QString& output,
+                      const std::function<void(int)>& progress, QString* error){
+    if (parts.isEmpty()) {
+        *error = "no parts";
+        return false;
+    }
+    // never paused
+    if (parts.size() == 1) {
+        QFile::remove(output);
+        if (!QFile::rename(parts.first(), output)) {
+            *error = "could not rename " + parts.first();
+            return false;
+        }
+        return true;
+    }
+
+    int64_t totalBytes = 0;
+    for (const QString& part : parts) {
+        totalBytes += QFileInfo(part).size();
+    }
+    const QString temporary = output + ".part";
+    const bool ok = [&]{
+        Context c;
+        c.packet = av_packet_alloc();
+        if (!c.packet) {
+            *error = "out of memory";
+            return false;
+        }
+        // where the parts joined so far end, in microseconds
+        int64_t offset = 0;
+        int64_t doneBytes = 0;
+        int reported = -1;
+        for (int index = 0; index < parts.size(); ++index) {
+            const QString& part = parts[index];
+            avformat_close_input(&c.in);
+            if (avformat_open_input(&c.in, part.toUtf8().constData(), nullptr, nullptr) < 0 ||
+                avformat_find_stream_info(c.in, nullptr) < 0) {
+                *error = "could not read " + part;
+                return false;
+            }
+            if (!c.out) {
+                // the first part sets the streams
+                if (avformat_alloc_output_context2(&c.out, nullptr, nullptr, output.toUtf8().constData()) < 0) {
+                    *error = "no muxer for " + output;
+                    return false;
+                }
+                for (unsigned i = 0; i < c.in->nb_streams; ++i) {
+                    AVStream* out = avformat_new_stream(c.out, nullptr);
+                    if (!out || avcodec_parameters_copy(out->codecpar, c.in->streams[i]->codecpar) < 0) {
+                        *error = "could not add a stream";
+                        return false;
+                    }
+                    out->time_base = c.in->streams[i]->time_base;
+                    out->avg_frame_rate = c.in->streams[i]->avg_frame_rate;
+                    out->codecpar->codec_tag = 0;
+                }
+                if (avio_open(&c.out->pb, temporary.toUtf8().constData(), AVIO_FLAG_WRITE) < 0) {
+                    *error = "could not create " + temporary;
+                    return false;
+                }
+                if (avformat_write_header(c.out, nullptr) < 0) {
+                    *error = "could not write the header of " + output;
+                    return false;
+                }
+            } else {
+                bool matches = c.in->nb_streams == c.out->nb_streams;
+                for (unsigned i = 0; matches && i < c.in->nb_streams; ++i) {
+                    matches = sameStream(c.in->streams[i]->codecpar, c.out->streams[i]->codecpar);
+                }
+                if (!matches) {
+                    *error = part + " was encoded with other settings";
+                    return false;
+                }
+            }
+
+            // the part's earliest packet, an encoder's priming one included,
+            // lands where the parts before it end
+            const int64_t start = c.in->start_time != AV_NOPTS_VALUE ? c.in->start_time : 0;
+            const int64_t shiftUs = index == 0 ? 0 : offset - start;
+            int64_t end = offset;
+            while (av_read_frame(c.in, c.packet) >= 0) {
+                AVStream* in = c.in->streams[c.packet->stream_index];
+                AVStream* out = c.out->streams[c.packet->stream_index];
+                const int64_t shift = av_rescale_q(shiftUs, AV_TIME_BASE_Q, in->time_base);
+                if (c.packet->pts != AV_NOPTS_VALUE) {
+                    c.packet->pts += shift;
+                    end = std::max(end, av_rescale_q(c.packet->pts + c.packet->duration, in->time_base, AV_TIME_BASE_Q));
+                }
+                if (c.packet->dts != AV_NOPTS_VALUE) {
+                    c.packet->dts += shift;
+                }
+                if (progress && totalBytes > 0 && c.packet->pos >= 0) {
+                    const int percent = int(std::clamp<int64_t>((doneBytes + c.packet->pos) * 100 / totalBytes, 0, 99));
+                    if (percent > reported) {
+                        reported = percent;
+                        progress(percent);
+                    }
+                }
+                av_packet_rescale_ts(c.packet, in->time_base, out->time_base);
+                c.packet->pos = -1;
+                const bool written = av_interleaved_write_frame(c.out, c.packet) >= 0;
+                av_packet_unref(c.packet);
+                if (!written) {
+                    *error = "error writing " + temporary;
+                    return false;
+                }
+            }
+            offset = end;
+            doneBytes += QFileInfo(part).size();
+        }
+        if (av_write_trailer(c.out) < 0 || avio_closep(&c.out->pb) < 0) {
+            *error = "error finishing " + temporary;
+            return false;
+        }
+        return true;
+    }();
+
+    if (!ok) {
+        QFile::remove(temporary);
+        return false;
+    }
+    QFile::remove(output);
+    if (!QFile::rename(temporary, output)) {
+        QFile::remove(temporary);
+        *error = "could not rename " + temporary;
+        return false;
+    }
+    for (const QString& part : parts) {
+        QFile::remove(part);
+    }
+    if (progress) {
+        progress(100);
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,28 @@
+#ifndef PART_JOINER_H
+#define PART_JOINER_H
+
+#include <QString>
+#include <QStringList>
+#include <functional>
+
+namespace adc{
+
+// The parts of a paused recording (Recorder::setPauseSegments) joined into
+// one file without re-encoding. Every part starts at zero in all streams;
+// each is moved to where the longest stream of the parts before it ended,
+// so audio and video stay aligned across the joins. The parts have to come
+// from identically configured encoders, stream headers are compared.
+class PartJoiner
+{
+public:
+    // <name>_part001.<ext>
+    static QString partPath(const QString& filename, int index);
+    // written to <output>.part and renamed once whole; the parts are
+    // removed once joined and kept if it fails
+    static bool join(const QStringList& parts, const QString& output,
+                     const std::function<void(int percent)>& progress, QString* error);
+};
+
+}
+
+#endif // PART_JOINER_H
@@ -1,6 +1,22 @@
 #include "recorder.h"
 #include "audiocapture.h"
 #include "videocapture.h"
+#include "encoder_tuning.h"
+#include "keyframe_scheduler.h"
+#include "finalizer.h"
+#include "packet_writer.h"
+#include "segment_writer.h"
+#include "recovery_journal.h"
+#include "frame_index.h"
+#include "replay_buffer.h"
+#include "encrypted_file.h"
+#include "stream_sink.h"
+#include "file_sink.h"
+#include "packaging_sink.h"
+#include "uploader.h"
+#include "transcode_queue.h"
+#include "part_joiner.h"
+#include "thumbnail_writer.h"
 extern "C" {
 #include <libavutil/avutil.h>
 #include <libavutil/opt.h>
@@ -11,10 +27,24 @@ extern "C" {
 #include <QAudioFormat>
 #include <QMutex>
 #include <QMutexLocker>
+#include <QThread>
 #include <QPainter>
 #include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <atomic>
+#include <objbase.h>
 
 namespace adc{
+static constexpr int kLatencySlots = 128;
+
+// tee output: another container from the same packets
+struct OutputTarget{
+    QString extension;
+    QString directory;
+};
+
 class RecorderPrivate{
 public:
     QMutex mutex;
@@ -22,8 +52,74 @@ public:
     VideoCapture* video = nullptr;
 
     bool opened = false;
-    bool running = false;
-    bool paused = false;
+    std::atomic<bool> armed{ false };
+    bool stale = false;
+    // bumped whenever a setting invalidates the encoders
+    int generation = 0;
+    bool globalHeader = true;
+    bool faststart = false;
+    AsyncFile::Options fileOptions;
+    bool journaled = false;
+    bool frameIndex = false;
+    bool indexSidx = false;
+    // > 0: fragmented mp4 / clustered mkv, playable up to the last fragment
+    int fragmentSeconds = 0;
+    // dashcam mode: rotate files, keep the newest within the budget
+    int segmentSeconds = 0;
+    int64_t segmentBytes = 0;
+    int64_t retainBytes = 0;
+    int retainSegments = 0;
+    // written by control commands on the worker, read lock-free by the capture threads
+    std::atomic<bool> running{ false };
+    std::atomic<bool> paused{ false };
+
+    // background preparation (MTA, lives as long as the recorder)
+    QThread* worker = nullptr;
+    QObject* workerContext = nullptr;
+    std::atomic<bool> preparing{ false };
+
+    Finalizer* finalizer = nullptr;
+    // one per recording, handed to the finalizer with the muxer
+    PacketWriter* writer = nullptr;
+    ReplayBuffer* replay = nullptr;
+    Uploader* uploader = nullptr;
+    TranscodeQueue* transcodes = nullptr;
+    bool archiving = false;
+    QString spoolDirectory;
+    int64_t spoolBytes = 0;
+    bool spoolCompress = false;
+    bool spoolDeferred = false;
+    int64_t queueMemory = 0;
+    int64_t spillBytes = 0;
+    QString spillDirectory;
+    // the last recording's, kept until it has drained
+    FrameSpool* spool = nullptr;
+    bool pauseSegments = false;
+    // the current recording's part files when pausing closes them, the
+    // last one is open unless paused
+    QStringList parts;
+    // the tune the current encoder was opened with; the later parts keep
+    // it so their stream headers match for the join
+    ContentClassifier::Content partContent = ContentClassifier::Unknown;
+    int thumbnailSeconds = 0;
+    int thumbnailWidth = 160;
+    QString thumbnailFormat = "jpg";
+    // the current recording's, finished with its last trailer
+    ThumbnailWriter* thumbnails = nullptr;
+    // frames encoded across all parts, the thumbnails' clock
+    int64_t thumbnailFrames = 0;
+    int64_t thumbnailEvery = 0;
+    int thumbnailFps = 0;
+    // capture threads only take captureMutex while spooling, the spool
+    // thread encodes under mutex
+    std::atomic<bool> spooling{ false };
+    QMutex captureMutex;
+    QList<StreamSink*> streams;
+    QList<OutputTarget> targets;
+    // the current recording's tee outputs, handed to the finalizer on stop
+    QList<FileSink*> outputs;
+    // everything that gets the encoded packets besides the file writer
+    QList<PacketSink*> sinks;
 
     AVFormatContext* fmtCtx = nullptr;
     AVStream* videoStream = nullptr;
@@ -43,17 +139,40 @@ public:
     int srcChannels = 0;
 
     QSize resolution;
+    QSize requestedResolution;
     int fps;
     int interval;
     QString filename;
-    WId target;
+    QString encoderName = "libx264";
+    WId target = 0;
+
+    ContentClassifier classifier;
+    ContentClassifier::Content contentHint = ContentClassifier::Unknown;
+    ContentClassifier::Content content = ContentClassifier::Unknown;
+
+    KeyframeScheduler keyframes;
+    int keyframeSeconds = 10;
+    QSize sourceSize;
+
+    bool lowLatency = false;
+    bool intraRefresh = false;
+    int64_t arrivalUs[kLatencySlots] = {};
+    EncodeLatency latency;
+    double latencyWindowMax = 0;
 
     int64_t videoPts = 0;
     int64_t audioPts = 0;
+    // last pts sent to the video encoder, behind videoPts while spooling
+    int64_t encodedPts = -1;
+    // reused encoders keep counting, packets are rebased per recording
+    int64_t videoBase = 0;
+    int64_t audioBase = 0;
+    int64_t videoFramesSent = 0;
+    int64_t videoPacketsOut = 0;
 
-    int64_t startTimeUs = 0;
-    int64_t pauseStartUs = 0;
-    int64_t totalPauseUs = 0;
+    std::atomic<int64_t> startTimeUs{ 0 };
+    std::atomic<int64_t> pauseStartUs{ 0 };
+    std::atomic<int64_t> totalPauseUs{ 0 };
 
 
 
@@ -67,76 +186,283 @@ Recorder::Recorder(QObject *parent)
     d = new RecorderPrivate;
 
     d->fps = 30;
-    d->resolution = {1920,1080};
+    d->resolution = d->requestedResolution = {1920,1080};
     d->videoPts = d->audioPts = 0;
     d->video = new VideoCapture(this);
     d->audio = new AudioCapture(this);
+    d->video->setFps(d->fps);
+    d->fileOptions.metrics = std::make_shared<WriteMetrics>();
+
+    d->replay = new ReplayBuffer(this);
+    connect(d->replay, &ReplayBuffer::saved, this, &Recorder::replaySaved);
+    d->sinks.append(d->replay);
+
+    d->finalizer = new Finalizer(this);
+    d->finalizer->setRecycler([this](OutputSession& session){
+        this->recycleEncoders(session);
+    });
+    connect(d->finalizer, &Finalizer::progress, this, &Recorder::finalizeProgress);
+    connect(d->finalizer, &Finalizer::finalized, this, &Recorder::onFinalized);
+    d->finalizer->start();
+
+    d->uploader = new Uploader(this);
+    connect(d->uploader, &Uploader::uploaded, this, [this](const QString& path, const QString&, bool ok){
+        emit uploaded(path, ok);
+    });
+    // completes followed uploads too
+    connect(d->finalizer, &Finalizer::closed, this, [this](const QString& path, bool){
+        if (QFileInfo::exists(path)) {
+            d->uploader->add(path);
+        }
+    }, Qt::DirectConnection);
+
+    d->transcodes = new TranscodeQueue(this);
+    connect(d->transcodes, &TranscodeQueue::transcoded, this, &Recorder::archived);
+
+    qRegisterMetaType<adc::Recorder::Command>("adc::Recorder::Command");
+    d->worker = new QThread(this);
+    d->workerContext = new QObject;
+    d->workerContext->moveToThread(d->worker);
+    // both run on the worker thread itself
+    connect(d->worker, &QThread::started, []{
+        CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+    });
+    connect(d->worker, &QThread::finished, [this]{
+        delete d->workerContext;
+        d->workerContext = nullptr;
+        CoUninitialize();
+    });
+    d->worker->start();
 }
 
 
 Recorder::~Recorder() {
 
-    this->stop();
+    this->stop().wait();
+    // a spool left to drain still hands its recording to the finalizer
+    delete d->spool;
+    d->spool = nullptr;
+    delete d->thumbnails;
+    d->thumbnails = nullptr;
+    d->finalizer->shutdown();
+    d->finalizer->wait();
+    // unfinished uploads are picked up by resumeUploads()
+    d->uploader->shutdown();
+    d->uploader->wait();
+    d->transcodes->shutdown();
+    d->transcodes->wait();
+    d->replay->shutdown();
+    d->replay->wait();
+    d->worker->quit();
+    d->worker->wait();
+    this->releaseEncoders();
     delete d;
 }
 
 bool Recorder::init(){
-    if(d->opened){
-        return false;
+    QMutexLocker locker(&d->mutex);
+    return this->prepareLocked();
+}
+
+void Recorder::prepare(){
+    if (d->armed || d->running || d->preparing.exchange(true)) {
+        return;
     }
-    avformat_alloc_output_context2(&d->fmtCtx, nullptr, nullptr, d->filename.toUtf8().data());
-    if (!d->fmtCtx) return false;
-    if (!(d->fmtCtx->oformat->flags & AVFMT_NOFILE)) {
-        if (avio_open(&d->fmtCtx->pb, d->filename.toUtf8().constData(), AVIO_FLAG_WRITE) < 0) {
-            qDebug()<<"Could not open output file: " + d->filename;
-            return false;
+    QMetaObject::invokeMethod(d->workerContext, [this]{
+        bool ok;
+        {
+            QMutexLocker locker(&d->mutex);
+            ok = d->running || this->prepareLocked();
         }
-    }
+        d->preparing = false;
+        emit prepared(ok);
+    }, Qt::QueuedConnection);
+}
+
+bool Recorder::isArmed() const{
+    return d->armed;
+}
 
-    connect(d->video, &QThread::finished, this, &Recorder::writeTrailer);
-    if(!d->video->init()){
+bool Recorder::prepareLocked(){
+    if (d->armed) {
+        return true;
+    }
+    // encoders are opened before the output exists, the container type
+    // is known from the configured file name
+    d->globalHeader = this->needsGlobalHeader();
+    if (!d->video->prepare()) {
+        return false;
+    }
+    if (!d->vencCtx && !this->initVideo()) {
+        this->releaseEncoders();
         return false;
     }
+    if (d->audio) {
+        if (!d->audio->init()) {
+            this->releaseEncoders();
+            return false;
+        }
+        if (!d->aencCtx && !this->initAudio()) {
+            this->releaseEncoders();
+            return false;
+        }
+    }
+    d->armed = true;
+    d->stale = false;
+    return true;
+}
 
+bool Recorder::needsGlobalHeader() const{
+    QByteArray name = d->filename.isEmpty() ? QByteArray("output.mp4") : d->filename.toUtf8();
+    const AVOutputFormat* format = av_guess_format(nullptr, name.constData(), nullptr);
+    return !format || (format->flags & AVFMT_GLOBALHEADER);
+}
 
+void Recorder::invalidateLocked(){
+    d->generation += 1;
+    if (d->running) {
+        d->stale = true;
+        return;
+    }
+    this->releaseEncoders();
+}
 
+bool Recorder::openOutput(){
+    for (PacketSink* sink : d->sinks) {
+        sink->begin(d->vencCtx, d->aencCtx);
+    }
+    if (d->filename.isEmpty()) {
+        // replay buffer / streams only
+        d->opened = true;
+        return true;
+    }
+    const bool segmented = d->segmentSeconds > 0 || d->segmentBytes > 0;
+    QString path = segmented ? SegmentWriter::segmentPath(d->filename, 1) : d->filename;
+    if (!d->parts.isEmpty()) {
+        path = d->parts.last();
+    }
+    avformat_alloc_output_context2(&d->fmtCtx, nullptr, nullptr, path.toUtf8().data());
+    if (!d->fmtCtx) return false;
 
-    auto ret = this->initVideo();
-    if (!ret) {
+    d->videoStream = avformat_new_stream(d->fmtCtx, nullptr);
+    if (!d->videoStream || avcodec_parameters_from_context(d->videoStream->codecpar, d->vencCtx) < 0) {
+        qWarning() << "Failed to create video stream";
         return false;
     }
-
-
-    if(d->audio){
-        if(!d->audio->init()){
+    d->videoStream->time_base = d->vencCtx->time_base;
+    if (d->aencCtx) {
+        d->audioStream = avformat_new_stream(d->fmtCtx, nullptr);
+        if (!d->audioStream || avcodec_parameters_from_context(d->audioStream->codecpar, d->aencCtx) < 0) {
+            qWarning() << "Failed to create audio stream";
             return false;
         }
+        d->audioStream->time_base = AVRational{ 1, d->aencCtx->sample_rate };
+    }
+    if (d->lowLatency) {
+        d->fmtCtx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+    }
+    AVDictionary* opts = nullptr;
+    const QByteArray format = d->fmtCtx->oformat->name;
+    const bool isoMedia = format == "mp4" || format == "mov";
+    if (d->fragmentSeconds > 0) {
+        // every fragment carries its own moof, nothing is left for the
+        // trailer that playback depends on
+        if (isoMedia) {
+            av_dict_set(&opts, "movflags", d->frameIndex && d->indexSidx
+                                               ? "+frag_keyframe+empty_moov+default_base_moof+global_sidx"
+                                               : "+frag_keyframe+empty_moov+default_base_moof", 0);
+            av_dict_set_int(&opts, "frag_duration", int64_t(d->fragmentSeconds) * 1000000, 0);
+        } else if (format == "matroska") {
+            av_dict_set_int(&opts, "cluster_time_limit", int64_t(d->fragmentSeconds) * 1000, 0);
+        }
+        d->fmtCtx->flush_packets = 1;
+    } else if (d->faststart && isoMedia && d->fileOptions.key.isEmpty() && !segmented) {
+        // not for segments: their trailers are written on the writer thread
+        // while recording, rewriting each one would stall the encoder
+        av_dict_set(&opts, "movflags", "+faststart", 0);
+    }
 
-        ret = this->initAudio();
-        if (!ret) {
+    if (!(d->fmtCtx->oformat->flags & AVFMT_NOFILE)) {
+        if (AsyncFile::open(d->fmtCtx, path, d->fileOptions) < 0) {
+            qDebug()<<"Could not open output file: " + path;
+            av_dict_free(&opts);
             return false;
         }
     }
 
+    if (segmented) {
+        auto writer = new SegmentWriter;
+        writer->setFilename(d->filename);
+        writer->setLimits(d->segmentSeconds, d->segmentBytes);
+        writer->setRetention(d->retainBytes, d->retainSegments);
+        writer->setMuxerOptions(opts);
+        writer->setFileOptions(d->fileOptions);
+        writer->setKeyframeRequester([this]{
+            d->keyframes.request(KeyframeScheduler::Segment);
+        });
+        connect(writer, &SegmentWriter::segmentClosed, d->uploader, &Uploader::add, Qt::DirectConnection);
+        d->writer = writer;
+    } else {
+        d->writer = new PacketWriter;
+        // fragments are final once written, they go up while recording
+        if (d->fragmentSeconds > 0) {
+            d->uploader->follow(path);
+        }
+    }
+    connect(d->writer, &PacketWriter::error, this, &Recorder::errorOccurred);
 
-    if (avformat_write_header(d->fmtCtx, nullptr) < 0) {
+    auto ret = avformat_write_header(d->fmtCtx, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
         qWarning() << "Error occurred when writing header";
         return false;
     }
 
+    if (d->journaled && !segmented && d->fragmentSeconds <= 0 && d->fileOptions.key.isEmpty() &&
+        RecoveryJournal::isSupported(d->fmtCtx)) {
+        auto journal = new RecoveryJournal;
+        if (journal->open(RecoveryJournal::pathFor(path), d->fmtCtx)) {
+            d->writer->setJournal(journal);
+        } else {
+            delete journal;
+        }
+    }
+    if (d->frameIndex && !segmented && d->fileOptions.key.isEmpty() && d->parts.isEmpty()) {
+        auto index = new FrameIndexWriter;
+        if (index->open(FrameIndexWriter::pathFor(path), d->fmtCtx)) {
+            index->setRelocated(d->faststart && isoMedia && d->fragmentSeconds <= 0);
+            d->writer->setIndex(index, RecoveryJournal::isSupported(d->fmtCtx) && d->fragmentSeconds <= 0);
+        } else {
+            delete index;
+        }
+    }
+    d->writer->begin(d->fmtCtx, !d->lowLatency);
+
+    const QFileInfo info(d->filename);
+    for (const OutputTarget& target : d->targets) {
+        const QDir dir(target.directory.isEmpty() ? info.absolutePath() : target.directory);
+        const QString filename = dir.filePath(QString("%1.%2").arg(info.completeBaseName(), target.extension));
+        if (QFileInfo(filename).absoluteFilePath() == info.absoluteFilePath()) {
+            continue;
+        }
+        auto output = new FileSink(filename);
+        output->setFileOptions(d->fileOptions);
+        connect(output, &FileSink::error, this, &Recorder::errorOccurred);
+        output->begin(d->vencCtx, d->aencCtx);
+        d->outputs.append(output);
+        d->sinks.append(output);
+    }
     d->opened = true;
     return true;
 }
 
 bool Recorder::initVideo() {
-    const AVCodec* vcodec = avcodec_find_encoder(AV_CODEC_ID_H264);
-    if (!vcodec) { qWarning("No H264 encoder"); return false; }
-
-    d->videoStream = avformat_new_stream(d->fmtCtx, nullptr);
-    if (!d->videoStream) {
-        qWarning() << "Failed to create new stream";
-        return false;
+    const AVCodec* vcodec = avcodec_find_encoder_by_name(d->encoderName.toUtf8().constData());
+    if (!vcodec) {
+        qWarning() << "No encoder" << d->encoderName << ", falling back to H264";
+        vcodec = avcodec_find_encoder(AV_CODEC_ID_H264);
     }
+    if (!vcodec) { qWarning("No H264 encoder"); return false; }
 
     d->vencCtx = avcodec_alloc_context3(vcodec);
     if (!d->vencCtx) {
@@ -144,6 +470,7 @@ bool Recorder::initVideo() {
         return false;
     }
 
+    d->resolution = d->requestedResolution;
     if(d->resolution.width()==0 || d->resolution.height()==0){
         d->resolution = d->video->currentResolution();
     }
@@ -153,24 +480,45 @@ bool Recorder::initVideo() {
     d->vencCtx->time_base = AVRational{ 1, d->fps };
     d->vencCtx->framerate = AVRational{ d->fps, 1 };
     d->vencCtx->pix_fmt = AV_PIX_FMT_YUV420P;
-    d->vencCtx->gop_size = 12;
+    d->vencCtx->gop_size = d->fps * d->keyframeSeconds;
     d->vencCtx->max_b_frames = 2;
 
     av_opt_set(d->vencCtx->priv_data, "preset", "veryfast", 0);
-    if (d->fmtCtx->oformat->flags & AVFMT_GLOBALHEADER)
+    if (d->globalHeader)
         d->vencCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
-    if (avcodec_open2(d->vencCtx, vcodec, nullptr) < 0) {
+    // the class from the previous recording is the best guess until the
+    // first GOP of this one has been analyzed
+    d->classifier.reset();
+    if (d->parts.size() > 1) {
+        d->content = d->partContent;
+    } else {
+        d->content = d->contentHint != ContentClassifier::Unknown ? d->contentHint : d->classifier.content();
+        d->partContent = d->content;
+    }
+    AVDictionary* opts = nullptr;
+    EncoderTuning::applyContent(d->vencCtx, &opts, d->content);
+    EncoderTuning::applyForcedIdr(d->vencCtx, &opts);
+    d->keyframes.setInterval(d->vencCtx->gop_size);
+    d->keyframes.setMinDistance(std::max(1, d->fps / 2));
+    d->keyframes.setIntraRefresh(d->intraRefresh);
+    if (d->lowLatency) {
+        EncoderTuning::applyLowLatency(d->vencCtx, &opts, d->intraRefresh);
+    }
+    auto plan = EncoderTuning::planThreading(vcodec->name, d->resolution.width(), d->resolution.height(),
+                                             d->fps, QThread::idealThreadCount(), d->lowLatency);
+    EncoderTuning::applyThreading(d->vencCtx, &opts, plan);
+    auto ret = avcodec_open2(d->vencCtx, vcodec, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
         qWarning("Open vcodec failed"); return false;
     }
+    d->videoPts = 0;
+    d->videoFramesSent = d->videoPacketsOut = 0;
 
-    if (avcodec_parameters_from_context(d->videoStream->codecpar, d->vencCtx) < 0) {
-        qWarning() << "Failed to copy codec params to stream";
-        return false;
+    if (d->sws) {
+        sws_freeContext(d->sws);
     }
-
-    d->videoStream->time_base = d->vencCtx->time_base;
-
     d->sws = sws_getContext(d->resolution.width(), d->resolution.height(), AV_PIX_FMT_BGRA,
         d->resolution.width(), d->resolution.height(), AV_PIX_FMT_YUV420P,
         SWS_BILINEAR, nullptr, nullptr, nullptr);
@@ -182,7 +530,6 @@ bool Recorder::initAudio() {
     // AUDIO encoder (AAC)
     const AVCodec* acodec = avcodec_find_encoder(AV_CODEC_ID_AAC);
     if (!acodec) { qWarning("No AAC encoder"); return false; }
-    d->audioStream = avformat_new_stream(d->fmtCtx, nullptr);
 
     int channels = 2;
     int sampleRate = 48000;
@@ -193,17 +540,14 @@ bool Recorder::initAudio() {
     d->aencCtx->time_base = AVRational{ 1, d->aencCtx->sample_rate };
 
 
-    if (d->fmtCtx->oformat->flags & AVFMT_GLOBALHEADER) d->aencCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (d->globalHeader) d->aencCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     if (avcodec_open2(d->aencCtx, acodec, nullptr) < 0) {
         qWarning("Open acodec failed"); return false;
     }
-    avcodec_parameters_from_context(d->audioStream->codecpar, d->aencCtx);
-    d->audioStream->time_base = AVRational{ 1, d->aencCtx->sample_rate };
-
-
-    avcodec_parameters_from_context(d->audioStream->codecpar, d->aencCtx);
-
+    d->audioPts = 0;
 
+    av_frame_free(&d->audioFrame);
+    swr_free(&d->swr);
     d->audioFrame = av_frame_alloc();
 
     d->audioFrame->format = d->aencCtx->sample_fmt;
@@ -223,26 +567,185 @@ bool Recorder::initAudio() {
     return true;
 }
 
-bool Recorder::start(){
-    if(!d->opened){
-        auto ret = this->init();
-        if(!ret){
+std::future<bool> Recorder::post(Command command, std::function<bool()> apply){
+    auto promise = std::make_shared<std::promise<bool>>();
+    auto future = promise->get_future();
+    QMetaObject::invokeMethod(d->workerContext, [this, command, apply, promise]{
+        bool ok = apply();
+        promise->set_value(ok);
+        emit commandFinished(command, ok);
+    }, Qt::QueuedConnection);
+    return future;
+}
+
+void Recorder::configure(std::function<void()> apply){
+    // the worker holds the mutex while it prepares, a GUI thread setter
+    // would wait for the encoders to open
+    if (QThread::currentThread() == d->worker) {
+        QMutexLocker locker(&d->mutex);
+        apply();
+        return;
+    }
+    QMetaObject::invokeMethod(d->workerContext, [this, apply]{
+        QMutexLocker locker(&d->mutex);
+        apply();
+    }, Qt::QueuedConnection);
+}
+
+std::future<bool> Recorder::start(){
+    return this->post(Start, [this]{ return this->startNow(); });
+}
+
+std::future<bool> Recorder::start(const QString& output,const QSize size,int fps){
+    // settings are applied on the worker so the caller never waits on the mutex
+    return this->post(Start, [=]{
+        this->setOutput(output);
+        this->setResolution(size);
+        this->setFps(fps);
+        return this->startNow();
+    });
+}
+
+std::future<bool> Recorder::stop(){
+    return this->post(Stop, [this]{ return this->stopNow(); });
+}
+
+std::future<bool> Recorder::pause(){
+    return this->post(Pause, [this]{ return this->pauseNow(); });
+}
+
+std::future<bool> Recorder::resume(){
+    return this->post(Resume, [this]{ return this->resumeNow(); });
+}
+
+bool Recorder::isRunning() const{
+    return d->running;
+}
+
+bool Recorder::isPaused() const{
+    return d->paused;
+}
+
+bool Recorder::startNow(){
+    {
+        // waits for a preparation still running in the background
+        QMutexLocker locker(&d->mutex);
+        if (d->running || d->opened) {
+            return false;
+        }
+        if (d->armed && d->globalHeader != this->needsGlobalHeader()) {
+            this->releaseEncoders();
+        }
+        if(!this->prepareLocked()){
             qDebug()<<"recorder init failed";
             return false;
         }
+        d->parts.clear();
+        if (d->pauseSegments && !d->filename.isEmpty() && d->segmentSeconds <= 0 && d->segmentBytes <= 0 &&
+            d->fragmentSeconds <= 0 && d->fileOptions.key.isEmpty() && d->targets.isEmpty() &&
+            d->spoolDirectory.isEmpty() && d->queueMemory <= 0) {
+            d->parts.append(PartJoiner::partPath(d->filename, 1));
+        }
+        if(!this->openOutput()){
+            qDebug()<<"open output failed";
+            this->closeOutput();
+            return false;
+        }
+        d->videoBase = d->videoPts;
+        d->audioBase = d->audioPts;
+        d->classifier.reset();
+        d->keyframes.reset();
+        d->sourceSize = QSize();
+        d->latency = EncodeLatency();
+        d->latencyWindowMax = 0;
+        d->fileOptions.metrics->reset();
+        d->encodedPts = d->videoPts - 1;
+
+        // the previous recording's sheets are saved by now or never will be
+        delete d->thumbnails;
+        d->thumbnails = nullptr;
+        d->thumbnailFrames = 0;
+        d->thumbnailEvery = int64_t(d->thumbnailSeconds) * d->fps;
+        d->thumbnailFps = d->fps;
+        if (d->thumbnailSeconds > 0 && !d->filename.isEmpty()) {
+            d->thumbnails = new ThumbnailWriter;
+            d->thumbnails->setOutput(d->filename);
+            d->thumbnails->setWidth(d->thumbnailWidth);
+            d->thumbnails->setFormat(d->thumbnailFormat);
+            d->thumbnails->setInterval(d->thumbnailSeconds);
+            d->thumbnails->start(QThread::LowPriority);
+        }
+
+        // the previous spool has written its trailer, opened says so
+        delete d->spool;
+        d->spool = nullptr;
+        // a spool directory sends everything through the file, the overflow
+        // queue only what does not fit in memory
+        const bool spooled = !d->spoolDirectory.isEmpty();
+        if (spooled || d->queueMemory > 0) {
+            QString name = QFileInfo(d->filename).completeBaseName();
+            if (name.isEmpty()) {
+                name = "capture";
+            }
+            QString directory = spooled ? d->spoolDirectory : d->spillDirectory;
+            if (directory.isEmpty()) {
+                directory = QDir::tempPath();
+            }
+            d->spool = new FrameSpool;
+            if (d->spool->open(QDir(directory).filePath(name + ".spool"), spooled ? d->spoolBytes : d->spillBytes,
+                               spooled ? d->spoolCompress : true, !spooled)) {
+                d->spool->setDeferred(spooled && d->spoolDeferred);
+                d->spool->setMemoryBudget(d->queueMemory);
+                d->spool->setConsumer([this](AVFrame* frame, FrameSpool::Kind kind, int requests){
+                    this->encodeSpooled(frame, kind, requests);
+                });
+                d->spool->setFinished([this]{
+                    this->writeTrailer();
+                });
+                d->spooling = true;
+            } else {
+                qWarning() << "spool unavailable, encoding live";
+                delete d->spool;
+                d->spool = nullptr;
+            }
+        }
     }
+    // archiving yields the CPU to the recording until its trailer is written
+    d->transcodes->setSuspended(true);
     auto ret = d->video->startRecording();
     if(!ret){
         qDebug()<<"video start failed";
+        d->transcodes->setSuspended(false);
+        d->spooling = false;
+        QMutexLocker locker(&d->mutex);
+        this->closeOutput();
+        this->releaseEncoders();
+        if (d->thumbnails) {
+            d->thumbnails->finish(0);
+        }
         return false;
     }
     if(d->audio){
         ret = d->audio->startRecording();
         if(!ret){
             qDebug()<<"audio start failed";
+            d->video->stopRecording();
+            d->video->wait();
+            // what was spooled is encoded before the trailer
+            if (d->spooling.exchange(false)) {
+                d->spool->start(d->spoolDirectory.isEmpty() ? QThread::NormalPriority : QThread::LowPriority);
+                d->spool->finish();
+                return false;
+            }
+            this->writeTrailer();
+            this->joinParts();
             return false;
         }
     }
+    if (d->spooling) {
+        // the overflow queue is the live encoder, the spool catches up later
+        d->spool->start(d->spoolDirectory.isEmpty() ? QThread::NormalPriority : QThread::LowPriority);
+    }
 
     d->startTimeUs = this->nowUs();
     d->totalPauseUs = 0;
@@ -252,92 +755,361 @@ bool Recorder::start(){
     return true;
 }
 
-bool Recorder::start(const QString& output,const QSize size,int fps){
-    this->setOutput(output);
-    this->setResolution(size);
-    this->setFps(fps);
-    return this->start();
-}
-
-
-void Recorder::stop(){
+bool Recorder::stopNow(){
     if(!d->running){
-        return ;
+        return false;
     }
     d->video->stopRecording();
     if(d->audio)
         d->audio->stopRecording();
-    if (d->video->isRunning()) {
-        d->video->quit();
-        if (d->video->wait(1000)) {
-            d->video->terminate();
-            d->video->wait();
-        }
-    }
+    // the capture loops exit after the frame in hand, draining the
+    // encoders and writing the trailer is left to the finalizer
+    d->video->wait();
     if(d->audio)
-        if (d->audio->isRunning()) {
-            d->audio->quit();
-            if (d->audio->wait(1000)) {
-                d->audio->terminate();
-                d->audio->wait();
-            }
-        }
+        d->audio->wait();
     d->running = false;
+    d->paused = false;
 
-    //this->cleanup();
-
+    if (d->spooling.exchange(false)) {
+        // the spool thread writes the trailer once it has caught up
+        d->spool->finish();
+        return true;
+    }
+    this->writeTrailer();
+    this->joinParts();
+    return true;
 }
 
 
 
-void Recorder::pause() {
-    if (!d->paused) {
-        d->pauseStartUs = nowUs();
-        d->paused = true;
-        d->video->pause();
-        if(d->audio){
-            d->audio->pause();
-        }
+bool Recorder::pauseNow() {
+    // the capture loops pick the flag up before their next frame
+    if (!d->running || d->paused) {
+        return false;
     }
+    d->pauseStartUs = nowUs();
+    d->paused = true;
+    d->video->pause();
+    if(d->audio){
+        d->audio->pause();
+    }
+    if (!d->parts.isEmpty()) {
+        // the part goes to the finalizer with its encoders, a frame still
+        // in flight finds the output closed
+        this->writeTrailer();
+    }
+    return true;
 }
 
-void Recorder::resume() {
-    if (d->paused) {
-        d->totalPauseUs += nowUs() - d->pauseStartUs;
-        d->paused = false;
-        d->video->resume();
-        if(d->audio){
-            d->audio->resume();
+bool Recorder::resumeNow() {
+    if (!d->running || !d->paused) {
+        return false;
+    }
+    if (!d->parts.isEmpty()) {
+        // fresh encoders start the next part on an IDR frame, at zero
+        QMutexLocker locker(&d->mutex);
+        d->parts.append(PartJoiner::partPath(d->filename, d->parts.size() + 1));
+        if (!this->prepareLocked() || !this->openOutput()) {
+            qWarning() << "Could not open" << d->parts.last();
+            this->closeOutput();
+            d->parts.removeLast();
+            return false;
         }
+        d->videoBase = d->videoPts;
+        d->audioBase = d->audioPts;
+        d->encodedPts = d->videoPts - 1;
+        d->transcodes->setSuspended(true);
+    }
+    d->totalPauseUs += nowUs() - d->pauseStartUs;
+    d->keyframes.request(KeyframeScheduler::Resume);
+    d->paused = false;
+    d->video->resume();
+    if(d->audio){
+        d->audio->resume();
     }
+    return true;
 }
 
 void Recorder::setFps(int fps){
-    d->fps = fps;
-    if(d->video){
-        d->video->setFps(fps);
-    }
+    this->configure([this, fps]{
+        if (fps == d->fps) {
+            return;
+        }
+        this->invalidateLocked();
+        d->fps = fps;
+        if(d->video){
+            d->video->setFps(fps);
+        }
+    });
 }
 
 void Recorder::setResolution(const QSize& size){
-    d->resolution = size;
+    this->configure([this, size]{
+        if (size == d->requestedResolution) {
+            return;
+        }
+        this->invalidateLocked();
+        d->requestedResolution = size;
+    });
 }
 
 void Recorder::setOutput(const QString& filename){
     d->filename = filename;
 }
 
-void Recorder::setTargetWindow(WId id){
-    d->target = id;
-    if(d->video){
-        if(id==0){
-            d->video->setMode(VideoCapture::Screen);
-            d->video->setScreen(VideoCapture::availableMonitors()[0]);
-        }else{
-            d->video->setMode(VideoCapture::Window);
-            d->video->setWindow((HWND)id);
+void Recorder::setFaststart(bool enable){
+    d->faststart = enable;
+}
+
+void Recorder::setRecoveryJournal(bool enable){
+    d->journaled = enable;
+}
+
+void Recorder::setFrameIndex(bool enable, bool sidx){
+    d->frameIndex = enable;
+    d->indexSidx = sidx;
+}
+
+void Recorder::setWriteBehind(int64_t queueBytes, int64_t preallocateBytes){
+    d->fileOptions.maxQueuedBytes = std::max<int64_t>(1, queueBytes);
+    d->fileOptions.preallocateBytes = std::max<int64_t>(0, preallocateBytes);
+    d->replay->setFileOptions(d->fileOptions);
+}
+
+void Recorder::setSyncPolicy(AsyncFile::Sync policy, int intervalMs){
+    d->fileOptions.sync = policy;
+    d->fileOptions.syncIntervalMs = std::max(1, intervalMs);
+    d->replay->setFileOptions(d->fileOptions);
+}
+
+bool Recorder::setEncryptionKey(const QByteArray& key){
+    if (!key.isEmpty()) {
+        ChunkCipher cipher;
+        if (!cipher.setKey(key)) {
+            qWarning() << "Encryption needs a 32 byte key and Windows CNG";
+            return false;
         }
     }
+    d->fileOptions.key = key;
+    d->replay->setFileOptions(d->fileOptions);
+    return true;
+}
+
+WriteStats Recorder::writeStats() const{
+    return d->fileOptions.metrics->stats();
+}
+
+void Recorder::setFragmentDuration(int seconds){
+    d->fragmentSeconds = std::max(0, seconds);
+}
+
+void Recorder::setSegmentation(int seconds, int64_t maxBytes){
+    d->segmentSeconds = std::max(0, seconds);
+    d->segmentBytes = std::max<int64_t>(0, maxBytes);
+}
+
+void Recorder::setReplayBuffer(int seconds, int64_t maxBytes){
+    d->replay->setLimits(seconds, maxBytes);
+}
+
+bool Recorder::saveReplay(const QString& filename){
+    return d->replay->save(filename);
+}
+
+void Recorder::addStream(const QString& url, int maxDelayMs){
+    auto sink = new StreamSink(url, this);
+    sink->setMaxDelay(maxDelayMs);
+    sink->setKeyframeRequester([this]{
+        d->keyframes.request(KeyframeScheduler::Congestion);
+    });
+    this->attachStream(sink);
+}
+
+void Recorder::addPackaging(const QString& manifest, int segmentMs, int chunkMs, int window){
+    auto sink = new PackagingSink(manifest, this);
+    sink->setSegmentDuration(segmentMs);
+    sink->setChunkDuration(chunkMs);
+    sink->setWindow(window);
+    sink->setKeyframeRequester([this]{
+        d->keyframes.request(KeyframeScheduler::Segment);
+    });
+    this->attachStream(sink);
+}
+
+void Recorder::attachStream(StreamSink* sink){
+    connect(sink, &StreamSink::error, this, &Recorder::errorOccurred);
+    QMutexLocker locker(&d->mutex);
+    d->streams.append(sink);
+    d->sinks.append(sink);
+    if (d->opened) {
+        // joins a running recording at its next keyframe
+        sink->begin(d->vencCtx, d->aencCtx);
+        d->keyframes.request(KeyframeScheduler::Marker);
+    }
+}
+
+void Recorder::addOutput(const QString& extension, const QString& directory){
+    QMutexLocker locker(&d->mutex);
+    d->targets.append(OutputTarget{ extension, directory });
+}
+
+void Recorder::clearOutputs(){
+    QMutexLocker locker(&d->mutex);
+    d->targets.clear();
+}
+
+void Recorder::clearStreams(){
+    QList<StreamSink*> streams;
+    {
+        QMutexLocker locker(&d->mutex);
+        streams.swap(d->streams);
+        for (StreamSink* sink : streams) {
+            d->sinks.removeOne(sink);
+        }
+    }
+    qDeleteAll(streams);
+}
+
+QStringList Recorder::streams() const{
+    QMutexLocker locker(&d->mutex);
+    QStringList urls;
+    for (StreamSink* sink : d->streams) {
+        urls << sink->url();
+    }
+    return urls;
+}
+
+void Recorder::setRetention(int64_t maxBytes, int maxSegments){
+    d->retainBytes = std::max<int64_t>(0, maxBytes);
+    d->retainSegments = std::max(0, maxSegments);
+}
+
+int Recorder::finalizing() const{
+    return d->finalizer->pending();
+}
+
+void Recorder::setUpload(const S3Config& config){
+    d->uploader->setConfig(config);
+}
+
+int Recorder::resumeUploads(const QString& directory){
+    return d->uploader->resume(directory);
+}
+
+int Recorder::uploading() const{
+    return d->uploader->pending();
+}
+
+void Recorder::setSpool(const QString& directory, int64_t maxBytes, bool compress, bool deferred){
+    QMutexLocker locker(&d->mutex);
+    d->spoolDirectory = directory;
+    d->spoolBytes = maxBytes;
+    d->spoolCompress = compress;
+    d->spoolDeferred = deferred;
+}
+
+void Recorder::setPauseSegments(bool enable){
+    QMutexLocker locker(&d->mutex);
+    d->pauseSegments = enable;
+}
+
+void Recorder::setThumbnails(int intervalSeconds, int width, const QString& format){
+    QMutexLocker locker(&d->mutex);
+    d->thumbnailSeconds = std::max(0, intervalSeconds);
+    d->thumbnailWidth = width;
+    d->thumbnailFormat = format;
+}
+
+void Recorder::setOverflowQueue(int64_t memoryBytes, int64_t spillBytes, const QString& directory){
+    QMutexLocker locker(&d->mutex);
+    d->queueMemory = std::max<int64_t>(0, memoryBytes);
+    d->spillBytes = spillBytes;
+    d->spillDirectory = directory;
+}
+
+SpoolStats Recorder::spoolStats() const{
+    QMutexLocker locker(&d->mutex);
+    return d->spool ? d->spool->stats() : SpoolStats();
+}
+
+void Recorder::setArchiving(bool enable, const TranscodeProfile& profile){
+    d->archiving = enable;
+    d->transcodes->setProfile(profile);
+}
+
+int Recorder::resumeArchiving(const QString& directory){
+    return d->transcodes->resume(directory);
+}
+
+int Recorder::archiving() const{
+    return d->transcodes->pending();
+}
+
+void Recorder::setVideoEncoder(const QString& name){
+    QMutexLocker locker(&d->mutex);
+    if (name == d->encoderName) {
+        return;
+    }
+    this->invalidateLocked();
+    d->encoderName = name;
+}
+
+void Recorder::setContentHint(ContentClassifier::Content content){
+    QMutexLocker locker(&d->mutex);
+    if (content == d->contentHint) {
+        return;
+    }
+    this->invalidateLocked();
+    d->contentHint = content;
+}
+
+void Recorder::setLowLatency(bool enable, bool intraRefresh){
+    QMutexLocker locker(&d->mutex);
+    intraRefresh = enable && intraRefresh;
+    if (enable == d->lowLatency && intraRefresh == d->intraRefresh) {
+        return;
+    }
+    this->invalidateLocked();
+    d->lowLatency = enable;
+    d->intraRefresh = intraRefresh;
+}
+
+EncodeLatency Recorder::encodeLatency() const{
+    QMutexLocker locker(&d->mutex);
+    return d->latency;
+}
+
+void Recorder::setKeyframeInterval(int seconds){
+    QMutexLocker locker(&d->mutex);
+    seconds = std::max(1, seconds);
+    if (seconds == d->keyframeSeconds) {
+        return;
+    }
+    this->invalidateLocked();
+    d->keyframeSeconds = seconds;
+}
+
+void Recorder::requestKeyframe(){
+    d->keyframes.request(KeyframeScheduler::Marker);
+}
+
+void Recorder::setTargetWindow(WId id){
+    this->configure([this, id]{
+        if (id == d->target) {
+            return;
+        }
+        this->invalidateLocked();
+        d->target = id;
+        if(d->video){
+            if(id==0){
+                d->video->setMode(VideoCapture::Screen);
+                d->video->setScreen(VideoCapture::availableMonitors()[0]);
+            }else{
+                d->video->setMode(VideoCapture::Window);
+                d->video->setWindow((HWND)id);
+            }
+        }
+    });
 }
 
 int Recorder::mode(){
@@ -349,7 +1121,18 @@ int Recorder::mode(){
 
 
 void Recorder::pushVideoFrame(const QImage& image){
-    QMutexLocker locker(&d->mutex);
+    const int64_t arrivalUs = this->nowUs();
+    QMutexLocker locker(d->spooling ? &d->captureMutex : &d->mutex);
+    // paused between two parts
+    if (!d->opened) {
+        return;
+    }
+    if (image.size() != d->sourceSize) {
+        if (d->sourceSize.isValid()) {
+            d->keyframes.request(KeyframeScheduler::Resize);
+        }
+        d->sourceSize = image.size();
+    }
     QImage src = image;
     if (src.format() != QImage::Format_ARGB32 && src.format() != QImage::Format_RGBA8888)
         src = src.convertToFormat(QImage::Format_ARGB32);
@@ -385,8 +1168,15 @@ void Recorder::pushVideoFrame(const QImage& image){
     //yuvFrame->pts = av_rescale_q(tsUs, AVRational{ 1, 1000000 }, d->videoStream->time_base);
     yuvFrame->pts = d->videoPts++;
 
-    //qDebug()<<"write video frame";
-    int ret = this->writeFrame(yuvFrame,d->videoStream,d->vencCtx);
+    if (d->spooling) {
+        // the capture-side keyframe reasons are replayed when it is encoded
+        const int requests = d->keyframes.take(KeyframeScheduler::Resume | KeyframeScheduler::Resize |
+                                               KeyframeScheduler::Marker);
+        d->spool->push(yuvFrame, FrameSpool::Video, requests);
+    } else {
+        //qDebug()<<"write video frame";
+        this->encodeVideo(yuvFrame, arrivalUs);
+    }
 
     av_freep(&srcFrame->data[0]);
     av_frame_free(&srcFrame);
@@ -395,7 +1185,10 @@ void Recorder::pushVideoFrame(const QImage& image){
 
 
 void Recorder::pushAudioFrame(const uint8_t* pcm, int bytes, int sampleRate, int channels){
-    QMutexLocker locker(&d->mutex);
+    QMutexLocker locker(d->spooling ? &d->captureMutex : &d->mutex);
+    if (!d->opened) {
+        return;
+    }
     //qDebug() << "pushAudioFrame";
     if(d->audioFrame==nullptr){
         d->srcSampleRate = sampleRate;
@@ -445,16 +1238,69 @@ void Recorder::pushAudioFrame(const uint8_t* pcm, int bytes, int sampleRate, int
     d->audioFrame->pts = d->audioPts;
     d->audioPts += ret;
 
+    if (d->spooling) {
+        d->spool->push(d->audioFrame, FrameSpool::Audio);
+        return;
+    }
     this->writeFrame(d->audioFrame, d->audioStream, d->aencCtx);
 
     //qDebug() << "write audio frame";
 }
 
+void Recorder::adaptContent(){
+    auto content = d->classifier.commit();
+    if (d->contentHint != ContentClassifier::Unknown || content == d->content) {
+        return;
+    }
+    if (EncoderTuning::reconfigureContent(d->vencCtx, content)) {
+        d->content = content;
+    }
+}
+
+void Recorder::encodeVideo(AVFrame* frame, int64_t arrivalUs){
+    d->classifier.analyze(frame);
+    const int reasons = d->keyframes.next(d->classifier.frameMotion());
+    // intra refresh replaces the periodic IDR frame, the interval only ends a
+    // refresh period; a recycled encoder does not start the file on an IDR
+    // frame by itself
+    if ((reasons != KeyframeScheduler::None && !(d->intraRefresh && reasons == KeyframeScheduler::Interval)) ||
+        frame->pts == d->videoBase) {
+        frame->pict_type = AV_PICTURE_TYPE_I;
+    }
+    if (reasons != KeyframeScheduler::None) {
+        this->adaptContent();
+    }
+    d->encodedPts = frame->pts;
+    d->arrivalUs[frame->pts % kLatencySlots] = arrivalUs;
+    if (d->thumbnails) {
+        // counted rather than taken from pts, which restarts with each part
+        if (d->thumbnailFrames % d->thumbnailEvery == 0) {
+            d->thumbnails->sample(frame, double(d->thumbnailFrames) / d->thumbnailFps);
+        }
+        d->thumbnailFrames += 1;
+    }
+    this->writeFrame(frame, d->videoStream, d->vencCtx);
+}
+
+void Recorder::encodeSpooled(AVFrame* frame, FrameSpool::Kind kind, int requests){
+    // spool thread; latency is counted from here, not from the capture
+    QMutexLocker locker(&d->mutex);
+    if (kind == FrameSpool::Audio) {
+        this->writeFrame(frame, d->audioStream, d->aencCtx);
+        return;
+    }
+    if (requests != 0) {
+        d->keyframes.request(KeyframeScheduler::Reason(requests));
+    }
+    this->encodeVideo(frame, this->nowUs());
+}
 
 bool Recorder::writeFrame(AVFrame *frame, AVStream *stream, AVCodecContext *codecContext){
     int ret = avcodec_send_frame(codecContext, frame);
     if (ret < 0) {
         qWarning() << "Error sending frame to encoder" << ret;
+    } else if (codecContext == d->vencCtx) {
+        d->videoFramesSent += 1;
     }
 
     AVPacket *pkt = av_packet_alloc();
@@ -466,12 +1312,26 @@ bool Recorder::writeFrame(AVFrame *frame, AVStream *stream, AVCodecContext *code
             qWarning() << "Error during encoding" << ret;
             break;
         }
+        if (codecContext == d->vencCtx) {
+            d->videoPacketsOut += 1;
+            this->recordLatency(pkt->pts);
+        }
+        // the sinks share the packet buffer, timestamps stay in the encoder time base
+        const PacketSink::Stream kind = codecContext == d->vencCtx ? PacketSink::Video : PacketSink::Audio;
+        for (PacketSink* sink : d->sinks) {
+            sink->push(pkt, kind);
+        }
+        if (!d->writer) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        this->rebase(pkt, codecContext);
        // qDebug() << "output:" << codecContext->time_base.num << codecContext->time_base.den<<d->videoFrame->time_base.num<<d->videoFrame->time_base.den;
         //qDebug() << "time base" << stream->time_base.num << stream->time_base.den << stream->index;
         av_packet_rescale_ts(pkt, codecContext->time_base, stream->time_base);
         pkt->stream_index = stream->index;
-        av_interleaved_write_frame(d->fmtCtx, pkt);
-        av_packet_unref(pkt);
+        // low latency skips the interleaving queue, each stream is already in dts order
+        d->writer->push(pkt);
     }
     av_packet_free(&pkt);
 
@@ -480,39 +1340,117 @@ bool Recorder::writeFrame(AVFrame *frame, AVStream *stream, AVCodecContext *code
 }
 
 
+void Recorder::recordLatency(int64_t pts){
+    // pts counts frames, so the slot is still valid unless the encoder
+    // holds more than kLatencySlots frames
+    if (pts == AV_NOPTS_VALUE || pts < 0 || d->encodedPts - pts >= kLatencySlots) {
+        return;
+    }
+    double ms = (this->nowUs() - d->arrivalUs[pts % kLatencySlots]) / 1000.0;
+    auto& latency = d->latency;
+    latency.lastMs = ms;
+    latency.frames += 1;
+    latency.averageMs += (ms - latency.averageMs) / latency.frames;
+    latency.maxMs = std::max(latency.maxMs, ms);
+    d->latencyWindowMax = std::max(d->latencyWindowMax, ms);
+    if (latency.frames % d->fps == 0) {
+        emit encodeLatencyReport(latency.averageMs, d->latencyWindowMax);
+        d->latencyWindowMax = 0;
+    }
+}
+
+void Recorder::rebase(AVPacket* pkt, AVCodecContext* codecContext){
+    int64_t base = codecContext == d->vencCtx ? d->videoBase : d->audioBase;
+    if (pkt->pts != AV_NOPTS_VALUE) pkt->pts -= base;
+    if (pkt->dts != AV_NOPTS_VALUE) pkt->dts -= base;
+}
+
 void Recorder::writeTrailer() {
-    if (d->vencCtx) {
-        avcodec_send_frame(d->vencCtx, nullptr);
-        AVPacket* packet = av_packet_alloc();
-        while (true) {
-            int ret = avcodec_receive_packet(d->vencCtx, packet);
-            if (ret == AVERROR_EOF) {
-                break;
-            }
-            else if (ret < 0 && ret != AVERROR(EAGAIN)) {
-                qWarning() << "Error receiving final video packets:" << ret;
-                break;
-            }
-            else if (ret >= 0) {
-                av_packet_rescale_ts(packet, d->vencCtx->time_base, d->videoStream->time_base);
-                packet->stream_index = d->videoStream->index;
-
-                if (av_interleaved_write_frame(d->fmtCtx, packet) < 0) {
-                    qWarning() << "Error writing final video packet";
-                }
-                av_packet_unref(packet);
-            }
+    // hands the muxer and the encoders over to the finalizer; a new
+    // recording can start while it drains them
+    OutputSession* session = nullptr;
+    bool recyclable = false;
+    {
+        QMutexLocker locker(&d->mutex);
+        if (!d->opened) {
+            return;
         }
-    }
+        // the tee outputs still get the packets drained by the finalizer
+        for (FileSink* output : d->outputs) {
+            d->sinks.removeOne(output);
+        }
+        for (PacketSink* sink : d->sinks) {
+            sink->end();
+        }
+        session = new OutputSession;
+        session->outputs.swap(d->outputs);
+        session->filename = qobject_cast<SegmentWriter*>(d->writer) ? SegmentWriter::indexPath(d->filename) : d->filename;
+        if (!d->parts.isEmpty()) {
+            session->filename = d->parts.last();
+            session->part = true;
+        }
+        session->fmtCtx = d->fmtCtx;
+        // keeps running, the finalizer pushes the drained packets through it
+        session->writer = d->writer;
+        session->videoStream = d->videoStream;
+        session->audioStream = d->audioStream;
+        session->vencCtx = d->vencCtx;
+        session->aencCtx = d->aencCtx;
+        session->videoBase = d->videoBase;
+        session->audioBase = d->audioBase;
+        session->videoPts = d->videoPts;
+        session->audioPts = d->audioPts;
+        session->pendingFrames = d->videoFramesSent - d->videoPacketsOut;
+        session->generation = d->generation;
+        // the video encoder alone is worth keeping; AAC cannot be flushed
+        // and is reopened next to it
+        recyclable = !d->stale && this->isRecyclable(session->vencCtx);
 
-    // Write trailer
-    if (d->fmtCtx && d->fmtCtx->pb) {
-        av_write_trailer(d->fmtCtx);
+        d->fmtCtx = nullptr;
+        d->writer = nullptr;
+        d->videoStream = d->audioStream = nullptr;
+        d->vencCtx = d->aencCtx = nullptr;
+        d->opened = false;
+        d->armed = false;
+        d->stale = false;
+        // a part closed by pause is not the end of the track
+        if (d->thumbnails && !d->running) {
+            d->thumbnails->finish(double(d->thumbnailFrames) / d->thumbnailFps);
+        }
+    }
+    d->finalizer->submit(session);
+    d->transcodes->setSuspended(false);
+    if (!recyclable) {
+        // fresh encoders for the next recording, in the background
+        this->prepare();
     }
-    this->cleanup();
+}
 
-    emit openOutput(d->filename);
+void Recorder::joinParts(){
+    // queued behind the last part, reported as the recording
+    OutputSession* session = nullptr;
+    {
+        QMutexLocker locker(&d->mutex);
+        if (d->parts.isEmpty()) {
+            return;
+        }
+        session = new OutputSession;
+        session->filename = d->filename;
+        session->parts.swap(d->parts);
+    }
+    d->finalizer->submit(session);
+}
 
+void Recorder::onFinalized(const QString& path, bool ok) {
+    if (ok && !path.isEmpty()) {
+        emit openOutput(path);
+    }
+    // a segmented recording finalizes its index
+    if (ok && d->archiving && d->fileOptions.key.isEmpty() && !path.endsWith(".segments") && QFileInfo::exists(path)) {
+        d->transcodes->add(path);
+    }
+    // picks up the recycled encoders and a new capture session
+    this->prepare();
 }
 
 QImage Recorder::scaleToSizeWithBlackBorder(const QImage& src, const QSize& size){
@@ -538,7 +1476,66 @@ QString Recorder::windowTitle() const{
     return d->video->windowTitle();
 }
 
-void Recorder::cleanup(){
+void Recorder::closeOutput(){
+    for (FileSink* output : d->outputs) {
+        d->sinks.removeOne(output);
+    }
+    qDeleteAll(d->outputs);
+    d->outputs.clear();
+    delete d->writer;
+    d->writer = nullptr;
+    if (!d->filename.isEmpty()) {
+        QFile::remove(RecoveryJournal::pathFor(d->filename));
+    }
+    if (d->fmtCtx) {
+        AsyncFile::close(d->fmtCtx);
+        avformat_free_context(d->fmtCtx);
+        d->fmtCtx = nullptr;
+    }
+    d->videoStream = nullptr;
+    d->audioStream = nullptr;
+    d->opened = false;
+}
+
+bool Recorder::isRecyclable(AVCodecContext* ctx) const{
+    return ctx && (ctx->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH);
+}
+
+void Recorder::recycleEncoders(OutputSession& session){
+    // finalizer thread: drained encoders that support flushing start over
+    // without a reopen, unless a newer recording already opened its own.
+    // Video and audio are taken on their own, what is left is freed by the
+    // finalizer and reopened by prepare()
+    {
+        QMutexLocker locker(&d->mutex);
+        if (d->vencCtx || d->aencCtx || d->running || session.generation != d->generation || !d->sws) {
+            return;
+        }
+        if (this->isRecyclable(session.vencCtx)) {
+            avcodec_flush_buffers(session.vencCtx);
+            d->vencCtx = session.vencCtx;
+            session.vencCtx = nullptr;
+            d->videoPts = session.videoPts;
+            d->videoFramesSent = d->videoPacketsOut = 0;
+        }
+        if (this->isRecyclable(session.aencCtx)) {
+            avcodec_flush_buffers(session.aencCtx);
+            d->aencCtx = session.aencCtx;
+            session.aencCtx = nullptr;
+            d->audioPts = session.audioPts;
+            if (d->swr) {
+                swr_init(d->swr);
+            }
+        }
+    }
+    this->prepare();
+}
+
+void Recorder::releaseEncoders(){
+    d->armed = false;
+    if (d->audioFrame) {
+        av_frame_free(&d->audioFrame);
+    }
     if (d->sws) {
         sws_freeContext(d->sws);
         d->sws = nullptr;
@@ -555,13 +1552,6 @@ void Recorder::cleanup(){
         avcodec_free_context(&d->aencCtx);
         d->aencCtx = nullptr;
     }
-    if (d->fmtCtx) {
-        if (d->fmtCtx->pb) {
-            avio_closep(&d->fmtCtx->pb);
-        }
-        avformat_free_context(d->fmtCtx);
-        d->fmtCtx = nullptr;
-    }
 }
 
 }
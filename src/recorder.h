@@ -3,6 +3,14 @@
 
 #include <QObject>
 #include <QIcon>
+#include <QStringList>
+#include <future>
+#include <functional>
+#include "content_classifier.h"
+#include "async_file.h"
+#include "s3_client.h"
+#include "frame_spool.h"
+#include "transcoder.h"
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -17,25 +25,160 @@ extern "C" {
 
 namespace adc{
 
+// capture-to-packet latency of the video encoder
+struct EncodeLatency{
+    double lastMs = 0;
+    double averageMs = 0;
+    double maxMs = 0;
+    int64_t frames = 0;
+};
+
 class RecorderPrivate;
+struct OutputSession;
+class StreamSink;
 class Recorder : public QObject
 {
     Q_OBJECT
 public:
+    enum Command{
+        Start,
+        Stop,
+        Pause,
+        Resume
+    };
+    Q_ENUM(Command)
+
     explicit Recorder(QObject *parent = nullptr);
     ~Recorder();
+    //synchronous prepare()
     bool init();
-    bool start();
-    bool start(const QString& output,const QSize size,int fps);
-    void stop();
+    //opens encoders and the capture session in the background so that
+    //start() only has to open the output
+    void prepare();
+    bool isArmed() const;
+    //control commands are queued on the worker thread and applied between
+    //frames; the future and commandFinished() carry the result
+    std::future<bool> start();
+    std::future<bool> start(const QString& output,const QSize size,int fps);
+    std::future<bool> stop();
 
-    void pause();
-    void resume();
+    std::future<bool> pause();
+    std::future<bool> resume();
+    bool isRunning() const;
+    bool isPaused() const;
 
+    //fps, resolution and target window are applied on the worker, in order
+    //with the queued commands; they never wait for a preparation
     void setFps(int fps);
     void setResolution(const QSize& size);
+    //an empty name records into the replay buffer only
     void setOutput(const QString& filename);
+    //moves the moov atom to the front while finalizing (mp4/mov)
+    void setFaststart(bool enable);
+    //file output is written behind by its own thread: up to queueBytes wait
+    //in memory for a slow disk, files grow in preallocateBytes steps
+    void setWriteBehind(int64_t queueBytes, int64_t preallocateBytes = 0);
+    //plain mp4/mov: <file>.journal lists where every sample went, so a file
+    //left without its index by a crash can be rebuilt (RecoveryJournal::recover).
+    //Off by default: samples are then written in arrival order, not interleaved
+    void setRecoveryJournal(bool enable);
+    //<file>.index: timestamps, flags and, for plain mp4/mov, byte offsets of
+    //every packet, laid out for memory mapping (FrameIndex); sidx also
+    //writes a global sidx box into fragmented mp4. Not for segmented,
+    //encrypted or paused-in-parts recordings; applies on start()
+    void setFrameIndex(bool enable, bool sidx = false);
+    void setSyncPolicy(AsyncFile::Sync policy, int intervalMs = 1000);
+    //32 byte AES-256 key: files, segments, tee outputs and replays are written
+    //AES-GCM encrypted (EncryptedFile::decrypt), an empty key turns it off;
+    //faststart and the recovery journal do not apply
+    bool setEncryptionKey(const QByteArray& key);
+    //write latency and queue depth of the current recording's files
+    WriteStats writeStats() const;
+    //crash-safe output: fragmented mp4 or mkv clusters every few seconds,
+    //0 writes the index only at the end; faststart does not apply
+    void setFragmentDuration(int seconds);
+    //dashcam mode: <name>_00001.<ext>, ... cut on keyframes once either limit
+    //is reached (0 = none), indexed in <name>.segments; segments are written
+    //without faststart. Applies on start()
+    void setSegmentation(int seconds, int64_t maxBytes = 0);
+    //oldest segments are deleted past either budget, 0 keeps everything
+    void setRetention(int64_t maxBytes, int maxSegments = 0);
+    //keeps the last seconds of encoded packets in memory, 0 disables;
+    //whole GOPs are dropped, so the window is rounded to the keyframe interval
+    void setReplayBuffer(int seconds, int64_t maxBytes = 0);
+    //writes the buffered window in the background, see replaySaved()
+    bool saveReplay(const QString& filename);
+    //live output next to the file from the same encoder: rtmp:// (flv),
+    //srt:// or udp:// (mpegts); past maxDelayMs of backlog the stream
+    //drops to the next keyframe, the file is never held up
+    void addStream(const QString& url, int maxDelayMs = 2000);
+    //live HLS + DASH (CMAF) for a static web server: <dir>/<name>.mpd and
+    //<name>.m3u8 with segments next to them; chunkMs > 0 writes segments as
+    //CMAF chunks for low-latency DASH and LHLS prefetch hints (not LL-HLS
+    //parts), window is the number of segments kept
+    void addPackaging(const QString& manifest, int segmentMs = 4000, int chunkMs = 0, int window = 6);
+    void clearStreams();
+    //tee: the same packets also go into <name>.<extension> ("mkv", "nut", ...)
+    //in directory or next to the recording, each on its own writer thread;
+    //an output that fails or stalls is closed alone; applies on start()
+    void addOutput(const QString& extension, const QString& directory = QString());
+    void clearOutputs();
+    QStringList streams() const;
+    //recordings still being finalized in the background
+    int finalizing() const;
+    //uploads to S3-compatible storage while recording: segments as they are
+    //closed, fragmented files as they grow, others once finalized; an
+    //invalid config turns it off
+    void setUpload(const S3Config& config);
+    //continues the uploads a previous run left in directory
+    int resumeUploads(const QString& directory);
+    int uploading() const;
+    //weak machines: captured frames go converted, optionally LZ4 compressed,
+    //into <directory>/<name>.spool (at most maxBytes, frames past it are
+    //dropped) and are encoded from there at low priority, or only once
+    //stopped or the spool fills up when deferred; the output is the same.
+    //stop() returns at once, start() is refused until the spool has drained.
+    //An empty directory turns it off; applies on start()
+    void setSpool(const QString& directory, int64_t maxBytes = 8LL << 30, bool compress = false, bool deferred = false);
+    //capture hands its frames to the encoder through a queue instead of
+    //waiting for it: up to memoryBytes in memory, past that they spill LZ4
+    //compressed into a spool file in directory (the temp dir if empty), so
+    //short encoder stalls cost no frames; the file is created on the first
+    //spill. 0 turns it off. Applies on start()
+    void setOverflowQueue(int64_t memoryBytes, int64_t spillBytes = 4LL << 30, const QString& directory = QString());
+    //pause closes the file at a keyframe and frees the encoders, resume
+    //opens <name>_part002.<ext>, ...; once stopped the parts are joined
+    //without re-encoding into the output (PartJoiner); streams and the
+    //replay buffer start over with each part. Plain files only: not
+    //segmented, fragmented, encrypted, teed or spooled; applies on start()
+    void setPauseSegments(bool enable);
+    //queue / spool depth, spills and their duration
+    SpoolStats spoolStats() const;
+    //every intervalSeconds a frame already converted for the encoder is
+    //shrunk to width and packed into <name>_sprites_001.<format> ("jpg" or
+    //"webp") sheets, <name>_thumbnails.vtt points into them once stopped
+    //(ThumbnailWriter); 0 turns it off. Applies on start()
+    void setThumbnails(int intervalSeconds, int width = 160, const QString& format = "jpg");
+    //re-encodes finished recordings with a slower preset or another codec
+    //at idle priority, paused while a recording runs; jobs left by a
+    //restart continue with resumeArchiving(). Encrypted and segmented
+    //recordings are not archived
+    void setArchiving(bool enable, const TranscodeProfile& profile = TranscodeProfile());
+    int resumeArchiving(const QString& directory);
+    int archiving() const;
     void setTargetWindow(WId id);
+    void setVideoEncoder(const QString& name);
+    //Unknown lets the classifier pick the content class
+    void setContentHint(ContentClassifier::Content content);
+    //live streaming: no B-frames / lookahead, slice threads, packets flushed as they come.
+    //intraRefresh drops the periodic and scene cut IDR frames; resume, markers,
+    //segment cuts and congestion recovery still force one, with its bitrate spike
+    void setLowLatency(bool enable, bool intraRefresh = false);
+    EncodeLatency encodeLatency() const;
+    //longest distance between keyframes; scene cuts, resume and markers add more
+    void setKeyframeInterval(int seconds);
+    //forces an IDR frame on the next captured frame
+    void requestKeyframe();
 
     int mode();
 
@@ -50,17 +193,48 @@ public:
 signals:
     void errorOccurred(const QString& message);
     void openOutput(const QString& path);
+    void encodeLatencyReport(double averageMs, double maxMs);
+    void prepared(bool ok);
+    void commandFinished(adc::Recorder::Command command, bool ok);
+    void finalizeProgress(const QString& path, int percent);
+    void replaySaved(const QString& path, bool ok);
+    void uploaded(const QString& path, bool ok);
+    void archived(const QString& path, const QString& output, bool ok);
 
 
 public slots:
     void writeTrailer();
 
+private slots:
+    void onFinalized(const QString& path, bool ok);
+
 private:
+    std::future<bool> post(Command command, std::function<bool()> apply);
+    // runs apply under the mutex on the worker, without waiting for it
+    void configure(std::function<void()> apply);
+    bool startNow();
+    bool stopNow();
+    bool pauseNow();
+    bool resumeNow();
+    void joinParts();
+    bool prepareLocked();
+    bool needsGlobalHeader() const;
+    void invalidateLocked();
+    bool openOutput();
+    void closeOutput();
+    void attachStream(StreamSink* sink);
+    bool isRecyclable(AVCodecContext* ctx) const;
+    void recycleEncoders(OutputSession& session);
+    void releaseEncoders();
     bool initVideo();
     bool initAudio();
+    void adaptContent();
+    void encodeVideo(AVFrame* frame, int64_t arrivalUs);
+    void encodeSpooled(AVFrame* frame, FrameSpool::Kind kind, int requests);
+    void recordLatency(int64_t pts);
     bool writeFrame(AVFrame *frame, AVStream *stream, AVCodecContext *codecContext);
+    void rebase(AVPacket* pkt, AVCodecContext* codecContext);
     QImage scaleToSizeWithBlackBorder(const QImage& src, const QSize& size);
-    void cleanup();
 
     int64_t currentTimestampUs();
     int64_t currentVideoTimestampUs();
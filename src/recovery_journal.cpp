@@ -0,0 +1,217 @@
+#include "recovery_journal.h"
+#include <QByteArray>
+#include <QVector>
+#include <QDebug>
+#include <cstring>
+
+namespace adc{
+
+namespace {
+constexpr quint32 kMagic = 0x4a524341; // "ACRJ"
+constexpr quint32 kVersion = 1;
+// records between flushes; the journal only has to survive the process
+constexpr int kFlushRecords = 32;
+
+// mov stores H.264/HEVC samples with 4 byte lengths; with Annex B extradata
+// a new muxer expects start codes, which take the same 4 bytes
+bool needsStartCodes(const AVCodecParameters* par){
+    if (par->codec_id != AV_CODEC_ID_H264 && par->codec_id != AV_CODEC_ID_HEVC) {
+        return false;
+    }
+    const uint8_t* data = par->extradata;
+    return par->extradata_size >= 4 && data[0] == 0 && data[1] == 0 &&
+           (data[2] == 1 || (data[2] == 0 && data[3] == 1));
+}
+
+void toStartCodes(uint8_t* data, int size){
+    int pos = 0;
+    while (pos + 4 <= size) {
+        const uint32_t length = (uint32_t(data[pos]) << 24) | (uint32_t(data[pos + 1]) << 16) |
+                                (uint32_t(data[pos + 2]) << 8) | uint32_t(data[pos + 3]);
+        if (length > uint32_t(size - pos - 4)) {
+            break;
+        }
+        data[pos] = data[pos + 1] = data[pos + 2] = 0;
+        data[pos + 3] = 1;
+        pos += 4 + int(length);
+    }
+}
+}
+
+RecoveryJournal::~RecoveryJournal(){
+    this->close();
+}
+
+QString RecoveryJournal::pathFor(const QString& filename){
+    return filename + ".journal";
+}
+
+bool RecoveryJournal::isSupported(const AVFormatContext* fmtCtx){
+    const QByteArray format = fmtCtx->oformat->name;
+    return (format == "mp4" || format == "mov") && fmtCtx->pb;
+}
+
+bool RecoveryJournal::open(const QString& path, const AVFormatContext* fmtCtx){
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Could not open recovery journal" << path;
+        return false;
+    }
+    m_stream.setDevice(&m_file);
+    m_stream.setByteOrder(QDataStream::LittleEndian);
+    m_stream << kMagic << kVersion << QByteArray(fmtCtx->oformat->name) << quint32(fmtCtx->nb_streams);
+    for (unsigned i = 0; i < fmtCtx->nb_streams; ++i) {
+        const AVStream* stream = fmtCtx->streams[i];
+        const AVCodecParameters* par = stream->codecpar;
+        m_stream << qint32(par->codec_type) << qint32(par->codec_id) << quint32(par->codec_tag)
+                 << qint32(par->format) << qint64(par->bit_rate)
+                 << qint32(par->width) << qint32(par->height)
+                 << qint32(par->sample_aspect_ratio.num) << qint32(par->sample_aspect_ratio.den)
+                 << qint32(par->sample_rate) << qint32(par->ch_layout.nb_channels) << qint32(par->frame_size)
+                 << qint32(stream->time_base.num) << qint32(stream->time_base.den)
+                 << QByteArray(reinterpret_cast<const char*>(par->extradata), par->extradata_size);
+    }
+    m_file.flush();
+    m_unflushed = 0;
+    return m_stream.status() == QDataStream::Ok;
+}
+
+void RecoveryJournal::record(int stream, int flags, int64_t pts, int64_t dts, int64_t duration,
+                             int64_t offset, int64_t size){
+    if (!m_file.isOpen() || size <= 0) {
+        return;
+    }
+    m_stream << qint32(stream) << qint32(flags) << qint64(pts) << qint64(dts) << qint64(duration)
+             << qint64(offset) << qint64(size);
+    if (++m_unflushed >= kFlushRecords || (flags & AV_PKT_FLAG_KEY)) {
+        m_file.flush();
+        m_unflushed = 0;
+    }
+}
+
+void RecoveryJournal::close(){
+    if (m_file.isOpen()) {
+        m_file.close();
+    }
+}
+
+int RecoveryJournal::recover(const QString& journal, const QString& damaged, const QString& output){
+    QFile file(journal);
+    QFile media(damaged);
+    if (!file.open(QIODevice::ReadOnly) || !media.open(QIODevice::ReadOnly)) {
+        qWarning() << "Could not open" << journal << "or" << damaged;
+        return AVERROR(ENOENT);
+    }
+    QDataStream in(&file);
+    in.setByteOrder(QDataStream::LittleEndian);
+    quint32 magic = 0, version = 0, count = 0;
+    QByteArray format;
+    in >> magic >> version >> format >> count;
+    if (in.status() != QDataStream::Ok || magic != kMagic || version != kVersion || count == 0) {
+        qWarning() << "Not a recovery journal" << journal;
+        return AVERROR_INVALIDDATA;
+    }
+
+    const QByteArray path = output.toUtf8();
+    AVFormatContext* ctx = nullptr;
+    avformat_alloc_output_context2(&ctx, nullptr, nullptr, path.constData());
+    if (!ctx) {
+        avformat_alloc_output_context2(&ctx, nullptr, format.constData(), path.constData());
+    }
+    if (!ctx) {
+        return AVERROR_MUXER_NOT_FOUND;
+    }
+    QVector<AVRational> timeBases;
+    QVector<bool> startCodes;
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i) {
+        qint32 type, codec, pixelFormat, width, height, sarNum, sarDen, rate, channels, frameSize, num, den;
+        quint32 tag;
+        qint64 bitRate;
+        QByteArray extradata;
+        in >> type >> codec >> tag >> pixelFormat >> bitRate >> width >> height >> sarNum >> sarDen
+           >> rate >> channels >> frameSize >> num >> den >> extradata;
+        AVStream* stream = avformat_new_stream(ctx, nullptr);
+        if (!stream) {
+            avformat_free_context(ctx);
+            return AVERROR(ENOMEM);
+        }
+        AVCodecParameters* par = stream->codecpar;
+        par->codec_type = AVMediaType(type);
+        par->codec_id = AVCodecID(codec);
+        par->format = pixelFormat;
+        par->bit_rate = bitRate;
+        par->width = width;
+        par->height = height;
+        par->sample_aspect_ratio = AVRational{ sarNum, sarDen };
+        par->sample_rate = rate;
+        if (channels > 0) {
+            av_channel_layout_default(&par->ch_layout, channels);
+        }
+        par->frame_size = frameSize;
+        if (!extradata.isEmpty()) {
+            par->extradata = static_cast<uint8_t*>(av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+            memcpy(par->extradata, extradata.constData(), extradata.size());
+            par->extradata_size = extradata.size();
+        }
+        stream->time_base = AVRational{ num, den };
+        timeBases.append(stream->time_base);
+        startCodes.append(needsStartCodes(par));
+    }
+    if (in.status() != QDataStream::Ok) {
+        avformat_free_context(ctx);
+        return AVERROR_INVALIDDATA;
+    }
+    if (avio_open(&ctx->pb, path.constData(), AVIO_FLAG_WRITE) < 0) {
+        avformat_free_context(ctx);
+        return AVERROR(EIO);
+    }
+    int ret = avformat_write_header(ctx, nullptr);
+
+    // samples sit in mdat in the order they were journaled, so the file is
+    // read front to back once
+    const int64_t available = media.size();
+    int recovered = 0;
+    AVPacket* pkt = av_packet_alloc();
+    while (ret >= 0 && !in.atEnd()) {
+        qint32 index, flags;
+        qint64 pts, dts, duration, offset, size;
+        in >> index >> flags >> pts >> dts >> duration >> offset >> size;
+        if (in.status() != QDataStream::Ok) {
+            // torn last record
+            break;
+        }
+        if (index < 0 || index >= int(ctx->nb_streams) || size <= 0 || size > INT_MAX ||
+            offset < 0 || offset + size > available) {
+            // written past what reached the disk
+            break;
+        }
+        if (av_new_packet(pkt, int(size)) < 0 || !media.seek(offset) ||
+            media.read(reinterpret_cast<char*>(pkt->data), size) != size) {
+            av_packet_unref(pkt);
+            break;
+        }
+        if (startCodes[index]) {
+            toStartCodes(pkt->data, pkt->size);
+        }
+        pkt->stream_index = index;
+        pkt->flags = flags;
+        pkt->pts = pts;
+        pkt->dts = dts;
+        pkt->duration = duration;
+        av_packet_rescale_ts(pkt, timeBases[index], ctx->streams[index]->time_base);
+        ret = av_interleaved_write_frame(ctx, pkt);
+        recovered += ret >= 0 ? 1 : 0;
+    }
+    av_packet_free(&pkt);
+    if (ret >= 0) {
+        ret = av_write_trailer(ctx);
+    }
+    avio_closep(&ctx->pb);
+    avformat_free_context(ctx);
+    if (ret < 0) {
+        return ret;
+    }
+    return recovered;
+}
+
+}
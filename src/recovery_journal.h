@@ -0,0 +1,49 @@
+#ifndef RECOVERY_JOURNAL_H
+#define RECOVERY_JOURNAL_H
+
+#include <QString>
+#include <QFile>
+#include <QDataStream>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+namespace adc{
+
+// Sidecar of a plain (unfragmented) mp4/mov recording: the streams' codec
+// parameters, then offset, size and timestamps of every sample as it lands
+// in mdat. If the recorder dies before the trailer, recover() copies the
+// samples out of the orphaned mdat into a new file, without decoding, in a
+// single pass over the file. Removed once the trailer is written.
+class RecoveryJournal
+{
+public:
+    RecoveryJournal() = default;
+    ~RecoveryJournal();
+
+    // <recording>.journal
+    static QString pathFor(const QString& filename);
+    // only muxers that write samples in place as they come
+    static bool isSupported(const AVFormatContext* fmtCtx);
+
+    // after the header has been written
+    bool open(const QString& path, const AVFormatContext* fmtCtx);
+    // pkt as passed to av_write_frame(), data at [offset, offset + size)
+    void record(int stream, int flags, int64_t pts, int64_t dts, int64_t duration,
+                int64_t offset, int64_t size);
+    void close();
+
+    // rebuilds damaged into output, returns the number of packets recovered
+    // or a negative AVERROR
+    static int recover(const QString& journal, const QString& damaged, const QString& output);
+
+private:
+    QFile m_file;
+    QDataStream m_stream;
+    int m_unflushed = 0;
+};
+
+}
+
+#endif // RECOVERY_JOURNAL_H
@@ -0,0 +1,305 @@
+#include "replay_buffer.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QVector>
+#include <QDebug>
+#include <algorithm>
+
+namespace adc{
+
+namespace {
+struct Entry{
+    AVPacket* pkt = nullptr;
+    PacketSink::Stream stream = PacketSink::Video;
+};
+
+int64_t timestampUs(const AVPacket* pkt, AVRational timeBase){
+    const int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    return ts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : av_rescale_q(ts, timeBase, AV_TIME_BASE_Q);
+}
+}
+
+struct ReplaySnapshot{
+    QString filename;
+    AsyncFile::Options fileOptions;
+    AVCodecParameters* params[2] = {};
+    AVRational timeBases[2] = { { 1, 1 }, { 1, 1 } };
+    QVector<Entry> packets;
+
+    ~ReplaySnapshot(){
+        for (Entry& entry : packets) {
+            av_packet_free(&entry.pkt);
+        }
+        avcodec_parameters_free(&params[0]);
+        avcodec_parameters_free(&params[1]);
+    }
+};
+
+class ReplayBufferPrivate{
+public:
+    mutable QMutex mutex;
+    QWaitCondition wake;
+    QQueue<ReplaySnapshot*> jobs;
+    bool quit = false;
+
+    int seconds = 0;
+    int64_t maxBytes = 0;
+    AsyncFile::Options fileOptions;
+    AVCodecParameters* params[2] = {};
+    AVRational timeBases[2] = { { 1, 1 }, { 1, 1 } };
+
+    // always starts with a video keyframe
+    QQueue<Entry> packets;
+    int64_t bytes = 0;
+    int64_t firstUs = AV_NOPTS_VALUE;
+    int64_t lastUs = AV_NOPTS_VALUE;
+};
+
+ReplayBuffer::ReplayBuffer(QObject *parent)
+    : QThread{parent}
+{
+    d = new ReplayBufferPrivate;
+}
+
+ReplayBuffer::~ReplayBuffer(){
+    this->shutdown();
+    this->wait();
+    this->clear();
+    avcodec_parameters_free(&d->params[Video]);
+    avcodec_parameters_free(&d->params[Audio]);
+    delete d;
+}
+
+void ReplayBuffer::setLimits(int seconds, int64_t maxBytes){
+    QMutexLocker locker(&d->mutex);
+    d->seconds = std::max(0, seconds);
+    d->maxBytes = std::max<int64_t>(0, maxBytes);
+    this->evictLocked();
+}
+
+bool ReplayBuffer::isEnabled() const{
+    QMutexLocker locker(&d->mutex);
+    return d->seconds > 0;
+}
+
+void ReplayBuffer::setFileOptions(const AsyncFile::Options& options){
+    QMutexLocker locker(&d->mutex);
+    d->fileOptions = options;
+    // saves do not count towards the recording's write stats
+    d->fileOptions.metrics.reset();
+}
+
+void ReplayBuffer::begin(const AVCodecContext* video, const AVCodecContext* audio){
+    this->clear();
+    QMutexLocker locker(&d->mutex);
+    const AVCodecContext* contexts[2] = { video, audio };
+    for (int i = Video; i <= Audio; ++i) {
+        avcodec_parameters_free(&d->params[i]);
+        if (contexts[i]) {
+            d->params[i] = avcodec_parameters_alloc();
+            avcodec_parameters_from_context(d->params[i], contexts[i]);
+            d->timeBases[i] = contexts[i]->time_base;
+        }
+    }
+}
+
+void ReplayBuffer::push(const AVPacket* pkt, Stream stream){
+    QMutexLocker locker(&d->mutex);
+    if (d->seconds <= 0 || !d->params[stream]) {
+        return;
+    }
+    const bool key = stream == Video && (pkt->flags & AV_PKT_FLAG_KEY);
+    if (d->packets.isEmpty() && !key) {
+        return;
+    }
+    Entry entry;
+    entry.pkt = av_packet_clone(pkt);
+    entry.stream = stream;
+    if (!entry.pkt) {
+        return;
+    }
+    if (stream == Video) {
+        const int64_t us = timestampUs(pkt, d->timeBases[Video]);
+        if (d->packets.isEmpty()) {
+            d->firstUs = us;
+        }
+        d->lastUs = us;
+    }
+    d->bytes += pkt->size;
+    d->packets.enqueue(entry);
+    this->evictLocked();
+}
+
+void ReplayBuffer::evictLocked(){
+    auto exceeded = [this]{
+        const bool tooLong = d->firstUs != AV_NOPTS_VALUE && d->lastUs != AV_NOPTS_VALUE &&
+                             d->lastUs - d->firstUs > int64_t(d->seconds) * AV_TIME_BASE;
+        return tooLong || (d->maxBytes > 0 && d->bytes > d->maxBytes);
+    };
+    while (exceeded()) {
+        // drops the oldest GOP, the newest one is always kept
+        int next = -1;
+        for (int i = 1; i < d->packets.size(); ++i) {
+            const Entry& entry = d->packets.at(i);
+            if (entry.stream == Video && (entry.pkt->flags & AV_PKT_FLAG_KEY)) {
+                next = i;
+                break;
+            }
+        }
+        if (next < 0) {
+            break;
+        }
+        for (int i = 0; i < next; ++i) {
+            Entry entry = d->packets.dequeue();
+            d->bytes -= entry.pkt->size;
+            av_packet_free(&entry.pkt);
+        }
+        d->firstUs = timestampUs(d->packets.head().pkt, d->timeBases[Video]);
+    }
+}
+
+void ReplayBuffer::clear(){
+    QMutexLocker locker(&d->mutex);
+    while (!d->packets.isEmpty()) {
+        Entry entry = d->packets.dequeue();
+        av_packet_free(&entry.pkt);
+    }
+    d->bytes = 0;
+    d->firstUs = d->lastUs = AV_NOPTS_VALUE;
+}
+
+bool ReplayBuffer::save(const QString& filename){
+    auto snapshot = new ReplaySnapshot;
+    snapshot->filename = filename;
+    {
+        QMutexLocker locker(&d->mutex);
+        if (d->packets.isEmpty()) {
+            delete snapshot;
+            return false;
+        }
+        snapshot->fileOptions = d->fileOptions;
+        for (int i = Video; i <= Audio; ++i) {
+            if (d->params[i]) {
+                snapshot->params[i] = avcodec_parameters_alloc();
+                avcodec_parameters_copy(snapshot->params[i], d->params[i]);
+            }
+            snapshot->timeBases[i] = d->timeBases[i];
+        }
+        // new references to the same buffers
+        snapshot->packets.reserve(d->packets.size());
+        for (const Entry& entry : d->packets) {
+            Entry copy;
+            copy.pkt = av_packet_clone(entry.pkt);
+            copy.stream = entry.stream;
+            if (copy.pkt) {
+                snapshot->packets.append(copy);
+            }
+        }
+        d->jobs.enqueue(snapshot);
+        d->wake.wakeOne();
+    }
+    if (!this->isRunning()) {
+        this->start(QThread::LowPriority);
+    }
+    return true;
+}
+
+int64_t ReplayBuffer::bytes() const{
+    QMutexLocker locker(&d->mutex);
+    return d->bytes;
+}
+
+double ReplayBuffer::seconds() const{
+    QMutexLocker locker(&d->mutex);
+    if (d->firstUs == AV_NOPTS_VALUE || d->lastUs == AV_NOPTS_VALUE) {
+        return 0;
+    }
+    return (d->lastUs - d->firstUs) / double(AV_TIME_BASE);
+}
+
+void ReplayBuffer::shutdown(){
+    QMutexLocker locker(&d->mutex);
+    d->quit = true;
+    d->wake.wakeOne();
+}
+
+void ReplayBuffer::run(){
+    while (true) {
+        ReplaySnapshot* snapshot = nullptr;
+        {
+            QMutexLocker locker(&d->mutex);
+            while (d->jobs.isEmpty() && !d->quit) {
+                d->wake.wait(&d->mutex);
+            }
+            if (d->jobs.isEmpty()) {
+                return;
+            }
+            snapshot = d->jobs.dequeue();
+        }
+        bool ok = this->write(snapshot);
+        QString filename = snapshot->filename;
+        delete snapshot;
+        emit saved(filename, ok);
+    }
+}
+
+bool ReplayBuffer::write(ReplaySnapshot* snapshot){
+    const QByteArray path = snapshot->filename.toUtf8();
+    AVFormatContext* ctx = nullptr;
+    avformat_alloc_output_context2(&ctx, nullptr, nullptr, path.constData());
+    if (!ctx) {
+        qWarning() << "Unsupported replay container" << snapshot->filename;
+        return false;
+    }
+    AVStream* streams[2] = {};
+    for (int i = Video; i <= Audio; ++i) {
+        if (!snapshot->params[i]) {
+            continue;
+        }
+        streams[i] = avformat_new_stream(ctx, nullptr);
+        if (!streams[i] || avcodec_parameters_copy(streams[i]->codecpar, snapshot->params[i]) < 0) {
+            avformat_free_context(ctx);
+            return false;
+        }
+        streams[i]->time_base = snapshot->timeBases[i];
+    }
+    if (AsyncFile::open(ctx, snapshot->filename, snapshot->fileOptions) < 0) {
+        qWarning() << "Could not open replay output" << snapshot->filename;
+        avformat_free_context(ctx);
+        return false;
+    }
+    bool ok = avformat_write_header(ctx, nullptr) >= 0;
+
+    // the window starts at its first keyframe, audio from before is cut
+    const int64_t startUs = timestampUs(snapshot->packets.first().pkt, snapshot->timeBases[Video]);
+    for (int i = 0; ok && i < snapshot->packets.size(); ++i) {
+        Entry& entry = snapshot->packets[i];
+        AVStream* stream = streams[entry.stream];
+        const AVRational timeBase = snapshot->timeBases[entry.stream];
+        const int64_t offset = av_rescale_q(startUs, AV_TIME_BASE_Q, timeBase);
+        AVPacket* pkt = entry.pkt;
+        if (pkt->pts != AV_NOPTS_VALUE) pkt->pts -= offset;
+        if (pkt->dts != AV_NOPTS_VALUE) pkt->dts -= offset;
+        if (entry.stream == Audio && pkt->pts < 0) {
+            continue;
+        }
+        av_packet_rescale_ts(pkt, timeBase, stream->time_base);
+        pkt->stream_index = stream->index;
+        if (av_interleaved_write_frame(ctx, pkt) < 0) {
+            qWarning() << "Error writing replay packet";
+            ok = false;
+        }
+    }
+    if (ok && av_write_trailer(ctx) < 0) {
+        ok = false;
+    }
+    if (AsyncFile::close(ctx) < 0) {
+        ok = false;
+    }
+    avformat_free_context(ctx);
+    return ok;
+}
+
+}
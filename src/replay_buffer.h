@@ -0,0 +1,63 @@
+#ifndef REPLAY_BUFFER_H
+#define REPLAY_BUFFER_H
+
+#include <QThread>
+#include <QString>
+#include "packet_sink.h"
+#include "async_file.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+namespace adc{
+
+// Instant replay: keeps the last few seconds of encoded packets in memory.
+// Packets are shared references to the encoder output, nothing is copied
+// or re-encoded; whole GOPs are evicted from the front once the duration
+// or byte budget is exceeded. save() muxes the window on its own thread.
+class ReplayBufferPrivate;
+struct ReplaySnapshot;
+class ReplayBuffer : public QThread, public PacketSink
+{
+    Q_OBJECT
+public:
+    explicit ReplayBuffer(QObject *parent = nullptr);
+    ~ReplayBuffer();
+
+    // 0 seconds disables the buffer
+    void setLimits(int seconds, int64_t maxBytes);
+    bool isEnabled() const;
+    // how saved replays are written (encryption, sync)
+    void setFileOptions(const AsyncFile::Options& options);
+    // drops the buffered packets and takes the stream layout of the
+    // encoders the following packets come from
+    void begin(const AVCodecContext* video, const AVCodecContext* audio) override;
+    // adds a reference to pkt
+    void push(const AVPacket* pkt, Stream stream) override;
+    void clear();
+
+    // snapshot of the current window, written in the background
+    bool save(const QString& filename);
+    int64_t bytes() const;
+    double seconds() const;
+    void shutdown();
+
+signals:
+    void saved(const QString& filename, bool ok);
+
+protected:
+    void run() override;
+
+private:
+    void evictLocked();
+    bool write(ReplaySnapshot* snapshot);
+
+private:
+    ReplayBufferPrivate* d;
+};
+
+}
+
+#endif // REPLAY_BUFFER_H
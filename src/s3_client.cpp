@@ -0,0 +1,233 @@
+#include "s3_client.h"
+#include <QNetworkAccessManager>
+#include <QNetworkRequest>
+#include <QNetworkReply>
+#include <QMessageAuthenticationCode>
+#include <QCryptographicHash>
+#include <QXmlStreamReader>
+#include <QDateTime>
+#include <QEventLoop>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QDebug>
+#include <algorithm>
+
+namespace adc{
+
+namespace {
+QByteArray sha256Hex(const QByteArray& data){
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha256).toHex();
+}
+
+QByteArray hmac(const QByteArray& key, const QByteArray& message){
+    return QMessageAuthenticationCode::hash(message, key, QCryptographicHash::Sha256);
+}
+
+// text of the first element with that name
+QString xmlValue(const QByteArray& xml, const QString& name){
+    QXmlStreamReader reader(xml);
+    while (!reader.atEnd()) {
+        if (reader.readNext() == QXmlStreamReader::StartElement && reader.name() == name) {
+            return reader.readElementText();
+        }
+    }
+    return QString();
+}
+}
+
+S3Client::S3Client(const S3Config& config)
+    : m_config(config)
+{
+}
+
+S3Client::~S3Client(){
+    delete m_network;
+}
+
+void S3Client::setCancelFlag(const std::atomic<bool>* cancel){
+    m_cancel = cancel;
+}
+
+void S3Client::setTimeout(int ms){
+    m_timeoutMs = std::max(1000, ms);
+}
+
+int S3Client::status() const{
+    return m_status;
+}
+
+QString S3Client::errorString() const{
+    return m_error;
+}
+
+bool S3Client::retryable() const{
+    return m_retryable;
+}
+
+bool S3Client::createUpload(const QString& key, QString* uploadId){
+    QByteArray reply;
+    if (!this->send("POST", key, { { "uploads", QByteArray() } }, QByteArray(), &reply)) {
+        return false;
+    }
+    *uploadId = xmlValue(reply, "UploadId");
+    if (uploadId->isEmpty()) {
+        m_error = "no upload id in the reply";
+        m_retryable = false;
+        return false;
+    }
+    return true;
+}
+
+bool S3Client::uploadPart(const QString& key, const QString& uploadId, int number, const QByteArray& data, QString* etag){
+    QByteArray tag;
+    const Query query = { { "partNumber", QByteArray::number(number) }, { "uploadId", uploadId.toUtf8() } };
+    if (!this->send("PUT", key, query, data, nullptr, &tag)) {
+        return false;
+    }
+    *etag = QString::fromUtf8(tag);
+    return true;
+}
+
+bool S3Client::completeUpload(const QString& key, const QString& uploadId, const QStringList& etags){
+    QByteArray body = "<CompleteMultipartUpload>";
+    for (int i = 0; i < etags.size(); ++i) {
+        body += QString("<Part><PartNumber>%1</PartNumber><ETag>%2</ETag></Part>")
+                    .arg(i + 1).arg(etags[i].toHtmlEscaped()).toUtf8();
+    }
+    body += "</CompleteMultipartUpload>";
+    QByteArray reply;
+    if (!this->send("POST", key, { { "uploadId", uploadId.toUtf8() } }, body, &reply)) {
+        return false;
+    }
+    // a failed completion can still come back as 200
+    if (reply.contains("<Error>")) {
+        m_error = xmlValue(reply, "Message");
+        m_retryable = xmlValue(reply, "Code") == "InternalError";
+        return false;
+    }
+    return true;
+}
+
+bool S3Client::abortUpload(const QString& key, const QString& uploadId){
+    return this->send("DELETE", key, { { "uploadId", uploadId.toUtf8() } }, QByteArray());
+}
+
+bool S3Client::putObject(const QString& key, const QByteArray& data){
+    return this->send("PUT", key, Query(), data);
+}
+
+bool S3Client::headObject(const QString& key, int64_t* size){
+    return this->send("HEAD", key, Query(), QByteArray(), nullptr, nullptr, size);
+}
+
+bool S3Client::send(const QByteArray& method, const QString& key, const Query& query,
+                    const QByteArray& body, QByteArray* reply, QByteArray* etag, int64_t* length){
+    m_status = 0;
+    m_retryable = false;
+    m_error.clear();
+    if (!m_network) {
+        // belongs to the thread of the first call
+        m_network = new QNetworkAccessManager;
+    }
+
+    // path-style: /<bucket>/<key>, each byte encoded once
+    const QByteArray path = QUrl::toPercentEncoding(QString("/%1/%2").arg(m_config.bucket, key), "/");
+    Query sorted = query;
+    std::sort(sorted.begin(), sorted.end());
+    QByteArray canonicalQuery;
+    for (const auto& item : sorted) {
+        if (!canonicalQuery.isEmpty()) {
+            canonicalQuery += '&';
+        }
+        canonicalQuery += QUrl::toPercentEncoding(QString::fromUtf8(item.first)) + '=' +
+                          QUrl::toPercentEncoding(QString::fromUtf8(item.second));
+    }
+    const QUrl& endpoint = m_config.endpoint;
+    QByteArray host = endpoint.host().toUtf8();
+    const int defaultPort = endpoint.scheme() == "https" ? 443 : 80;
+    if (endpoint.port() != -1 && endpoint.port() != defaultPort) {
+        host += ':' + QByteArray::number(endpoint.port());
+    }
+    QByteArray encoded = endpoint.scheme().toUtf8() + "://" + host + path;
+    if (!canonicalQuery.isEmpty()) {
+        encoded += '?' + canonicalQuery;
+    }
+
+    const QByteArray amzDate = QDateTime::currentDateTimeUtc().toString("yyyyMMdd'T'HHmmss'Z'").toUtf8();
+    const QByteArray payloadHash = sha256Hex(body);
+    QNetworkRequest request(QUrl::fromEncoded(encoded, QUrl::StrictMode));
+    request.setRawHeader("x-amz-date", amzDate);
+    request.setRawHeader("x-amz-content-sha256", payloadHash);
+    request.setRawHeader("Authorization", this->authorization(method, path, canonicalQuery, host, payloadHash, amzDate));
+    if (!body.isEmpty()) {
+        request.setHeader(QNetworkRequest::ContentTypeHeader, "application/octet-stream");
+    }
+
+    QNetworkReply* response = m_network->sendCustomRequest(request, method, body);
+    QEventLoop loop;
+    QTimer poll;
+    QElapsedTimer elapsed;
+    elapsed.start();
+    bool timedOut = false;
+    QObject::connect(response, &QNetworkReply::finished, &loop, &QEventLoop::quit);
+    // progress resets the timeout, a stalled transfer is given up
+    QObject::connect(response, &QNetworkReply::uploadProgress, &loop, [&elapsed]{ elapsed.restart(); });
+    QObject::connect(response, &QNetworkReply::downloadProgress, &loop, [&elapsed]{ elapsed.restart(); });
+    QObject::connect(&poll, &QTimer::timeout, &loop, [&]{
+        if ((m_cancel && *m_cancel) || elapsed.elapsed() > m_timeoutMs) {
+            timedOut = elapsed.elapsed() > m_timeoutMs;
+            response->abort();
+        }
+    });
+    poll.start(100);
+    if (!response->isFinished()) {
+        loop.exec();
+    }
+    poll.stop();
+
+    m_status = response->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    const QByteArray data = response->readAll();
+    const bool ok = response->error() == QNetworkReply::NoError && m_status >= 200 && m_status < 300;
+    if (ok) {
+        if (reply) {
+            *reply = data;
+        }
+        if (etag) {
+            *etag = response->rawHeader("ETag");
+        }
+        if (length) {
+            *length = response->header(QNetworkRequest::ContentLengthHeader).toLongLong();
+        }
+    } else {
+        const bool cancelled = m_cancel && *m_cancel;
+        m_retryable = !cancelled && (m_status == 0 || timedOut || m_status == 408 || m_status == 429 || m_status >= 500);
+        const QString message = xmlValue(data, "Message");
+        m_error = QString("%1 %2: %3").arg(QString::fromUtf8(method), key,
+                                          message.isEmpty() ? response->errorString() : message);
+    }
+    response->deleteLater();
+    return ok;
+}
+
+QByteArray S3Client::authorization(const QByteArray& method, const QByteArray& path, const QByteArray& query,
+                                   const QByteArray& host, const QByteArray& payloadHash, const QByteArray& amzDate) const{
+    const QByteArray signedHeaders = "host;x-amz-content-sha256;x-amz-date";
+    const QByteArray canonical = method + '\n' + path + '\n' + query + '\n' +
+                                 "host:" + host + '\n' +
+                                 "x-amz-content-sha256:" + payloadHash + '\n' +
+                                 "x-amz-date:" + amzDate + '\n' + '\n' +
+                                 signedHeaders + '\n' + payloadHash;
+    const QByteArray date = amzDate.left(8);
+    const QByteArray region = m_config.region.toUtf8();
+    const QByteArray scope = date + '/' + region + "/s3/aws4_request";
+    const QByteArray toSign = "AWS4-HMAC-SHA256\n" + amzDate + '\n' + scope + '\n' + sha256Hex(canonical);
+
+    QByteArray key = hmac("AWS4" + m_config.secretKey.toUtf8(), date);
+    key = hmac(key, region);
+    key = hmac(key, "s3");
+    key = hmac(key, "aws4_request");
+    return "AWS4-HMAC-SHA256 Credential=" + m_config.accessKey.toUtf8() + '/' + scope +
+           ", SignedHeaders=" + signedHeaders + ", Signature=" + hmac(key, toSign).toHex();
+}
+
+}
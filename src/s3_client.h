@@ -0,0 +1,82 @@
+#ifndef S3_CLIENT_H
+#define S3_CLIENT_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QUrl>
+#include <QList>
+#include <QPair>
+#include <atomic>
+
+class QNetworkAccessManager;
+
+namespace adc{
+
+struct S3Config{
+    // http://127.0.0.1:9000 for a local MinIO, buckets are path-style
+    QUrl endpoint;
+    QString region = "us-east-1";
+    QString bucket;
+    QString accessKey;
+    QString secretKey;
+    // object key: prefix + file name
+    QString prefix;
+
+    bool isValid() const{
+        return endpoint.isValid() && !bucket.isEmpty() && !accessKey.isEmpty() && !secretKey.isEmpty();
+    }
+};
+
+// Blocking S3 multipart upload calls signed with AWS Signature V4. Each call
+// runs a local event loop on the calling thread, which is the uploader's
+// own; nothing here is shared between threads but the cancel flag.
+class S3Client
+{
+public:
+    explicit S3Client(const S3Config& config);
+    ~S3Client();
+    S3Client(const S3Client&) = delete;
+    S3Client& operator=(const S3Client&) = delete;
+
+    // set from another thread, ends the running call as failed
+    void setCancelFlag(const std::atomic<bool>* cancel);
+    void setTimeout(int ms);
+
+    bool createUpload(const QString& key, QString* uploadId);
+    // number starts at 1
+    bool uploadPart(const QString& key, const QString& uploadId, int number, const QByteArray& data, QString* etag);
+    bool completeUpload(const QString& key, const QString& uploadId, const QStringList& etags);
+    bool abortUpload(const QString& key, const QString& uploadId);
+    // single request for files smaller than one part
+    bool putObject(const QString& key, const QByteArray& data);
+    bool headObject(const QString& key, int64_t* size);
+
+    int status() const;
+    QString errorString() const;
+    // network errors, timeouts, 5xx and throttling; not cancellation
+    bool retryable() const;
+
+private:
+    // unencoded name / value pairs
+    using Query = QList<QPair<QByteArray, QByteArray>>;
+
+    bool send(const QByteArray& method, const QString& key, const Query& query,
+              const QByteArray& body, QByteArray* reply = nullptr, QByteArray* etag = nullptr,
+              int64_t* length = nullptr);
+    QByteArray authorization(const QByteArray& method, const QByteArray& path, const QByteArray& query,
+                             const QByteArray& host, const QByteArray& payloadHash, const QByteArray& amzDate) const;
+
+private:
+    S3Config m_config;
+    QNetworkAccessManager* m_network = nullptr;
+    const std::atomic<bool>* m_cancel = nullptr;
+    int m_timeoutMs = 60000;
+    int m_status = 0;
+    bool m_retryable = false;
+    QString m_error;
+};
+
+}
+
+#endif // S3_CLIENT_H
@@ -0,0 +1,302 @@
+#include "segment_writer.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QSaveFile>
+#include <QDateTime>
+#include <QList>
+#include <QVector>
+#include <QDebug>
+#include <algorithm>
+
+namespace adc{
+
+namespace {
+struct Segment{
+    int index = 0;
+    QString path;
+    // media time of the first keyframe, AV_TIME_BASE
+    int64_t startUs = 0;
+    int64_t endUs = 0;
+    int64_t bytes = 0;
+};
+}
+
+class SegmentWriterPrivate{
+public:
+    QString filename;
+    int limitSeconds = 0;
+    int64_t limitBytes = 0;
+    int64_t retainBytes = 0;
+    int retainSegments = 0;
+    AVDictionary* options = nullptr;
+    AsyncFile::Options fileOptions;
+    std::function<void()> requester;
+
+    // the context the recorder opened; owned by the caller
+    AVFormatContext* first = nullptr;
+    QVector<AVRational> timeBases;
+    int videoIndex = -1;
+    int64_t wallStartMs = 0;
+
+    AVFormatContext* current = nullptr;
+    Segment segment;
+    AVFormatContext* next = nullptr;
+    QString nextPath;
+    bool requested = false;
+    QList<Segment> closed;
+};
+
+SegmentWriter::SegmentWriter(QObject *parent)
+    : PacketWriter{parent}
+{
+    d = new SegmentWriterPrivate;
+}
+
+SegmentWriter::~SegmentWriter(){
+    this->finish();
+    this->discardNext();
+    if (d->current && d->current != d->first) {
+        AsyncFile::close(d->current);
+        avformat_free_context(d->current);
+    }
+    av_dict_free(&d->options);
+    delete d;
+}
+
+QString SegmentWriter::segmentPath(const QString& filename, int index){
+    QFileInfo info(filename);
+    QString name = QString("%1_%2").arg(info.completeBaseName()).arg(index, 5, 10, QChar('0'));
+    if (!info.suffix().isEmpty()) {
+        name += "." + info.suffix();
+    }
+    return QDir(info.path()).filePath(name);
+}
+
+QString SegmentWriter::indexPath(const QString& filename){
+    QFileInfo info(filename);
+    return QDir(info.path()).filePath(info.completeBaseName() + ".segments");
+}
+
+void SegmentWriter::setFilename(const QString& filename){
+    d->filename = filename;
+}
+
+void SegmentWriter::setLimits(int seconds, int64_t bytes){
+    d->limitSeconds = std::max(0, seconds);
+    d->limitBytes = std::max<int64_t>(0, bytes);
+}
+
+void SegmentWriter::setRetention(int64_t maxBytes, int maxSegments){
+    d->retainBytes = std::max<int64_t>(0, maxBytes);
+    d->retainSegments = std::max(0, maxSegments);
+}
+
+void SegmentWriter::setMuxerOptions(const AVDictionary* options){
+    av_dict_free(&d->options);
+    av_dict_copy(&d->options, options, 0);
+}
+
+void SegmentWriter::setFileOptions(const AsyncFile::Options& options){
+    d->fileOptions = options;
+}
+
+void SegmentWriter::setKeyframeRequester(const std::function<void()>& requester){
+    d->requester = requester;
+}
+
+bool SegmentWriter::setup(){
+    d->first = d->current = this->output();
+    if (!d->first) {
+        return false;
+    }
+    d->timeBases.clear();
+    d->videoIndex = -1;
+    for (unsigned i = 0; i < d->first->nb_streams; ++i) {
+        AVStream* stream = d->first->streams[i];
+        d->timeBases.append(stream->time_base);
+        if (d->videoIndex < 0 && stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            d->videoIndex = int(i);
+        }
+    }
+    d->wallStartMs = QDateTime::currentMSecsSinceEpoch();
+    d->segment = Segment();
+    d->segment.index = 1;
+    d->segment.path = segmentPath(d->filename, 1);
+    d->closed.clear();
+    d->requested = false;
+    d->next = this->openSegment(2);
+    return true;
+}
+
+int SegmentWriter::write(AVPacket* pkt){
+    const int index = pkt->stream_index;
+    if (index < 0 || index >= d->timeBases.size()) {
+        return AVERROR(EINVAL);
+    }
+    const AVRational timeBase = d->timeBases[index];
+    const int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    const int64_t tsUs = ts == AV_NOPTS_VALUE ? d->segment.endUs : av_rescale_q(ts, timeBase, AV_TIME_BASE_Q);
+
+    if (index == d->videoIndex && tsUs > d->segment.startUs) {
+        const bool due = (d->limitSeconds > 0 && tsUs - d->segment.startUs >= int64_t(d->limitSeconds) * AV_TIME_BASE) ||
+                         (d->limitBytes > 0 && d->current->pb && avio_tell(d->current->pb) >= d->limitBytes);
+        if (due && (pkt->flags & AV_PKT_FLAG_KEY)) {
+            int ret = this->rotate(tsUs);
+            if (ret < 0) {
+                return ret;
+            }
+        } else if (due && !d->requested) {
+            d->requested = true;
+            if (d->requester) {
+                d->requester();
+            }
+        }
+    }
+    d->segment.endUs = std::max(d->segment.endUs, tsUs);
+
+    // every segment starts at zero
+    const int64_t offset = av_rescale_q(d->segment.startUs, AV_TIME_BASE_Q, timeBase);
+    if (pkt->pts != AV_NOPTS_VALUE) pkt->pts -= offset;
+    if (pkt->dts != AV_NOPTS_VALUE) pkt->dts -= offset;
+    av_packet_rescale_ts(pkt, timeBase, d->current->streams[index]->time_base);
+    return PacketWriter::write(pkt);
+}
+
+void SegmentWriter::drained(){
+    // the last segment is completed by the finalizer like a single file
+    this->discardNext();
+    this->setOutput(d->current);
+    const int64_t bytes = d->current && d->current->pb ? avio_tell(d->current->pb) : 0;
+    this->writeIndex(bytes);
+}
+
+AVFormatContext* SegmentWriter::openSegment(int index){
+    const QString path = segmentPath(d->filename, index);
+    AVFormatContext* ctx = nullptr;
+    avformat_alloc_output_context2(&ctx, d->first->oformat, nullptr, path.toUtf8().constData());
+    if (!ctx) {
+        return nullptr;
+    }
+    for (unsigned i = 0; i < d->first->nb_streams; ++i) {
+        AVStream* stream = avformat_new_stream(ctx, nullptr);
+        if (!stream || avcodec_parameters_copy(stream->codecpar, d->first->streams[i]->codecpar) < 0) {
+            avformat_free_context(ctx);
+            return nullptr;
+        }
+        stream->time_base = d->first->streams[i]->time_base;
+    }
+    ctx->flags = d->first->flags;
+    ctx->flush_packets = d->first->flush_packets;
+
+    if (AsyncFile::open(ctx, path, d->fileOptions) < 0) {
+        qWarning() << "Could not open segment" << path;
+        avformat_free_context(ctx);
+        return nullptr;
+    }
+    AVDictionary* opts = nullptr;
+    av_dict_copy(&opts, d->options, 0);
+    int ret = avformat_write_header(ctx, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        qWarning() << "Could not write segment header" << path;
+        AsyncFile::close(ctx);
+        avformat_free_context(ctx);
+        QFile::remove(path);
+        return nullptr;
+    }
+    d->nextPath = path;
+    return ctx;
+}
+
+void SegmentWriter::discardNext(){
+    if (!d->next) {
+        return;
+    }
+    AsyncFile::close(d->next);
+    avformat_free_context(d->next);
+    d->next = nullptr;
+    QFile::remove(d->nextPath);
+}
+
+int SegmentWriter::rotate(int64_t startUs){
+    AVFormatContext* next = d->next ? d->next : this->openSegment(d->segment.index + 1);
+    d->next = nullptr;
+    if (!next) {
+        return AVERROR(EIO);
+    }
+    AVFormatContext* done = d->current;
+    int ret = av_write_trailer(done);
+    if (ret < 0) {
+        qWarning() << "Error writing segment trailer" << d->segment.path << ret;
+    }
+    d->segment.bytes = avio_size(done->pb);
+    AsyncFile::close(done);
+    if (done != d->first) {
+        avformat_free_context(done);
+    }
+    d->segment.endUs = startUs;
+    d->closed.append(d->segment);
+    emit segmentClosed(d->segment.path);
+
+    Segment segment;
+    segment.index = d->segment.index + 1;
+    segment.path = segmentPath(d->filename, segment.index);
+    segment.startUs = segment.endUs = startUs;
+    d->segment = segment;
+    d->current = next;
+    d->requested = false;
+
+    this->enforceRetention(0);
+    this->writeIndex(0);
+    // the next file is ready long before it is needed
+    d->next = this->openSegment(d->segment.index + 1);
+    return 0;
+}
+
+void SegmentWriter::enforceRetention(int64_t currentBytes){
+    int64_t total = currentBytes;
+    for (const Segment& segment : d->closed) {
+        total += segment.bytes;
+    }
+    int count = d->closed.size() + 1;
+    while (!d->closed.isEmpty() &&
+           ((d->retainBytes > 0 && total > d->retainBytes) ||
+            (d->retainSegments > 0 && count > d->retainSegments))) {
+        Segment oldest = d->closed.takeFirst();
+        if (!QFile::remove(oldest.path)) {
+            qWarning() << "Could not delete segment" << oldest.path;
+        }
+        total -= oldest.bytes;
+        count -= 1;
+    }
+}
+
+void SegmentWriter::writeIndex(int64_t currentBytes){
+    QList<Segment> segments = d->closed;
+    Segment current = d->segment;
+    current.bytes = currentBytes;
+    segments.append(current);
+
+    QSaveFile file(indexPath(d->filename));
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Could not write segment index" << file.fileName();
+        return;
+    }
+    QByteArray text("# index\tstart\toffset\tduration\tbytes\tfile\n");
+    for (const Segment& segment : segments) {
+        const QDateTime start = QDateTime::fromMSecsSinceEpoch(d->wallStartMs + segment.startUs / 1000, Qt::UTC);
+        text += QString("%1\t%2\t%3\t%4\t%5\t%6\n")
+                    .arg(segment.index)
+                    .arg(start.toString(Qt::ISODateWithMs))
+                    .arg(segment.startUs / double(AV_TIME_BASE), 0, 'f', 3)
+                    .arg((segment.endUs - segment.startUs) / double(AV_TIME_BASE), 0, 'f', 3)
+                    .arg(segment.bytes)
+                    .arg(QFileInfo(segment.path).fileName())
+                    .toUtf8();
+    }
+    file.write(text);
+    file.commit();
+}
+
+}
@@ -0,0 +1,59 @@
+#ifndef SEGMENT_WRITER_H
+#define SEGMENT_WRITER_H
+
+#include "packet_writer.h"
+#include "async_file.h"
+#include <functional>
+
+namespace adc{
+
+// Splits a recording into files of a fixed duration and/or size (dashcam
+// mode). Files are cut on video keyframes, one is requested when a segment
+// is due, and the next file is opened ahead of time, so rotating neither
+// drops frames nor restarts the encoders. The oldest segments are deleted
+// past the retention budget; <name>.segments lists the ones kept on disk.
+class SegmentWriterPrivate;
+class SegmentWriter : public PacketWriter
+{
+    Q_OBJECT
+public:
+    explicit SegmentWriter(QObject *parent = nullptr);
+    ~SegmentWriter();
+
+    // <dir>/<name>_00001.<ext>; the writer begins with index 1 already open
+    static QString segmentPath(const QString& filename, int index);
+    static QString indexPath(const QString& filename);
+
+    void setFilename(const QString& filename);
+    // 0 disables the limit
+    void setLimits(int seconds, int64_t bytes);
+    void setRetention(int64_t maxBytes, int maxSegments);
+    // options the first segment's header was written with
+    void setMuxerOptions(const AVDictionary* options);
+    // how the later segments are opened, see AsyncFile
+    void setFileOptions(const AsyncFile::Options& options);
+    // asks the encoder for a keyframe, called on the writer thread
+    void setKeyframeRequester(const std::function<void()>& requester);
+
+signals:
+    void segmentClosed(const QString& path);
+
+protected:
+    bool setup() override;
+    int write(AVPacket* pkt) override;
+    void drained() override;
+
+private:
+    AVFormatContext* openSegment(int index);
+    void discardNext();
+    int rotate(int64_t startUs);
+    void enforceRetention(int64_t currentBytes);
+    void writeIndex(int64_t currentBytes);
+
+private:
+    SegmentWriterPrivate* d;
+};
+
+}
+
+#endif // SEGMENT_WRITER_H
@@ -0,0 +1,394 @@
+#include "stream_sink.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QDebug>
+#include <atomic>
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+namespace adc{
+
+namespace {
+// end(): time left to get the queue out before the connection is cut
+constexpr int64_t kGraceUs = 3 * AV_TIME_BASE;
+constexpr int64_t kRetryUs = 2 * AV_TIME_BASE;
+constexpr int64_t kTimeoutUs = 5 * AV_TIME_BASE;
+
+struct Entry{
+    AVPacket* pkt = nullptr;
+    PacketSink::Stream stream = PacketSink::Video;
+};
+
+int64_t timestampUs(const AVPacket* pkt, AVRational timeBase){
+    const int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    return ts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : av_rescale_q(ts, timeBase, AV_TIME_BASE_Q);
+}
+
+const char* formatFor(const QString& url){
+    if (url.startsWith("rtmp://") || url.startsWith("rtmps://")) {
+        return "flv";
+    }
+    if (url.startsWith("srt://") || url.startsWith("udp://") || url.startsWith("tcp://")) {
+        return "mpegts";
+    }
+    return nullptr;
+}
+}
+
+class StreamSinkPrivate{
+public:
+    QString url;
+    int64_t maxDelayUs = 2 * AV_TIME_BASE;
+    std::function<void()> requester;
+
+    mutable QMutex mutex;
+    QWaitCondition wake;
+    AVCodecParameters* params[2] = {};
+    AVRational timeBases[2] = { { 1, 1 }, { 1, 1 } };
+    QQueue<Entry> queue;
+    bool waitKeyframe = true;
+    // first keyframe of the recording, sent as time zero
+    int64_t startUs = AV_NOPTS_VALUE;
+    int64_t sentUs = AV_NOPTS_VALUE;
+    int64_t dropped = 0;
+    bool ending = false;
+    bool reported = false;
+
+    std::atomic<bool> abort{ false };
+    std::atomic<bool> stopping{ false };
+    std::atomic<int64_t> deadlineUs{ 0 };
+    std::atomic<bool> connected{ false };
+
+    bool expired() const{
+        return abort || (stopping && av_gettime_relative() > deadlineUs);
+    }
+};
+
+StreamSink::StreamSink(const QString& url, QObject *parent)
+    : QThread{parent}
+{
+    d = new StreamSinkPrivate;
+    d->url = url;
+}
+
+StreamSink::~StreamSink(){
+    {
+        QMutexLocker locker(&d->mutex);
+        d->abort = true;
+        d->wake.wakeOne();
+    }
+    this->wait();
+    this->dropLocked();
+    avcodec_parameters_free(&d->params[Video]);
+    avcodec_parameters_free(&d->params[Audio]);
+    delete d;
+}
+
+QString StreamSink::url() const{
+    return d->url;
+}
+
+void StreamSink::setMaxDelay(int ms){
+    QMutexLocker locker(&d->mutex);
+    d->maxDelayUs = std::max(1, ms) * int64_t(1000);
+}
+
+void StreamSink::setKeyframeRequester(const std::function<void()>& requester){
+    QMutexLocker locker(&d->mutex);
+    d->requester = requester;
+}
+
+void StreamSink::begin(const AVCodecContext* video, const AVCodecContext* audio){
+    if (this->isRunning()) {
+        d->abort = true;
+        d->wake.wakeOne();
+        this->wait();
+    }
+    {
+        QMutexLocker locker(&d->mutex);
+        this->dropLocked();
+        const AVCodecContext* contexts[2] = { video, audio };
+        for (int i = Video; i <= Audio; ++i) {
+            avcodec_parameters_free(&d->params[i]);
+            if (contexts[i]) {
+                d->params[i] = avcodec_parameters_alloc();
+                avcodec_parameters_from_context(d->params[i], contexts[i]);
+                d->timeBases[i] = contexts[i]->time_base;
+            }
+        }
+        d->waitKeyframe = true;
+        d->startUs = d->sentUs = AV_NOPTS_VALUE;
+        d->dropped = 0;
+        d->ending = false;
+        d->reported = false;
+        d->abort = false;
+        d->stopping = false;
+    }
+    this->start();
+}
+
+void StreamSink::push(const AVPacket* pkt, Stream stream){
+    QMutexLocker locker(&d->mutex);
+    if (d->ending || !d->params[stream] || !this->isRunning()) {
+        return;
+    }
+    const bool key = stream == Video && (pkt->flags & AV_PKT_FLAG_KEY);
+    const int64_t us = stream == Video ? timestampUs(pkt, d->timeBases[Video]) : AV_NOPTS_VALUE;
+    if (stream == Video && us != AV_NOPTS_VALUE && d->sentUs != AV_NOPTS_VALUE &&
+        us - d->sentUs > d->maxDelayUs) {
+        // the link cannot keep up: drop to the next keyframe instead of
+        // falling further behind
+        const int count = d->queue.size();
+        this->dropLocked();
+        d->dropped += count;
+        d->sentUs = AV_NOPTS_VALUE;
+        d->waitKeyframe = true;
+        if (!key && d->requester) {
+            d->requester();
+        }
+    }
+    if (d->waitKeyframe) {
+        if (!key) {
+            d->dropped += 1;
+            return;
+        }
+        d->waitKeyframe = false;
+    }
+    if (stream == Video) {
+        if (d->startUs == AV_NOPTS_VALUE) {
+            d->startUs = us;
+        }
+        if (d->sentUs == AV_NOPTS_VALUE) {
+            d->sentUs = us;
+        }
+    }
+    Entry entry;
+    entry.pkt = av_packet_clone(pkt);
+    entry.stream = stream;
+    if (entry.pkt) {
+        d->queue.enqueue(entry);
+        d->wake.wakeOne();
+    }
+}
+
+void StreamSink::end(){
+    QMutexLocker locker(&d->mutex);
+    d->ending = true;
+    d->deadlineUs = av_gettime_relative() + kGraceUs;
+    d->stopping = true;
+    d->wake.wakeOne();
+}
+
+int64_t StreamSink::dropped() const{
+    QMutexLocker locker(&d->mutex);
+    return d->dropped;
+}
+
+bool StreamSink::isConnected() const{
+    return d->connected;
+}
+
+void StreamSink::dropLocked(){
+    while (!d->queue.isEmpty()) {
+        Entry entry = d->queue.dequeue();
+        av_packet_free(&entry.pkt);
+    }
+}
+
+int StreamSink::interrupted(void* opaque){
+    return static_cast<StreamSinkPrivate*>(opaque)->expired() ? 1 : 0;
+}
+
+void StreamSink::run(){
+    AVFormatContext* ctx = nullptr;
+    int64_t retryAt = 0;
+    while (!d->expired()) {
+        if (!ctx) {
+            {
+                QMutexLocker locker(&d->mutex);
+                if (d->ending && d->queue.isEmpty()) {
+                    break;
+                }
+            }
+            if (av_gettime_relative() < retryAt) {
+                QThread::msleep(100);
+                continue;
+            }
+            ctx = this->openConnection();
+            if (!ctx) {
+                retryAt = av_gettime_relative() + kRetryUs;
+                continue;
+            }
+            // a new connection starts with a keyframe
+            QMutexLocker locker(&d->mutex);
+            while (!d->queue.isEmpty() &&
+                   !(d->queue.head().stream == Video && (d->queue.head().pkt->flags & AV_PKT_FLAG_KEY))) {
+                Entry entry = d->queue.dequeue();
+                av_packet_free(&entry.pkt);
+                d->dropped += 1;
+            }
+            if (d->queue.isEmpty() && !d->waitKeyframe) {
+                d->waitKeyframe = true;
+                d->sentUs = AV_NOPTS_VALUE;
+                if (d->requester) {
+                    d->requester();
+                }
+            }
+        }
+
+        Entry entry;
+        int64_t startUs = 0;
+        {
+            QMutexLocker locker(&d->mutex);
+            if (d->queue.isEmpty() && !d->ending) {
+                d->wake.wait(&d->mutex, 100);
+            }
+            if (d->queue.isEmpty()) {
+                if (d->ending) {
+                    break;
+                }
+                continue;
+            }
+            entry = d->queue.dequeue();
+            startUs = d->startUs;
+        }
+        AVPacket* pkt = entry.pkt;
+        const AVRational timeBase = d->timeBases[entry.stream];
+        const int64_t us = timestampUs(pkt, timeBase);
+        const int64_t offset = av_rescale_q(startUs, AV_TIME_BASE_Q, timeBase);
+        if (pkt->pts != AV_NOPTS_VALUE) pkt->pts -= offset;
+        if (pkt->dts != AV_NOPTS_VALUE) pkt->dts -= offset;
+        int ret = 0;
+        if (pkt->pts == AV_NOPTS_VALUE || pkt->pts >= 0) {
+            AVStream* stream = ctx->streams[entry.stream == Video ? 0 : 1];
+            av_packet_rescale_ts(pkt, timeBase, stream->time_base);
+            pkt->stream_index = stream->index;
+            ret = av_interleaved_write_frame(ctx, pkt);
+        }
+        av_packet_free(&pkt);
+
+        if (ret < 0) {
+            char reason[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+            av_strerror(ret, reason, sizeof(reason));
+            qWarning() << "Stream" << d->url << "lost:" << reason;
+            emit error(QString("Stream %1 disconnected: %2").arg(d->url, reason));
+            this->closeConnection(&ctx, false);
+            retryAt = av_gettime_relative() + kRetryUs;
+            continue;
+        }
+        if (entry.stream == Video) {
+            QMutexLocker locker(&d->mutex);
+            if (d->sentUs != AV_NOPTS_VALUE) {
+                d->sentUs = std::max(d->sentUs, us);
+            }
+        }
+    }
+    this->closeConnection(&ctx, !d->abort);
+    QMutexLocker locker(&d->mutex);
+    this->dropLocked();
+}
+
+AVFormatContext* StreamSink::openConnection(){
+    const QByteArray url = d->url.toUtf8();
+    const char* format = this->formatName();
+    AVFormatContext* ctx = nullptr;
+    avformat_alloc_output_context2(&ctx, nullptr, format, url.constData());
+    if (!ctx) {
+        avformat_alloc_output_context2(&ctx, nullptr, "mpegts", url.constData());
+    }
+    if (!ctx) {
+        return nullptr;
+    }
+    ctx->interrupt_callback.callback = &StreamSink::interrupted;
+    ctx->interrupt_callback.opaque = d;
+
+    bool ok = true;
+    for (int i = Video; i <= Audio && ok; ++i) {
+        if (!d->params[i]) {
+            continue;
+        }
+        AVStream* stream = avformat_new_stream(ctx, nullptr);
+        ok = stream && avcodec_parameters_copy(stream->codecpar, d->params[i]) >= 0;
+        if (ok) {
+            stream->time_base = d->timeBases[i];
+        }
+    }
+    if (ok && !(ctx->oformat->flags & AVFMT_NOFILE)) {
+        AVDictionary* opts = nullptr;
+        av_dict_set_int(&opts, "rw_timeout", kTimeoutUs, 0);
+        ok = avio_open2(&ctx->pb, url.constData(), AVIO_FLAG_WRITE, &ctx->interrupt_callback, &opts) >= 0;
+        av_dict_free(&opts);
+    }
+    if (ok) {
+        AVDictionary* opts = nullptr;
+        this->muxerOptions(&opts);
+        ok = avformat_write_header(ctx, &opts) >= 0;
+        av_dict_free(&opts);
+    }
+    if (!ok) {
+        if (ctx->pb) {
+            avio_closep(&ctx->pb);
+        }
+        avformat_free_context(ctx);
+        bool report = false;
+        {
+            QMutexLocker locker(&d->mutex);
+            report = !d->reported;
+            d->reported = true;
+        }
+        if (report && !d->expired()) {
+            qWarning() << "Could not connect to" << d->url;
+            emit error(QString("Could not connect to %1, retrying").arg(d->url));
+        }
+        return nullptr;
+    }
+    {
+        QMutexLocker locker(&d->mutex);
+        d->reported = false;
+    }
+    qDebug() << "stream connected" << d->url;
+    d->connected = true;
+    return ctx;
+}
+
+const char* StreamSink::formatName() const{
+    return formatFor(d->url);
+}
+
+void StreamSink::muxerOptions(AVDictionary** options) const{
+    // a live flv has no duration or file size to patch in at the end
+    av_dict_set(options, "flvflags", "no_duration_filesize", 0);
+}
+
+void StreamSink::requestKeyframe(){
+    std::function<void()> requester;
+    {
+        QMutexLocker locker(&d->mutex);
+        requester = d->requester;
+    }
+    if (requester) {
+        requester();
+    }
+}
+
+void StreamSink::closeConnection(AVFormatContext** ctx, bool trailer){
+    d->connected = false;
+    if (!*ctx) {
+        return;
+    }
+    if (trailer) {
+        av_write_trailer(*ctx);
+    }
+    if ((*ctx)->pb) {
+        avio_closep(&(*ctx)->pb);
+    }
+    avformat_free_context(*ctx);
+    *ctx = nullptr;
+}
+
+}
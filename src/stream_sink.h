@@ -0,0 +1,63 @@
+#ifndef STREAM_SINK_H
+#define STREAM_SINK_H
+
+#include <QThread>
+#include <QString>
+#include <functional>
+#include "packet_sink.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+namespace adc{
+
+// Live output of the recording's packets to rtmp:// (flv) or srt:// and
+// udp:// (mpegts), sharing the encoder with the file. The queue never
+// blocks the encoder: once more than maxDelay is waiting, everything queued
+// is dropped and sending resumes at the next keyframe, which is requested
+// right away. A lost connection is retried until the recording stops.
+class StreamSinkPrivate;
+class StreamSink : public QThread, public PacketSink
+{
+    Q_OBJECT
+public:
+    explicit StreamSink(const QString& url, QObject *parent = nullptr);
+    ~StreamSink();
+
+    QString url() const;
+    void setMaxDelay(int ms);
+    // asks the encoder for a keyframe, called from push()
+    void setKeyframeRequester(const std::function<void()>& requester);
+
+    void begin(const AVCodecContext* video, const AVCodecContext* audio) override;
+    void push(const AVPacket* pkt, Stream stream) override;
+    // sends what is queued within a short grace period, then disconnects
+    void end() override;
+
+    int64_t dropped() const;
+    bool isConnected() const;
+
+signals:
+    void error(const QString& message);
+
+protected:
+    void run() override;
+    // muxer for the url and the options its header is written with
+    virtual const char* formatName() const;
+    virtual void muxerOptions(AVDictionary** options) const;
+    void requestKeyframe();
+
+private:
+    AVFormatContext* openConnection();
+    void closeConnection(AVFormatContext** ctx, bool trailer);
+    void dropLocked();
+    static int interrupted(void* opaque);
+
+private:
+    StreamSinkPrivate* d;
+};
+
+}
+
+#endif // STREAM_SINK_H
@@ -0,0 +1,299 @@
+#include "thumbnail_writer.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QByteArray>
+#include <QImage>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDebug>
+#include <algorithm>
+#include <vector>
+
+extern "C" {
+#include <libavutil/pixfmt.h>
+}
+
+namespace adc{
+
+namespace {
+// thumbnails waiting for the thread; more are dropped, not queued
+constexpr int kMaxQueued = 64;
+
+struct Thumbnail{
+    double seconds = 0;
+    int width = 0;
+    int height = 0;
+    // YUV420P, planes back to back
+    QByteArray yuv;
+};
+
+struct Cue{
+    double start = 0;
+    int sheet = 0;
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+// the mean of each factor x factor block
+void boxFilter(const uint8_t* src, int stride, int factor, uint8_t* dst, int width, int height){
+    const int area = factor * factor;
+    for (int y = 0; y < height; ++y) {
+        const uint8_t* rows = src + int64_t(y) * factor * stride;
+        for (int x = 0; x < width; ++x) {
+            const uint8_t* block = rows + x * factor;
+            int sum = 0;
+            for (int dy = 0; dy < factor; ++dy) {
+                const uint8_t* line = block + int64_t(dy) * stride;
+                for (int dx = 0; dx < factor; ++dx) {
+                    sum += line[dx];
+                }
+            }
+            *dst++ = uint8_t((sum + area / 2) / area);
+        }
+    }
+}
+
+uint8_t clamp8(int value){
+    return uint8_t(std::clamp(value, 0, 255));
+}
+
+QString timestamp(double seconds){
+    const int64_t ms = int64_t(std::max(0.0, seconds) * 1000 + 0.5);
+    return QString("%1:%2:%3.%4")
+        .arg(ms / 3600000, 2, 10, QChar('0'))
+        .arg(ms / 60000 % 60, 2, 10, QChar('0'))
+        .arg(ms / 1000 % 60, 2, 10, QChar('0'))
+        .arg(ms % 1000, 3, 10, QChar('0'));
+}
+}
+
+class ThumbnailWriterPrivate{
+public:
+    mutable QMutex mutex;
+    QWaitCondition wake;
+    QQueue<Thumbnail> queue;
+    bool finishing = false;
+    double end = -1;
+    int sampled = 0;
+
+    QString filename;
+    int width = 160;
+    QString format = "jpg";
+    int quality = 75;
+    int columns = 10;
+    int rows = 10;
+    double interval = 10;
+
+    // writer thread
+    QImage sheet;
+    int sheetNumber = 1;
+    int inSheet = 0;
+    int cellWidth = 0;
+    int cellHeight = 0;
+    std::vector<Cue> cues;
+};
+
+ThumbnailWriter::ThumbnailWriter(QObject *parent)
+    : QThread{parent}
+{
+    d = new ThumbnailWriterPrivate;
+}
+
+ThumbnailWriter::~ThumbnailWriter(){
+    {
+        QMutexLocker locker(&d->mutex);
+        d->finishing = true;
+        d->wake.wakeAll();
+    }
+    this->wait();
+    delete d;
+}
+
+QString ThumbnailWriter::vttPath(const QString& filename){
+    QFileInfo info(filename);
+    return QDir(info.path()).filePath(info.completeBaseName() + "_thumbnails.vtt");
+}
+
+QString ThumbnailWriter::spritePath(const QString& filename, int sheet, const QString& format){
+    QFileInfo info(filename);
+    return QDir(info.path()).filePath(QString("%1_sprites_%2.%3")
+                                          .arg(info.completeBaseName())
+                                          .arg(sheet, 3, 10, QChar('0'))
+                                          .arg(format));
+}
+
+void ThumbnailWriter::setOutput(const QString& filename){
+    d->filename = filename;
+}
+
+void ThumbnailWriter::setWidth(int width){
+    d->width = std::max(16, width);
+}
+
+void ThumbnailWriter::setFormat(const QString& format, int quality){
+    d->format = format.toLower();
+    d->quality = quality;
+}
+
+void ThumbnailWriter::setGrid(int columns, int rows){
+    d->columns = std::max(1, columns);
+    d->rows = std::max(1, rows);
+}
+
+void ThumbnailWriter::setInterval(double seconds){
+    d->interval = seconds;
+}
+
+void ThumbnailWriter::sample(const AVFrame* frame, double seconds){
+    if (frame->format != AV_PIX_FMT_YUV420P) {
+        return;
+    }
+    // whole pixel blocks; the thumbnail is at most the configured width
+    const int factor = std::max(1, (frame->width + d->width - 1) / d->width);
+    const int width = frame->width / factor & ~1;
+    const int height = frame->height / factor & ~1;
+    if (width < 2 || height < 2) {
+        return;
+    }
+    {
+        QMutexLocker locker(&d->mutex);
+        if (d->finishing || d->queue.size() >= kMaxQueued) {
+            return;
+        }
+    }
+    Thumbnail thumbnail;
+    thumbnail.seconds = seconds;
+    thumbnail.width = width;
+    thumbnail.height = height;
+    const int chroma = (width / 2) * (height / 2);
+    thumbnail.yuv.resize(width * height + 2 * chroma);
+    uint8_t* y = reinterpret_cast<uint8_t*>(thumbnail.yuv.data());
+    boxFilter(frame->data[0], frame->linesize[0], factor, y, width, height);
+    boxFilter(frame->data[1], frame->linesize[1], factor, y + width * height, width / 2, height / 2);
+    boxFilter(frame->data[2], frame->linesize[2], factor, y + width * height + chroma, width / 2, height / 2);
+
+    QMutexLocker locker(&d->mutex);
+    d->queue.enqueue(thumbnail);
+    d->sampled += 1;
+    d->wake.wakeOne();
+}
+
+void ThumbnailWriter::finish(double seconds){
+    QMutexLocker locker(&d->mutex);
+    d->end = seconds;
+    d->finishing = true;
+    d->wake.wakeAll();
+}
+
+int ThumbnailWriter::thumbnails() const{
+    QMutexLocker locker(&d->mutex);
+    return d->sampled;
+}
+
+void ThumbnailWriter::run(){
+    auto saveSheet = [this]{
+        if (d->inSheet == 0) {
+            return;
+        }
+        // the last sheet only as high as its rows
+        const int rows = (d->inSheet + d->columns - 1) / d->columns;
+        const QImage sheet = rows < d->rows ? d->sheet.copy(0, 0, d->sheet.width(), rows * d->cellHeight) : d->sheet;
+        const QString path = spritePath(d->filename, d->sheetNumber, d->format);
+        if (!sheet.save(path, d->format.toUtf8().constData(), d->quality)) {
+            qWarning() << "Could not save thumbnails" << path;
+        }
+        d->sheetNumber += 1;
+        d->inSheet = 0;
+        d->sheet = QImage();
+    };
+
+    while (true) {
+        Thumbnail thumbnail;
+        {
+            QMutexLocker locker(&d->mutex);
+            while (d->queue.isEmpty() && !d->finishing) {
+                d->wake.wait(&d->mutex);
+            }
+            if (d->queue.isEmpty()) {
+                break;
+            }
+            thumbnail = d->queue.dequeue();
+        }
+        // a resized capture starts a sheet of its own
+        if (!d->sheet.isNull() && (thumbnail.width != d->cellWidth || thumbnail.height != d->cellHeight)) {
+            saveSheet();
+        }
+        if (d->sheet.isNull()) {
+            d->cellWidth = thumbnail.width;
+            d->cellHeight = thumbnail.height;
+            d->sheet = QImage(d->columns * d->cellWidth, d->rows * d->cellHeight, QImage::Format_RGB32);
+            d->sheet.fill(0);
+        }
+        const int x = d->inSheet % d->columns * d->cellWidth;
+        const int y = d->inSheet / d->columns * d->cellHeight;
+
+        // BT.601 limited range, as sws converted the capture
+        const int width = thumbnail.width;
+        const int height = thumbnail.height;
+        const uint8_t* planeY = reinterpret_cast<const uint8_t*>(thumbnail.yuv.constData());
+        const uint8_t* planeU = planeY + width * height;
+        const uint8_t* planeV = planeU + (width / 2) * (height / 2);
+        for (int row = 0; row < height; ++row) {
+            uint32_t* out = reinterpret_cast<uint32_t*>(d->sheet.scanLine(y + row)) + x;
+            const uint8_t* lineY = planeY + row * width;
+            const uint8_t* lineU = planeU + (row / 2) * (width / 2);
+            const uint8_t* lineV = planeV + (row / 2) * (width / 2);
+            for (int col = 0; col < width; ++col) {
+                const int c = 298 * (lineY[col] - 16);
+                const int u = lineU[col / 2] - 128;
+                const int v = lineV[col / 2] - 128;
+                out[col] = 0xff000000u | (uint32_t(clamp8((c + 409 * v + 128) >> 8)) << 16) |
+                           (uint32_t(clamp8((c - 100 * u - 208 * v + 128) >> 8)) << 8) |
+                           uint32_t(clamp8((c + 516 * u + 128) >> 8));
+            }
+        }
+        d->cues.push_back(Cue{ thumbnail.seconds, d->sheetNumber, x, y, width, height });
+        d->inSheet += 1;
+        if (d->inSheet == d->columns * d->rows) {
+            saveSheet();
+        }
+    }
+    saveSheet();
+    if (d->cues.empty() || d->filename.isEmpty()) {
+        return;
+    }
+
+    double end = 0;
+    {
+        QMutexLocker locker(&d->mutex);
+        end = d->end;
+    }
+    QSaveFile file(vttPath(d->filename));
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Could not write" << file.fileName();
+        return;
+    }
+    QString vtt = "WEBVTT\n\n";
+    for (size_t i = 0; i < d->cues.size(); ++i) {
+        const Cue& cue = d->cues[i];
+        double until = i + 1 < d->cues.size() ? d->cues[i + 1].start : end;
+        if (until <= cue.start) {
+            until = cue.start + d->interval;
+        }
+        vtt += QString("%1 --> %2\n%3#xywh=%4,%5,%6,%7\n\n")
+                   .arg(timestamp(cue.start), timestamp(until),
+                        QFileInfo(spritePath(d->filename, cue.sheet, d->format)).fileName())
+                   .arg(cue.x).arg(cue.y).arg(cue.width).arg(cue.height);
+    }
+    file.write(vtt.toUtf8());
+    if (!file.commit()) {
+        qWarning() << "Could not write" << file.fileName();
+    }
+}
+
+}
@@ -0,0 +1,56 @@
+#ifndef THUMBNAIL_WRITER_H
+#define THUMBNAIL_WRITER_H
+
+#include <QThread>
+#include <QString>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+namespace adc{
+
+// Scrubbing thumbnails for a recording without decoding it afterwards. The
+// encoder side hands in a converted YUV420P frame every few seconds, which
+// sample() shrinks with a box filter on the spot; this thread turns the
+// thumbnails into RGB and packs them into sprite sheets
+// <name>_sprites_001.<format>, ... saved as they fill. finish() saves the
+// last sheet and writes <name>_thumbnails.vtt, a WebVTT track of cues
+// pointing into the sheets (#xywh=).
+class ThumbnailWriterPrivate;
+class ThumbnailWriter : public QThread
+{
+public:
+    explicit ThumbnailWriter(QObject *parent = nullptr);
+    ~ThumbnailWriter();
+
+    static QString vttPath(const QString& filename);
+    static QString spritePath(const QString& filename, int sheet, const QString& format);
+
+    // before start(): the recording the track is for, the thumbnail width
+    // (the height keeps the frames' aspect ratio), "jpg" or "webp" sheets
+    // of columns x rows thumbnails
+    void setOutput(const QString& filename);
+    void setWidth(int width);
+    void setFormat(const QString& format, int quality = 75);
+    void setGrid(int columns, int rows);
+    // length of the last cue when finish() does not know better
+    void setInterval(double seconds);
+
+    // encoder side, frame is only read during the call
+    void sample(const AVFrame* frame, double seconds);
+    // no more thumbnails; the recording ends at seconds. The thread saves
+    // the last sheet and the track, then exits
+    void finish(double seconds);
+    int thumbnails() const;
+
+protected:
+    void run() override;
+
+private:
+    ThumbnailWriterPrivate* d;
+};
+
+}
+
+#endif // THUMBNAIL_WRITER_H
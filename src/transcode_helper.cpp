@@ -0,0 +1,111 @@
+// anycapture_transcode: one TranscodeQueue job in a process of its own.
+//
+// Started by TranscodeProcess with the idle priority class; it also enters
+// background mode, so the encoders' worker threads and its disk access stay
+// out of the way of a live recording. Prints "progress <percent>" and, on
+// failure, "error <message>" on stdout; reads "suspend", "resume" and
+// "quit" from stdin, a closed stdin quits. Exits with 0 once the output is
+// complete, 1 on failure, 2 when cancelled.
+//
+//   anycapture_transcode <source> <output> <encoder> <preset> <crf> <threads> <jobs>
+
+#include "transcoder.h"
+#include "chunked_transcoder.h"
+
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+using namespace adc;
+
+namespace {
+struct Control{
+    QMutex mutex;
+    QWaitCondition wake;
+    bool suspended = false;
+    bool quit = false;
+};
+}
+
+int main(int argc, char* argv[]){
+    if (argc < 8) {
+        fprintf(stderr, "usage: anycapture_transcode <source> <output> <encoder> <preset> <crf> <threads> <jobs>\n");
+        return 1;
+    }
+#ifdef _WIN32
+    SetPriorityClass(GetCurrentProcess(), IDLE_PRIORITY_CLASS);
+    SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN);
+#endif
+    const QString source = QString::fromUtf8(argv[1]);
+    const QString output = QString::fromUtf8(argv[2]);
+    TranscodeProfile profile;
+    profile.encoder = QString::fromUtf8(argv[3]);
+    profile.preset = QString::fromUtf8(argv[4]);
+    profile.crf = atoi(argv[5]);
+    profile.threads = atoi(argv[6]);
+    profile.jobs = atoi(argv[7]);
+
+    // blocked in getline until the parent writes or goes away
+    Control control;
+    std::thread reader([&control]{
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            QMutexLocker locker(&control.mutex);
+            if (line == "suspend") {
+                control.suspended = true;
+            } else if (line == "resume") {
+                control.suspended = false;
+            } else if (line == "quit") {
+                control.quit = true;
+            }
+            control.wake.wakeAll();
+        }
+        QMutexLocker locker(&control.mutex);
+        control.quit = true;
+        control.wake.wakeAll();
+    });
+    reader.detach();
+
+    bool ok = false;
+    bool cancelled = false;
+    QString error;
+    auto transcode = [&](auto& transcoder){
+        transcoder.setProfile(profile);
+        transcoder.setCheckpoint([&control]{
+            QMutexLocker locker(&control.mutex);
+            while (control.suspended && !control.quit) {
+                control.wake.wait(&control.mutex);
+            }
+            return !control.quit;
+        });
+        transcoder.setProgress([](int percent){
+            printf("progress %d\n", percent);
+            fflush(stdout);
+        });
+        ok = transcoder.transcode(source, output);
+        cancelled = transcoder.isCancelled();
+        error = transcoder.errorString();
+    };
+    if (profile.jobs == 1) {
+        Transcoder transcoder;
+        transcode(transcoder);
+    } else {
+        ChunkedTranscoder transcoder;
+        transcode(transcoder);
+    }
+    if (!ok && !cancelled) {
+        printf("error %s\n", error.toUtf8().constData());
+    }
+    fflush(stdout);
+    // the reader may still be blocked on stdin
+    _Exit(cancelled ? 2 : ok ? 0 : 1);
+}
@@ -0,0 +1,127 @@
+#include "transcode_process.h"
+#include <QCoreApplication>
+#include <QProcess>
+#include <QFileInfo>
+#include <QDir>
+#include <QDebug>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
+namespace adc{
+
+namespace {
+constexpr int kPollMs = 200;
+// a helper told to quit stops between packets
+constexpr int kQuitMs = 5000;
+// exit codes of the helper
+constexpr int kExitCancelled = 2;
+}
+
+TranscodeProcess::TranscodeProcess(){
+
+}
+
+QString TranscodeProcess::helperPath(){
+#ifdef Q_OS_WIN
+    const QString name = "anycapture_transcode.exe";
+#else
+    const QString name = "anycapture_transcode";
+#endif
+    const QString path = QDir(QCoreApplication::applicationDirPath()).filePath(name);
+    return QFileInfo::exists(path) ? path : QString();
+}
+
+void TranscodeProcess::setProfile(const TranscodeProfile& profile){
+    m_profile = profile;
+}
+
+void TranscodeProcess::setState(const std::function<State()>& state){
+    m_state = state;
+}
+
+void TranscodeProcess::setProgress(const std::function<void(int percent)>& progress){
+    m_progress = progress;
+}
+
+bool TranscodeProcess::transcode(const QString& source, const QString& output){
+    m_cancelled = false;
+    m_error.clear();
+    const QString helper = helperPath();
+    if (helper.isEmpty()) {
+        m_error = "transcode helper not found";
+        return false;
+    }
+
+    QProcess process;
+    process.setProgram(helper);
+    process.setArguments({ source, output, m_profile.encoder, m_profile.preset, QString::number(m_profile.crf),
+                           QString::number(m_profile.threads), QString::number(m_profile.jobs) });
+    process.setProcessChannelMode(QProcess::SeparateChannels);
+#ifdef Q_OS_WIN
+    // idle from its first instruction, the helper adds background mode
+    process.setCreateProcessArgumentsModifier([](QProcess::CreateProcessArguments* args){
+        args->flags |= IDLE_PRIORITY_CLASS;
+    });
+#endif
+    process.start();
+    if (!process.waitForStarted()) {
+        m_error = "could not start " + helper + ": " + process.errorString();
+        return false;
+    }
+
+    State sent = Running;
+    while (!process.waitForFinished(kPollMs)) {
+        while (process.canReadLine()) {
+            const QByteArray line = process.readLine().trimmed();
+            if (line.startsWith("progress ") && m_progress) {
+                m_progress(line.mid(9).toInt());
+            }
+        }
+        const State state = m_state ? m_state() : Running;
+        if (state == sent) {
+            continue;
+        }
+        sent = state;
+        if (state == Cancelled) {
+            process.write("quit\n");
+            if (!process.waitForFinished(kQuitMs)) {
+                process.kill();
+                process.waitForFinished();
+            }
+            break;
+        }
+        process.write(state == Suspended ? "suspend\n" : "resume\n");
+    }
+
+    while (process.canReadLine()) {
+        const QByteArray line = process.readLine().trimmed();
+        if (line.startsWith("progress ") && m_progress) {
+            m_progress(line.mid(9).toInt());
+        } else if (line.startsWith("error ")) {
+            m_error = QString::fromUtf8(line.mid(6));
+        }
+    }
+    if (sent == Cancelled || (process.exitStatus() == QProcess::NormalExit && process.exitCode() == kExitCancelled)) {
+        m_cancelled = true;
+        return false;
+    }
+    if (process.exitStatus() != QProcess::NormalExit || process.exitCode() != 0) {
+        if (m_error.isEmpty()) {
+            m_error = QString("transcode helper exited with %1").arg(process.exitCode());
+        }
+        return false;
+    }
+    return true;
+}
+
+bool TranscodeProcess::isCancelled() const{
+    return m_cancelled;
+}
+
+QString TranscodeProcess::errorString() const{
+    return m_error;
+}
+
+}
@@ -0,0 +1,49 @@
+#ifndef TRANSCODE_PROCESS_H
+#define TRANSCODE_PROCESS_H
+
+#include <QString>
+#include <functional>
+#include "transcoder.h"
+
+namespace adc{
+
+// Runs a transcode in the anycapture_transcode helper next to the
+// application, an idle priority class process in background mode. The
+// encoders' own worker threads are created at the process' priority, so
+// none of them competes with the live recording, which a low priority
+// thread in this process cannot ensure. The helper reports progress on
+// stdout and reads suspend / resume / quit from stdin.
+class TranscodeProcess
+{
+public:
+    enum State{
+        Running,
+        Suspended,
+        Cancelled
+    };
+
+    TranscodeProcess();
+
+    // empty if the helper is not installed
+    static QString helperPath();
+
+    void setProfile(const TranscodeProfile& profile);
+    // polled on the caller's thread while the helper runs
+    void setState(const std::function<State()>& state);
+    void setProgress(const std::function<void(int percent)>& progress);
+
+    bool transcode(const QString& source, const QString& output);
+    bool isCancelled() const;
+    QString errorString() const;
+
+private:
+    TranscodeProfile m_profile;
+    std::function<State()> m_state;
+    std::function<void(int)> m_progress;
+    bool m_cancelled = false;
+    QString m_error;
+};
+
+}
+
+#endif // TRANSCODE_PROCESS_H
@@ -0,0 +1,273 @@
+#include "transcode_queue.h"
+#include "chunked_transcoder.h"
+#include "transcode_process.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QDir>
+#include <QDebug>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
+namespace adc{
+
+namespace {
+struct Job{
+    QString filename;
+    QString output;
+    TranscodeProfile profile;
+};
+
+// tab separated: output path, then the profile it was queued with
+bool saveState(const Job& job){
+    QSaveFile file(TranscodeQueue::statePath(job.filename));
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Could not write transcode state" << file.fileName();
+        return false;
+    }
+    const TranscodeProfile& profile = job.profile;
+    file.write(QString("output\t%1\nencoder\t%2\npreset\t%3\ncrf\t%4\nthreads\t%5\nkeep\t%6\njobs\t%7\n")
+                   .arg(job.output, profile.encoder, profile.preset)
+                   .arg(profile.crf).arg(profile.threads).arg(profile.keepSource ? 1 : 0).arg(profile.jobs).toUtf8());
+    return file.commit();
+}
+
+bool loadState(Job* job){
+    QFile file(TranscodeQueue::statePath(job->filename));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    while (!file.atEnd()) {
+        const QStringList fields = QString::fromUtf8(file.readLine()).trimmed().split('\t');
+        if (fields.size() != 2) {
+            continue;
+        }
+        if (fields[0] == "output") {
+            job->output = fields[1];
+        } else if (fields[0] == "encoder") {
+            job->profile.encoder = fields[1];
+        } else if (fields[0] == "preset") {
+            job->profile.preset = fields[1];
+        } else if (fields[0] == "crf") {
+            job->profile.crf = fields[1].toInt();
+        } else if (fields[0] == "threads") {
+            job->profile.threads = fields[1].toInt();
+        } else if (fields[0] == "keep") {
+            job->profile.keepSource = fields[1].toInt() != 0;
+        } else if (fields[0] == "jobs") {
+            job->profile.jobs = fields[1].toInt();
+        }
+    }
+    return !job->output.isEmpty() && !job->profile.encoder.isEmpty();
+}
+}
+
+class TranscodeQueuePrivate{
+public:
+    mutable QMutex mutex;
+    QWaitCondition wake;
+    QList<Job*> jobs;
+    TranscodeProfile profile;
+    bool suspended = false;
+    bool quit = false;
+
+    Job* find(const QString& filename) const{
+        for (Job* job : jobs) {
+            if (job->filename == filename) {
+                return job;
+            }
+        }
+        return nullptr;
+    }
+};
+
+TranscodeQueue::TranscodeQueue(QObject *parent)
+    : QThread{parent}
+{
+    d = new TranscodeQueuePrivate;
+}
+
+TranscodeQueue::~TranscodeQueue(){
+    this->shutdown();
+    this->wait();
+    qDeleteAll(d->jobs);
+    delete d;
+}
+
+QString TranscodeQueue::statePath(const QString& filename){
+    return filename + ".transcode";
+}
+
+void TranscodeQueue::setProfile(const TranscodeProfile& profile){
+    QMutexLocker locker(&d->mutex);
+    d->profile = profile;
+}
+
+TranscodeProfile TranscodeQueue::profile() const{
+    QMutexLocker locker(&d->mutex);
+    return d->profile;
+}
+
+bool TranscodeQueue::enqueue(const QString& filename, const TranscodeProfile& profile){
+    if (d->find(filename)) {
+        return false;
+    }
+    auto job = new Job;
+    job->filename = filename;
+    job->profile = profile;
+    if (!loadState(job)) {
+        job->output = Transcoder::outputPath(filename, profile);
+        saveState(*job);
+    }
+    d->jobs.append(job);
+    d->quit = false;
+    d->wake.wakeOne();
+    return true;
+}
+
+void TranscodeQueue::add(const QString& filename){
+    {
+        QMutexLocker locker(&d->mutex);
+        if (!this->enqueue(filename, d->profile)) {
+            return;
+        }
+    }
+    if (!this->isRunning()) {
+        this->start(QThread::IdlePriority);
+    }
+}
+
+int TranscodeQueue::resume(const QString& directory){
+    int count = 0;
+    {
+        QMutexLocker locker(&d->mutex);
+        const QDir dir(directory);
+        for (const QString& name : dir.entryList({ "*.transcode" }, QDir::Files)) {
+            const QString state = dir.filePath(name);
+            const QString filename = state.left(state.lastIndexOf(".transcode"));
+            if (!QFileInfo::exists(filename)) {
+                QFile::remove(state);
+                continue;
+            }
+            if (this->enqueue(filename, d->profile)) {
+                count += 1;
+            }
+        }
+    }
+    if (count > 0 && !this->isRunning()) {
+        this->start(QThread::IdlePriority);
+    }
+    return count;
+}
+
+void TranscodeQueue::setSuspended(bool suspended){
+    QMutexLocker locker(&d->mutex);
+    d->suspended = suspended;
+    d->wake.wakeAll();
+}
+
+bool TranscodeQueue::isSuspended() const{
+    QMutexLocker locker(&d->mutex);
+    return d->suspended;
+}
+
+int TranscodeQueue::pending() const{
+    QMutexLocker locker(&d->mutex);
+    return d->jobs.size();
+}
+
+void TranscodeQueue::shutdown(){
+    QMutexLocker locker(&d->mutex);
+    d->quit = true;
+    d->wake.wakeAll();
+}
+
+void TranscodeQueue::run(){
+#ifdef Q_OS_WIN
+    // in process fallback: idle CPU priority is not enough to keep the disk
+    // to the recording
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+#endif
+    while (true) {
+        Job* job = nullptr;
+        {
+            QMutexLocker locker(&d->mutex);
+            while (!d->quit && (d->jobs.isEmpty() || d->suspended)) {
+                d->wake.wait(&d->mutex);
+            }
+            if (d->quit) {
+                return;
+            }
+            job = d->jobs.first();
+        }
+
+        const QString filename = job->filename;
+        qDebug() << "transcoding" << filename << "->" << job->output << job->profile.encoder << job->profile.preset;
+        bool ok = false;
+        bool cancelled = false;
+        QString error;
+        // in one piece, or in chunks on all cores
+        auto transcode = [&](auto& transcoder){
+            transcoder.setProfile(job->profile);
+            transcoder.setCheckpoint([this]{
+                QMutexLocker locker(&d->mutex);
+                while (d->suspended && !d->quit) {
+                    d->wake.wait(&d->mutex);
+                }
+                return !d->quit;
+            });
+            transcoder.setProgress([this, filename](int percent){
+                emit progress(filename, percent);
+            });
+            ok = transcoder.transcode(filename, job->output);
+            cancelled = transcoder.isCancelled();
+            error = transcoder.errorString();
+        };
+        if (!TranscodeProcess::helperPath().isEmpty()) {
+            // the helper process keeps the encoders' threads idle too
+            TranscodeProcess transcoder;
+            transcoder.setProfile(job->profile);
+            transcoder.setState([this]{
+                QMutexLocker locker(&d->mutex);
+                return d->quit ? TranscodeProcess::Cancelled
+                               : d->suspended ? TranscodeProcess::Suspended : TranscodeProcess::Running;
+            });
+            transcoder.setProgress([this, filename](int percent){
+                emit progress(filename, percent);
+            });
+            ok = transcoder.transcode(filename, job->output);
+            cancelled = transcoder.isCancelled();
+            error = transcoder.errorString();
+        } else if (job->profile.jobs == 1) {
+            Transcoder transcoder;
+            transcode(transcoder);
+        } else {
+            ChunkedTranscoder transcoder;
+            transcode(transcoder);
+        }
+        if (cancelled) {
+            // the state file stays for resume()
+            return;
+        }
+        if (!ok) {
+            qWarning() << "Transcode failed" << filename << error;
+        } else if (!job->profile.keepSource) {
+            QFile::remove(filename);
+        }
+        QFile::remove(statePath(filename));
+        const QString output = job->output;
+        {
+            QMutexLocker locker(&d->mutex);
+            d->jobs.removeOne(job);
+        }
+        delete job;
+        emit transcoded(filename, output, ok);
+    }
+}
+
+}
@@ -0,0 +1,58 @@
+#ifndef TRANSCODE_QUEUE_H
+#define TRANSCODE_QUEUE_H
+
+#include <QThread>
+#include <QString>
+#include "transcoder.h"
+
+namespace adc{
+
+// Re-encodes finished recordings into smaller archive files, one at a time
+// in the idle priority helper process (TranscodeProcess), or on an idle
+// priority thread where the helper is not installed. A job stops between
+// packets as soon as the queue is suspended (a live recording started) and
+// goes on where it was once resumed. Jobs are kept in <file>.transcode, so
+// those cut off by a restart are picked up again by resume(): a chunked job
+// (profile.jobs != 1) keeps the chunks it finished, a single encode starts
+// over from the beginning.
+class TranscodeQueuePrivate;
+class TranscodeQueue : public QThread
+{
+    Q_OBJECT
+public:
+    explicit TranscodeQueue(QObject *parent = nullptr);
+    ~TranscodeQueue();
+
+    static QString statePath(const QString& filename);
+
+    // applies to the jobs added afterwards
+    void setProfile(const TranscodeProfile& profile);
+    TranscodeProfile profile() const;
+
+    void add(const QString& filename);
+    // queues the jobs a previous run left in directory
+    int resume(const QString& directory);
+    void setSuspended(bool suspended);
+    bool isSuspended() const;
+
+    int pending() const;
+    // stops the current job; it is left for resume()
+    void shutdown();
+
+signals:
+    void progress(const QString& filename, int percent);
+    void transcoded(const QString& filename, const QString& output, bool ok);
+
+protected:
+    void run() override;
+
+private:
+    bool enqueue(const QString& filename, const TranscodeProfile& profile);
+
+private:
+    TranscodeQueuePrivate* d;
+};
+
+}
+
+#endif // TRANSCODE_QUEUE_H
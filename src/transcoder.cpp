@@ -0,0 +1,381 @@
+#include "transcoder.h"
+#include "encoder_tuning.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QThread>
+#include <QDebug>
+#include <algorithm>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+}
+
+namespace adc{
+
+namespace {
+// the decoder's format if the encoder takes it, else 4:2:0
+AVPixelFormat encoderFormat(const AVCodec* codec, AVPixelFormat wanted){
+    const AVPixelFormat* formats = nullptr;
+    int count = 0;
+    if (avcodec_get_supported_config(nullptr, codec, AV_CODEC_CONFIG_PIX_FORMAT, 0,
+                                     reinterpret_cast<const void**>(&formats), &count) < 0 || !formats) {
+        return wanted;
+    }
+    const AVPixelFormat* end = formats + count;
+    if (std::find(formats, end, wanted) != end) {
+        return wanted;
+    }
+    if (std::find(formats, end, AV_PIX_FMT_YUV420P) != end) {
+        return AV_PIX_FMT_YUV420P;
+    }
+    return count > 0 ? formats[0] : wanted;
+}
+
+struct Context{
+    AVFormatContext* in = nullptr;
+    AVFormatContext* out = nullptr;
+    AVCodecContext* decoder = nullptr;
+    AVCodecContext* encoder = nullptr;
+    SwsContext* sws = nullptr;
+    AVFrame* frame = nullptr;
+    AVFrame* scaled = nullptr;
+    AVPacket* packet = nullptr;
+    AVPacket* encoded = nullptr;
+
+    ~Context(){
+        av_packet_free(&encoded);
+        av_packet_free(&packet);
+        av_frame_free(&scaled);
+        av_frame_free(&frame);
+        sws_freeContext(sws);
+        avcodec_free_context(&encoder);
+        avcodec_free_context(&decoder);
+        if (out) {
+            avio_closep(&out->pb);
+            avformat_free_context(out);
+        }
+        avformat_close_input(&in);
+    }
+};
+}
+
+Transcoder::Transcoder(){
+
+}
+
+QString Transcoder::outputPath(const QString& source, const TranscodeProfile& profile){
+    QFileInfo info(source);
+    const QString extension = profile.extension.isEmpty() ? info.suffix() : profile.extension;
+    return QDir(info.path()).filePath(info.completeBaseName() + profile.suffix + "." + extension);
+}
+
+AVCodecContext* Transcoder::openEncoder(const TranscodeProfile& profile, const AVCodecContext* decoder,
+                                        AVRational timeBase, AVRational frameRate, bool globalHeader,
+                                        int cores, QString* error){
+    const AVCodec* codec = avcodec_find_encoder_by_name(profile.encoder.toUtf8().constData());
+    AVCodecContext* encoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+    if (!encoder) {
+        *error = "no encoder " + profile.encoder;
+        return nullptr;
+    }
+    encoder->width = decoder->width;
+    encoder->height = decoder->height;
+    encoder->sample_aspect_ratio = decoder->sample_aspect_ratio;
+    encoder->pix_fmt = encoderFormat(codec, decoder->pix_fmt);
+    encoder->color_range = decoder->color_range;
+    encoder->color_primaries = decoder->color_primaries;
+    encoder->color_trc = decoder->color_trc;
+    encoder->colorspace = decoder->colorspace;
+    encoder->time_base = timeBase;
+    encoder->framerate = frameRate;
+    if (globalHeader) {
+        encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    AVDictionary* opts = nullptr;
+    av_dict_set(&opts, "preset", profile.preset.toUtf8().constData(), 0);
+    av_dict_set_int(&opts, "crf", profile.crf, 0);
+    const int rate = frameRate.num > 0 && frameRate.den > 0 ? std::max(1, frameRate.num / frameRate.den) : 30;
+    auto plan = EncoderTuning::planThreading(codec->name, encoder->width, encoder->height, rate, cores, false);
+    plan.threads = std::min(plan.threads, cores);
+    EncoderTuning::applyThreading(encoder, &opts, plan);
+    const int ret = avcodec_open2(encoder, codec, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        *error = "could not open " + profile.encoder;
+        avcodec_free_context(&encoder);
+    }
+    return encoder;
+}
+
+void Transcoder::setProfile(const TranscodeProfile& profile){
+    m_profile = profile;
+}
+
+void Transcoder::setCheckpoint(const std::function<bool()>& checkpoint){
+    m_checkpoint = checkpoint;
+}
+
+void Transcoder::setProgress(const std::function<void(int)>& progress){
+    m_progress = progress;
+}
+
+bool Transcoder::isCancelled() const{
+    return m_cancelled;
+}
+
+QString Transcoder::errorString() const{
+    return m_error;
+}
+
+bool Transcoder::fail(const QString& message){
+    m_error = message;
+    return false;
+}
+
+bool Transcoder::transcode(const QString& source, const QString& output){
+    return this->run(source, output, Range());
+}
+
+bool Transcoder::transcodeRange(const QString& source, const QString& output, int64_t startPts, int64_t endPts,
+                                bool globalHeader, int64_t offset){
+    Range range;
+    range.start = startPts;
+    range.end = endPts;
+    range.globalHeader = globalHeader;
+    range.offset = offset;
+    return this->run(source, output, range);
+}
+
+bool Transcoder::run(const QString& source, const QString& output, const Range& range){
+    const bool ranged = range.start != AV_NOPTS_VALUE;
+    m_cancelled = false;
+    m_error.clear();
+    const QString part = output + ".part";
+    const bool ok = [&]{
+        Context c;
+        if (avformat_open_input(&c.in, source.toUtf8().constData(), nullptr, nullptr) < 0 ||
+            avformat_find_stream_info(c.in, nullptr) < 0) {
+            return this->fail("could not read " + source);
+        }
+        if (avformat_alloc_output_context2(&c.out, nullptr, nullptr, output.toUtf8().constData()) < 0) {
+            return this->fail("no muxer for " + output);
+        }
+
+        // the first video stream is encoded, audio copied, the rest dropped
+        const int videoIndex = av_find_best_stream(c.in, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        if (videoIndex < 0) {
+            return this->fail("no video in " + source);
+        }
+        std::vector<int> streams(c.in->nb_streams, -1);
+        for (unsigned i = 0; i < c.in->nb_streams; ++i) {
+            AVStream* in = c.in->streams[i];
+            if (int(i) != videoIndex && (ranged || in->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)) {
+                in->discard = AVDISCARD_ALL;
+                continue;
+            }
+            AVStream* out = avformat_new_stream(c.out, nullptr);
+            if (!out) {
+                return this->fail("could not add a stream");
+            }
+            streams[i] = out->index;
+            out->time_base = in->time_base;
+            if (int(i) != videoIndex) {
+                avcodec_parameters_copy(out->codecpar, in->codecpar);
+                out->codecpar->codec_tag = 0;
+            }
+        }
+
+        AVStream* inVideo = c.in->streams[videoIndex];
+        AVStream* outVideo = c.out->streams[streams[videoIndex]];
+        const AVCodec* decoder = avcodec_find_decoder(inVideo->codecpar->codec_id);
+        c.decoder = decoder ? avcodec_alloc_context3(decoder) : nullptr;
+        if (!c.decoder || avcodec_parameters_to_context(c.decoder, inVideo->codecpar) < 0) {
+            return this->fail("no decoder for " + source);
+        }
+        c.decoder->pkt_timebase = inVideo->time_base;
+        if (avcodec_open2(c.decoder, decoder, nullptr) < 0) {
+            return this->fail("could not open the decoder");
+        }
+
+        const AVRational fps = av_guess_frame_rate(c.in, inVideo, nullptr);
+        const int cores = m_profile.threads > 0 ? m_profile.threads : std::max(1, QThread::idealThreadCount() / 2);
+        const bool globalHeader = ranged ? range.globalHeader : (c.out->oformat->flags & AVFMT_GLOBALHEADER) != 0;
+        c.encoder = Transcoder::openEncoder(m_profile, c.decoder, inVideo->time_base, fps, globalHeader,
+                                            cores, &m_error);
+        if (!c.encoder || avcodec_parameters_from_context(outVideo->codecpar, c.encoder) < 0) {
+            return false;
+        }
+        outVideo->avg_frame_rate = fps;
+        if (c.encoder->pix_fmt != c.decoder->pix_fmt) {
+            c.sws = sws_getContext(c.decoder->width, c.decoder->height, c.decoder->pix_fmt,
+                                   c.encoder->width, c.encoder->height, c.encoder->pix_fmt,
+                                   SWS_BILINEAR, nullptr, nullptr, nullptr);
+            c.scaled = av_frame_alloc();
+            if (!c.sws || !c.scaled) {
+                return this->fail("no conversion to the encoder's format");
+            }
+            c.scaled->format = c.encoder->pix_fmt;
+            c.scaled->width = c.encoder->width;
+            c.scaled->height = c.encoder->height;
+            if (av_frame_get_buffer(c.scaled, 0) < 0) {
+                return this->fail("out of memory");
+            }
+        }
+
+        if (avio_open(&c.out->pb, part.toUtf8().constData(), AVIO_FLAG_WRITE) < 0) {
+            return this->fail("could not create " + part);
+        }
+        if (avformat_write_header(c.out, nullptr) < 0) {
+            return this->fail("could not write the header of " + output);
+        }
+        if (ranged && av_seek_frame(c.in, videoIndex, range.start, AVSEEK_FLAG_BACKWARD) < 0) {
+            return this->fail("could not seek in " + source);
+        }
+
+        c.frame = av_frame_alloc();
+        c.packet = av_packet_alloc();
+        c.encoded = av_packet_alloc();
+        if (!c.frame || !c.packet || !c.encoded) {
+            return this->fail("out of memory");
+        }
+        auto encode = [&](AVFrame* frame){
+            int ret = avcodec_send_frame(c.encoder, frame);
+            if (ret < 0 && ret != AVERROR_EOF) {
+                return false;
+            }
+            while (true) {
+                ret = avcodec_receive_packet(c.encoder, c.encoded);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                    return true;
+                }
+                if (ret < 0) {
+                    return false;
+                }
+                if (c.encoded->pts != AV_NOPTS_VALUE) {
+                    c.encoded->pts += range.offset;
+                }
+                if (c.encoded->dts != AV_NOPTS_VALUE) {
+                    c.encoded->dts += range.offset;
+                }
+                av_packet_rescale_ts(c.encoded, c.encoder->time_base, outVideo->time_base);
+                c.encoded->stream_index = outVideo->index;
+                if (av_interleaved_write_frame(c.out, c.encoded) < 0) {
+                    return false;
+                }
+            }
+        };
+        // past the end of the range
+        bool done = false;
+        auto decode = [&](const AVPacket* packet){
+            int ret = avcodec_send_packet(c.decoder, packet);
+            if (ret < 0 && ret != AVERROR_EOF) {
+                // a damaged packet costs its frames, not the file
+                qWarning() << "Skipping undecodable packet in" << source << ret;
+                return true;
+            }
+            while (true) {
+                ret = avcodec_receive_frame(c.decoder, c.frame);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                    return true;
+                }
+                if (ret < 0) {
+                    return false;
+                }
+                c.frame->pts = c.frame->best_effort_timestamp;
+                c.frame->pict_type = AV_PICTURE_TYPE_NONE;
+                if (ranged && c.frame->pts != AV_NOPTS_VALUE && c.frame->pts >= range.end) {
+                    done = true;
+                    av_frame_unref(c.frame);
+                    return true;
+                }
+                if (ranged && c.frame->pts != AV_NOPTS_VALUE && c.frame->pts < range.start) {
+                    av_frame_unref(c.frame);
+                    continue;
+                }
+                AVFrame* frame = c.frame;
+                if (c.sws) {
+                    // the encoder may still hold the previous one
+                    if (av_frame_make_writable(c.scaled) < 0 || sws_scale_frame(c.sws, c.scaled, c.frame) < 0) {
+                        return false;
+                    }
+                    c.scaled->pts = c.frame->pts;
+                    frame = c.scaled;
+                }
+                const bool ok = encode(frame);
+                av_frame_unref(c.frame);
+                if (!ok) {
+                    return false;
+                }
+            }
+        };
+
+        // in microseconds, or in video packets' time base for a range
+        int64_t duration = c.in->duration > 0 ? c.in->duration : 0;
+        int64_t start = c.in->start_time != AV_NOPTS_VALUE ? c.in->start_time : 0;
+        if (ranged) {
+            start = range.start;
+            duration = range.end > range.start ? range.end - range.start : 0;
+        }
+        int reported = -1;
+        while (!done && av_read_frame(c.in, c.packet) >= 0) {
+            if (m_checkpoint && !m_checkpoint()) {
+                av_packet_unref(c.packet);
+                m_cancelled = true;
+                return this->fail("cancelled");
+            }
+            const int index = c.packet->stream_index;
+            const AVRational timeBase = c.in->streams[index]->time_base;
+            if (m_progress && duration > 0 && c.packet->pts != AV_NOPTS_VALUE && (!ranged || index == videoIndex)) {
+                const int64_t elapsed = (ranged ? c.packet->pts : av_rescale_q(c.packet->pts, timeBase, AVRational{ 1, AV_TIME_BASE })) - start;
+                const int percent = int(std::clamp<int64_t>(elapsed * 100 / duration, 0, 99));
+                if (percent != reported) {
+                    reported = percent;
+                    m_progress(percent);
+                }
+            }
+            bool ok = true;
+            if (index == videoIndex) {
+                ok = decode(c.packet);
+            } else if (streams[index] >= 0) {
+                AVStream* out = c.out->streams[streams[index]];
+                av_packet_rescale_ts(c.packet, timeBase, out->time_base);
+                c.packet->stream_index = out->index;
+                c.packet->pos = -1;
+                ok = av_interleaved_write_frame(c.out, c.packet) >= 0;
+            }
+            av_packet_unref(c.packet);
+            if (!ok) {
+                return this->fail("error transcoding " + source);
+            }
+        }
+        // the decoder's frames past the range are not needed
+        if ((!done && !decode(nullptr)) || !encode(nullptr)) {
+            return this->fail("error flushing the encoder");
+        }
+        if (av_write_trailer(c.out) < 0 || avio_closep(&c.out->pb) < 0) {
+            return this->fail("error finishing " + part);
+        }
+        return true;
+    }();
+
+    if (!ok) {
+        QFile::remove(part);
+        return false;
+    }
+    QFile::remove(output);
+    if (!QFile::rename(part, output)) {
+        QFile::remove(part);
+        return this->fail("could not rename " + part);
+    }
+    if (m_progress) {
+        m_progress(100);
+    }
+    return true;
+}
+
+}
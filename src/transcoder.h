@@ -0,0 +1,81 @@
+#ifndef TRANSCODER_H
+#define TRANSCODER_H
+
+#include <QString>
+#include <functional>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+namespace adc{
+
+struct TranscodeProfile{
+    QString encoder = "libx265";
+    QString preset = "slow";
+    int crf = 26;
+    // encoder threads, 0 = half the cores
+    int threads = 0;
+    // <name><suffix>.<extension> next to the source; an empty extension
+    // keeps the source's
+    QString suffix = "_archive";
+    QString extension;
+    // false deletes the recording once its archive is complete
+    bool keepSource = true;
+    // chunks encoded at once by ChunkedTranscoder, 1 encodes the file in
+    // one piece, 0 picks one per four cores
+    int jobs = 1;
+};
+
+// Re-encodes the video of a finished recording with a slower preset or
+// another codec, on the caller's thread; audio is copied as it is. The
+// output is written to <output>.part and renamed once complete, so a file
+// with the output name is always whole.
+class Transcoder
+{
+public:
+    Transcoder();
+
+    static QString outputPath(const QString& source, const TranscodeProfile& profile);
+    // the profile's encoder for the decoder's frames, planned for cores;
+    // frames have to be converted when its pix_fmt differs
+    static AVCodecContext* openEncoder(const TranscodeProfile& profile, const AVCodecContext* decoder,
+                                       AVRational timeBase, AVRational frameRate, bool globalHeader,
+                                       int cores, QString* error);
+
+    void setProfile(const TranscodeProfile& profile);
+    // called between packets; may block to pause, false cancels
+    void setCheckpoint(const std::function<bool()>& checkpoint);
+    void setProgress(const std::function<void(int percent)>& progress);
+
+    bool transcode(const QString& source, const QString& output);
+    // video only, the frames from startPts up to endPts (source video time
+    // base, starting at a keyframe); a chunk for ChunkedTranscoder. The
+    // packets are written offset later, for containers without negative
+    // timestamps
+    bool transcodeRange(const QString& source, const QString& output, int64_t startPts, int64_t endPts,
+                        bool globalHeader, int64_t offset);
+    bool isCancelled() const;
+    QString errorString() const;
+
+private:
+    struct Range{
+        int64_t start = AV_NOPTS_VALUE;
+        int64_t end = AV_NOPTS_VALUE;
+        bool globalHeader = false;
+        int64_t offset = 0;
+    };
+    bool run(const QString& source, const QString& output, const Range& range);
+    bool fail(const QString& message);
+
+private:
+    TranscodeProfile m_profile;
+    std::function<bool()> m_checkpoint;
+    std::function<void(int)> m_progress;
+    bool m_cancelled = false;
+    QString m_error;
+};
+
+}
+
+#endif // TRANSCODER_H
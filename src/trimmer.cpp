@@ -0,0 +1,578 @@
+#include "trimmer.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QByteArray>
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+}
+
+namespace adc{
+
+namespace {
+struct Context{
+    AVFormatContext* in = nullptr;
+    AVFormatContext* out = nullptr;
+    AVCodecContext* decoder = nullptr;
+    AVCodecContext* encoder = nullptr;
+    AVFrame* frame = nullptr;
+    AVPacket* packet = nullptr;
+    AVPacket* encoded = nullptr;
+
+    ~Context(){
+        av_packet_free(&encoded);
+        av_packet_free(&packet);
+        av_frame_free(&frame);
+        avcodec_free_context(&encoder);
+        avcodec_free_context(&decoder);
+        if (out) {
+            avio_closep(&out->pb);
+            avformat_free_context(out);
+        }
+        avformat_close_input(&in);
+    }
+};
+
+// where the Annex B start code at or after p begins, end if none
+const uint8_t* findStartCode(const uint8_t* p, const uint8_t* end){
+    for (; p + 3 <= end; ++p) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+            return p;
+        }
+    }
+    return end;
+}
+
+// the encoder's Annex B NAL units with the length prefixes of an avcC stream
+QByteArray lengthPrefixed(const uint8_t* data, int size, int lengthSize){
+    QByteArray result;
+    result.reserve(size + 16);
+    const uint8_t* end = data + size;
+    const uint8_t* nal = findStartCode(data, end);
+    while (nal < end) {
+        nal += 3;
+        const uint8_t* next = findStartCode(nal, end);
+        // trailing zeros belong to the next four byte start code
+        const uint8_t* last = next;
+        while (last > nal && last[-1] == 0) {
+            --last;
+        }
+        const int64_t length = last - nal;
+        for (int i = lengthSize - 1; i >= 0; --i) {
+            result += char((length >> (8 * i)) & 0xff);
+        }
+        result.append(reinterpret_cast<const char*>(nal), int(length));
+        nal = next;
+    }
+    return result;
+}
+
+// the source's profile for libx264, nullptr if it cannot produce it
+const char* x264Profile(int profile){
+    switch (profile) {
+    case AV_PROFILE_H264_BASELINE:
+    case AV_PROFILE_H264_CONSTRAINED_BASELINE:
+        return "baseline";
+    case AV_PROFILE_H264_MAIN:
+        return "main";
+    case AV_PROFILE_H264_HIGH:
+        return "high";
+    default:
+        return nullptr;
+    }
+}
+
+// libx264 for the frames before the first copied keyframe, at the source's
+// profile and level and with its own parameter set ids, so the copied
+// stream's headers still apply. For avcC sources the headers go into
+// extradata to be added to the source's, otherwise they stay in band
+AVCodecContext* openRenderer(const AVCodecContext* decoder, AVRational timeBase, AVRational frameRate,
+                             bool globalHeader){
+    const AVCodec* codec = avcodec_find_encoder_by_name("libx264");
+    const char* profile = x264Profile(decoder->profile);
+    AVCodecContext* encoder = codec && profile ? avcodec_alloc_context3(codec) : nullptr;
+    if (!encoder) {
+        return nullptr;
+    }
+    encoder->width = decoder->width;
+    encoder->height = decoder->height;
+    encoder->sample_aspect_ratio = decoder->sample_aspect_ratio;
+    encoder->pix_fmt = decoder->pix_fmt;
+    encoder->color_range = decoder->color_range;
+    encoder->color_primaries = decoder->color_primaries;
+    encoder->color_trc = decoder->color_trc;
+    encoder->colorspace = decoder->colorspace;
+    encoder->time_base = timeBase;
+    encoder->framerate = frameRate;
+    encoder->level = decoder->level;
+    // no reordering: decode order is presentation order, ahead of the
+    // copied keyframe's decode timestamp
+    encoder->max_b_frames = 0;
+    if (globalHeader) {
+        encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    AVDictionary* opts = nullptr;
+    av_dict_set(&opts, "preset", "fast", 0);
+    av_dict_set(&opts, "profile", profile, 0);
+    av_dict_set_int(&opts, "crf", 16, 0);
+    av_dict_set(&opts, "x264-params", "sps-id=1", 0);
+    const int ret = avcodec_open2(encoder, codec, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        avcodec_free_context(&encoder);
+    }
+    return encoder;
+}
+
+// the SPS and PPS NAL units of Annex B headers
+void parameterSets(const uint8_t* data, int size, std::vector<QByteArray>* sps, std::vector<QByteArray>* pps){
+    const uint8_t* end = data + size;
+    const uint8_t* nal = findStartCode(data, end);
+    while (nal < end) {
+        nal += 3;
+        const uint8_t* next = findStartCode(nal, end);
+        const uint8_t* last = next;
+        while (last > nal && last[-1] == 0) {
+            --last;
+        }
+        if (last > nal) {
+            const int type = nal[0] & 0x1f;
+            const QByteArray unit(reinterpret_cast<const char*>(nal), int(last - nal));
+            if (type == 7) {
+                sps->push_back(unit);
+            } else if (type == 8) {
+                pps->push_back(unit);
+            }
+        }
+        nal = next;
+    }
+}
+
+// the source's avcC with the renderer's parameter sets listed after its
+// own, as every set the samples use has to be in the sample entry. Empty
+// if they would not fit together: another profile, a higher level, or
+// the source using id 1 itself
+QByteArray extendAvcC(const uint8_t* avcc, int size, const std::vector<QByteArray>& sps,
+                      const std::vector<QByteArray>& pps){
+    if (size < 7 || avcc[0] != 1 || sps.empty() || pps.empty() || sps[0].size() < 4) {
+        return QByteArray();
+    }
+    const uint8_t* rendered = reinterpret_cast<const uint8_t*>(sps[0].constData());
+    if (rendered[1] != avcc[1] || rendered[3] > avcc[3]) {
+        return QByteArray();
+    }
+    // the length prefixed sets of one list; id 0 is a single set bit
+    // right after the fixed fields
+    auto list = [&](int* pos, int count, int idByte, QByteArray* out){
+        for (int i = 0; i < count; ++i) {
+            if (*pos + 2 > size) {
+                return false;
+            }
+            const int length = (avcc[*pos] << 8) | avcc[*pos + 1];
+            if (length <= idByte || *pos + 2 + length > size || !(avcc[*pos + 2 + idByte] & 0x80)) {
+                return false;
+            }
+            out->append(reinterpret_cast<const char*>(avcc + *pos), 2 + length);
+            *pos += 2 + length;
+        }
+        return true;
+    };
+    auto append = [](const std::vector<QByteArray>& units, QByteArray* out){
+        for (const QByteArray& unit : units) {
+            *out += char(unit.size() >> 8);
+            *out += char(unit.size() & 0xff);
+            out->append(unit);
+        }
+    };
+    int pos = 6;
+    const int spsCount = avcc[5] & 0x1f;
+    QByteArray spsList;
+    if (!list(&pos, spsCount, 4, &spsList) || pos >= size) {
+        return QByteArray();
+    }
+    const int ppsCount = avcc[pos++];
+    QByteArray ppsList;
+    if (!list(&pos, ppsCount, 1, &ppsList) || spsCount + int(sps.size()) > 31 || ppsCount + int(pps.size()) > 255) {
+        return QByteArray();
+    }
+    QByteArray result(reinterpret_cast<const char*>(avcc), 5);
+    // the constraint flags every listed SPS satisfies
+    result.data()[2] = char(avcc[2] & rendered[2]);
+    result += char(0xe0 | (spsCount + int(sps.size())));
+    result.append(spsList);
+    append(sps, &result);
+    result += char(ppsCount + int(pps.size()));
+    result.append(ppsList);
+    append(pps, &result);
+    // the High profile extension
+    result.append(reinterpret_cast<const char*>(avcc + pos), size - pos);
+    return result;
+}
+}
+
+Trimmer::Trimmer(){
+
+}
+
+QString Trimmer::outputPath(const QString& source){
+    QFileInfo info(source);
+    return QDir(info.path()).filePath(info.completeBaseName() + "_trim." + info.suffix());
+}
+
+void Trimmer::setSmartRender(bool enable){
+    m_smartRender = enable;
+}
+
+void Trimmer::setProgress(const std::function<void(int)>& progress){
+    m_progress = progress;
+}
+
+QString Trimmer::errorString() const{
+    return m_error;
+}
+
+int64_t Trimmer::keyframeUs() const{
+    return m_keyframeUs;
+}
+
+bool Trimmer::isFrameAccurate() const{
+    return m_frameAccurate;
+}
+
+int Trimmer::renderedFrames() const{
+    return m_renderedFrames;
+}
+
+bool Trimmer::fail(const QString& message){
+    m_error = message;
+    return false;
+}
+
+bool Trimmer::trim(const QString& source, const QString& output, int64_t startUs, int64_t endUs){
+    m_error.clear();
+    m_keyframeUs = startUs;
+    m_frameAccurate = false;
+    m_renderedFrames = 0;
+    if (QFileInfo(source).absoluteFilePath() == QFileInfo(output).absoluteFilePath()) {
+        return this->fail("the output would replace the source");
+    }
+    if (startUs < 0 || (endUs > 0 && endUs <= startUs)) {
+        return this->fail("nothing to keep");
+    }
+    const QString part = output + ".part";
+    const bool ok = [&]{
+        Context c;
+        if (avformat_open_input(&c.in, source.toUtf8().constData(), nullptr, nullptr) < 0 ||
+            avformat_find_stream_info(c.in, nullptr) < 0) {
+            return this->fail("could not read " + source);
+        }
+        if (avformat_alloc_output_context2(&c.out, nullptr, nullptr, output.toUtf8().constData()) < 0) {
+            return this->fail("no muxer for " + output);
+        }
+        const QString format = c.out->oformat->name;
+        const bool isoMedia = format == "mp4" || format == "mov";
+
+        // the first video stream and the audio are copied, the rest dropped
+        const int videoIndex = av_find_best_stream(c.in, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        std::vector<int> streams(c.in->nb_streams, -1);
+        for (unsigned i = 0; i < c.in->nb_streams; ++i) {
+            AVStream* in = c.in->streams[i];
+            if (int(i) != videoIndex && in->codecpar->codec_type != AVMEDIA_TYPE_AUDIO) {
+                in->discard = AVDISCARD_ALL;
+                continue;
+            }
+            AVStream* out = avformat_new_stream(c.out, nullptr);
+            if (!out || avcodec_parameters_copy(out->codecpar, in->codecpar) < 0) {
+                return this->fail("could not add a stream");
+            }
+            streams[i] = out->index;
+            out->time_base = in->time_base;
+            out->avg_frame_rate = in->avg_frame_rate;
+            out->codecpar->codec_tag = 0;
+        }
+        if (c.out->nb_streams == 0) {
+            return this->fail("nothing to copy in " + source);
+        }
+
+        // the recording's timeline starts at its first packet
+        const int64_t origin = c.in->start_time != AV_NOPTS_VALUE ? c.in->start_time : 0;
+        const int64_t cutUs = origin + startUs;
+        const int64_t endAt = endUs > 0 ? origin + endUs : INT64_MAX;
+        auto inStream = [&](int64_t us, int index){
+            return us == INT64_MAX ? INT64_MAX : av_rescale_q(us, AV_TIME_BASE_Q, c.in->streams[index]->time_base);
+        };
+
+        // smart render decodes from the keyframe before the cut
+        int lengthSize = 0;
+        if (m_smartRender && videoIndex >= 0) {
+            AVStream* inVideo = c.in->streams[videoIndex];
+            const AVCodec* decoder = avcodec_find_decoder(inVideo->codecpar->codec_id);
+            if (inVideo->codecpar->codec_id != AV_CODEC_ID_H264 || !decoder) {
+                qWarning() << "Smart render needs H.264, copying from the keyframe" << source;
+            } else {
+                c.decoder = avcodec_alloc_context3(decoder);
+                if (!c.decoder || avcodec_parameters_to_context(c.decoder, inVideo->codecpar) < 0) {
+                    return this->fail("out of memory");
+                }
+                c.decoder->pkt_timebase = inVideo->time_base;
+                if (avcodec_open2(c.decoder, decoder, nullptr) < 0) {
+                    return this->fail("could not open the decoder");
+                }
+                // avcC streams take length prefixed NAL units, Annex B ones as they are
+                const AVCodecParameters* par = inVideo->codecpar;
+                if (par->extradata_size > 4 && par->extradata[0] == 1) {
+                    lengthSize = (par->extradata[4] & 3) + 1;
+                }
+                c.encoder = openRenderer(c.decoder, inVideo->time_base, av_guess_frame_rate(c.in, inVideo, nullptr),
+                                         lengthSize > 0);
+                if (!c.encoder) {
+                    qWarning() << "Could not open libx264 at the source's profile for smart render, copying from the keyframe"
+                               << source;
+                } else if (lengthSize > 0) {
+                    std::vector<QByteArray> sps;
+                    std::vector<QByteArray> pps;
+                    parameterSets(c.encoder->extradata, c.encoder->extradata_size, &sps, &pps);
+                    const QByteArray avcc = extendAvcC(par->extradata, par->extradata_size, sps, pps);
+                    AVCodecParameters* outPar = c.out->streams[streams[videoIndex]]->codecpar;
+                    uint8_t* extradata = avcc.isEmpty() ? nullptr
+                                                        : static_cast<uint8_t*>(av_mallocz(avcc.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+                    if (!extradata) {
+                        qWarning() << "Smart render headers do not fit the source's, copying from the keyframe" << source;
+                        avcodec_free_context(&c.encoder);
+                    } else {
+                        memcpy(extradata, avcc.constData(), avcc.size());
+                        av_freep(&outPar->extradata);
+                        outPar->extradata = extradata;
+                        outPar->extradata_size = avcc.size();
+                    }
+                }
+                if (!c.encoder) {
+                    avcodec_free_context(&c.decoder);
+                }
+            }
+        }
+
+        // negative timestamps become the edit list hiding the frames before the cut
+        if (isoMedia) {
+            c.out->avoid_negative_ts = AVFMT_AVOID_NEG_TS_DISABLED;
+        }
+        if (avio_open(&c.out->pb, part.toUtf8().constData(), AVIO_FLAG_WRITE) < 0) {
+            return this->fail("could not create " + part);
+        }
+        if (avformat_write_header(c.out, nullptr) < 0) {
+            return this->fail("could not write the header of " + output);
+        }
+        if (startUs > 0) {
+            const int ret = videoIndex >= 0
+                                ? av_seek_frame(c.in, videoIndex, inStream(cutUs, videoIndex), AVSEEK_FLAG_BACKWARD)
+                                : av_seek_frame(c.in, -1, cutUs, AVSEEK_FLAG_BACKWARD);
+            if (ret < 0) {
+                return this->fail("could not seek in " + source);
+            }
+        }
+
+        c.frame = av_frame_alloc();
+        c.packet = av_packet_alloc();
+        c.encoded = av_packet_alloc();
+        if (!c.frame || !c.packet || !c.encoded) {
+            return this->fail("out of memory");
+        }
+
+        // timestamps move by the cut, so it is at zero in every stream
+        auto write = [&](AVPacket* packet, int index){
+            const int64_t shift = inStream(cutUs, index);
+            if (packet->pts != AV_NOPTS_VALUE) {
+                packet->pts -= shift;
+            }
+            if (packet->dts != AV_NOPTS_VALUE) {
+                packet->dts -= shift;
+            }
+            AVStream* out = c.out->streams[streams[index]];
+            av_packet_rescale_ts(packet, c.in->streams[index]->time_base, out->time_base);
+            packet->stream_index = out->index;
+            packet->pos = -1;
+            return av_interleaved_write_frame(c.out, packet) >= 0;
+        };
+
+        // the source's decode delay, rendered packets decode that far ahead
+        int64_t delay = 0;
+        auto encode = [&](AVFrame* frame){
+            int ret = avcodec_send_frame(c.encoder, frame);
+            if (ret < 0 && ret != AVERROR_EOF) {
+                return false;
+            }
+            while (true) {
+                ret = avcodec_receive_packet(c.encoder, c.encoded);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                    return true;
+                }
+                if (ret < 0) {
+                    return false;
+                }
+                if (lengthSize > 0) {
+                    const QByteArray data = lengthPrefixed(c.encoded->data, c.encoded->size, lengthSize);
+                    AVPacket* converted = av_packet_alloc();
+                    if (!converted || av_new_packet(converted, data.size()) < 0) {
+                        av_packet_free(&converted);
+                        return false;
+                    }
+                    memcpy(converted->data, data.constData(), data.size());
+                    av_packet_copy_props(converted, c.encoded);
+                    av_packet_unref(c.encoded);
+                    av_packet_move_ref(c.encoded, converted);
+                    av_packet_free(&converted);
+                }
+                if (c.encoded->pts != AV_NOPTS_VALUE) {
+                    c.encoded->dts = c.encoded->pts - delay;
+                }
+                const bool ok = write(c.encoded, videoIndex);
+                av_packet_unref(c.encoded);
+                if (!ok) {
+                    return false;
+                }
+            }
+        };
+        auto decode = [&](const AVPacket* packet, int64_t cut, int64_t end){
+            int ret = avcodec_send_packet(c.decoder, packet);
+            if (ret < 0 && ret != AVERROR_EOF) {
+                qWarning() << "Skipping undecodable packet in" << source << ret;
+                return true;
+            }
+            while (true) {
+                ret = avcodec_receive_frame(c.decoder, c.frame);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                    return true;
+                }
+                if (ret < 0) {
+                    return false;
+                }
+                c.frame->pts = c.frame->best_effort_timestamp;
+                c.frame->pict_type = AV_PICTURE_TYPE_NONE;
+                bool ok = true;
+                if (c.frame->pts != AV_NOPTS_VALUE && c.frame->pts >= cut && c.frame->pts < end) {
+                    ok = encode(c.frame);
+                    m_renderedFrames += 1;
+                }
+                av_frame_unref(c.frame);
+                if (!ok) {
+                    return false;
+                }
+            }
+        };
+
+        enum class Video{ Waiting, Rendering, Copying, Done };
+        Video video = videoIndex >= 0 ? Video::Waiting : Video::Done;
+        std::vector<bool> finished(c.in->nb_streams, false);
+        for (unsigned i = 0; i < c.in->nb_streams; ++i) {
+            finished[i] = streams[i] < 0;
+        }
+        // the decoder and encoder are drained before the first copied packet
+        auto finishRendering = [&](int64_t cut, int64_t end){
+            video = Video::Copying;
+            return decode(nullptr, cut, end) && encode(nullptr);
+        };
+
+        const int64_t total = endAt != INT64_MAX ? endAt - cutUs
+                                                 : (c.in->duration > 0 ? origin + c.in->duration - cutUs : 0);
+        int reported = -1;
+        while (av_read_frame(c.in, c.packet) >= 0) {
+            const int index = c.packet->stream_index;
+            const int64_t cut = inStream(cutUs, index);
+            const int64_t end = inStream(endAt, index);
+            const int64_t ts = c.packet->pts != AV_NOPTS_VALUE ? c.packet->pts : c.packet->dts;
+            if (m_progress && total > 0 && ts != AV_NOPTS_VALUE) {
+                const int64_t elapsed = av_rescale_q(ts, c.in->streams[index]->time_base, AV_TIME_BASE_Q) - cutUs;
+                const int percent = int(std::clamp<int64_t>(elapsed * 100 / total, 0, 99));
+                if (percent != reported) {
+                    reported = percent;
+                    m_progress(percent);
+                }
+            }
+            bool ok = true;
+            if (index == videoIndex && video != Video::Done) {
+                // frames after the end may only be references of ones before it,
+                // decoded ahead of them
+                const int64_t decodeTs = c.packet->dts != AV_NOPTS_VALUE ? c.packet->dts : ts;
+                const bool key = (c.packet->flags & AV_PKT_FLAG_KEY) != 0;
+                if (decodeTs != AV_NOPTS_VALUE && decodeTs >= end) {
+                    if (video == Video::Rendering) {
+                        ok = finishRendering(cut, end);
+                    }
+                    video = Video::Done;
+                    finished[index] = true;
+                } else if (video == Video::Waiting) {
+                    if (key) {
+                        m_keyframeUs = ts != AV_NOPTS_VALUE
+                                           ? av_rescale_q(ts, c.in->streams[index]->time_base, AV_TIME_BASE_Q) - origin
+                                           : startUs;
+                        if (c.packet->pts != AV_NOPTS_VALUE && c.packet->dts != AV_NOPTS_VALUE) {
+                            delay = c.packet->pts - c.packet->dts;
+                        }
+                        const bool exact = ts == AV_NOPTS_VALUE || ts >= cut;
+                        video = c.encoder && !exact ? Video::Rendering : Video::Copying;
+                        m_frameAccurate = exact || isoMedia || video == Video::Rendering;
+                        ok = video == Video::Rendering ? decode(c.packet, cut, end) : write(c.packet, index);
+                    }
+                } else if (video == Video::Rendering) {
+                    // the next keyframe is copied from on
+                    if (key) {
+                        ok = finishRendering(cut, end) && write(c.packet, index);
+                    } else {
+                        ok = decode(c.packet, cut, end);
+                    }
+                } else {
+                    ok = write(c.packet, index);
+                }
+            } else if (streams[index] >= 0 && !finished[index]) {
+                // audio to the packet, the part before the cut is trimmed by the
+                // edit list in mp4/mov
+                const int64_t duration = std::max<int64_t>(c.packet->duration, 0);
+                if (ts != AV_NOPTS_VALUE && ts >= end) {
+                    finished[index] = true;
+                } else if (ts == AV_NOPTS_VALUE || ts + duration > cut) {
+                    ok = write(c.packet, index);
+                }
+            }
+            av_packet_unref(c.packet);
+            if (!ok) {
+                return this->fail("error trimming " + source);
+            }
+            if (std::all_of(finished.begin(), finished.end(), [](bool done){ return done; })) {
+                break;
+            }
+        }
+        if (video == Video::Rendering && !finishRendering(inStream(cutUs, videoIndex), inStream(endAt, videoIndex))) {
+            return this->fail("error flushing the encoder");
+        }
+        if (video == Video::Waiting) {
+            return this->fail("no keyframe before the end in " + source);
+        }
+        if (av_write_trailer(c.out) < 0 || avio_closep(&c.out->pb) < 0) {
+            return this->fail("error finishing " + part);
+        }
+        return true;
+    }();
+
+    if (!ok) {
+        QFile::remove(part);
+        return false;
+    }
+    QFile::remove(output);
+    if (!QFile::rename(part, output)) {
+        QFile::remove(part);
+        return this->fail("could not rename " + part);
+    }
+    if (m_progress) {
+        m_progress(100);
+    }
+    return true;
+}
+
+}
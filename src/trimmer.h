@@ -0,0 +1,60 @@
+#ifndef TRIMMER_H
+#define TRIMMER_H
+
+#include <QString>
+#include <functional>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+namespace adc{
+
+// Cuts the start and end off a finished recording without re-encoding:
+// packets are copied from the keyframe at or before the cut, timestamps
+// moved so the cut is at zero. In mp4/mov the frames between that keyframe
+// and the cut get negative timestamps and the muxer's edit list hides
+// them, so playback starts on the exact frame; other containers start at
+// the keyframe. Smart render re-encodes the frames from the cut up to the
+// next keyframe instead and copies the rest, exact in every container
+// (H.264 baseline, main or high sources, with libx264 at the same profile
+// and level; its parameter sets are added to the avcC). Audio is cut to
+// the packet. The output is written to <output>.part and renamed once
+// complete.
+class Trimmer
+{
+public:
+    Trimmer();
+
+    // <name>_trim.<ext> next to the source
+    static QString outputPath(const QString& source);
+
+    void setSmartRender(bool enable);
+    void setProgress(const std::function<void(int percent)>& progress);
+
+    // keeps [startUs, endUs) of the recording's timeline, endUs <= 0 keeps
+    // everything after startUs
+    bool trim(const QString& source, const QString& output, int64_t startUs, int64_t endUs = 0);
+    QString errorString() const;
+    // of the last trim(): where the copied video starts on the source's
+    // timeline, and whether the output starts on the cut's frame
+    int64_t keyframeUs() const;
+    bool isFrameAccurate() const;
+    // frames re-encoded by smart render
+    int renderedFrames() const;
+
+private:
+    bool fail(const QString& message);
+
+private:
+    bool m_smartRender = false;
+    std::function<void(int)> m_progress;
+    QString m_error;
+    int64_t m_keyframeUs = 0;
+    bool m_frameAccurate = false;
+    int m_renderedFrames = 0;
+};
+
+}
+
+#endif // TRIMMER_H
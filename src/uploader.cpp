@@ -0,0 +1,426 @@
+#include "uploader.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QRandomGenerator>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QDir>
+#include <QDebug>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+namespace adc{
+
+namespace {
+constexpr int64_t kMinPartBytes = 5 * 1024 * 1024;
+// how often growing files are looked at
+constexpr int kPollMs = 500;
+
+struct Upload{
+    QString filename;
+    QString key;
+    QString uploadId;
+    int64_t partBytes = 0;
+    // by part number - 1, empty until sent
+    QStringList etags;
+    bool growing = false;
+    int attempts = 0;
+    int64_t retryUs = 0;
+};
+
+enum Step{
+    Waiting,
+    Progress,
+    Done,
+    Failed,
+};
+}
+
+class UploaderPrivate{
+public:
+    mutable QMutex mutex;
+    QWaitCondition wake;
+    QList<Upload*> uploads;
+    S3Config config;
+    int configVersion = 0;
+    int64_t partBytes = 8 * 1024 * 1024;
+    int maxAttempts = 8;
+    int maxBackoffMs = 60000;
+    bool quit = false;
+    std::atomic<bool> cancel{ false };
+    std::atomic<int64_t> uploadedBytes{ 0 };
+
+    Upload* find(const QString& filename) const{
+        for (Upload* upload : uploads) {
+            if (upload->filename == filename) {
+                return upload;
+            }
+        }
+        return nullptr;
+    }
+};
+
+namespace {
+// tab separated: key, upload id, part size, then one line per sent part
+void saveState(const Upload& upload){
+    QSaveFile file(Uploader::statePath(upload.filename));
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Could not write upload state" << file.fileName();
+        return;
+    }
+    QByteArray text = QString("key\t%1\nupload\t%2\npart\t%3\n")
+                          .arg(upload.key, upload.uploadId).arg(upload.partBytes).toUtf8();
+    for (int i = 0; i < upload.etags.size(); ++i) {
+        if (!upload.etags[i].isEmpty()) {
+            text += QString("etag\t%1\t%2\n").arg(i + 1).arg(upload.etags[i]).toUtf8();
+        }
+    }
+    file.write(text);
+    file.commit();
+}
+
+bool loadState(Upload* upload){
+    QFile file(Uploader::statePath(upload->filename));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    while (!file.atEnd()) {
+        const QStringList fields = QString::fromUtf8(file.readLine()).trimmed().split('\t');
+        if (fields.size() == 2 && fields[0] == "key") {
+            upload->key = fields[1];
+        } else if (fields.size() == 2 && fields[0] == "upload") {
+            upload->uploadId = fields[1];
+        } else if (fields.size() == 2 && fields[0] == "part") {
+            upload->partBytes = fields[1].toLongLong();
+        } else if (fields.size() == 3 && fields[0] == "etag") {
+            const int number = fields[1].toInt();
+            if (number < 1) {
+                continue;
+            }
+            while (upload->etags.size() < number) {
+                upload->etags.append(QString());
+            }
+            upload->etags[number - 1] = fields[2];
+        }
+    }
+    // parts of an unknown size cannot be continued
+    if (upload->key.isEmpty() || upload->partBytes < kMinPartBytes) {
+        upload->uploadId.clear();
+        upload->etags.clear();
+    }
+    return !upload->key.isEmpty();
+}
+
+QByteArray readRange(QFile& file, int64_t offset, int64_t size){
+    if (!file.seek(offset)) {
+        return QByteArray();
+    }
+    return file.read(size);
+}
+}
+
+Uploader::Uploader(QObject *parent)
+    : QThread{parent}
+{
+    d = new UploaderPrivate;
+}
+
+Uploader::~Uploader(){
+    this->shutdown();
+    this->wait();
+    qDeleteAll(d->uploads);
+    delete d;
+}
+
+QString Uploader::statePath(const QString& filename){
+    return filename + ".upload";
+}
+
+void Uploader::setConfig(const S3Config& config){
+    QMutexLocker locker(&d->mutex);
+    d->config = config;
+    d->configVersion += 1;
+    d->wake.wakeOne();
+}
+
+bool Uploader::isEnabled() const{
+    QMutexLocker locker(&d->mutex);
+    return d->config.isValid();
+}
+
+void Uploader::setPartSize(int64_t bytes){
+    QMutexLocker locker(&d->mutex);
+    d->partBytes = std::max(kMinPartBytes, bytes);
+}
+
+void Uploader::setRetries(int attempts, int maxBackoffMs){
+    QMutexLocker locker(&d->mutex);
+    d->maxAttempts = std::max(0, attempts);
+    d->maxBackoffMs = std::max(1000, maxBackoffMs);
+}
+
+void Uploader::follow(const QString& filename){
+    this->enqueue(filename, true);
+}
+
+void Uploader::add(const QString& filename){
+    this->enqueue(filename, false);
+}
+
+void Uploader::enqueue(const QString& filename, bool growing){
+    {
+        QMutexLocker locker(&d->mutex);
+        if (!d->config.isValid()) {
+            return;
+        }
+        if (Upload* upload = d->find(filename)) {
+            upload->growing = growing;
+            d->wake.wakeOne();
+            return;
+        }
+        // a new file under an old name starts over
+        QFile::remove(statePath(filename));
+        auto upload = new Upload;
+        upload->filename = filename;
+        upload->key = d->config.prefix + QFileInfo(filename).fileName();
+        upload->partBytes = d->partBytes;
+        upload->growing = growing;
+        d->uploads.append(upload);
+        d->quit = false;
+        d->cancel = false;
+        d->wake.wakeOne();
+    }
+    if (!this->isRunning()) {
+        this->start(QThread::LowPriority);
+    }
+}
+
+int Uploader::resume(const QString& directory){
+    int count = 0;
+    {
+        QMutexLocker locker(&d->mutex);
+        if (!d->config.isValid()) {
+            return 0;
+        }
+        const QDir dir(directory);
+        for (const QString& name : dir.entryList({ "*.upload" }, QDir::Files)) {
+            const QString state = dir.filePath(name);
+            const QString filename = state.left(state.lastIndexOf(".upload"));
+            if (d->find(filename)) {
+                continue;
+            }
+            auto upload = new Upload;
+            upload->filename = filename;
+            if (!QFileInfo::exists(filename) || !loadState(upload)) {
+                QFile::remove(state);
+                delete upload;
+                continue;
+            }
+            // whatever was being written when the last run ended is all there is
+            upload->growing = false;
+            d->uploads.append(upload);
+            count += 1;
+        }
+        if (count > 0) {
+            d->quit = false;
+            d->cancel = false;
+            d->wake.wakeOne();
+        }
+    }
+    if (count > 0 && !this->isRunning()) {
+        this->start(QThread::LowPriority);
+    }
+    return count;
+}
+
+int Uploader::pending() const{
+    QMutexLocker locker(&d->mutex);
+    return d->uploads.size();
+}
+
+int64_t Uploader::uploadedBytes() const{
+    return d->uploadedBytes;
+}
+
+void Uploader::shutdown(){
+    QMutexLocker locker(&d->mutex);
+    d->quit = true;
+    d->cancel = true;
+    d->wake.wakeOne();
+}
+
+void Uploader::run(){
+    std::unique_ptr<S3Client> client;
+    int clientVersion = -1;
+    while (true) {
+        Upload* upload = nullptr;
+        bool growing = false;
+        int64_t partBytes = 0;
+        int maxAttempts = 0;
+        int maxBackoffMs = 0;
+        {
+            QMutexLocker locker(&d->mutex);
+            while (!d->quit) {
+                // round robin over the uploads that are not backing off
+                const int64_t now = av_gettime_relative();
+                int64_t nextUs = now + int64_t(kPollMs) * 1000;
+                if (d->config.isValid()) {
+                    for (int i = 0; i < d->uploads.size(); ++i) {
+                        if (d->uploads[i]->retryUs <= now) {
+                            upload = d->uploads.takeAt(i);
+                            d->uploads.append(upload);
+                            break;
+                        }
+                        nextUs = std::min(nextUs, d->uploads[i]->retryUs);
+                    }
+                }
+                if (upload) {
+                    break;
+                }
+                if (d->uploads.isEmpty()) {
+                    d->wake.wait(&d->mutex);
+                } else {
+                    d->wake.wait(&d->mutex, ulong(std::max<int64_t>(1, (nextUs - now) / 1000)));
+                }
+            }
+            if (d->quit) {
+                return;
+            }
+            if (clientVersion != d->configVersion) {
+                client.reset(new S3Client(d->config));
+                client->setCancelFlag(&d->cancel);
+                clientVersion = d->configVersion;
+            }
+            growing = upload->growing;
+            partBytes = upload->partBytes;
+            maxAttempts = d->maxAttempts;
+            maxBackoffMs = d->maxBackoffMs;
+        }
+
+        // one request per round, the lock is not held meanwhile
+        Step step = Waiting;
+        bool gone = false;
+        QFile file(upload->filename);
+        if (!file.open(QIODevice::ReadOnly)) {
+            if (growing) {
+                upload->retryUs = av_gettime_relative() + int64_t(kPollMs) * 1000;
+                continue;
+            }
+            // deleted by retention before it got out
+            qWarning() << "Upload source is gone" << upload->filename;
+            if (!upload->uploadId.isEmpty()) {
+                client->abortUpload(upload->key, upload->uploadId);
+            }
+            QFile::remove(statePath(upload->filename));
+            step = Failed;
+            gone = true;
+        } else {
+            const int64_t size = file.size();
+            if (upload->uploadId.isEmpty()) {
+                if (!growing && size < partBytes) {
+                    step = client->putObject(upload->key, file.readAll()) ? Done : Failed;
+                    if (step == Done) {
+                        d->uploadedBytes += size;
+                    }
+                } else if (growing && size < 3 * partBytes) {
+                    // until the second part is ready, see below
+                    step = Waiting;
+                } else if (client->createUpload(upload->key, &upload->uploadId)) {
+                    saveState(*upload);
+                    step = Progress;
+                } else {
+                    step = Failed;
+                }
+            } else {
+                // a growing file keeps a part behind its end (written
+                // behind, the muxer may still go back into it) and its
+                // first part, rewritten on close, until it is closed
+                const int parts = growing ? int(size / partBytes) - 1
+                                          : int(std::max<int64_t>(1, (size + partBytes - 1) / partBytes));
+                int next = 0;
+                for (int number = growing ? 2 : 1; number <= parts; ++number) {
+                    if (number > upload->etags.size() || upload->etags[number - 1].isEmpty()) {
+                        next = number;
+                        break;
+                    }
+                }
+                if (next > 0) {
+                    const int64_t offset = int64_t(next - 1) * partBytes;
+                    const QByteArray data = readRange(file, offset, std::min(partBytes, size - offset));
+                    QString etag;
+                    if (data.isEmpty() && size > 0) {
+                        step = Waiting;
+                    } else if (client->uploadPart(upload->key, upload->uploadId, next, data, &etag)) {
+                        while (upload->etags.size() < next) {
+                            upload->etags.append(QString());
+                        }
+                        upload->etags[next - 1] = etag;
+                        d->uploadedBytes += data.size();
+                        saveState(*upload);
+                        step = Progress;
+                    } else {
+                        step = Failed;
+                    }
+                } else if (growing) {
+                    step = Waiting;
+                } else {
+                    upload->etags = upload->etags.mid(0, parts);
+                    step = client->completeUpload(upload->key, upload->uploadId, upload->etags) ? Done : Failed;
+                }
+            }
+        }
+
+        if (step == Failed && d->cancel) {
+            // shutting down, the state file has the rest
+            return;
+        }
+        if (step == Failed && !gone && client->status() == 404 && !upload->uploadId.isEmpty() &&
+            upload->attempts < maxAttempts) {
+            // the upload expired or was aborted on the server: start over
+            qWarning() << "Restarting upload" << upload->key << client->errorString();
+            upload->uploadId.clear();
+            upload->etags.clear();
+            upload->attempts += 1;
+            saveState(*upload);
+            continue;
+        }
+        if (step == Failed && !gone && client->retryable() && upload->attempts < maxAttempts) {
+            const int64_t backoffMs = std::min<int64_t>(maxBackoffMs, 1000ll << std::min(upload->attempts, 16));
+            const int64_t jitterMs = QRandomGenerator::global()->bounded(int(backoffMs / 4) + 1);
+            qWarning() << "Upload failed, retrying in" << backoffMs + jitterMs << "ms:" << client->errorString();
+            upload->attempts += 1;
+            upload->retryUs = av_gettime_relative() + (backoffMs + jitterMs) * 1000;
+            continue;
+        }
+        if (step == Waiting) {
+            upload->retryUs = av_gettime_relative() + int64_t(kPollMs) * 1000;
+            continue;
+        }
+        if (step == Progress) {
+            upload->attempts = 0;
+            continue;
+        }
+
+        if (step == Done) {
+            QFile::remove(statePath(upload->filename));
+        } else {
+            // the state file stays for resume()
+            qWarning() << "Upload failed" << upload->filename << client->errorString();
+        }
+        {
+            QMutexLocker locker(&d->mutex);
+            d->uploads.removeOne(upload);
+        }
+        emit uploaded(upload->filename, upload->key, step == Done);
+        delete upload;
+    }
+}
+
+}
@@ -0,0 +1,62 @@
+#ifndef UPLOADER_H
+#define UPLOADER_H
+
+#include <QThread>
+#include <QString>
+#include "s3_client.h"
+
+namespace adc{
+
+// Uploads recordings to S3-compatible storage on its own thread while the
+// recording goes on. Files are read back from disk one part at a time, so
+// memory stays at a part per upload and a slow link never holds up the
+// encoder or the writer. Growing files (fragmented mp4 / mkv) are sent as
+// they are written, all but their first part, where the muxer goes back to
+// on close; that part follows once the file is closed. Failed requests are
+// retried with exponential backoff; progress is kept in <file>.upload, so
+// uploads cut off by a restart resume where they stopped.
+class UploaderPrivate;
+class Uploader : public QThread
+{
+    Q_OBJECT
+public:
+    explicit Uploader(QObject *parent = nullptr);
+    ~Uploader();
+
+    static QString statePath(const QString& filename);
+
+    // an invalid config turns uploading off, queued uploads stay on disk
+    void setConfig(const S3Config& config);
+    bool isEnabled() const;
+    // parts are at least 5 MiB (the S3 minimum)
+    void setPartSize(int64_t bytes);
+    void setRetries(int attempts, int maxBackoffMs);
+
+    // a file still being written
+    void follow(const QString& filename);
+    // a finished file; completes the upload of a followed one
+    void add(const QString& filename);
+    // queues the uploads a previous run left in directory
+    int resume(const QString& directory);
+
+    int pending() const;
+    int64_t uploadedBytes() const;
+    // stops after the current request; what is left resumes next time
+    void shutdown();
+
+signals:
+    void uploaded(const QString& filename, const QString& key, bool ok);
+
+protected:
+    void run() override;
+
+private:
+    void enqueue(const QString& filename, bool growing);
+
+private:
+    UploaderPrivate* d;
+};
+
+}
+
+#endif // UPLOADER_H
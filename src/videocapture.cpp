@@ -25,6 +25,7 @@
 #include <QRect>
 #include <QImage>
 #include <QDebug>
+#include <atomic>
 
 namespace adc{
 class VideoCapturePrivate{
@@ -39,9 +40,11 @@ public:
     winrt::Windows::Graphics::Capture::GraphicsCaptureSession captureSession{ nullptr };
 
     //QTimer m_captureTimer;
-    bool capturing = false;
+    std::atomic<bool> capturing{ false };
     bool initialized = false;
-    bool paused = false;
+    bool prepared = false;
+    // flipped by the recorder's worker, checked once per frame
+    std::atomic<bool> paused{ false };
     UINT width = 0;
     UINT height = 0;
     float interval = 0;
@@ -60,11 +63,16 @@ VideoCapture::VideoCapture(Recorder* instance)
 {
     d = new VideoCapturePrivate;
     d->instance = instance;
-    connect(this, &QThread::finished, this, &VideoCapture::onFinished);
+    // runs on the capture thread before wait() returns, so the recorder can
+    // prepare the next session as soon as stop() is done
+    connect(this, &QThread::finished, this, &VideoCapture::onFinished, Qt::DirectConnection);
 
 }
 
 void VideoCapture::setMode(Mode mode){
+    if (mode != d->mode && !d->capturing) {
+        this->release();
+    }
     d->mode = mode;
 }
 
@@ -73,10 +81,16 @@ VideoCapture::Mode VideoCapture::mode(){
 }
 
 void VideoCapture::setScreen(HMONITOR monitor){
+    if (monitor != d->monitor && !d->capturing) {
+        this->release();
+    }
     d->monitor = monitor;
 }
 
 void VideoCapture::setWindow(HWND hwnd){
+    if (hwnd != d->hwnd && !d->capturing) {
+        this->release();
+    }
     d->hwnd = hwnd;
 }
 
@@ -98,7 +112,16 @@ bool VideoCapture::init()
         return false;
     }
     d->initialized = true;
+    return true;
+}
 
+bool VideoCapture::prepare(){
+    if (d->prepared) {
+        return true;
+    }
+    if (!init()) {
+        return false;
+    }
     if(d->mode==Screen || d->mode==Region){
         if(d->monitor==0){
             if (!createCaptureItem(MonitorFromWindow(nullptr, MONITOR_DEFAULTTOPRIMARY))) {
@@ -114,25 +137,30 @@ bool VideoCapture::init()
             return false;
         }
     }
-
+    if (!createFramePool()) {
+        return false;
+    }
+    if (!createCaptureSession()) {
+        return false;
+    }
+    d->prepared = true;
     return true;
 }
 
+bool VideoCapture::isPrepared() const{
+    return d->prepared;
+}
+
 bool VideoCapture::startRecording(){
     if (d->capturing) {
         stopRecording();
     }
-    if (!init()) {
-        return false;
-    }
-    if (!createFramePool()) {
-        return false;
-    }
-    if (!createCaptureSession()) {
+    if (!prepare()) {
         return false;
     }
     try {
         d->captureSession.StartCapture();
+        d->paused = false;
         d->capturing = true;
         qDebug() << "Graphics Capture started successfully";
         this->start();
@@ -244,7 +272,8 @@ bool VideoCapture::createFramePool()
             return false;
         }
         auto direct3DDevice = inspectable.as<winrt::Windows::Graphics::DirectX::Direct3D11::IDirect3DDevice>();
-        d->framePool = winrt::Windows::Graphics::Capture::Direct3D11CaptureFramePool::Create(direct3DDevice,winrt::Windows::Graphics::DirectX::DirectXPixelFormat::B8G8R8A8UIntNormalized,2,d->captureItem.Size());
+        // free threaded: the pool may be created on the recorder's worker thread
+        d->framePool = winrt::Windows::Graphics::Capture::Direct3D11CaptureFramePool::CreateFreeThreaded(direct3DDevice,winrt::Windows::Graphics::DirectX::DirectXPixelFormat::B8G8R8A8UIntNormalized,2,d->captureItem.Size());
         qDebug() << "Frame pool created successfully";
         return true;
     }catch (const winrt::hresult_error& error) {
@@ -364,6 +393,11 @@ void VideoCapture::run(){
 }
 
 void VideoCapture::onFinished() {
+    this->release();
+}
+
+void VideoCapture::release() {
+        d->prepared = false;
         try {
             if (d->captureSession) {
                 d->captureSession.Close();
@@ -27,6 +27,9 @@ public:
     void setWindow(HWND hwnd);
     void setRegion(const QRect& rc);
     bool init();
+    //capture item, frame pool and session for the current target
+    bool prepare();
+    bool isPrepared() const;
     bool startRecording();
     void stopRecording();
     ~VideoCapture();
@@ -57,6 +60,7 @@ private:
     bool createCaptureItem(HMONITOR monitor);
     bool createFramePool();
     bool createCaptureSession();
+    void release();
 
 
     //QImage textureToImage(ID3D11Texture2D* texture);
@@ -0,0 +1,148 @@
+// Decrypts a recording written with Recorder::setEncryptionKey.
+//
+// Every chunk is authenticated before it is written out; a wrong key, a
+// modified file or a file cut off before its final chunk is reported (what
+// verified up to that point is kept in the output).
+//
+//   decrypt_recording <recording> <output> <64 hex digits | @keyfile>
+//
+// --bench writes the same data through AsyncFile plain and encrypted and
+// prints the throughput of both and the share of time spent in AES-GCM:
+//
+//   decrypt_recording --bench [MiB=1024] [directory=temp]
+
+#include "async_file.h"
+#include "encrypted_file.h"
+
+#include <QFile>
+#include <QDir>
+#include <QString>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace adc;
+
+namespace {
+
+QByteArray readKey(const QString& arg){
+    QByteArray text = arg.toUtf8();
+    if (arg.startsWith("@")) {
+        QFile file(arg.mid(1));
+        if (!file.open(QIODevice::ReadOnly)) {
+            return QByteArray();
+        }
+        text = file.readAll();
+        // a raw key file
+        if (text.size() == ChunkCipher::kKeyBytes) {
+            return text;
+        }
+    }
+    const QByteArray key = QByteArray::fromHex(text.trimmed());
+    return key.size() == ChunkCipher::kKeyBytes ? key : QByteArray();
+}
+
+struct BenchResult{
+    double seconds = 0;
+    double cipherMs = 0;
+    bool ok = false;
+};
+
+BenchResult writeFile(const QString& path, int64_t bytes, const QByteArray& key){
+    BenchResult result;
+    AsyncFile::Options options;
+    options.sync = AsyncFile::SyncNever;
+    options.metrics = std::make_shared<WriteMetrics>();
+    options.key = key;
+    AVFormatContext* ctx = avformat_alloc_context();
+    if (!ctx) {
+        return result;
+    }
+    // packet sized writes, like the muxer's
+    std::vector<uint8_t> packet(64 * 1024);
+    for (size_t i = 0; i < packet.size(); ++i) {
+        packet[i] = uint8_t(i * 31 + (i >> 8));
+    }
+    const auto start = std::chrono::steady_clock::now();
+    if (AsyncFile::open(ctx, path, options) < 0) {
+        avformat_free_context(ctx);
+        return result;
+    }
+    for (int64_t written = 0; written < bytes; written += int64_t(packet.size())) {
+        avio_write(ctx->pb, packet.data(), int(packet.size()));
+    }
+    result.ok = AsyncFile::close(ctx) >= 0;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.cipherMs = options.metrics->stats().cipherMs;
+    avformat_free_context(ctx);
+    QFile::remove(path);
+    return result;
+}
+
+int bench(int argc, char* argv[]){
+    const int64_t mib = argc > 2 ? std::max(1, atoi(argv[2])) : 1024;
+    const QDir dir(argc > 3 ? QString::fromUtf8(argv[3]) : QDir::tempPath());
+    const int64_t bytes = mib * 1024 * 1024;
+    QByteArray key(ChunkCipher::kKeyBytes, 0);
+    if (!ChunkCipher::random(reinterpret_cast<uint8_t*>(key.data()), key.size())) {
+        fprintf(stderr, "no AES-GCM support on this system\n");
+        return 1;
+    }
+    const BenchResult plain = writeFile(dir.filePath("decrypt_bench_plain.bin"), bytes, QByteArray());
+    const BenchResult encrypted = writeFile(dir.filePath("decrypt_bench_encrypted.bin"), bytes, key);
+    if (!plain.ok || !encrypted.ok) {
+        fprintf(stderr, "could not write to %s\n", dir.absolutePath().toUtf8().constData());
+        return 1;
+    }
+    const double plainRate = mib / plain.seconds;
+    const double encryptedRate = mib / encrypted.seconds;
+    printf("| write | MiB/s | AES-GCM ms |\n|---|---|---|\n");
+    printf("| plain | %.0f | - |\n", plainRate);
+    printf("| encrypted | %.0f | %.0f |\n", encryptedRate, encrypted.cipherMs);
+    printf("\nthroughput overhead %.1f%%, cipher %.0f MiB/s (%.1f%% of the write time)\n",
+           (plainRate - encryptedRate) * 100.0 / plainRate,
+           mib * 1000.0 / std::max(encrypted.cipherMs, 0.001),
+           encrypted.cipherMs / 10.0 / encrypted.seconds);
+    return 0;
+}
+
+}
+
+int main(int argc, char* argv[]){
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        return bench(argc, argv);
+    }
+    if (argc < 4) {
+        fprintf(stderr, "usage: decrypt_recording <recording> <output> <64 hex digits | @keyfile>\n"
+                        "       decrypt_recording --bench [MiB] [directory]\n");
+        return 1;
+    }
+    const QByteArray key = readKey(QString::fromUtf8(argv[3]));
+    if (key.isEmpty()) {
+        fprintf(stderr, "the key must be 32 bytes: 64 hex digits or a key file\n");
+        return 1;
+    }
+    QFile in(QString::fromUtf8(argv[1]));
+    QFile out(QString::fromUtf8(argv[2]));
+    if (!in.open(QIODevice::ReadOnly)) {
+        fprintf(stderr, "could not open %s\n", argv[1]);
+        return 1;
+    }
+    if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        fprintf(stderr, "could not create %s\n", argv[2]);
+        return 1;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    QString error;
+    const bool ok = EncryptedFile::decrypt(&in, &out, key, &error);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!ok) {
+        fprintf(stderr, "decryption failed: %s\n", error.toUtf8().constData());
+        return 1;
+    }
+    printf("decrypted %lld bytes into %s in %.2fs\n", (long long)out.size(), argv[2], seconds);
+    return 0;
+}
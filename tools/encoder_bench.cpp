@@ -0,0 +1,185 @@
+// Encoder threading benchmark.
+//
+// Encodes synthetic screen-like frames at every resolution offered by
+// MainWindow::initResolution and compares the plan chosen by
+// EncoderTuning::planThreading with fixed frame / slice threading on all
+// cores and with a single thread. Prints a markdown table of achieved fps,
+// the realtime factor against the target fps and the bitrate, then a sweep
+// of frame thread counts up to one per macroblock row (at most 64): every
+// x264 frame thread narrows the motion search range, which shows up as
+// bitrate even on a machine with fewer cores than threads.
+//
+//   encoder_bench [encoder=libx264] [frames=120] [preset=veryfast] [max height=4320]
+
+#include "encoder_tuning.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+}
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace adc;
+
+namespace {
+
+struct Config{
+    const char* name;
+    ThreadingPlan plan;
+};
+
+// scrolling high-contrast rows (text) with a moving flat block (window drag)
+void fillFrame(AVFrame* frame, int index){
+    for (int y = 0; y < frame->height; ++y) {
+        uint8_t* line = frame->data[0] + y * frame->linesize[0];
+        int row = (y + index * 4) % 24;
+        for (int x = 0; x < frame->width; ++x) {
+            line[x] = (row < 12 && (x / 6 + y / 24) % 3) ? 230 : 24;
+        }
+    }
+    int bx = (index * 16) % std::max(1, frame->width - frame->width / 4);
+    for (int y = frame->height / 4; y < frame->height / 2; ++y) {
+        memset(frame->data[0] + y * frame->linesize[0] + bx, 128, frame->width / 4);
+    }
+    for (int p = 1; p < 3; ++p) {
+        for (int y = 0; y < frame->height / 2; ++y) {
+            memset(frame->data[p] + y * frame->linesize[p], 128, frame->width / 2);
+        }
+    }
+}
+
+struct Result{
+    double fps = 0;     // 0 on failure
+    double kbps = 0;
+};
+
+Result run(const AVCodec* codec, const char* preset, int width, int height, int fps, const ThreadingPlan& plan, int frames){
+    Result result;
+    AVCodecContext* ctx = avcodec_alloc_context3(codec);
+    ctx->width = width;
+    ctx->height = height;
+    ctx->time_base = AVRational{ 1, fps };
+    ctx->framerate = AVRational{ fps, 1 };
+    ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    ctx->gop_size = fps * 2;
+    AVDictionary* opts = nullptr;
+    av_dict_set(&opts, "preset", preset, 0);
+    EncoderTuning::applyThreading(ctx, &opts, plan);
+    if (avcodec_open2(ctx, codec, &opts) < 0) {
+        av_dict_free(&opts);
+        avcodec_free_context(&ctx);
+        return result;
+    }
+    av_dict_free(&opts);
+
+    AVFrame* frame = av_frame_alloc();
+    frame->format = ctx->pix_fmt;
+    frame->width = width;
+    frame->height = height;
+    av_frame_get_buffer(frame, 32);
+    AVPacket* pkt = av_packet_alloc();
+    int64_t bytes = 0;
+
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i <= frames; ++i) {
+        AVFrame* input = nullptr;
+        if (i < frames) {
+            av_frame_make_writable(frame);
+            fillFrame(frame, i);
+            frame->pts = i;
+            input = frame;
+        }
+        avcodec_send_frame(ctx, input);
+        while (avcodec_receive_packet(ctx, pkt) >= 0) {
+            bytes += pkt->size;
+            av_packet_unref(pkt);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    avcodec_free_context(&ctx);
+    result.fps = seconds > 0 ? frames / seconds : 0;
+    result.kbps = bytes * 8.0 / 1000 * fps / frames;
+    return result;
+}
+
+}
+
+int main(int argc, char* argv[]){
+    const char* encoder = argc > 1 ? argv[1] : "libx264";
+    const int frames = argc > 2 ? std::max(1, atoi(argv[2])) : 120;
+    const char* preset = argc > 3 ? argv[3] : "veryfast";
+    // 8K frame threads need several GB
+    const int maxHeight = argc > 4 ? atoi(argv[4]) : 4320;
+    const AVCodec* codec = avcodec_find_encoder_by_name(encoder);
+    if (!codec) {
+        fprintf(stderr, "encoder %s not found\n", encoder);
+        return 1;
+    }
+    const int cores = std::max(1u, std::thread::hardware_concurrency());
+
+    const int resolutions[][2] = { {1280, 720}, {1920, 1080}, {3840, 2160}, {7680, 4320} };
+    const int rates[] = { 30, 60 };
+
+    printf("%s preset=%s cores=%d frames=%d\n\n", encoder, preset, cores, frames);
+    printf("| resolution | fps | config | threads | type | encoded fps | realtime | kbps |\n");
+    printf("|---|---|---|---|---|---|---|---|\n");
+    for (auto& res : resolutions) {
+        if (res[1] > maxHeight) {
+            continue;
+        }
+        for (int fps : rates) {
+            std::vector<Config> configs;
+            configs.push_back({ "auto", EncoderTuning::planThreading(encoder, res[0], res[1], fps, cores, false) });
+            configs.push_back({ "auto-lowlatency", EncoderTuning::planThreading(encoder, res[0], res[1], fps, cores, true) });
+            ThreadingPlan frame;
+            frame.threads = cores;
+            frame.threadType = FF_THREAD_FRAME;
+            configs.push_back({ "frame-all", frame });
+            ThreadingPlan slice;
+            slice.threads = cores;
+            slice.threadType = FF_THREAD_SLICE;
+            configs.push_back({ "slice-all", slice });
+            ThreadingPlan single;
+            single.threads = 1;
+            configs.push_back({ "single", single });
+
+            for (auto& config : configs) {
+                Result encoded = run(codec, preset, res[0], res[1], fps, config.plan, frames);
+                printf("| %dx%d | %d | %s | %d | %s | %.1f | %.2fx | %.0f |\n", res[0], res[1], fps, config.name,
+                       config.plan.threads, config.plan.threadType == FF_THREAD_SLICE ? "slice" : "frame",
+                       encoded.fps, encoded.fps / fps, encoded.kbps);
+                fflush(stdout);
+            }
+        }
+    }
+
+    printf("\n| resolution | mb rows | frame threads | encoded fps | kbps |\n");
+    printf("|---|---|---|---|---|\n");
+    for (auto& res : resolutions) {
+        if (res[1] > maxHeight) {
+            continue;
+        }
+        const int mbRows = (res[1] + 15) / 16;
+        // planThreading never goes past 64
+        for (int threads = 1; threads <= std::min(mbRows, 64); threads *= 2) {
+            ThreadingPlan plan;
+            plan.threads = threads;
+            plan.threadType = FF_THREAD_FRAME;
+            Result encoded = run(codec, preset, res[0], res[1], 30, plan, frames);
+            printf("| %dx%d | %d | %d | %.1f | %.0f |\n", res[0], res[1], mbRows, threads, encoded.fps, encoded.kbps);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,132 @@
+// Checks a recording's frame index and times seeking with it.
+//
+// Every packet the demuxer reads has to match its record: timestamps, size,
+// keyframe flag and, where the index has them, the byte offset. Then random
+// keyframe lookups in the memory mapped index are timed against
+// av_seek_frame() plus the first packet read on the file itself.
+//
+//   index_check <recording> [index=<recording>.index] [seeks=1000]
+
+#include "frame_index.h"
+
+#include <QString>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace adc;
+
+namespace {
+double microseconds(std::chrono::steady_clock::time_point since){
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - since).count();
+}
+}
+
+int main(int argc, char* argv[]){
+    if (argc < 2) {
+        fprintf(stderr, "usage: index_check <recording> [index] [seeks]\n");
+        return 1;
+    }
+    const QString recording = QString::fromUtf8(argv[1]);
+    const QString path = argc > 2 ? QString::fromUtf8(argv[2]) : FrameIndexWriter::pathFor(recording);
+    const int seeks = argc > 3 ? std::max(1, atoi(argv[3])) : 1000;
+
+    auto start = std::chrono::steady_clock::now();
+    FrameIndex index;
+    if (!index.open(path)) {
+        fprintf(stderr, "could not open %s\n", path.toUtf8().constData());
+        return 1;
+    }
+    printf("%s: %d streams, opened in %.0f us\n", path.toUtf8().constData(), index.streams(), microseconds(start));
+    for (int i = 0; i < index.streams(); ++i) {
+        printf("  stream %d: %s, %lld packets, %lld keyframes\n", i, av_get_media_type_string(index.type(i)),
+               (long long)index.count(i), (long long)index.keyframes(i));
+    }
+
+    AVFormatContext* in = nullptr;
+    if (avformat_open_input(&in, argv[1], nullptr, nullptr) < 0 || avformat_find_stream_info(in, nullptr) < 0) {
+        fprintf(stderr, "could not read %s\n", argv[1]);
+        return 1;
+    }
+    if (int(in->nb_streams) != index.streams()) {
+        fprintf(stderr, "%u streams in the file, %d in the index\n", in->nb_streams, index.streams());
+        return 1;
+    }
+
+    // every packet against its record
+    std::vector<int64_t> next(in->nb_streams, 0);
+    int64_t packets = 0;
+    int64_t mismatches = 0;
+    AVPacket* packet = av_packet_alloc();
+    while (av_read_frame(in, packet) >= 0) {
+        const int s = packet->stream_index;
+        const int64_t i = next[s]++;
+        packets += 1;
+        if (i >= index.count(s)) {
+            mismatches += 1;
+            av_packet_unref(packet);
+            continue;
+        }
+        const FrameIndexRecord& record = index.record(s, i);
+        const AVRational from = in->streams[s]->time_base;
+        const AVRational to = index.timeBase(s);
+        const bool ok = av_rescale_q(packet->pts, from, to) == record.pts &&
+                        av_rescale_q(packet->dts, from, to) == record.dts &&
+                        uint32_t(packet->size) == record.size &&
+                        ((packet->flags & AV_PKT_FLAG_KEY) != 0) == ((record.flags & AV_PKT_FLAG_KEY) != 0) &&
+                        (record.offset < 0 || record.offset == packet->pos);
+        if (!ok) {
+            if (mismatches < 5) {
+                printf("  stream %d packet %lld: file pts %lld dts %lld size %d pos %lld, index pts %lld dts %lld size %u offset %lld\n",
+                       s, (long long)i, (long long)packet->pts, (long long)packet->dts, packet->size,
+                       (long long)packet->pos, (long long)record.pts, (long long)record.dts, record.size,
+                       (long long)record.offset);
+            }
+            mismatches += 1;
+        }
+        av_packet_unref(packet);
+    }
+    for (int s = 0; s < index.streams(); ++s) {
+        if (next[s] != index.count(s)) {
+            printf("  stream %d: %lld packets in the file, %lld in the index\n", s, (long long)next[s],
+                   (long long)index.count(s));
+            mismatches += 1;
+        }
+    }
+    printf("%lld packets checked, %lld mismatches\n", (long long)packets, (long long)mismatches);
+
+    const int video = index.find(AVMEDIA_TYPE_VIDEO);
+    if (video >= 0 && index.keyframes(video) > 0 && index.count(video) > 0) {
+        const int64_t first = index.record(video, 0).pts;
+        const int64_t last = index.record(video, index.count(video) - 1).pts;
+        std::mt19937_64 random(1);
+        std::uniform_int_distribution<int64_t> pick(first, std::max(first, last));
+        std::vector<int64_t> targets(seeks);
+        for (int64_t& target : targets) {
+            target = pick(random);
+        }
+
+        start = std::chrono::steady_clock::now();
+        int64_t found = 0;
+        for (int64_t target : targets) {
+            found += index.seek(video, target) >= 0 ? 1 : 0;
+        }
+        const double indexed = microseconds(start) / seeks;
+
+        start = std::chrono::steady_clock::now();
+        for (int64_t target : targets) {
+            const int64_t ts = av_rescale_q(target, index.timeBase(video), in->streams[video]->time_base);
+            if (av_seek_frame(in, video, ts, AVSEEK_FLAG_BACKWARD) >= 0 && av_read_frame(in, packet) >= 0) {
+                av_packet_unref(packet);
+            }
+        }
+        const double demuxed = microseconds(start) / seeks;
+        printf("%d seeks: index %.2f us, av_seek_frame %.1f us (%lld found)\n", seeks, indexed, demuxed,
+               (long long)found);
+    }
+    av_packet_free(&packet);
+    avformat_close_input(&in);
+    return mismatches == 0 ? 0 : 1;
+}
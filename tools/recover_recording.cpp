@@ -0,0 +1,43 @@
+// Rebuilds a recording that was cut off before its trailer.
+//
+// Reads the samples listed in <recording>.journal straight out of the
+// orphaned mdat and muxes them into a new file, without decoding. Samples
+// the journal lists past the end of what reached the disk are dropped.
+//
+//   recover_recording <recording.mp4> [output=<name>_recovered.<ext>] [journal=<recording>.journal]
+
+#include "recovery_journal.h"
+
+#include <QFileInfo>
+#include <QDir>
+#include <QString>
+#include <chrono>
+#include <cstdio>
+
+using namespace adc;
+
+int main(int argc, char* argv[]){
+    if (argc < 2) {
+        fprintf(stderr, "usage: recover_recording <recording.mp4> [output] [journal]\n");
+        return 1;
+    }
+    const QString damaged = QString::fromUtf8(argv[1]);
+    QString output = argc > 2 ? QString::fromUtf8(argv[2]) : QString();
+    if (output.isEmpty()) {
+        QFileInfo info(damaged);
+        output = info.dir().filePath(QString("%1_recovered.%2").arg(info.completeBaseName(), info.suffix()));
+    }
+    const QString journal = argc > 3 ? QString::fromUtf8(argv[3]) : RecoveryJournal::pathFor(damaged);
+
+    const auto start = std::chrono::steady_clock::now();
+    const int ret = RecoveryJournal::recover(journal, damaged, output);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (ret < 0) {
+        char reason[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+        av_strerror(ret, reason, sizeof(reason));
+        fprintf(stderr, "recovery failed: %s\n", reason);
+        return 1;
+    }
+    printf("recovered %d packets into %s in %.2fs\n", ret, output.toUtf8().constData(), seconds);
+    return 0;
+}
@@ -0,0 +1,153 @@
+// Record-and-stream check against a local stand-in server.
+//
+// Encodes synthetic frames in real time with one encoder and fans the
+// packets out to a file (PacketWriter) and a live StreamSink, the same way
+// Recorder does. Prints once per second whether the stream is connected,
+// how many packets it dropped to catch up and the file writer backlog.
+//
+//   stream_check <url> [seconds=20] [output=stream_check.mp4] [maxDelayMs=2000]
+//
+// Stand-ins:
+//   ffmpeg -listen 1 -f flv -i rtmp://127.0.0.1:1935/live/test -c copy standin.flv
+//   ffmpeg -i "srt://127.0.0.1:9000?mode=listener" -c copy standin.ts
+// (or an nginx-rtmp "live" application). Stop the stand-in midway to see
+// the file keep going while the stream drops, reconnects and resumes on a
+// keyframe.
+
+#include "packet_writer.h"
+#include "stream_sink.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+#include <libavutil/time.h>
+}
+
+#include <QString>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace adc;
+
+namespace {
+
+void fillFrame(AVFrame* frame, int index){
+    for (int y = 0; y < frame->height; ++y) {
+        uint8_t* line = frame->data[0] + y * frame->linesize[0];
+        for (int x = 0; x < frame->width; ++x) {
+            line[x] = uint8_t((x + y + index * 4) & 0xff);
+        }
+    }
+    for (int p = 1; p < 3; ++p) {
+        for (int y = 0; y < frame->height / 2; ++y) {
+            memset(frame->data[p] + y * frame->linesize[p], 128 + (index % 64), frame->width / 2);
+        }
+    }
+}
+
+}
+
+int main(int argc, char* argv[]){
+    if (argc < 2) {
+        fprintf(stderr, "usage: stream_check <url> [seconds=20] [output=stream_check.mp4] [maxDelayMs=2000]\n");
+        return 1;
+    }
+    const QString url = QString::fromUtf8(argv[1]);
+    const int seconds = argc > 2 ? std::max(1, atoi(argv[2])) : 20;
+    const char* output = argc > 3 ? argv[3] : "stream_check.mp4";
+    const int maxDelay = argc > 4 ? std::max(1, atoi(argv[4])) : 2000;
+    const int fps = 30;
+
+    avformat_network_init();
+    const AVCodec* codec = avcodec_find_encoder_by_name("libx264");
+    if (!codec) codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    if (!codec) {
+        fprintf(stderr, "no H264 encoder\n");
+        return 1;
+    }
+    AVCodecContext* enc = avcodec_alloc_context3(codec);
+    enc->width = 1280;
+    enc->height = 720;
+    enc->time_base = AVRational{ 1, fps };
+    enc->framerate = AVRational{ fps, 1 };
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc->gop_size = fps * 2;
+    enc->max_b_frames = 0;
+    enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    av_opt_set(enc->priv_data, "preset", "veryfast", 0);
+    av_opt_set(enc->priv_data, "tune", "zerolatency", 0);
+    if (avcodec_open2(enc, codec, nullptr) < 0) {
+        fprintf(stderr, "could not open encoder\n");
+        return 1;
+    }
+
+    AVFormatContext* file = nullptr;
+    avformat_alloc_output_context2(&file, nullptr, nullptr, output);
+    AVStream* stream = file ? avformat_new_stream(file, nullptr) : nullptr;
+    if (!stream || avcodec_parameters_from_context(stream->codecpar, enc) < 0 ||
+        avio_open(&file->pb, output, AVIO_FLAG_WRITE) < 0 || avformat_write_header(file, nullptr) < 0) {
+        fprintf(stderr, "could not open %s\n", output);
+        return 1;
+    }
+    PacketWriter writer;
+    writer.begin(file, true);
+
+    StreamSink sink(url);
+    sink.setMaxDelay(maxDelay);
+    bool forceKey = false;
+    sink.setKeyframeRequester([&forceKey]{ forceKey = true; });
+    sink.begin(enc, nullptr);
+
+    AVFrame* frame = av_frame_alloc();
+    frame->format = enc->pix_fmt;
+    frame->width = enc->width;
+    frame->height = enc->height;
+    av_frame_get_buffer(frame, 0);
+    AVPacket* pkt = av_packet_alloc();
+
+    const int64_t start = av_gettime_relative();
+    const int frames = seconds * fps;
+    for (int i = 0; i < frames; ++i) {
+        av_frame_make_writable(frame);
+        fillFrame(frame, i);
+        frame->pts = i;
+        frame->pict_type = forceKey ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+        forceKey = false;
+        avcodec_send_frame(enc, frame);
+        while (avcodec_receive_packet(enc, pkt) >= 0) {
+            sink.push(pkt, PacketSink::Video);
+            av_packet_rescale_ts(pkt, enc->time_base, stream->time_base);
+            pkt->stream_index = stream->index;
+            writer.push(pkt);
+        }
+        if (i % fps == fps - 1) {
+            printf("%3ds  stream %-12s dropped %6lld  file backlog %lld bytes\n", (i + 1) / fps,
+                   sink.isConnected() ? "connected" : "disconnected",
+                   (long long)sink.dropped(), (long long)writer.queuedBytes());
+            fflush(stdout);
+        }
+        // real time pace
+        const int64_t due = start + int64_t(i + 1) * AV_TIME_BASE / fps;
+        const int64_t now = av_gettime_relative();
+        if (due > now) {
+            av_usleep(unsigned(due - now));
+        }
+    }
+
+    sink.end();
+    writer.finish();
+    av_write_trailer(file);
+    avio_closep(&file->pb);
+    avformat_free_context(file);
+    sink.wait();
+    printf("done, stream dropped %lld packets, file %s\n", (long long)sink.dropped(), output);
+
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    avcodec_free_context(&enc);
+    avformat_network_deinit();
+    return 0;
+}
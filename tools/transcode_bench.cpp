@@ -0,0 +1,134 @@
+// Chunked transcode scaling benchmark.
+//
+// Re-encodes <file> once with a single encoder on all cores (Transcoder),
+// then with ChunkedTranscoder at 1, 2, 4, ... chunks in parallel, each
+// chunk encoder getting cores / jobs threads. Prints a markdown table of
+// wall time, encoded fps and the speedup over the single encoder, and
+// checks every output: same frame count as the source, video dts strictly
+// increasing across the chunk joins.
+//
+//   transcode_bench <file> [encoder=libx264] [preset=medium] [chunk seconds=0] [max jobs=cores]
+
+#include "transcoder.h"
+#include "chunked_transcoder.h"
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QThread>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace adc;
+
+namespace {
+
+struct Check{
+    int64_t frames = 0;
+    int64_t backwards = 0;
+};
+
+// video packets and decode timestamps that do not move forward
+Check check(const QString& filename){
+    Check result;
+    AVFormatContext* in = nullptr;
+    if (avformat_open_input(&in, filename.toUtf8().constData(), nullptr, nullptr) < 0) {
+        result.frames = -1;
+        return result;
+    }
+    avformat_find_stream_info(in, nullptr);
+    const int video = av_find_best_stream(in, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    AVPacket* packet = av_packet_alloc();
+    int64_t last = AV_NOPTS_VALUE;
+    while (video >= 0 && av_read_frame(in, packet) >= 0) {
+        if (packet->stream_index == video) {
+            result.frames += 1;
+            if (last != AV_NOPTS_VALUE && packet->dts != AV_NOPTS_VALUE && packet->dts <= last) {
+                result.backwards += 1;
+            }
+            last = packet->dts;
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    avformat_close_input(&in);
+    return result;
+}
+
+double seconds(std::chrono::steady_clock::time_point since){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+}
+
+int main(int argc, char* argv[]){
+    QCoreApplication app(argc, argv);
+    if (argc < 2) {
+        fprintf(stderr, "usage: transcode_bench <file> [encoder] [preset] [chunk seconds] [max jobs]\n");
+        return 1;
+    }
+    const QString source = QString::fromUtf8(argv[1]);
+    TranscodeProfile profile;
+    profile.encoder = argc > 2 ? QString::fromUtf8(argv[2]) : QString("libx264");
+    profile.preset = argc > 3 ? QString::fromUtf8(argv[3]) : QString("medium");
+    profile.crf = 23;
+    const int chunkSeconds = argc > 4 ? atoi(argv[4]) : 0;
+    const int cores = QThread::idealThreadCount();
+    const int maxJobs = argc > 5 ? std::max(1, atoi(argv[5])) : cores;
+    profile.threads = cores;
+
+    const Check original = check(source);
+    if (original.frames <= 0) {
+        fprintf(stderr, "no video in %s\n", argv[1]);
+        return 1;
+    }
+    const QString output = QDir::temp().filePath("transcode_bench." + QFileInfo(source).suffix());
+    printf("%s: %lld frames, %s preset=%s, %d cores\n\n", argv[1], (long long)original.frames,
+           profile.encoder.toUtf8().constData(), profile.preset.toUtf8().constData(), cores);
+    printf("| mode | jobs | threads/job | chunks | seconds | fps | speedup | frames | dts |\n");
+    printf("|---|---|---|---|---|---|---|---|---|\n");
+
+    auto report = [&](const char* mode, int jobs, int threads, int chunks, double elapsed, double baseline){
+        const Check result = check(output);
+        printf("| %s | %d | %d | %d | %.1f | %.1f | %.2fx | %s | %s |\n", mode, jobs, threads, chunks, elapsed,
+               original.frames / elapsed, baseline / elapsed, result.frames == original.frames ? "ok" : "MISMATCH",
+               result.backwards == 0 ? "ok" : "BACKWARDS");
+        fflush(stdout);
+        return result.frames == original.frames && result.backwards == 0;
+    };
+
+    bool ok = true;
+    auto start = std::chrono::steady_clock::now();
+    Transcoder single;
+    single.setProfile(profile);
+    if (!single.transcode(source, output)) {
+        fprintf(stderr, "single encoder failed: %s\n", single.errorString().toUtf8().constData());
+        return 1;
+    }
+    const double baseline = seconds(start);
+    ok = report("single", 1, cores, 1, baseline, baseline) && ok;
+
+    for (int jobs = 1; jobs <= maxJobs; jobs *= 2) {
+        profile.jobs = jobs;
+        ChunkedTranscoder chunked;
+        chunked.setProfile(profile);
+        chunked.setChunkSeconds(chunkSeconds);
+        start = std::chrono::steady_clock::now();
+        if (!chunked.transcode(source, output)) {
+            fprintf(stderr, "%d jobs failed: %s\n", jobs, chunked.errorString().toUtf8().constData());
+            ok = false;
+            break;
+        }
+        ok = report("chunked", chunked.jobs(), std::max(1, cores / chunked.jobs()), chunked.chunks(),
+                    seconds(start), baseline) && ok;
+    }
+    QFile::remove(output);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+// Cuts the start and end off a recording without re-encoding it.
+//
+// Times are seconds, mm:ss or hh:mm:ss, with a fraction if needed; an end
+// of 0 keeps everything after the start. --smart re-encodes the frames
+// from the start to the next keyframe so every container starts on the
+// exact frame, not only mp4/mov.
+//
+//   trim_recording <recording> <start> [end=0] [output=<name>_trim.<ext>] [--smart]
+
+#include "trimmer.h"
+
+#include <QString>
+#include <QStringList>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+using namespace adc;
+
+namespace {
+// microseconds, -1 if it is not a time
+int64_t parseTime(const QString& text){
+    const QStringList parts = text.split(':');
+    if (parts.size() > 3) {
+        return -1;
+    }
+    double seconds = 0;
+    for (const QString& part : parts) {
+        bool ok = false;
+        const double value = part.toDouble(&ok);
+        if (!ok || value < 0) {
+            return -1;
+        }
+        seconds = seconds * 60 + value;
+    }
+    return int64_t(seconds * 1000000 + 0.5);
+}
+}
+
+int main(int argc, char* argv[]){
+    bool smart = false;
+    QStringList args;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--smart") == 0) {
+            smart = true;
+        } else {
+            args.append(QString::fromUtf8(argv[i]));
+        }
+    }
+    if (args.size() < 2) {
+        fprintf(stderr, "usage: trim_recording <recording> <start> [end] [output] [--smart]\n");
+        return 1;
+    }
+    const QString source = args[0];
+    const int64_t start = parseTime(args[1]);
+    const int64_t end = args.size() > 2 ? parseTime(args[2]) : 0;
+    if (start < 0 || end < 0) {
+        fprintf(stderr, "times are seconds, mm:ss or hh:mm:ss\n");
+        return 1;
+    }
+    const QString output = args.size() > 3 ? args[3] : Trimmer::outputPath(source);
+
+    Trimmer trimmer;
+    trimmer.setSmartRender(smart);
+    const auto begin = std::chrono::steady_clock::now();
+    if (!trimmer.trim(source, output, start, end)) {
+        fprintf(stderr, "trim failed: %s\n", trimmer.errorString().toUtf8().constData());
+        return 1;
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    printf("wrote %s in %.2fs, video copied from %.3fs", output.toUtf8().constData(), seconds,
+           trimmer.keyframeUs() / 1000000.0);
+    if (trimmer.renderedFrames() > 0) {
+        printf(", %d frames re-encoded", trimmer.renderedFrames());
+    }
+    printf(trimmer.isFrameAccurate() ? ", frame accurate\n" : ", starts at the keyframe\n");
+    return 0;
+}
@@ -0,0 +1,124 @@
+// Upload-while-recording check against a local S3 stand-in.
+//
+// Copies <file> into a new file at the given rate, the way a fragmented
+// recording grows, while Uploader sends it as a multipart upload; once the
+// copy is done the file is handed over as finished. Prints the bytes on
+// disk and uploaded once per second, then compares the object's size.
+// Rate 0 uploads the file as a finished one. Stopping the stand-in midway
+// shows the backoff; restarting this tool resumes from <copy>.upload.
+//
+//   upload_check <file> [bucket=recordings] [MiB/s=8] [endpoint=http://127.0.0.1:9000]
+//
+// Credentials come from AWS_ACCESS_KEY_ID / AWS_SECRET_ACCESS_KEY
+// (minioadmin / minioadmin if unset). Stand-in:
+//   docker run -p 9000:9000 minio/minio server /data
+//   mc alias set local http://127.0.0.1:9000 minioadmin minioadmin && mc mb local/recordings
+
+#include "uploader.h"
+
+#include <QCoreApplication>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QThread>
+#include <QElapsedTimer>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace adc;
+
+namespace {
+QString environment(const char* name, const char* fallback){
+    const QByteArray value = qgetenv(name);
+    return QString::fromUtf8(value.isEmpty() ? QByteArray(fallback) : value);
+}
+}
+
+int main(int argc, char* argv[]){
+    QCoreApplication app(argc, argv);
+    if (argc < 2) {
+        fprintf(stderr, "usage: upload_check <file> [bucket] [MiB/s] [endpoint]\n");
+        return 1;
+    }
+    const QString source = QString::fromUtf8(argv[1]);
+    S3Config config;
+    config.bucket = argc > 2 ? QString::fromUtf8(argv[2]) : QString("recordings");
+    const double rate = argc > 3 ? std::max(0.0, atof(argv[3])) : 8.0;
+    config.endpoint = QUrl(argc > 4 ? QString::fromUtf8(argv[4]) : QString("http://127.0.0.1:9000"));
+    config.accessKey = environment("AWS_ACCESS_KEY_ID", "minioadmin");
+    config.secretKey = environment("AWS_SECRET_ACCESS_KEY", "minioadmin");
+    config.prefix = "upload_check/";
+
+    QFile in(source);
+    if (!in.open(QIODevice::ReadOnly)) {
+        fprintf(stderr, "could not open %s\n", argv[1]);
+        return 1;
+    }
+    const QString copy = QDir::temp().filePath("upload_check_" + QFileInfo(source).fileName());
+
+    Uploader uploader;
+    uploader.setConfig(config);
+    uploader.setRetries(6, 8000);
+    if (uploader.resume(QDir::tempPath()) > 0) {
+        printf("resuming an earlier upload\n");
+    } else if (rate <= 0) {
+        if (!QFile::exists(copy) && !QFile::copy(source, copy)) {
+            fprintf(stderr, "could not copy to %s\n", copy.toUtf8().constData());
+            return 1;
+        }
+        uploader.add(copy);
+    } else {
+        QFile out(copy);
+        if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            fprintf(stderr, "could not create %s\n", copy.toUtf8().constData());
+            return 1;
+        }
+        uploader.follow(copy);
+        // 100 ms worth of data at a time
+        const int64_t step = std::max<int64_t>(4096, int64_t(rate * 1024 * 1024 / 10));
+        QElapsedTimer clock;
+        clock.start();
+        int64_t written = 0;
+        int64_t reported = 0;
+        while (!in.atEnd()) {
+            const QByteArray data = in.read(step);
+            out.write(data);
+            out.flush();
+            written += data.size();
+            const int64_t dueMs = int64_t(written / (rate * 1024 * 1024) * 1000);
+            QThread::msleep(ulong(std::max<int64_t>(0, dueMs - clock.elapsed())));
+            if (clock.elapsed() - reported >= 1000) {
+                reported = clock.elapsed();
+                printf("%6.1fs  on disk %8.1f MiB  uploaded %8.1f MiB\n", reported / 1000.0,
+                       written / 1048576.0, uploader.uploadedBytes() / 1048576.0);
+            }
+        }
+        out.close();
+        uploader.add(copy);
+        printf("recording done after %.1fs, %.1f MiB already uploaded\n", clock.elapsed() / 1000.0,
+               uploader.uploadedBytes() / 1048576.0);
+    }
+
+    QElapsedTimer clock;
+    clock.start();
+    while (uploader.pending() > 0) {
+        QThread::msleep(200);
+    }
+    uploader.shutdown();
+    uploader.wait();
+    printf("finished %.1fs after the recording\n", clock.elapsed() / 1000.0);
+
+    S3Client client(config);
+    int64_t size = -1;
+    const QString key = config.prefix + QFileInfo(copy).fileName();
+    if (!client.headObject(key, &size)) {
+        fprintf(stderr, "object check failed: %s\n", client.errorString().toUtf8().constData());
+        return 1;
+    }
+    const int64_t expected = QFileInfo(copy).size();
+    printf("%s: %lld bytes, local %lld: %s\n", key.toUtf8().constData(), (long long)size,
+           (long long)expected, size == expected ? "ok" : "MISMATCH");
+    QFile::remove(copy);
+    return size == expected ? 0 : 1;
+}